@@ -0,0 +1,350 @@
+/*
+ * bench: timings of the engine itself, without the REPL
+ *
+ * db.c is compiled in (see the Makefile), so the benchmarks call the
+ * engine's own functions: execute_statement for inserts, table_find for
+ * point lookups and execute_select for full scans. Each benchmark prints a
+ * csv line:
+ *
+ *   benchmark,ops,seconds,ops_per_sec,p50_us,p99_us,pages_read,pages_written
+ *
+ *   insert_seq     ids 1 to --rows in order, into an empty db, --txn-rows
+ *                  inserts per transaction. The commit counts as part of
+ *                  the insert before it.
+ *   insert_random  the same ids shuffled, into another empty db
+ *   find_warm      --lookups random ids, with every page already cached
+ *                  (the cache grows to hold the db for these)
+ *   scan_warm      --scans full scans, likewise
+ *   scan_parallel  --scans full scans counting rows with --threads threads
+ *                  (default: one per CPU), warm, through db_scan_parallel
+ *   find_cold      random ids, each looked up with nothing cached
+ *   scan_cold      full scans, each with nothing cached
+ *
+ * pages_read and pages_written are the pager's counts over the benchmark:
+ * pages loaded from the db file, and pages written to the log or the db
+ * file. Nothing cached means pager_drop_cache before each op, which empties
+ * the buffer pool and drops the file from the kernel's page cache (not
+ * possible on macOS, where a cold op still finds the file in memory).
+ * The shuffles and lookups use a fixed seed, so runs are comparable.
+ */
+#define TINYDB_LIBRARY
+#include "db.c"
+
+#define BENCH_DEFAULT_ROWS 100000
+#define BENCH_DEFAULT_LOOKUPS 100000
+#define BENCH_DEFAULT_COLD_LOOKUPS 1000
+#define BENCH_DEFAULT_SCANS 10
+#define BENCH_DEFAULT_TXN_ROWS 1000
+#define BENCH_SEED 0x9E3779B97F4A7C15ull
+
+typedef struct {
+  uint32_t rows;
+  uint32_t lookups;
+  uint32_t cold_lookups;
+  uint32_t scans;
+  uint32_t txn_rows;
+  uint32_t cache_pages;
+  uint32_t threads;
+  const char *dir;
+} BenchOptions;
+
+/* One benchmark's op latencies and the pager's counts when it started */
+typedef struct {
+  const char *name;
+  uint64_t *latencies_ns;
+  uint32_t num_ops;
+  uint64_t start_ns;
+  uint64_t op_start_ns;
+  uint64_t pages_read;
+  uint64_t pages_written;
+} BenchRun;
+
+/* xorshift64, good enough to pick ids */
+uint64_t bench_random(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+void bench_begin(BenchRun *run, const char *name, uint32_t max_ops,
+                 Pager *pager) {
+  run->name = name;
+  run->latencies_ns = malloc((max_ops > 0 ? max_ops : 1) * sizeof(uint64_t));
+  run->num_ops = 0;
+  run->pages_read = pager->stats.pages_read;
+  run->pages_written = pager->stats.pages_written;
+  run->start_ns = monotonic_ns();
+}
+
+void bench_op_start(BenchRun *run) { run->op_start_ns = monotonic_ns(); }
+
+void bench_op_end(BenchRun *run) {
+  run->latencies_ns[run->num_ops++] = monotonic_ns() - run->op_start_ns;
+}
+
+int compare_latencies(const void *a, const void *b) {
+  uint64_t latency_a = *(const uint64_t *)a;
+  uint64_t latency_b = *(const uint64_t *)b;
+  return (latency_a > latency_b) - (latency_a < latency_b);
+}
+
+/* Nearest rank, of latencies already sorted */
+double percentile_us(BenchRun *run, uint32_t percent) {
+  if (run->num_ops == 0) {
+    return 0;
+  }
+  uint64_t rank = ((uint64_t)run->num_ops * percent + 99) / 100;
+  return run->latencies_ns[rank - 1] / 1e3;
+}
+
+/*
+Print the benchmark's line. seconds runs from bench_begin, so it includes
+anything done between ops, unless only_ops: cold runs count just the ops,
+leaving out the cache dropping before each.
+*/
+void bench_end(BenchRun *run, Pager *pager, bool only_ops) {
+  uint64_t elapsed_ns = monotonic_ns() - run->start_ns;
+  if (only_ops) {
+    elapsed_ns = 0;
+    for (uint32_t i = 0; i < run->num_ops; i++) {
+      elapsed_ns += run->latencies_ns[i];
+    }
+  }
+  qsort(run->latencies_ns, run->num_ops, sizeof(uint64_t), compare_latencies);
+  double p50 = percentile_us(run, 50);
+  double p99 = percentile_us(run, 99);
+  double seconds = elapsed_ns / 1e9;
+  printf("%s,%u,%.6f,%.1f,%.3f,%.3f,%llu,%llu\n", run->name, run->num_ops,
+         seconds, seconds > 0 ? run->num_ops / seconds : 0, p50, p99,
+         (unsigned long long)(pager->stats.pages_read - run->pages_read),
+         (unsigned long long)(pager->stats.pages_written -
+                              run->pages_written));
+  fflush(stdout);
+  free(run->latencies_ns);
+}
+
+void bench_remove_db(const char *filename) {
+  char wal_filename[PATH_MAX];
+  snprintf(wal_filename, sizeof(wal_filename), "%s-wal", filename);
+  unlink(filename);
+  unlink(wal_filename);
+}
+
+ExecuteResult bench_execute(Table *table, StatementType type) {
+  Statement statement = {.type = type};
+  return execute_statement(&statement, table, ignore_row_visitor, NULL);
+}
+
+/* Insert the ids in the order given into a new db at filename */
+void bench_insert(const char *name, const char *filename, uint32_t *ids,
+                  BenchOptions *options) {
+  bench_remove_db(filename);
+  Table *table = db_open(filename, options->cache_pages);
+
+  BenchRun run;
+  bench_begin(&run, name, options->rows, table->pager);
+  Row row;
+  Statement statement = {.type = STATEMENT_INSERT,
+                         .rows_to_insert = &row,
+                         .num_rows = 1};
+  for (uint32_t i = 0; i < options->rows; i++) {
+    row.id = ids[i];
+    snprintf(row.username, sizeof(row.username), "user%u", ids[i]);
+    snprintf(row.email, sizeof(row.email), "person%u@example.com", ids[i]);
+
+    bench_op_start(&run);
+    if (i % options->txn_rows == 0) {
+      bench_execute(table, STATEMENT_BEGIN);
+    }
+    if (execute_statement(&statement, table, ignore_row_visitor, NULL) !=
+        EXECUTE_SUCCESS) {
+      printf("Could not insert id %u.\n", ids[i]);
+      exit(EXIT_FAILURE);
+    }
+    if ((i + 1) % options->txn_rows == 0 || i + 1 == options->rows) {
+      bench_execute(table, STATEMENT_COMMIT);
+    }
+    bench_op_end(&run);
+  }
+  bench_end(&run, table->pager, false);
+  db_close(table);
+}
+
+/* The lookup table_find makes, as db_get does but without a snapshot */
+void bench_find(Table *table, uint32_t id) {
+  Row row;
+  Cursor *cursor = table_find(table, id);
+  if (!cursor_at_key(cursor, id)) {
+    printf("Id %u is missing.\n", id);
+    exit(EXIT_FAILURE);
+  }
+  cursor_read_row(cursor, &row);
+  cursor_close(cursor);
+  pager_trim(table->pager);
+}
+
+void bench_scan(Table *table, uint32_t expected_rows) {
+  Statement statement = {.type = STATEMENT_SELECT,
+                         .min_id = 0,
+                         .max_id = UINT32_MAX,
+                         .limit = UINT32_MAX};
+  uint64_t num_rows = 0;
+  execute_select(&statement, table, count_row_visitor, &num_rows);
+  if (num_rows != expected_rows) {
+    printf("Scan found %llu rows, not %u.\n", (unsigned long long)num_rows,
+           expected_rows);
+    exit(EXIT_FAILURE);
+  }
+}
+
+void bench_lookups(const char *name, Table *table, uint32_t num_lookups,
+                   uint32_t rows, bool cold) {
+  uint64_t state = BENCH_SEED;
+  BenchRun run;
+  bench_begin(&run, name, num_lookups, table->pager);
+  for (uint32_t i = 0; i < num_lookups; i++) {
+    uint32_t id = bench_random(&state) % rows + 1;
+    if (cold) {
+      pager_drop_cache(table->pager);
+    }
+    bench_op_start(&run);
+    bench_find(table, id);
+    bench_op_end(&run);
+  }
+  bench_end(&run, table->pager, cold);
+}
+
+void bench_scans(const char *name, Table *table, uint32_t num_scans,
+                 uint32_t rows, bool cold) {
+  BenchRun run;
+  bench_begin(&run, name, num_scans, table->pager);
+  for (uint32_t i = 0; i < num_scans; i++) {
+    if (cold) {
+      pager_drop_cache(table->pager);
+    }
+    bench_op_start(&run);
+    bench_scan(table, rows);
+    bench_op_end(&run);
+  }
+  bench_end(&run, table->pager, cold);
+}
+
+void bench_parallel_scans(Table *table, uint32_t num_scans, uint32_t rows,
+                          uint32_t num_threads) {
+  uint64_t counts[DB_SCAN_MAX_THREADS];
+  void *contexts[DB_SCAN_MAX_THREADS];
+  for (uint32_t i = 0; i < DB_SCAN_MAX_THREADS; i++) {
+    contexts[i] = &counts[i];
+  }
+
+  BenchRun run;
+  bench_begin(&run, "scan_parallel", num_scans, table->pager);
+  for (uint32_t i = 0; i < num_scans; i++) {
+    memset(counts, 0, sizeof(counts));
+    bench_op_start(&run);
+    db_scan_parallel(table, num_threads, count_row_visitor, contexts);
+    bench_op_end(&run);
+
+    uint64_t num_rows = 0;
+    for (uint32_t j = 0; j < DB_SCAN_MAX_THREADS; j++) {
+      num_rows += counts[j];
+    }
+    if (num_rows != rows) {
+      printf("Parallel scan found %llu rows, not %u.\n",
+             (unsigned long long)num_rows, rows);
+      exit(EXIT_FAILURE);
+    }
+  }
+  bench_end(&run, table->pager, false);
+}
+
+bool parse_count(const char *arg, const char *option, uint32_t *value) {
+  size_t length = strlen(option);
+  if (strncmp(arg, option, length) != 0) {
+    return false;
+  }
+  *value = atoi(arg + length);
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  BenchOptions options = {.rows = BENCH_DEFAULT_ROWS,
+                          .lookups = BENCH_DEFAULT_LOOKUPS,
+                          .cold_lookups = BENCH_DEFAULT_COLD_LOOKUPS,
+                          .scans = BENCH_DEFAULT_SCANS,
+                          .txn_rows = BENCH_DEFAULT_TXN_ROWS,
+                          .cache_pages = PAGER_DEFAULT_MAX_FRAMES,
+                          .threads = sysconf(_SC_NPROCESSORS_ONLN),
+                          .dir = "."};
+  for (int i = 1; i < argc; i++) {
+    if (parse_count(argv[i], "--rows=", &options.rows) ||
+        parse_count(argv[i], "--lookups=", &options.lookups) ||
+        parse_count(argv[i], "--cold-lookups=", &options.cold_lookups) ||
+        parse_count(argv[i], "--scans=", &options.scans) ||
+        parse_count(argv[i], "--txn-rows=", &options.txn_rows) ||
+        parse_count(argv[i], "--cache-pages=", &options.cache_pages) ||
+        parse_count(argv[i], "--threads=", &options.threads)) {
+      continue;
+    } else if (strncmp(argv[i], "--dir=", 6) == 0) {
+      options.dir = argv[i] + 6;
+    } else {
+      printf("Usage: %s [--rows=N] [--lookups=N] [--cold-lookups=N] "
+             "[--scans=N] [--txn-rows=N] [--cache-pages=N] [--threads=N] "
+             "[--dir=DIR]\n",
+             argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (options.rows == 0 || options.txn_rows == 0) {
+    printf("--rows and --txn-rows must be at least 1.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (options.threads == 0 || options.threads > DB_SCAN_MAX_THREADS) {
+    printf("--threads must be from 1 to %d.\n", DB_SCAN_MAX_THREADS);
+    exit(EXIT_FAILURE);
+  }
+
+  char filename[PATH_MAX];
+  char random_filename[PATH_MAX];
+  snprintf(filename, sizeof(filename), "%s/bench.db", options.dir);
+  snprintf(random_filename, sizeof(random_filename), "%s/bench-random.db",
+           options.dir);
+
+  uint32_t *ids = malloc(options.rows * sizeof(uint32_t));
+  for (uint32_t i = 0; i < options.rows; i++) {
+    ids[i] = i + 1;
+  }
+
+  printf("benchmark,ops,seconds,ops_per_sec,p50_us,p99_us,pages_read,"
+         "pages_written\n");
+  bench_insert("insert_seq", filename, ids, &options);
+
+  // Fisher-Yates
+  uint64_t state = BENCH_SEED;
+  for (uint32_t i = options.rows - 1; i > 0; i--) {
+    uint32_t j = bench_random(&state) % (i + 1);
+    uint32_t id = ids[i];
+    ids[i] = ids[j];
+    ids[j] = id;
+  }
+  bench_insert("insert_random", random_filename, ids, &options);
+  bench_remove_db(random_filename);
+  free(ids);
+
+  // The inserts get --cache-pages; the warm runs need room for every page
+  Table *table = db_open(filename, options.cache_pages);
+  if (table->pager->max_frames < table->pager->num_pages) {
+    table->pager->max_frames = table->pager->num_pages;
+  }
+  // One scan untimed, to fill the cache
+  bench_scan(table, options.rows);
+  bench_lookups("find_warm", table, options.lookups, options.rows, false);
+  bench_scans("scan_warm", table, options.scans, options.rows, false);
+  bench_parallel_scans(table, options.scans, options.rows, options.threads);
+  bench_lookups("find_cold", table, options.cold_lookups, options.rows, true);
+  bench_scans("scan_cold", table, options.scans, options.rows, true);
+  db_close(table);
+  bench_remove_db(filename);
+  return 0;
+}
@@ -1,34 +1,46 @@
 #include <_string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/_types/_off_t.h>
 #include <sys/_types/_u_int32_t.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+#include "tinydb.h"
 
-#define COLUMN_USERNAME_SIZE 32
-#define COLUMN_EMAIL_SIZE 255
 #define INVALID_PAGE_NUM UINT32_MAX
 
-#define size_of_attribute(Struct, Attribute) sizeof(((Struct *)0)->Attribute)
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
-typedef enum {
-  EXECUTE_SUCCESS,
-  EXECUTE_TABLE_FULL,
-  EXECUTE_DUPLICATE_KEY
-} ExecuteResult;
+#define size_of_attribute(Struct, Attribute) sizeof(((Struct *)0)->Attribute)
 
-typedef struct {
-  uint32_t id;
-  char username[COLUMN_USERNAME_SIZE + 1];
-  char email[COLUMN_EMAIL_SIZE + 1];
-} Row;
+typedef enum { NODE_INTERNAL, NODE_LEAF, NODE_OVERFLOW, NODE_FREE } NodeType;
 
-typedef enum { NODE_INTERNAL, NODE_LEAF } NodeType;
+/* Columns that can have a secondary index */
+typedef enum { COLUMN_USERNAME, COLUMN_EMAIL } IndexedColumn;
+#define NUM_INDEXED_COLUMNS 2
 
 const uint32_t ID_SIZE = size_of_attribute(Row, id);
 const uint32_t USERNAME_SIZE = size_of_attribute(Row, username);
@@ -38,21 +50,110 @@ const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
 const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
 const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
 
-const uint32_t PAGE_SIZE = 4096;
-#define TABLE_MAX_PAGES 400
+/*
+ * Page size
+ * A db picks its page size, a power of two from 4K to 64K, when the file is
+ * created and keeps it in its header. PAGE_SIZE and the limits below that
+ * depend on it are set from the header by layout_open when a db is opened,
+ * before any page is read. They are shared by the whole process, so every
+ * db open at the same time must have the same page size.
+ */
+#define DEFAULT_PAGE_SIZE 4096
+#define MIN_PAGE_SIZE 4096
+#define MAX_PAGE_SIZE 65536
+#define PAGER_DEFAULT_READAHEAD_PAGES 32
+
+uint32_t PAGE_SIZE = DEFAULT_PAGE_SIZE;
+
+/*
+ * Page Checksum
+ * Every page, the header page included, starts with a CRC32C of its page
+ * number and the rest of the page. A commit sets it when it writes the page
+ * to the log, and it is checked whenever a page is read from the db file.
+ * Pages past the end of the file are never read, so every page that is read
+ * must carry one, a page of zeros included.
+ */
+const uint32_t PAGE_CHECKSUM_SIZE = sizeof(uint32_t);
+const uint32_t PAGE_CHECKSUM_OFFSET = 0;
+
+/*
+ * File Header Layout
+ * Page 0 starts with HEADER_MAGIC and the format version, then the page
+ * size, the most keys an internal node takes before it splits and the
+ * largest a leaf cell may be. These are set when the file is created and
+ * never change. After them it records
+ * where the table's B-tree and each index's B-tree are rooted, and the
+ * first page of the freelist. A root never moves once created. An index
+ * root of 0 means no index; a freelist head of 0 means no free pages. Last
+ * is the row schema: the number of columns, then each column's type and
+ * size, which must match the Row this program was built with.
+ */
+#define HEADER_MAGIC "tinydb\0\0"
+#define DB_FORMAT_VERSION 3
+#define ROW_NUM_COLUMNS 3
+
+typedef enum { COLUMN_TYPE_INTEGER, COLUMN_TYPE_TEXT } ColumnType;
+
+const uint32_t HEADER_PAGE_NUM = 0;
+const uint32_t HEADER_MAGIC_SIZE = 8;
+const uint32_t HEADER_MAGIC_OFFSET = PAGE_CHECKSUM_OFFSET + PAGE_CHECKSUM_SIZE;
+const uint32_t HEADER_VERSION_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_VERSION_OFFSET = HEADER_MAGIC_OFFSET + HEADER_MAGIC_SIZE;
+const uint32_t HEADER_PAGE_SIZE_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_PAGE_SIZE_OFFSET =
+    HEADER_VERSION_OFFSET + HEADER_VERSION_SIZE;
+const uint32_t HEADER_MAX_INTERNAL_CELLS_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_MAX_INTERNAL_CELLS_OFFSET =
+    HEADER_PAGE_SIZE_OFFSET + HEADER_PAGE_SIZE_SIZE;
+const uint32_t HEADER_MAX_LEAF_CELL_SIZE_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_MAX_LEAF_CELL_SIZE_OFFSET =
+    HEADER_MAX_INTERNAL_CELLS_OFFSET + HEADER_MAX_INTERNAL_CELLS_SIZE;
+const uint32_t HEADER_ROOT_PAGE_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_ROOT_PAGE_OFFSET =
+    HEADER_MAX_LEAF_CELL_SIZE_OFFSET + HEADER_MAX_LEAF_CELL_SIZE_SIZE;
+const uint32_t HEADER_INDEX_ROOT_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_INDEX_ROOTS_OFFSET =
+    HEADER_ROOT_PAGE_OFFSET + HEADER_ROOT_PAGE_SIZE;
+const uint32_t HEADER_FREELIST_HEAD_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_FREELIST_HEAD_OFFSET =
+    HEADER_INDEX_ROOTS_OFFSET + NUM_INDEXED_COLUMNS * HEADER_INDEX_ROOT_SIZE;
+const uint32_t HEADER_NUM_COLUMNS_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_NUM_COLUMNS_OFFSET =
+    HEADER_FREELIST_HEAD_OFFSET + HEADER_FREELIST_HEAD_SIZE;
+const uint32_t HEADER_COLUMN_TYPE_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_COLUMN_SIZE_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_COLUMN_SIZE =
+    HEADER_COLUMN_TYPE_SIZE + HEADER_COLUMN_SIZE_SIZE;
+const uint32_t HEADER_COLUMNS_OFFSET =
+    HEADER_NUM_COLUMNS_OFFSET + HEADER_NUM_COLUMNS_SIZE;
+// The part of the header read before the page size is known
+const uint32_t HEADER_SIZE =
+    HEADER_COLUMNS_OFFSET + ROW_NUM_COLUMNS * HEADER_COLUMN_SIZE;
 
 /*
  * Common Node header Layout
+ * A leaf or internal node records the size of its keys, which is the same
+ * for every node of a tree. The table's B-tree is keyed by row id, in
+ * TABLE_KEY_SIZE bytes; an index's by the value's hash and the row id, in
+ * INDEX_KEY_SIZE (see index_key). The key size takes two bytes, which puts
+ * the parent pointer and a leaf's keys on aligned offsets.
  */
 
+const uint32_t TABLE_KEY_SIZE = sizeof(uint32_t);
+const uint32_t INDEX_KEY_SIZE = sizeof(uint64_t);
+
 const uint32_t NODE_TYPE_SIZE = sizeof(uint8_t);
-const uint32_t NODE_TYPE_OFFSET = 0;
+const uint32_t NODE_TYPE_OFFSET = PAGE_CHECKSUM_OFFSET + PAGE_CHECKSUM_SIZE;
 const uint32_t IS_ROOT_SIZE = sizeof(uint8_t);
-const uint32_t IS_ROOT_OFFSET = NODE_TYPE_SIZE;
+const uint32_t IS_ROOT_OFFSET = NODE_TYPE_OFFSET + NODE_TYPE_SIZE;
+const uint32_t NODE_KEY_SIZE_SIZE = sizeof(uint16_t);
+const uint32_t NODE_KEY_SIZE_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
 const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);
-const uint32_t PARENT_POINTER_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
-const uint8_t COMMON_NODE_HEADER_SIZE =
-    NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE;
+const uint32_t PARENT_POINTER_OFFSET =
+    NODE_KEY_SIZE_OFFSET + NODE_KEY_SIZE_SIZE;
+const uint8_t COMMON_NODE_HEADER_SIZE = PAGE_CHECKSUM_SIZE + NODE_TYPE_SIZE +
+                                        IS_ROOT_SIZE + NODE_KEY_SIZE_SIZE +
+                                        PARENT_POINTER_SIZE;
 
 /*
  * Leaf Node Header Layout
@@ -63,9 +164,12 @@ const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
 const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET =
     LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
-const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
-                                       LEAF_NODE_NUM_CELLS_SIZE +
-                                       LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_CONTENT_START_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_CONTENT_START_OFFSET =
+    LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_HEADER_SIZE =
+    COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE +
+    LEAF_NODE_NEXT_LEAF_SIZE + LEAF_NODE_CONTENT_START_SIZE;
 
 /*
  * Internal Node Header Layout
@@ -81,35 +185,340 @@ const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
 
 /*
  * Leaf Node Body Layout
+ *
+ * A leaf is a slotted page. Right after the header come the keys, one
+ * per cell in key order, so that a search reads nothing else
+ * (see leaf_node_lower_bound). After them is an array of 2-byte slots in the
+ * same order, each holding the offset of its cell. Cells are variable length
+ * and are packed from the end of the page towards the slots; content_start
+ * in the header is the lowest cell offset. Free space is the gap between the
+ * slot array and content_start, plus any holes left behind by removed cells,
+ * which are reclaimed by compacting the page when the gap alone is too
+ * small.
+ *
+ * A cell is the size of the row's payload and the payload itself (see
+ * pack_row). A payload longer than LEAF_NODE_MAX_LOCAL_PAYLOAD keeps only
+ * its first part in the leaf, followed by the number of the first of a
+ * chain of overflow pages holding the rest. That caps a cell and its key
+ * and slot at a quarter of the page, so a leaf always holds at least 4
+ * cells and either half of a split always fits, whatever its key size.
+ *
+ * Even the widest row is well under a quarter of the smallest page, so a db
+ * only has overflow pages if it was created with a lower cap on cells
+ * (--max-leaf-cell-size), as the specs do to exercise them.
+ */
+
+const uint32_t LEAF_NODE_SLOT_SIZE = sizeof(uint16_t);
+// A key and slot with the larger key size, which the limits below allow for
+const uint32_t LEAF_NODE_MAX_ENTRY_SIZE = INDEX_KEY_SIZE + LEAF_NODE_SLOT_SIZE;
+const uint32_t LEAF_NODE_PAYLOAD_SIZE_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_PAYLOAD_SIZE_OFFSET = 0;
+const uint32_t LEAF_NODE_PAYLOAD_OFFSET =
+    LEAF_NODE_PAYLOAD_SIZE_OFFSET + LEAF_NODE_PAYLOAD_SIZE_SIZE;
+const uint32_t LEAF_NODE_OVERFLOW_POINTER_SIZE = sizeof(uint32_t);
+// The smallest cap on cells a db can be created with
+const uint32_t LEAF_NODE_MIN_MAX_CELL_SIZE = 16;
+// These three depend on the layout (see layout_open)
+uint32_t LEAF_NODE_SPACE_FOR_CELLS;
+uint32_t LEAF_NODE_MAX_CELL_SIZE;
+uint32_t LEAF_NODE_MAX_LOCAL_PAYLOAD;
+
+/*
+ * Overflow Page Layout
+ * The common header, the next page in the chain (0 for the last one), and
+ * as much of the payload as fits
+ */
+const uint32_t OVERFLOW_NODE_NEXT_SIZE = sizeof(uint32_t);
+const uint32_t OVERFLOW_NODE_NEXT_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t OVERFLOW_NODE_HEADER_SIZE =
+    COMMON_NODE_HEADER_SIZE + OVERFLOW_NODE_NEXT_SIZE;
+uint32_t OVERFLOW_NODE_SPACE;
+
+/*
+ * Free Page Layout
+ * The common header and the next page on the freelist (0 for the last one)
+ */
+const uint32_t FREE_NODE_NEXT_SIZE = sizeof(uint32_t);
+const uint32_t FREE_NODE_NEXT_OFFSET = COMMON_NODE_HEADER_SIZE;
+
+/*
+A leaf that falls below this many bytes of cells and slots after a delete
+is merged with or borrows from a sibling
+*/
+uint32_t LEAF_NODE_MIN_USED_SPACE;
+
+/*
+ * Row Payload Layout
+ * The id, then each string as a 1-byte length followed by its characters,
+ * without a terminator or padding
+ */
+const uint32_t ROW_STRING_LENGTH_SIZE = sizeof(uint8_t);
+const uint32_t ROW_MAX_PAYLOAD_SIZE = ID_SIZE + ROW_STRING_LENGTH_SIZE +
+                                      COLUMN_USERNAME_SIZE +
+                                      ROW_STRING_LENGTH_SIZE + COLUMN_EMAIL_SIZE;
+
+/*
+ * Write-ahead log record layout
+ *
+ * The log is a sequence of records. A page record is a header followed by a
+ * full image of the page. A commit record is a header whose page number is
+ * WAL_COMMIT_MARKER and whose checksum slot holds the number of page records
+ * in the commit; it has no body. Pages are only ever applied to the db file
+ * once the commit record that covers them is on disk.
+ */
+#define WAL_COMMIT_MARKER INVALID_PAGE_NUM
+#define WAL_CHECKPOINT_PAGES 1000
+#define WAL_DEFAULT_GROUP_COMMIT 1
+#define WAL_GROUP_COMMIT_WINDOW_NS 10000000
+
+const uint32_t WAL_RECORD_PAGE_NUM_SIZE = sizeof(uint32_t);
+const uint32_t WAL_RECORD_PAGE_NUM_OFFSET = 0;
+const uint32_t WAL_RECORD_CHECKSUM_SIZE = sizeof(uint32_t);
+const uint32_t WAL_RECORD_CHECKSUM_OFFSET =
+    WAL_RECORD_PAGE_NUM_OFFSET + WAL_RECORD_PAGE_NUM_SIZE;
+const uint32_t WAL_RECORD_HEADER_SIZE =
+    WAL_RECORD_PAGE_NUM_SIZE + WAL_RECORD_CHECKSUM_SIZE;
+
+typedef struct {
+  int file_descriptor;
+  char *filename;
+  off_t length;
+  uint32_t *txn_pages; // Pages changed since the last commit
+  uint32_t txn_num_pages;
+  uint32_t txn_capacity;
+  bool in_transaction; // Inside an explicit begin ... commit
+  uint32_t txn_start_num_pages;  // num_pages as of the last commit or begin
+  uint32_t group_size; // Commits per fdatasync
+  uint32_t unsynced_commits;
+  struct timespec first_unsynced_commit;
+  uint32_t pages_since_checkpoint;
+  pthread_mutex_t sync_lock;  // Guards unsynced_commits and the sync itself
+  /*
+  Syncs commits left waiting once the oldest has waited
+  WAL_GROUP_COMMIT_WINDOW_NS, when no later commit comes along to do it.
+  Started by the first commit that is not synced right away.
+  */
+  pthread_t flusher;
+  bool has_flusher;
+  bool closing;  // Tells the flusher to stop
+  pthread_cond_t sync_cond;  // Signalled when a commit is left unsynced
+} Wal;
+
+/*
+ * Buffer pool
+ *
+ * Each cached page lives in a Frame. Frames are found by page number through
+ * pager->frames and kept on a doubly linked LRU list (head is the most
+ * recently used). A frame with pin_count > 0 is never evicted. Only dirty
+ * frames (modified since they were last written) go back to disk.
+ *
+ * A frame changed by a transaction that has not committed yet is in_txn. It
+ * stays in memory until the commit, so the db file never sees uncommitted
+ * data.
+ *
+ * Each commit gets the next number from pager->commit_seq, and csn is the
+ * commit that last changed the frame. Before the first change after a
+ * commit, the frame copies its committed image onto versions (newest first).
+ * Readers with an older snapshot read those copies, and a rollback puts the
+ * newest one back. Copies no open snapshot can see any more are freed.
+ */
+typedef struct PageVersion {
+  uint64_t csn;  // Commit that wrote this image
+  void *data;
+  struct PageVersion *older;
+} PageVersion;
+
+typedef struct Frame {
+  uint32_t page_num;
+  uint32_t pin_count;
+  bool dirty;
+  bool in_txn;
+  uint64_t csn;
+  PageVersion *versions;
+  void *data;
+  struct Frame *lru_prev;
+  struct Frame *lru_next;
+  pthread_rwlock_t latch;
+  bool loading;  // Being read from the file; wait on pager->loaded
+} Frame;
+
+/*
+ * Concurrency
+ *
+ * Any number of threads may read while one thread writes. pager->lock
+ * guards the frame table, the LRU list, pin counts, the frame flags and
+ * versions, and the list of open snapshots, and is only held for the length
+ * of one of those updates. Writers take write_lock, so there is only ever
+ * one.
+ *
+ * A reader takes a snapshot, which is the number of the last commit, and
+ * sees every page as it was right after that commit: the frame itself if
+ * nothing has changed it since, otherwise the newest version at or before
+ * the snapshot. Since every page it reads belongs to the same committed
+ * tree, a reader needs no locks on the path it came down, and a long select
+ * never keeps the writer waiting. Readers copy each page out under a shared
+ * latch on its frame; the writer takes the latch exclusively once, when it
+ * first marks the page dirty, to let copies already under way finish.
+ *
+ * The writer's own cursors read the latest pages (SNAPSHOT_LATEST),
+ * including its uncommitted changes, in place.
+ *
+ * Rolling back frees the versions readers may be copying from, so it takes
+ * the table's structure_lock exclusively. Readers hold it shared for the
+ * length of a read, from taking their snapshot to the trim after it. It
+ * lives in the Table rather than the Pager because the end of a vacuum
+ * (vacuum_replace) closes the table's pager and opens another in its place,
+ * and readers only reach the pager through the table once they hold it.
+ *
+ * A page pointer is only safe in another thread's presence while the page
+ * is pinned, since a reader's pager_trim may evict it. The writer is the
+ * exception: trims from other threads leave the cache alone while a write
+ * is in progress, so the tree code can keep using get_page.
+ *
+ * No file I/O happens under pager->lock. A cache miss puts a pinned frame
+ * marked loading in the table and reads the page with the lock dropped;
+ * anyone else after the same page waits on pager->loaded. Frames written
+ * back to the file are pinned and their dirty flag cleared first, and
+ * flush_lock is held for the write, so a checkpoint never truncates the log
+ * while a trim's write-back is still on its way to the file.
  */
+const uint64_t SNAPSHOT_LATEST = UINT64_MAX;
+
+#define PAGER_ERROR_SIZE 128
 
-const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
-const uint32_t LEAF_NODE_KEY_OFFSET = 0;
-const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
-const uint32_t LEAF_NODE_VALUE_OFFSET =
-    LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
-const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
-const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_MAX_CELLS =
-    LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
 typedef struct {
   int file_descriptor;
-  uint32_t file_length;
-  void *pages[TABLE_MAX_PAGES];
+  off_t file_length;
   uint32_t num_pages;
+  Frame **frames;
+  uint32_t frames_capacity;
+  Frame *lru_head;
+  Frame *lru_tail;
+  uint32_t num_frames;
+  uint32_t max_frames;
+  Wal *wal;    // NULL when read-only
+  void *map;   // Whole file mapped by a read-only pager, otherwise NULL
+  bool *map_checked; // Pages of the map whose checksum has been checked
+  uint64_t *archive_offsets; // Where each page's image starts in an archive
+  pthread_mutex_t lock;
+  pthread_cond_t loaded;       // Broadcast when a loading frame is read in
+  pthread_mutex_t flush_lock;  // Held while frames are written to the file
+  pthread_mutex_t write_lock;
+  pthread_t writer;        // Holder of write_lock when write_depth > 0
+  uint32_t write_depth;    // write_lock is reentrant for its holder
+  uint64_t commit_seq;      // Number of the last commit
+  uint64_t *snapshots;      // Open snapshots, in no particular order
+  uint32_t num_snapshots;
+  uint32_t snapshots_capacity;
+  uint32_t num_versions;    // Page versions kept for snapshots or rollback
+  uint32_t readahead_pages; // How far scans read ahead, 0 for not at all
+  DbStats stats;            // Counters since open or db_stats_reset
+  bool in_memory;           // No file: pages only ever live in frames
+  pid_t snapshot_pid;       // Child writing db_snapshot_to_file, 0 if none
+  char *filename;           // Of a read-write db file, otherwise NULL
+  bool failed;              // A page could not be read (see pager_fail)
+  char error[PAGER_ERROR_SIZE];  // Why, once failed
+  void *stand_in;           // Handed out for a page with no frame to fill
 } Pager;
-typedef struct {
+
+typedef struct Vacuum Vacuum;
+/*
+A B-tree in the db file. The table itself and each of its indexes are one
+of these, sharing the pager.
+*/
+struct Table {
   uint32_t root_page_num;
   Pager *pager;
-} Table;
+  /*
+  Rightmost leaf, remembered so that inserts with increasing keys can append
+  without descending from the root. INVALID_PAGE_NUM when not known.
+  */
+  uint32_t append_page_num;
+  struct Table *indexes[NUM_INDEXED_COLUMNS];  // NULL when not indexed
+  Vacuum *vacuum;  // Compaction under way (see Vacuum), NULL if none
+  pthread_rwlock_t structure_lock;  // See Concurrency; unused by an index
+};
 
 typedef struct {
   Table *table;
   uint32_t page_num;
   uint32_t cell_num;
   bool end_of_table;
+  uint64_t snapshot;
+  void *node;  // The page as the snapshot sees it
+  void *copy;  // Private copy of the page, NULL if node points into the cache
+  uint32_t readahead_end;  // Pages before this have been read ahead
 } Cursor;
 
+uint32_t *header_version(void *header) {
+  return header + HEADER_VERSION_OFFSET;
+}
+
+uint32_t *header_page_size(void *header) {
+  return header + HEADER_PAGE_SIZE_OFFSET;
+}
+
+uint32_t *header_max_internal_cells(void *header) {
+  return header + HEADER_MAX_INTERNAL_CELLS_OFFSET;
+}
+
+uint32_t *header_max_leaf_cell_size(void *header) {
+  return header + HEADER_MAX_LEAF_CELL_SIZE_OFFSET;
+}
+
+uint32_t *header_root_page_num(void *header) {
+  return header + HEADER_ROOT_PAGE_OFFSET;
+}
+
+uint32_t *header_index_root(void *header, IndexedColumn column) {
+  return header + HEADER_INDEX_ROOTS_OFFSET + column * HEADER_INDEX_ROOT_SIZE;
+}
+
+uint32_t *header_freelist_head(void *header) {
+  return header + HEADER_FREELIST_HEAD_OFFSET;
+}
+
+uint32_t *header_num_columns(void *header) {
+  return header + HEADER_NUM_COLUMNS_OFFSET;
+}
+
+uint32_t *header_column_type(void *header, uint32_t column) {
+  return header + HEADER_COLUMNS_OFFSET + column * HEADER_COLUMN_SIZE;
+}
+
+uint32_t *header_column_size(void *header, uint32_t column) {
+  return header + HEADER_COLUMNS_OFFSET + column * HEADER_COLUMN_SIZE +
+         HEADER_COLUMN_TYPE_SIZE;
+}
+
+uint32_t node_key_size(void *node) {
+  return *((uint16_t *)(node + NODE_KEY_SIZE_OFFSET));
+}
+
+void set_node_key_size(void *node, uint32_t key_size) {
+  *((uint16_t *)(node + NODE_KEY_SIZE_OFFSET)) = key_size;
+}
+
+bool key_size_is_valid(uint32_t key_size) {
+  return key_size == TABLE_KEY_SIZE || key_size == INDEX_KEY_SIZE;
+}
+
+/* Read or write a key of either size at key */
+uint64_t key_get(void *key, uint32_t key_size) {
+  if (key_size == TABLE_KEY_SIZE) {
+    return *(uint32_t *)key;
+  }
+  return *(uint64_t *)key;
+}
+
+void key_put(void *key, uint32_t key_size, uint64_t value) {
+  if (key_size == TABLE_KEY_SIZE) {
+    *(uint32_t *)key = value;
+  } else {
+    *(uint64_t *)key = value;
+  }
+}
+
 uint32_t *leaf_node_num_cells(void *node) {
   return node + LEAF_NODE_NUM_CELLS_OFFSET;
 }
@@ -118,16 +527,288 @@ uint32_t *leaf_node_next_leaf(void *node) {
   return node + LEAF_NODE_NEXT_LEAF_OFFSET;
 }
 
+uint32_t *leaf_node_content_start(void *node) {
+  return node + LEAF_NODE_CONTENT_START_OFFSET;
+}
+
+void *leaf_node_keys(void *node) { return node + LEAF_NODE_HEADER_SIZE; }
+
+uint64_t leaf_node_key(void *node, uint32_t cell_num) {
+  uint32_t key_size = node_key_size(node);
+  return key_get(leaf_node_keys(node) + cell_num * key_size, key_size);
+}
+
+void leaf_node_set_key(void *node, uint32_t cell_num, uint64_t key) {
+  uint32_t key_size = node_key_size(node);
+  key_put(leaf_node_keys(node) + cell_num * key_size, key_size, key);
+}
+
+// A key and its slot
+uint32_t leaf_node_entry_size(void *node) {
+  return node_key_size(node) + LEAF_NODE_SLOT_SIZE;
+}
+
+// The slots start after the keys, so where depends on the number of cells
+uint16_t *leaf_node_slot(void *node, uint32_t cell_num) {
+  return leaf_node_keys(node) +
+         *leaf_node_num_cells(node) * node_key_size(node) +
+         cell_num * LEAF_NODE_SLOT_SIZE;
+}
+
 void *leaf_node_cell(void *node, uint32_t cell_num) {
-  return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+  return node + *leaf_node_slot(node, cell_num);
+}
+
+uint16_t *leaf_cell_payload_size(void *cell) {
+  return cell + LEAF_NODE_PAYLOAD_SIZE_OFFSET;
+}
+
+/* How much of a payload is kept in the leaf itself */
+uint32_t leaf_cell_local_size(uint32_t payload_size) {
+  if (payload_size > LEAF_NODE_MAX_LOCAL_PAYLOAD) {
+    return LEAF_NODE_MAX_LOCAL_PAYLOAD;
+  }
+  return payload_size;
+}
+
+uint32_t leaf_cell_size(uint32_t payload_size) {
+  uint32_t size = LEAF_NODE_PAYLOAD_OFFSET + leaf_cell_local_size(payload_size);
+  if (payload_size > LEAF_NODE_MAX_LOCAL_PAYLOAD) {
+    size += LEAF_NODE_OVERFLOW_POINTER_SIZE;
+  }
+  return (size + 3) & ~3u;
+}
+
+uint32_t *leaf_cell_overflow_page(void *cell) {
+  return cell + LEAF_NODE_PAYLOAD_OFFSET + LEAF_NODE_MAX_LOCAL_PAYLOAD;
+}
+
+/* Bytes between the end of the slot array and the first cell */
+uint32_t leaf_node_gap(void *node) {
+  uint32_t slots_end = LEAF_NODE_HEADER_SIZE +
+                       *leaf_node_num_cells(node) * leaf_node_entry_size(node);
+  return *leaf_node_content_start(node) - slots_end;
+}
+
+/* The gap plus holes left by removed cells */
+uint32_t leaf_node_free_space(void *node) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t used = num_cells * leaf_node_entry_size(node);
+  for (uint32_t i = 0; i < num_cells; i++) {
+    used += leaf_cell_size(*leaf_cell_payload_size(leaf_node_cell(node, i)));
+  }
+  return LEAF_NODE_SPACE_FOR_CELLS - used;
+}
+
+/*
+ * Searching a leaf
+ *
+ * A branchless binary search (the comparison picks between two values
+ * instead of two branches, so the compiler uses a conditional move)
+ * narrows the keys down to LEAF_NODE_SEARCH_WINDOW. Those are then all
+ * compared with the search key at once, and the position is the number
+ * that are smaller. Table keys go 8 at a time with AVX2 or 4 with SSE2,
+ * index keys 4 at a time with AVX2 or 2 with SSE4.2. The default build
+ * assumes no more than SSE2 on x86-64, so the AVX2 and SSE4.2 compares are
+ * built for those alone and picked at run time, as for CRC32C. Other
+ * machines compare the window one key at a time.
+ */
+#define LEAF_NODE_SEARCH_WINDOW 16
+
+typedef enum {
+  KEYS_COMPARE_SCALAR,
+  KEYS_COMPARE_SSE2,
+  KEYS_COMPARE_SSE42,
+  KEYS_COMPARE_AVX2
+} KeysCompare;
+
+const char *keys_compare_names[] = {"one at a time", "SSE2", "SSE4.2",
+                                    "AVX2"};
+
+/* The widest compare this CPU has for table keys */
+KeysCompare keys32_compare() {
+#if defined(__x86_64__) && defined(__GNUC__)
+  if (__builtin_cpu_supports("avx2")) {
+    return KEYS_COMPARE_AVX2;
+  }
+  return KEYS_COMPARE_SSE2;
+#else
+  return KEYS_COMPARE_SCALAR;
+#endif
+}
+
+/* The widest compare this CPU has for index keys */
+KeysCompare keys64_compare() {
+#if defined(__x86_64__) && defined(__GNUC__)
+  if (__builtin_cpu_supports("avx2")) {
+    return KEYS_COMPARE_AVX2;
+  }
+  if (__builtin_cpu_supports("sse4.2")) {
+    return KEYS_COMPARE_SSE42;
+  }
+#endif
+  return KEYS_COMPARE_SCALAR;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/*
+Each of these counts the keys less than key among num_keys, a multiple of
+the number it compares at a time. The compares are signed, so the top bit
+of both sides is flipped first.
+*/
+uint32_t keys32_less_than_sse2(uint32_t *keys, uint32_t num_keys,
+                               uint32_t key) {
+  uint32_t count = 0;
+  __m128i flip4 = _mm_set1_epi32(INT32_MIN);
+  __m128i key4 = _mm_xor_si128(_mm_set1_epi32(key), flip4);
+  for (uint32_t i = 0; i < num_keys; i += 4) {
+    __m128i chunk =
+        _mm_xor_si128(_mm_loadu_si128((__m128i *)(keys + i)), flip4);
+    __m128i less = _mm_cmpgt_epi32(key4, chunk);
+    count += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(less)));
+  }
+  return count;
+}
+
+__attribute__((target("avx2"))) uint32_t
+keys32_less_than_avx2(uint32_t *keys, uint32_t num_keys, uint32_t key) {
+  uint32_t count = 0;
+  __m256i flip8 = _mm256_set1_epi32(INT32_MIN);
+  __m256i key8 = _mm256_xor_si256(_mm256_set1_epi32(key), flip8);
+  for (uint32_t i = 0; i < num_keys; i += 8) {
+    __m256i chunk = _mm256_xor_si256(
+        _mm256_loadu_si256((__m256i *)(keys + i)), flip8);
+    __m256i less = _mm256_cmpgt_epi32(key8, chunk);
+    count += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(less)));
+  }
+  return count;
+}
+
+__attribute__((target("sse4.2"))) uint32_t
+keys64_less_than_sse42(uint64_t *keys, uint32_t num_keys, uint64_t key) {
+  uint32_t count = 0;
+  __m128i flip2 = _mm_set1_epi64x(INT64_MIN);
+  __m128i key2 = _mm_xor_si128(_mm_set1_epi64x(key), flip2);
+  for (uint32_t i = 0; i < num_keys; i += 2) {
+    __m128i chunk =
+        _mm_xor_si128(_mm_loadu_si128((__m128i *)(keys + i)), flip2);
+    __m128i less = _mm_cmpgt_epi64(key2, chunk);
+    count += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(less)));
+  }
+  return count;
+}
+
+__attribute__((target("avx2"))) uint32_t
+keys64_less_than_avx2(uint64_t *keys, uint32_t num_keys, uint64_t key) {
+  uint32_t count = 0;
+  __m256i flip4 = _mm256_set1_epi64x(INT64_MIN);
+  __m256i key4 = _mm256_xor_si256(_mm256_set1_epi64x(key), flip4);
+  for (uint32_t i = 0; i < num_keys; i += 4) {
+    __m256i chunk = _mm256_xor_si256(
+        _mm256_loadu_si256((__m256i *)(keys + i)), flip4);
+    __m256i less = _mm256_cmpgt_epi64(key4, chunk);
+    count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(less)));
+  }
+  return count;
+}
+#endif
+
+/*
+How many of the first num_keys sorted keys are less than key, compared
+with compare (which the CPU must have) and then one at a time
+*/
+uint32_t keys32_less_than_with(KeysCompare compare, uint32_t *keys,
+                               uint32_t num_keys, uint32_t key) {
+  uint32_t count = 0;
+  uint32_t i = 0;
+#if defined(__x86_64__) && defined(__GNUC__)
+  if (compare == KEYS_COMPARE_AVX2) {
+    i = num_keys / 8 * 8;
+    count += keys32_less_than_avx2(keys, i, key);
+  }
+  if (compare >= KEYS_COMPARE_SSE2) {
+    uint32_t chunk = (num_keys - i) / 4 * 4;
+    count += keys32_less_than_sse2(keys + i, chunk, key);
+    i += chunk;
+  }
+#endif
+  for (; i < num_keys; i++) {
+    count += keys[i] < key;
+  }
+  return count;
+}
+
+uint32_t keys64_less_than_with(KeysCompare compare, uint64_t *keys,
+                               uint32_t num_keys, uint64_t key) {
+  uint32_t count = 0;
+  uint32_t i = 0;
+#if defined(__x86_64__) && defined(__GNUC__)
+  if (compare == KEYS_COMPARE_AVX2) {
+    i = num_keys / 4 * 4;
+    count += keys64_less_than_avx2(keys, i, key);
+  }
+  if (compare >= KEYS_COMPARE_SSE42) {
+    uint32_t chunk = (num_keys - i) / 2 * 2;
+    count += keys64_less_than_sse42(keys + i, chunk, key);
+    i += chunk;
+  }
+#endif
+  for (; i < num_keys; i++) {
+    count += keys[i] < key;
+  }
+  return count;
+}
+
+/* How many of the first num_keys sorted keys are less than key */
+uint32_t keys32_less_than(uint32_t *keys, uint32_t num_keys, uint32_t key) {
+  return keys32_less_than_with(keys32_compare(), keys, num_keys, key);
+}
+
+uint32_t keys64_less_than(uint64_t *keys, uint32_t num_keys, uint64_t key) {
+  return keys64_less_than_with(keys64_compare(), keys, num_keys, key);
+}
+
+/* Position of key among num_keys sorted keys */
+uint32_t keys32_lower_bound(uint32_t *keys, uint32_t num_keys, uint64_t key) {
+  if (key > UINT32_MAX) {
+    return num_keys;
+  }
+  uint32_t base = 0;
+  while (num_keys > LEAF_NODE_SEARCH_WINDOW) {
+    uint32_t half = num_keys / 2;
+    base = keys[base + half - 1] < key ? base + half : base;
+    num_keys -= half;
+  }
+  return base + keys32_less_than(keys + base, num_keys, key);
+}
+
+uint32_t keys64_lower_bound(uint64_t *keys, uint32_t num_keys, uint64_t key) {
+  uint32_t base = 0;
+  while (num_keys > LEAF_NODE_SEARCH_WINDOW) {
+    uint32_t half = num_keys / 2;
+    base = keys[base + half - 1] < key ? base + half : base;
+    num_keys -= half;
+  }
+  return base + keys64_less_than(keys + base, num_keys, key);
+}
+
+/*
+Position of key in the leaf, or where it would go if it is not there
+*/
+uint32_t leaf_node_lower_bound(void *node, uint64_t key) {
+  uint32_t num_keys = *leaf_node_num_cells(node);
+  if (node_key_size(node) == TABLE_KEY_SIZE) {
+    return keys32_lower_bound(leaf_node_keys(node), num_keys, key);
+  }
+  return keys64_lower_bound(leaf_node_keys(node), num_keys, key);
 }
 
-uint32_t *leaf_node_key(void *node, uint32_t cell_num) {
-  return leaf_node_cell(node, cell_num);
+uint32_t *overflow_node_next(void *node) {
+  return node + OVERFLOW_NODE_NEXT_OFFSET;
 }
 
-void *leaf_node_value(void *node, uint32_t cell_num) {
-  return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+uint32_t *free_node_next(void *node) {
+  return node + FREE_NODE_NEXT_OFFSET;
 }
 NodeType get_node_type(void *node) {
   uint8_t value = *((uint8_t *)(node + NODE_TYPE_OFFSET));
@@ -154,20 +835,163 @@ void set_node_type(void *node, NodeType type) {
   *((uint8_t *)(node + NODE_TYPE_OFFSET)) = value;
 }
 
-void initialize_leaf_node(void *node) {
+void initialize_leaf_node(void *node, uint32_t key_size) {
   set_node_type(node, NODE_LEAF);
   set_node_root(node, false);
+  set_node_key_size(node, key_size);
   *leaf_node_num_cells(node) = 0;
+  *leaf_node_next_leaf(node) = 0;  // 0 represents no sibling
+  *leaf_node_content_start(node) = PAGE_SIZE;
+}
+
+/*
+Move the cells together at the end of the page so that all free space is
+in the gap
+*/
+void leaf_node_compact(void *node) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint8_t copy[PAGE_SIZE];
+  memcpy(copy, node, PAGE_SIZE);
+
+  uint32_t content_start = PAGE_SIZE;
+  for (uint32_t i = 0; i < num_cells; i++) {
+    void *cell = leaf_node_cell(copy, i);
+    uint32_t size = leaf_cell_size(*leaf_cell_payload_size(cell));
+    content_start -= size;
+    memcpy(node + content_start, cell, size);
+    *leaf_node_slot(node, i) = content_start;
+  }
+  *leaf_node_content_start(node) = content_start;
+}
+
+/*
+Put a cell and its key at position cell_num, shifting later keys and slots
+right. The caller makes sure the gap has room for them.
+*/
+void leaf_node_insert_cell(void *node, uint32_t cell_num, uint64_t key,
+                           void *cell, uint32_t size) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t content_start = *leaf_node_content_start(node) - size;
+  memcpy(node + content_start, cell, size);
+  *leaf_node_content_start(node) = content_start;
+
+  /*
+  The key array grows by one key, so every slot moves up by a key, and
+  those from cell_num on by a slot more. Move the later ones first since
+  they go further.
+  */
+  uint32_t key_size = node_key_size(node);
+  uint16_t *slots = leaf_node_slot(node, 0);
+  uint16_t *new_slots = (void *)slots + key_size;
+  memmove(new_slots + cell_num + 1, slots + cell_num,
+          (num_cells - cell_num) * LEAF_NODE_SLOT_SIZE);
+  memmove(new_slots, slots, cell_num * LEAF_NODE_SLOT_SIZE);
+  new_slots[cell_num] = content_start;
+
+  void *keys = leaf_node_keys(node);
+  memmove(keys + (cell_num + 1) * key_size, keys + cell_num * key_size,
+          (num_cells - cell_num) * key_size);
+  leaf_node_set_key(node, cell_num, key);
+  *leaf_node_num_cells(node) = num_cells + 1;
 }
 
 /*
  * Internal Node Body Layout
+ * A cell is a child's page number followed by its key
  */
-const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
-const uint32_t INTERNAL_NODE_CELL_SIZE =
-    INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
-const uint32_t INTERNAL_NODE_MAX_CELLS = 3;
+/*
+Keys an internal node holds before it splits. At most one fewer than fit in
+a page, so that the cell after the last key is inside the page too; a db can
+be created with fewer, down to 3, which makes for deep trees from few rows.
+The limit is set for the table's keys. An index's nodes, whose keys are
+wider, stop short of it when fewer of theirs fit.
+*/
+const uint32_t INTERNAL_NODE_MIN_MAX_CELLS = 3;
+uint32_t INTERNAL_NODE_MAX_CELLS;
+
+// Dbs open in this process, which all share the layout
+uint32_t layout_num_open = 0;
+
+uint32_t internal_node_cells_that_fit(uint32_t page_size, uint32_t key_size) {
+  return (page_size - INTERNAL_NODE_HEADER_SIZE) /
+         (INTERNAL_NODE_CHILD_SIZE + key_size);
+}
+
+uint32_t internal_node_max_cells_limit(uint32_t page_size,
+                                       uint32_t key_size) {
+  return internal_node_cells_that_fit(page_size, key_size) - 1;
+}
+
+uint32_t internal_node_cell_size(void *node) {
+  return INTERNAL_NODE_CHILD_SIZE + node_key_size(node);
+}
+
+uint32_t internal_node_max_cells(void *node) {
+  uint32_t limit =
+      internal_node_max_cells_limit(PAGE_SIZE, node_key_size(node));
+  return INTERNAL_NODE_MAX_CELLS < limit ? INTERNAL_NODE_MAX_CELLS : limit;
+}
+
+bool page_size_is_valid(uint32_t page_size) {
+  return page_size >= MIN_PAGE_SIZE && page_size <= MAX_PAGE_SIZE &&
+         (page_size & (page_size - 1)) == 0;
+}
+
+/*
+The largest a leaf cell can be in a page of this size: a cell with its key
+and slot takes at most a quarter of the page. Cell sizes are rounded up to
+a multiple of 4 so that overflow page numbers stay aligned, and so is this.
+*/
+uint32_t leaf_node_max_cell_size_limit(uint32_t page_size) {
+  uint32_t space_for_cells = page_size - LEAF_NODE_HEADER_SIZE;
+  return (space_for_cells / 4 - LEAF_NODE_MAX_ENTRY_SIZE) & ~3u;
+}
+
+/* Whether a db with this layout could have been created (see layout_create) */
+bool layout_is_valid(uint32_t page_size, uint32_t max_internal_cells,
+                     uint32_t max_leaf_cell_size) {
+  return page_size_is_valid(page_size) &&
+         max_internal_cells >= INTERNAL_NODE_MIN_MAX_CELLS &&
+         max_internal_cells <=
+             internal_node_max_cells_limit(page_size, TABLE_KEY_SIZE) &&
+         max_leaf_cell_size >= LEAF_NODE_MIN_MAX_CELL_SIZE &&
+         max_leaf_cell_size <= leaf_node_max_cell_size_limit(page_size) &&
+         max_leaf_cell_size % 4 == 0;
+}
+
+/*
+Set the page size and everything that depends on it, for a db about to be
+opened. Each layout_open is matched by a layout_close in db_close. False,
+with nothing changed, if another open db has a different layout: the layout
+is the process's, so that db has to be closed first.
+*/
+bool layout_open(uint32_t page_size, uint32_t max_internal_cells,
+                 uint32_t max_leaf_cell_size) {
+  if (layout_num_open > 0 && (page_size != PAGE_SIZE ||
+                              max_internal_cells != INTERNAL_NODE_MAX_CELLS ||
+                              max_leaf_cell_size != LEAF_NODE_MAX_CELL_SIZE)) {
+    printf("Db has %d-byte pages, %d-key internal nodes and %d-byte leaf "
+           "cells, but another open db has %d, %d and %d.\n",
+           page_size, max_internal_cells, max_leaf_cell_size, PAGE_SIZE,
+           INTERNAL_NODE_MAX_CELLS, LEAF_NODE_MAX_CELL_SIZE);
+    return false;
+  }
+  layout_num_open++;
+
+  PAGE_SIZE = page_size;
+  INTERNAL_NODE_MAX_CELLS = max_internal_cells;
+  LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
+  LEAF_NODE_MAX_CELL_SIZE = max_leaf_cell_size;
+  LEAF_NODE_MAX_LOCAL_PAYLOAD = LEAF_NODE_MAX_CELL_SIZE -
+                                LEAF_NODE_PAYLOAD_OFFSET -
+                                LEAF_NODE_OVERFLOW_POINTER_SIZE;
+  OVERFLOW_NODE_SPACE = PAGE_SIZE - OVERFLOW_NODE_HEADER_SIZE;
+  LEAF_NODE_MIN_USED_SPACE = LEAF_NODE_SPACE_FOR_CELLS / 4;
+  return true;
+}
+
+void layout_close() { layout_num_open--; }
 
 uint32_t *internal_node_num_keys(void *node) {
   return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
@@ -178,7 +1002,8 @@ uint32_t *internal_node_right_child(void *node) {
 }
 
 uint32_t *internal_node_cell(void *node, uint32_t cell_num) {
-  return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+  return node + INTERNAL_NODE_HEADER_SIZE +
+         cell_num * internal_node_cell_size(node);
 }
 
 uint32_t *internal_node_child(void *node, uint32_t child_num) {
@@ -206,11 +1031,14 @@ uint32_t *internal_node_child(void *node, uint32_t child_num) {
 
 void internal_node_split_and_insert(Table *table, uint32_t parent_page_num,
                                     uint32_t child_page_num);
-Cursor *table_find(Table *table, uint32_t key);
+Cursor *table_find(Table *table, uint64_t key);
+Cursor *table_find_at(Table *table, uint64_t key, uint64_t snapshot);
+Cursor *table_seek(Table *table, uint64_t key);
 
-void initialize_internal_node(void *node) {
+void initialize_internal_node(void *node, uint32_t key_size) {
   set_node_type(node, NODE_INTERNAL);
   set_node_root(node, false);
+  set_node_key_size(node, key_size);
   *internal_node_num_keys(node) = 0;
 
   /*
@@ -222,814 +1050,6566 @@ void initialize_internal_node(void *node) {
   *internal_node_right_child(node) = INVALID_PAGE_NUM;
 }
 
-const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
-const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT =
-    +(LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
 
-Pager *pager_open(const char *filename) {
-  int fd = open(filename,
-                O_RDWR |     // Read/Write mode
-                    O_CREAT, // Create file if it does not exist
-                S_IWUSR |    // User write permission
-                    S_IRUSR  // User read permission
-  );
-  if (fd == -1) {
-    printf("Unable to open file\n");
-    exit(EXIT_FAILURE);
+/*
+ * CRC32C
+ * Uses the CPU's CRC32C instruction where there is one: SSE4.2 on x86,
+ * looked up at run time since the default build does not assume it, and
+ * the CRC extension on ARM. Otherwise falls back to a table, a byte at a
+ * time.
+ */
+uint32_t crc32c_table[256];
+pthread_once_t crc32c_table_once = PTHREAD_ONCE_INIT;
+
+void crc32c_init_table() {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+    }
+    crc32c_table[i] = crc;
   }
+}
 
-  off_t file_length = lseek(fd, 0, SEEK_END);
-
-  Pager *pager = malloc(sizeof(Pager));
-  pager->file_descriptor = fd;
-  pager->file_length = file_length;
-  pager->num_pages = (file_length / PAGE_SIZE);
-
-  if (file_length % PAGE_SIZE != 0) {
-    printf("Db file is not a whole number of pages. Corrupt file. \n");
-    exit(EXIT_FAILURE);
+uint32_t crc32c_bytes(uint32_t crc, const uint8_t *data, size_t length) {
+  pthread_once(&crc32c_table_once, crc32c_init_table);
+  for (size_t i = 0; i < length; i++) {
+    crc = crc32c_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
   }
+  return crc;
+}
 
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    pager->pages[i] = NULL;
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2"))) uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t *data, size_t length) {
+  for (; length >= sizeof(uint64_t); length -= sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc = (uint32_t)_mm_crc32_u64(crc, word);
+    data += sizeof(word);
   }
-
-  return pager;
+  for (; length > 0; length--) {
+    crc = _mm_crc32_u8(crc, *data++);
+  }
+  return crc;
 }
-void *get_page(Pager *pager, uint32_t page_num) {
-  if (page_num > TABLE_MAX_PAGES) {
-    printf("Tried to fetch page number out of bounds. %d > %d\n", page_num,
-           TABLE_MAX_PAGES);
-    exit(EXIT_FAILURE);
+#endif
+
+/* Continue crc over length more bytes. Start from 0. */
+uint32_t crc32c(uint32_t crc, const void *data, size_t length) {
+  crc = ~crc;
+#if defined(__ARM_FEATURE_CRC32)
+  const uint8_t *bytes = data;
+  for (; length >= sizeof(uint64_t); length -= sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    crc = __crc32cd(crc, word);
+    bytes += sizeof(word);
   }
+  for (; length > 0; length--) {
+    crc = __crc32cb(crc, *bytes++);
+  }
+#elif defined(__x86_64__) && defined(__GNUC__)
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc = crc32c_sse42(crc, data, length);
+  } else {
+    crc = crc32c_bytes(crc, data, length);
+  }
+#else
+  crc = crc32c_bytes(crc, data, length);
+#endif
+  return ~crc;
+}
 
-  if (pager->pages[page_num] == NULL) {
-    // Cache miss. Allocate memory and load from file.
-    void *page = malloc(PAGE_SIZE);
-    uint32_t num_pages = pager->file_length / PAGE_SIZE;
-
-    // We might save a partial page at the end of the file
-    if (pager->file_length % PAGE_SIZE) {
-      num_pages += 1;
-    }
+uint32_t *page_stored_checksum(void *page) {
+  return page + PAGE_CHECKSUM_OFFSET;
+}
 
-    if (page_num <= num_pages) {
-      lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
+/*
+The page number goes into the checksum too, so a page written to the wrong
+place does not pass for the one that belongs there
+*/
+uint32_t page_checksum(uint32_t page_num, void *page) {
+  uint32_t crc = crc32c(0, &page_num, sizeof(page_num));
+  return crc32c(crc, page + PAGE_CHECKSUM_OFFSET + PAGE_CHECKSUM_SIZE,
+                PAGE_SIZE - PAGE_CHECKSUM_OFFSET - PAGE_CHECKSUM_SIZE);
+}
 
-      ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
+void page_set_checksum(uint32_t page_num, void *page) {
+  *page_stored_checksum(page) = page_checksum(page_num, page);
+}
 
-      if (bytes_read == -1) {
-        printf("Error reading file: %d\n", errno);
-        exit(EXIT_FAILURE);
-      }
-    }
+/*
+Every page inside the file was written with its checksum, so there is no
+exemption for a page of zeros: one that reads back that way was lost.
+Pages past the end of the file never get here.
+*/
+bool page_checksum_ok(uint32_t page_num, void *page) {
+  return *page_stored_checksum(page) == page_checksum(page_num, page);
+}
 
-    pager->pages[page_num] = page;
+/*
+ * Unreadable Pages
+ *
+ * A page that cannot be read, or fails its checksum, does not end the
+ * process: the pager records why and hands out an empty root leaf in its
+ * place, so the tree code stops at it instead of working from what is not
+ * there. From then on nothing reaches the db file or the log. Commits are
+ * dropped, to be rolled back (see run_statement), and checkpoints and
+ * write-back are skipped, leaving what was committed before in the log for
+ * the next open to replay. db_error says what went wrong.
+ */
+bool pager_failed(Pager *pager) {
+  return __atomic_load_n(&pager->failed, __ATOMIC_ACQUIRE);
+}
 
-    if (page_num >= pager->num_pages) {
-      pager->num_pages = page_num + 1;
-    }
+/* Record why the pager failed. Only the first failure is kept. */
+void pager_fail(Pager *pager, const char *format, ...) {
+  pthread_mutex_lock(&pager->lock);
+  if (!pager->failed) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(pager->error, PAGER_ERROR_SIZE, format, args);
+    va_end(args);
+    __atomic_store_n(&pager->failed, true, __ATOMIC_RELEASE);
   }
+  pthread_mutex_unlock(&pager->lock);
+}
 
-  return pager->pages[page_num];
+void page_make_stand_in(uint32_t page_num, void *page) {
+  memset(page, 0, PAGE_SIZE);
+  initialize_leaf_node(page, TABLE_KEY_SIZE);
+  set_node_root(page, true);
+  page_set_checksum(page_num, page);
 }
 
-Table *db_open(const char *filename) {
-  Pager *pager = pager_open(filename);
+/*
+Check a page just read. False, with the pager failed and the page made a
+stand-in, if it is not what was written.
+*/
+bool page_verify(Pager *pager, uint32_t page_num, void *page) {
+  if (page_checksum_ok(page_num, page)) {
+    return true;
+  }
+  pager_fail(pager, "Page %d is corrupt: checksum mismatch.", page_num);
+  page_make_stand_in(page_num, page);
+  return false;
+}
+
+uint32_t wal_checksum(uint32_t page_num, void *page) {
+  uint32_t crc = crc32c(0, &page_num, sizeof(page_num));
+  return crc32c(crc, page, PAGE_SIZE);
+}
+
+/*
+Scan the log and return the offset just past the last commit record whose
+pages are all intact. Anything after that was cut short by a crash.
+*/
+off_t wal_find_committed_end(int wal_fd, void *page) {
+  uint8_t header[WAL_RECORD_HEADER_SIZE];
+  off_t offset = 0;
+  off_t committed_end = 0;
+  uint32_t pages_in_commit = 0;
+
+  while (pread(wal_fd, header, WAL_RECORD_HEADER_SIZE, offset) ==
+         WAL_RECORD_HEADER_SIZE) {
+    uint32_t page_num = *(uint32_t *)(header + WAL_RECORD_PAGE_NUM_OFFSET);
+    uint32_t checksum = *(uint32_t *)(header + WAL_RECORD_CHECKSUM_OFFSET);
+    offset += WAL_RECORD_HEADER_SIZE;
+
+    if (page_num == WAL_COMMIT_MARKER) {
+      if (checksum != pages_in_commit) {
+        break;
+      }
+      committed_end = offset;
+      pages_in_commit = 0;
+      continue;
+    }
+
+    if (pread(wal_fd, page, PAGE_SIZE, offset) != PAGE_SIZE ||
+        wal_checksum(page_num, page) != checksum) {
+      break;
+    }
+    offset += PAGE_SIZE;
+    pages_in_commit++;
+  }
+
+  return committed_end;
+}
+
+/*
+Copy every committed page image from the log into the db file, then empty
+the log. Replaying twice is harmless, so a crash during recovery is too.
+False if the db file cannot be written, with the log left as it was.
+*/
+bool wal_replay(int db_fd, int wal_fd) {
+  void *page = malloc(PAGE_SIZE);
+  off_t committed_end = wal_find_committed_end(wal_fd, page);
+  uint8_t header[WAL_RECORD_HEADER_SIZE];
+  off_t offset = 0;
+
+  while (offset < committed_end) {
+    pread(wal_fd, header, WAL_RECORD_HEADER_SIZE, offset);
+    uint32_t page_num = *(uint32_t *)(header + WAL_RECORD_PAGE_NUM_OFFSET);
+    offset += WAL_RECORD_HEADER_SIZE;
+
+    if (page_num == WAL_COMMIT_MARKER) {
+      continue;
+    }
+
+    pread(wal_fd, page, PAGE_SIZE, offset);
+    offset += PAGE_SIZE;
+    if (pwrite(db_fd, page, PAGE_SIZE, (off_t)page_num * PAGE_SIZE) == -1) {
+      break;
+    }
+  }
+
+  bool ok = offset >= committed_end && fsync(db_fd) == 0 &&
+            ftruncate(wal_fd, 0) == 0;
+  if (!ok) {
+    printf("Error replaying write-ahead log: %d\n", errno);
+  }
+  free(page);
+  return ok;
+}
+
+Wal *wal_create(int fd, char *filename);
+
+/* Open the db's log and replay what it holds. NULL if either fails. */
+Wal *wal_open(const char *db_filename, int db_fd) {
+  char *filename = malloc(strlen(db_filename) + strlen("-wal") + 1);
+  sprintf(filename, "%s-wal", db_filename);
+  int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+  if (fd == -1) {
+    printf("Unable to open write-ahead log\n");
+    free(filename);
+    return NULL;
+  }
+
+  if (lseek(fd, 0, SEEK_END) > 0 && !wal_replay(db_fd, fd)) {
+    close(fd);
+    free(filename);
+    return NULL;
+  }
+  return wal_create(fd, filename);
+}
+
+/* A log with no file (fd -1) only keeps track of the open transaction */
+Wal *wal_create(int fd, char *filename) {
+  Wal *wal = malloc(sizeof(Wal));
+  wal->file_descriptor = fd;
+  wal->filename = filename;
+  wal->length = 0;
+  wal->txn_capacity = 16;
+  wal->txn_pages = malloc(wal->txn_capacity * sizeof(uint32_t));
+  wal->txn_num_pages = 0;
+  wal->in_transaction = false;
+  wal->group_size = WAL_DEFAULT_GROUP_COMMIT;
+  wal->unsynced_commits = 0;
+  wal->pages_since_checkpoint = 0;
+  pthread_mutex_init(&wal->sync_lock, NULL);
+  wal->has_flusher = false;
+  wal->closing = false;
+  pthread_cond_init(&wal->sync_cond, NULL);
+  return wal;
+}
+
+void wal_sync(Wal *wal) {
+  pthread_mutex_lock(&wal->sync_lock);
+  if (wal->unsynced_commits > 0) {
+#ifdef __APPLE__
+    int result = fsync(wal->file_descriptor);
+#else
+    int result = fdatasync(wal->file_descriptor);
+#endif
+    if (result == -1) {
+      printf("Error syncing write-ahead log: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    wal->unsynced_commits = 0;
+  }
+  pthread_mutex_unlock(&wal->sync_lock);
+}
+
+int64_t wal_unsynced_ns(Wal *wal) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)(now.tv_sec - wal->first_unsynced_commit.tv_sec) *
+             1000000000 +
+         (now.tv_nsec - wal->first_unsynced_commit.tv_nsec);
+}
+
+/* The flusher thread: sync whatever has waited out the window */
+void *wal_flusher_run(void *argument) {
+  Wal *wal = argument;
+  pthread_mutex_lock(&wal->sync_lock);
+  while (!wal->closing) {
+    if (wal->unsynced_commits == 0) {
+      pthread_cond_wait(&wal->sync_cond, &wal->sync_lock);
+      continue;
+    }
+    int64_t remaining_ns = WAL_GROUP_COMMIT_WINDOW_NS - wal_unsynced_ns(wal);
+    pthread_mutex_unlock(&wal->sync_lock);
+    if (remaining_ns > 0) {
+      struct timespec sleep = {.tv_sec = remaining_ns / 1000000000,
+                               .tv_nsec = remaining_ns % 1000000000};
+      nanosleep(&sleep, NULL);
+    } else {
+      wal_sync(wal);
+    }
+    pthread_mutex_lock(&wal->sync_lock);
+  }
+  pthread_mutex_unlock(&wal->sync_lock);
+  return NULL;
+}
+
+/* Called with wal->sync_lock held. False if the thread cannot be started. */
+bool wal_start_flusher(Wal *wal) {
+  wal->has_flusher =
+      pthread_create(&wal->flusher, NULL, wal_flusher_run, wal) == 0;
+  return wal->has_flusher;
+}
+
+void wal_stop_flusher(Wal *wal) {
+  pthread_mutex_lock(&wal->sync_lock);
+  bool has_flusher = wal->has_flusher;
+  wal->closing = true;
+  pthread_cond_signal(&wal->sync_cond);
+  pthread_mutex_unlock(&wal->sync_lock);
+  if (has_flusher) {
+    pthread_join(wal->flusher, NULL);
+  }
+}
+
+/*
+ * Compressed Archive Layout
+ *
+ * ".archive <file>" writes a compressed, read-only copy of the db, meant
+ * for tables that are no longer written to. The file starts with
+ * ARCHIVE_MAGIC, the number of pages, the db's page size, internal node
+ * size and leaf cell size (so they are known before page 0 is decoded),
+ * then one 8-byte file offset per page saying where its image starts, plus
+ * one for the end of the last image, then the images themselves. An image
+ * is a PageEncoding byte followed by the encoded page.
+ *
+ * A leaf is compacted first, then written as its header, its keys as the
+ * difference from the key before (a varint, usually one byte), and its
+ * cells in slot order. That stream, or the plain page for anything that is
+ * not a leaf, goes through a small LZ77 codec in the style of LZ4. A page
+ * that would not shrink is stored as it is.
+ *
+ * An archive can only be opened read-only. Its pager has frames like a
+ * read-write one, and a cache miss decodes the page's image into the frame,
+ * so the rest of the code never sees the difference.
+ */
+#define ARCHIVE_MAGIC "tinydbz4"
+#define LZ_HASH_BITS 12
+// Compressing can add a little to data that does not compress
+#define ARCHIVE_MAX_IMAGE_SIZE (1 + PAGE_SIZE + PAGE_SIZE / 255 + 16)
+
+typedef enum {
+  PAGE_ENCODING_RAW,  // The page as it is
+  PAGE_ENCODING_LZ,   // The page, compressed
+  PAGE_ENCODING_LEAF  // A leaf's keys and cells, compressed
+} PageEncoding;
+
+const uint32_t ARCHIVE_MAGIC_SIZE = 8;
+const uint32_t ARCHIVE_NUM_PAGES_SIZE = sizeof(uint32_t);
+const uint32_t ARCHIVE_NUM_PAGES_OFFSET = ARCHIVE_MAGIC_SIZE;
+const uint32_t ARCHIVE_PAGE_SIZE_SIZE = sizeof(uint32_t);
+const uint32_t ARCHIVE_PAGE_SIZE_OFFSET =
+    ARCHIVE_NUM_PAGES_OFFSET + ARCHIVE_NUM_PAGES_SIZE;
+const uint32_t ARCHIVE_MAX_INTERNAL_CELLS_SIZE = sizeof(uint32_t);
+const uint32_t ARCHIVE_MAX_INTERNAL_CELLS_OFFSET =
+    ARCHIVE_PAGE_SIZE_OFFSET + ARCHIVE_PAGE_SIZE_SIZE;
+const uint32_t ARCHIVE_MAX_LEAF_CELL_SIZE_SIZE = sizeof(uint32_t);
+const uint32_t ARCHIVE_MAX_LEAF_CELL_SIZE_OFFSET =
+    ARCHIVE_MAX_INTERNAL_CELLS_OFFSET + ARCHIVE_MAX_INTERNAL_CELLS_SIZE;
+const uint32_t ARCHIVE_OFFSET_SIZE = sizeof(uint64_t);
+const uint32_t ARCHIVE_OFFSETS_OFFSET =
+    ARCHIVE_MAX_LEAF_CELL_SIZE_OFFSET + ARCHIVE_MAX_LEAF_CELL_SIZE_SIZE;
+const uint32_t LZ_MIN_MATCH = 4;
+const uint32_t LZ_MAX_OFFSET = UINT16_MAX;
+
+/* Write value 7 bits at a time, low bits first. Returns the bytes used. */
+uint32_t varint_put(uint8_t *out, uint64_t value) {
+  uint32_t size = 0;
+  while (value >= 0x80) {
+    out[size++] = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  out[size++] = value;
+  return size;
+}
+
+/* Returns the bytes read, or 0 if the varint runs past end */
+uint32_t varint_get(const uint8_t *in, const uint8_t *end, uint64_t *value) {
+  uint64_t result = 0;
+  for (uint32_t i = 0; i < 10 && in + i < end; i++) {
+    result |= (uint64_t)(in[i] & 0x7F) << (7 * i);
+    if ((in[i] & 0x80) == 0) {
+      *value = result;
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+uint32_t lz_hash(const uint8_t *bytes) {
+  uint32_t word;
+  memcpy(&word, bytes, sizeof(word));
+  return (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* A length that did not fit in its 4 bits of the token: 255s, then the rest */
+uint8_t *lz_put_length(uint8_t *out, uint32_t length) {
+  while (length >= 255) {
+    *out++ = 255;
+    length -= 255;
+  }
+  *out++ = length;
+  return out;
+}
+
+bool lz_get_length(const uint8_t **in, const uint8_t *end, uint32_t *length) {
+  uint8_t byte;
+  do {
+    if (*in == end) {
+      return false;
+    }
+    byte = *(*in)++;
+    *length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+/*
+A sequence is a token (4 bits of literal count, 4 bits of match length), the
+literals, then the 2-byte distance back to the match. The last sequence has
+literals only.
+*/
+uint8_t *lz_put_sequence(uint8_t *out, const uint8_t *literals,
+                         uint32_t num_literals, uint32_t offset,
+                         uint32_t match_length) {
+  uint8_t *token = out++;
+  *token = (num_literals < 15 ? num_literals : 15) << 4;
+  if (num_literals >= 15) {
+    out = lz_put_length(out, num_literals - 15);
+  }
+  memcpy(out, literals, num_literals);
+  out += num_literals;
+  if (match_length == 0) {
+    return out;
+  }
+
+  *out++ = offset & 0xFF;
+  *out++ = offset >> 8;
+  uint32_t extra = match_length - LZ_MIN_MATCH;
+  *token |= extra < 15 ? extra : 15;
+  if (extra >= 15) {
+    out = lz_put_length(out, extra - 15);
+  }
+  return out;
+}
+
+/*
+Compress size bytes into out, which needs room for a little more than size
+in case nothing matches. Returns the compressed size.
+*/
+uint32_t lz_compress(const uint8_t *in, uint32_t size, uint8_t *out) {
+  // Where each hashed 4-byte sequence was last seen
+  int32_t last_seen[1 << LZ_HASH_BITS];
+  for (uint32_t i = 0; i < (1 << LZ_HASH_BITS); i++) {
+    last_seen[i] = -1;
+  }
+
+  uint8_t *end = out;
+  uint32_t literals_start = 0;
+  uint32_t pos = 0;
+  while (pos + LZ_MIN_MATCH <= size) {
+    uint32_t hash = lz_hash(in + pos);
+    int32_t candidate = last_seen[hash];
+    last_seen[hash] = pos;
+    if (candidate < 0 || pos - candidate > LZ_MAX_OFFSET ||
+        memcmp(in + candidate, in + pos, LZ_MIN_MATCH) != 0) {
+      pos++;
+      continue;
+    }
+
+    uint32_t length = LZ_MIN_MATCH;
+    while (pos + length < size && in[candidate + length] == in[pos + length]) {
+      length++;
+    }
+    end = lz_put_sequence(end, in + literals_start, pos - literals_start,
+                          pos - candidate, length);
+    pos += length;
+    literals_start = pos;
+  }
+  end = lz_put_sequence(end, in + literals_start, size - literals_start, 0, 0);
+  return end - out;
+}
+
+/*
+Returns the decompressed size, or UINT32_MAX if the stream is damaged or
+would not fit in capacity bytes
+*/
+uint32_t lz_decompress(const uint8_t *in, uint32_t size, uint8_t *out,
+                       uint32_t capacity) {
+  const uint8_t *end = in + size;
+  uint32_t out_size = 0;
+  while (in < end) {
+    uint8_t token = *in++;
+    uint32_t num_literals = token >> 4;
+    if (num_literals == 15 && !lz_get_length(&in, end, &num_literals)) {
+      return UINT32_MAX;
+    }
+    if (num_literals > end - in || num_literals > capacity - out_size) {
+      return UINT32_MAX;
+    }
+    memcpy(out + out_size, in, num_literals);
+    in += num_literals;
+    out_size += num_literals;
+    if (in == end) {
+      break;
+    }
+
+    if (end - in < 2) {
+      return UINT32_MAX;
+    }
+    uint32_t offset = in[0] | (uint32_t)in[1] << 8;
+    in += 2;
+    uint32_t length = token & 0xF;
+    if (length == 15 && !lz_get_length(&in, end, &length)) {
+      return UINT32_MAX;
+    }
+    length += LZ_MIN_MATCH;
+    if (offset == 0 || offset > out_size || length > capacity - out_size) {
+      return UINT32_MAX;
+    }
+    // Byte by byte, since a match may overlap the bytes it produces
+    for (uint32_t i = 0; i < length; i++) {
+      out[out_size + i] = out[out_size + i - offset];
+    }
+    out_size += length;
+  }
+  return out_size;
+}
+
+/* The header, the keys as differences, then the cells, of a compacted leaf */
+uint32_t leaf_node_encode(void *node, uint8_t *out) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint8_t *end = out;
+  memcpy(end, node, LEAF_NODE_HEADER_SIZE);
+  end += LEAF_NODE_HEADER_SIZE;
+
+  uint64_t previous = 0;
+  for (uint32_t i = 0; i < num_cells; i++) {
+    uint64_t key = leaf_node_key(node, i);
+    end += varint_put(end, key - previous);
+    previous = key;
+  }
+  for (uint32_t i = 0; i < num_cells; i++) {
+    void *cell = leaf_node_cell(node, i);
+    uint32_t size = leaf_cell_size(*leaf_cell_payload_size(cell));
+    memcpy(end, cell, size);
+    end += size;
+  }
+  return end - out;
+}
+
+/*
+Rebuild a leaf from leaf_node_encode's output, laid out exactly as
+leaf_node_compact leaves it. False if the stream does not make a leaf.
+*/
+bool leaf_node_decode(const uint8_t *in, uint32_t size, void *node) {
+  const uint8_t *end = in + size;
+  if (size < LEAF_NODE_HEADER_SIZE) {
+    return false;
+  }
+  memset(node, 0, PAGE_SIZE);
+  memcpy(node, in, LEAF_NODE_HEADER_SIZE);
+  in += LEAF_NODE_HEADER_SIZE;
+
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  if (!key_size_is_valid(node_key_size(node)) ||
+      num_cells > LEAF_NODE_SPACE_FOR_CELLS / leaf_node_entry_size(node)) {
+    return false;
+  }
+  uint64_t key = 0;
+  for (uint32_t i = 0; i < num_cells; i++) {
+    uint64_t delta;
+    uint32_t length = varint_get(in, end, &delta);
+    if (length == 0) {
+      return false;
+    }
+    in += length;
+    key += delta;
+    leaf_node_set_key(node, i, key);
+  }
+
+  uint32_t slots_end =
+      LEAF_NODE_HEADER_SIZE + num_cells * leaf_node_entry_size(node);
+  uint32_t content_start = PAGE_SIZE;
+  for (uint32_t i = 0; i < num_cells; i++) {
+    if (end - in < LEAF_NODE_PAYLOAD_OFFSET) {
+      return false;
+    }
+    uint16_t payload_size;
+    memcpy(&payload_size, in + LEAF_NODE_PAYLOAD_SIZE_OFFSET,
+           sizeof(payload_size));
+    uint32_t cell_size = leaf_cell_size(payload_size);
+    if (cell_size > end - in || cell_size > content_start - slots_end) {
+      return false;
+    }
+    content_start -= cell_size;
+    memcpy(node + content_start, in, cell_size);
+    in += cell_size;
+    *leaf_node_slot(node, i) = content_start;
+  }
+  return in == end && content_start == *leaf_node_content_start(node);
+}
+
+/*
+Encode a page into out, which has room for ARCHIVE_MAX_IMAGE_SIZE bytes.
+Returns the size of the image.
+*/
+uint32_t archive_encode_page(uint32_t page_num, void *page, uint8_t *out) {
+  uint8_t image[PAGE_SIZE];
+  uint8_t stream[PAGE_SIZE];
+  uint32_t stream_size = PAGE_SIZE;
+  memcpy(image, page, PAGE_SIZE);
+  out[0] = PAGE_ENCODING_LZ;
+
+  // The header page has no node type
+  if (page_num != HEADER_PAGE_NUM && get_node_type(image) == NODE_LEAF) {
+    // Compacted, with the gap zeroed, the leaf decodes to exactly this
+    leaf_node_compact(image);
+    uint32_t slots_end = LEAF_NODE_HEADER_SIZE +
+                         *leaf_node_num_cells(image) *
+                             leaf_node_entry_size(image);
+    memset(image + slots_end, 0, *leaf_node_content_start(image) - slots_end);
+    page_set_checksum(page_num, image);
+    stream_size = leaf_node_encode(image, stream);
+    out[0] = PAGE_ENCODING_LEAF;
+  } else {
+    memcpy(stream, image, PAGE_SIZE);
+  }
+
+  uint32_t size = lz_compress(stream, stream_size, out + 1);
+  if (size >= PAGE_SIZE) {
+    out[0] = PAGE_ENCODING_RAW;
+    memcpy(out + 1, image, PAGE_SIZE);
+    size = PAGE_SIZE;
+  }
+  return 1 + size;
+}
+
+/*
+Decode a page of an archive into page. Returns the bytes read, or 0 with
+the pager failed and a stand-in in page.
+*/
+uint64_t archive_read_page(Pager *pager, uint32_t page_num, void *page) {
+  if (page_num >= pager->num_pages) {
+    pager_fail(pager, "Tried to fetch page %d past the end of a read-only db.",
+               page_num);
+    page_make_stand_in(page_num, page);
+    return 0;
+  }
+
+  uint8_t image[ARCHIVE_MAX_IMAGE_SIZE];
+  uint8_t stream[PAGE_SIZE];
+  uint64_t offset = pager->archive_offsets[page_num];
+  uint64_t size = pager->archive_offsets[page_num + 1] - offset;
+  bool ok = size > 0 && size <= ARCHIVE_MAX_IMAGE_SIZE &&
+            pread(pager->file_descriptor, image, size, offset) == (ssize_t)size;
+
+  if (ok) {
+    uint32_t stream_size;
+    switch (image[0]) {
+      case (PAGE_ENCODING_RAW):
+        ok = size == 1 + PAGE_SIZE;
+        memcpy(page, image + 1, PAGE_SIZE);
+        break;
+      case (PAGE_ENCODING_LZ):
+        ok = lz_decompress(image + 1, size - 1, page, PAGE_SIZE) == PAGE_SIZE;
+        break;
+      case (PAGE_ENCODING_LEAF):
+        stream_size = lz_decompress(image + 1, size - 1, stream, PAGE_SIZE);
+        ok = stream_size != UINT32_MAX &&
+             leaf_node_decode(stream, stream_size, page);
+        break;
+      default:
+        ok = false;
+    }
+  }
+  if (!ok) {
+    pager_fail(pager, "Page %d is corrupt: cannot decode it.", page_num);
+    page_make_stand_in(page_num, page);
+    return 0;
+  }
+  return page_verify(pager, page_num, page) ? size : 0;
+}
+
+/*
+Fill in the fixed part of a new db's header: everything but the roots and
+the freelist
+*/
+void header_init(void *header, uint32_t page_size,
+                 uint32_t max_internal_cells, uint32_t max_leaf_cell_size) {
+  memcpy(header + HEADER_MAGIC_OFFSET, HEADER_MAGIC, HEADER_MAGIC_SIZE);
+  *header_version(header) = DB_FORMAT_VERSION;
+  *header_page_size(header) = page_size;
+  *header_max_internal_cells(header) = max_internal_cells;
+  *header_max_leaf_cell_size(header) = max_leaf_cell_size;
+
+  uint32_t types[ROW_NUM_COLUMNS] = {COLUMN_TYPE_INTEGER, COLUMN_TYPE_TEXT,
+                                     COLUMN_TYPE_TEXT};
+  uint32_t sizes[ROW_NUM_COLUMNS] = {ID_SIZE, COLUMN_USERNAME_SIZE,
+                                     COLUMN_EMAIL_SIZE};
+  *header_num_columns(header) = ROW_NUM_COLUMNS;
+  for (uint32_t i = 0; i < ROW_NUM_COLUMNS; i++) {
+    *header_column_type(header, i) = types[i];
+    *header_column_size(header, i) = sizes[i];
+  }
+}
+
+/*
+Check the first HEADER_SIZE bytes of a db file, which are all that can be
+read before the page size is known, and set the layout from them. False if
+they are not a header this program reads, or another open db has a
+different layout.
+*/
+bool header_open_layout(void *header) {
+  if (memcmp(header + HEADER_MAGIC_OFFSET, HEADER_MAGIC, HEADER_MAGIC_SIZE) !=
+      0) {
+    printf("File is not a db.\n");
+    return false;
+  }
+  if (*header_version(header) != DB_FORMAT_VERSION) {
+    printf("Db has format version %d, but this program reads version %d.\n",
+           *header_version(header), DB_FORMAT_VERSION);
+    return false;
+  }
+
+  uint32_t page_size = *header_page_size(header);
+  uint32_t max_internal_cells = *header_max_internal_cells(header);
+  uint32_t max_leaf_cell_size = *header_max_leaf_cell_size(header);
+  if (!layout_is_valid(page_size, max_internal_cells, max_leaf_cell_size)) {
+    printf("Db header is corrupt.\n");
+    return false;
+  }
+
+  uint8_t expected[HEADER_SIZE];
+  header_init(expected, page_size, max_internal_cells, max_leaf_cell_size);
+  if (memcmp(header + HEADER_NUM_COLUMNS_OFFSET,
+             expected + HEADER_NUM_COLUMNS_OFFSET,
+             HEADER_SIZE - HEADER_NUM_COLUMNS_OFFSET) != 0) {
+    printf("Db was created with a different row schema.\n");
+    return false;
+  }
+
+  return layout_open(page_size, max_internal_cells, max_leaf_cell_size);
+}
+
+/*
+Read the header of an existing db file and set the layout from it. The
+fields read here never change once the file is created, so the copy in
+the file is right even when the log holds a newer header page.
+*/
+bool db_file_open_layout(int fd) {
+  uint8_t header[HEADER_SIZE];
+  if (pread(fd, header, HEADER_SIZE, 0) != HEADER_SIZE) {
+    printf("Db file is too short to hold a header.\n");
+    return false;
+  }
+  return header_open_layout(header);
+}
+
+/*
+Check the layout asked for a new db (0 internal cells for as many as fit,
+and 0 leaf cell size for the largest allowed) and make it the process's.
+False if it is not one allowed, or another open db has a different one.
+*/
+bool layout_create(uint32_t page_size, uint32_t max_internal_cells,
+                   uint32_t max_leaf_cell_size) {
+  if (!page_size_is_valid(page_size)) {
+    printf("Page size must be a power of two from %d to %d.\n", MIN_PAGE_SIZE,
+           MAX_PAGE_SIZE);
+    return false;
+  }
+  uint32_t limit = internal_node_max_cells_limit(page_size, TABLE_KEY_SIZE);
+  if (max_internal_cells == 0) {
+    max_internal_cells = limit;
+  }
+  if (max_internal_cells < INTERNAL_NODE_MIN_MAX_CELLS ||
+      max_internal_cells > limit) {
+    printf("Internal nodes must hold from %d to %d keys.\n",
+           INTERNAL_NODE_MIN_MAX_CELLS, limit);
+    return false;
+  }
+  uint32_t cell_limit = leaf_node_max_cell_size_limit(page_size);
+  if (max_leaf_cell_size == 0) {
+    max_leaf_cell_size = cell_limit;
+  }
+  if (max_leaf_cell_size < LEAF_NODE_MIN_MAX_CELL_SIZE ||
+      max_leaf_cell_size > cell_limit || max_leaf_cell_size % 4 != 0) {
+    printf("Leaf cells must take from %d to %d bytes, a multiple of 4.\n",
+           LEAF_NODE_MIN_MAX_CELL_SIZE, cell_limit);
+    return false;
+  }
+  return layout_open(page_size, max_internal_cells, max_leaf_cell_size);
+}
+
+/* What a new db starts with: the header, and an empty leaf as root */
+void db_init_pages(void *header, void *root) {
+  header_init(header, PAGE_SIZE, INTERNAL_NODE_MAX_CELLS,
+              LEAF_NODE_MAX_CELL_SIZE);
+  *header_root_page_num(header) = 1;
+  initialize_leaf_node(root, TABLE_KEY_SIZE);
+  set_node_root(root, true);
+}
+
+/*
+Start a new db file. Its first pages are written straight to the file
+rather than through the log, so that the page size can always be read from
+the file before the log is replayed. False, leaving the file empty, if the
+layout is refused (see layout_create) or the pages cannot be written.
+*/
+bool db_file_create(int fd, uint32_t page_size, uint32_t max_internal_cells,
+                    uint32_t max_leaf_cell_size) {
+  if (!layout_create(page_size, max_internal_cells, max_leaf_cell_size)) {
+    return false;
+  }
+
+  uint8_t *pages = calloc(2, PAGE_SIZE);
+  void *header = pages;
+  void *root = pages + PAGE_SIZE;
+  db_init_pages(header, root);
+  page_set_checksum(HEADER_PAGE_NUM, header);
+  page_set_checksum(1, root);
+
+  bool ok = pwrite(fd, pages, 2 * PAGE_SIZE, 0) == 2 * PAGE_SIZE &&
+            fsync(fd) == 0;
+  free(pages);
+  if (!ok) {
+    printf("Error creating db file: %d\n", errno);
+    ftruncate(fd, 0);
+    layout_close();
+  }
+  return ok;
+}
+
+bool file_is_archive(int fd) {
+  char magic[ARCHIVE_MAGIC_SIZE];
+  return pread(fd, magic, ARCHIVE_MAGIC_SIZE, 0) == ARCHIVE_MAGIC_SIZE &&
+         memcmp(magic, ARCHIVE_MAGIC, ARCHIVE_MAGIC_SIZE) == 0;
+}
+
+void pager_init_locks(Pager *pager) {
+  pthread_mutex_init(&pager->lock, NULL);
+  pthread_cond_init(&pager->loaded, NULL);
+  pthread_mutex_init(&pager->flush_lock, NULL);
+  pthread_mutex_init(&pager->write_lock, NULL);
+  pager->write_depth = 0;
+  pager->commit_seq = 0;
+  pager->snapshots_capacity = 8;
+  pager->snapshots = malloc(pager->snapshots_capacity * sizeof(uint64_t));
+  pager->num_snapshots = 0;
+  pager->num_versions = 0;
+  memset(&pager->stats, 0, sizeof(DbStats));
+  pager->in_memory = false;
+  pager->snapshot_pid = 0;
+  pager->filename = NULL;
+  pager->failed = false;
+  pager->stand_in = malloc(PAGE_SIZE);
+}
+
+/*
+Open a db file for reading and writing. A new file is created with the
+given layout (see layout_create); an existing one keeps the one it was
+created with. NULL, with the reason
+printed, if the file cannot be opened or read as a db, or its layout is
+not the one another open db has.
+*/
+Pager *pager_open(const char *filename, uint32_t max_frames,
+                  uint32_t page_size, uint32_t max_internal_cells,
+                  uint32_t max_leaf_cell_size) {
+  if (max_frames == 0) {
+    printf("Page cache must hold at least one page.\n");
+    return NULL;
+  }
+  int fd = open(filename,
+                O_RDWR |     // Read/Write mode
+                    O_CREAT, // Create file if it does not exist
+                S_IWUSR |    // User write permission
+                    S_IRUSR  // User read permission
+  );
+  if (fd == -1) {
+    printf("Unable to open file\n");
+    return NULL;
+  }
+  if (file_is_archive(fd)) {
+    printf("Db is a compressed archive. Open it with --read-only.\n");
+    close(fd);
+    return NULL;
+  }
+  bool layout_ok = lseek(fd, 0, SEEK_END) == 0
+                       ? db_file_create(fd, page_size, max_internal_cells,
+                                        max_leaf_cell_size)
+                       : db_file_open_layout(fd);
+  if (!layout_ok) {
+    close(fd);
+    return NULL;
+  }
+
+  // Recover anything a crash left in the log before sizing the file
+  Wal *wal = wal_open(filename, fd);
+  off_t file_length = lseek(fd, 0, SEEK_END);
+  if (wal == NULL || file_length % PAGE_SIZE != 0) {
+    if (wal != NULL) {
+      printf("Db file is not a whole number of pages. Corrupt file. \n");
+      close(wal->file_descriptor);
+      free(wal->filename);
+      free(wal->txn_pages);
+      free(wal);
+    }
+    layout_close();
+    close(fd);
+    return NULL;
+  }
+
+  Pager *pager = malloc(sizeof(Pager));
+  pager->file_descriptor = fd;
+  pager->wal = wal;
+  pager->file_length = file_length;
+  pager->num_pages = (file_length / PAGE_SIZE);
+  wal->txn_start_num_pages = pager->num_pages;
+
+  pager->frames_capacity = pager->num_pages > 0 ? pager->num_pages : 1;
+  pager->frames = calloc(pager->frames_capacity, sizeof(Frame *));
+  pager->lru_head = NULL;
+  pager->lru_tail = NULL;
+  pager->num_frames = 0;
+  pager->max_frames = max_frames;
+  pager->readahead_pages = PAGER_DEFAULT_READAHEAD_PAGES;
+  pager->map = NULL;
+  pager->map_checked = NULL;
+  pager->archive_offsets = NULL;
+  pager_init_locks(pager);
+  pager->filename = strdup(filename);
+
+  return pager;
+}
+
+Frame *pager_get_frame(Pager *pager, uint32_t page_num);
+
+/*
+A db with no file, for db_open(":memory:"). Every page lives in a frame
+that is never evicted, and a commit only publishes the pages it changed to
+new snapshots; there is no log to write or sync. Transactions, snapshots
+and rollback work as they do for a file. Everything is gone at db_close,
+except what was written out with db_snapshot_to_file.
+*/
+Pager *pager_open_memory(uint32_t page_size, uint32_t max_internal_cells,
+                         uint32_t max_leaf_cell_size) {
+  if (!layout_create(page_size, max_internal_cells, max_leaf_cell_size)) {
+    return NULL;
+  }
+
+  Pager *pager = malloc(sizeof(Pager));
+  pager->file_descriptor = -1;
+  pager->wal = wal_create(-1, NULL);
+  pager->file_length = 0;
+  pager->num_pages = 0;
+  pager->frames_capacity = 16;
+  pager->frames = calloc(pager->frames_capacity, sizeof(Frame *));
+  pager->lru_head = NULL;
+  pager->lru_tail = NULL;
+  pager->num_frames = 0;
+  pager->max_frames = UINT32_MAX;
+  pager->readahead_pages = 0;
+  pager->map = NULL;
+  pager->map_checked = NULL;
+  pager->archive_offsets = NULL;
+  pager_init_locks(pager);
+  pager->in_memory = true;
+
+  // Past the end of the (empty) file, so both start out zeroed and dirty
+  pthread_mutex_lock(&pager->lock);
+  void *header = pager_get_frame(pager, HEADER_PAGE_NUM)->data;
+  void *root = pager_get_frame(pager, 1)->data;
+  pthread_mutex_unlock(&pager->lock);
+  db_init_pages(header, root);
+  pager->wal->txn_start_num_pages = pager->num_pages;
+  return pager;
+}
+
+/*
+An archive is read through frames like a read-write db, but with no log.
+NULL, with fd closed, if the archive's header cannot be read.
+*/
+Pager *pager_open_archive(int fd, uint32_t max_frames) {
+  uint8_t header[ARCHIVE_OFFSETS_OFFSET];
+  if (pread(fd, header, ARCHIVE_OFFSETS_OFFSET, 0) != ARCHIVE_OFFSETS_OFFSET) {
+    printf("Archive is empty or cut short.\n");
+    close(fd);
+    return NULL;
+  }
+  uint32_t num_pages = *(uint32_t *)(header + ARCHIVE_NUM_PAGES_OFFSET);
+  uint32_t page_size = *(uint32_t *)(header + ARCHIVE_PAGE_SIZE_OFFSET);
+  uint32_t max_internal_cells =
+      *(uint32_t *)(header + ARCHIVE_MAX_INTERNAL_CELLS_OFFSET);
+  uint32_t max_leaf_cell_size =
+      *(uint32_t *)(header + ARCHIVE_MAX_LEAF_CELL_SIZE_OFFSET);
+  if (num_pages == 0) {
+    printf("Archive is empty or cut short.\n");
+    close(fd);
+    return NULL;
+  }
+  if (!layout_is_valid(page_size, max_internal_cells, max_leaf_cell_size)) {
+    printf("Archive header is corrupt.\n");
+    close(fd);
+    return NULL;
+  }
+  ssize_t offsets_size = ((ssize_t)num_pages + 1) * ARCHIVE_OFFSET_SIZE;
+  uint64_t *offsets = malloc(offsets_size);
+  if (pread(fd, offsets, offsets_size, ARCHIVE_OFFSETS_OFFSET) !=
+      offsets_size) {
+    printf("Archive is empty or cut short.\n");
+    free(offsets);
+    close(fd);
+    return NULL;
+  }
+  if (!layout_open(page_size, max_internal_cells, max_leaf_cell_size)) {
+    free(offsets);
+    close(fd);
+    return NULL;
+  }
+
+  Pager *pager = malloc(sizeof(Pager));
+  pager->file_descriptor = fd;
+  pager->wal = NULL;
+  pager->map = NULL;
+  pager->map_checked = NULL;
+  pager->archive_offsets = offsets;
+  pager->file_length = offsets[num_pages];
+  pager->num_pages = num_pages;
+  pager->frames_capacity = num_pages;
+  pager->frames = calloc(pager->frames_capacity, sizeof(Frame *));
+  pager->lru_head = NULL;
+  pager->lru_tail = NULL;
+  pager->num_frames = 0;
+  pager->max_frames = max_frames;
+  pager->readahead_pages = PAGER_DEFAULT_READAHEAD_PAGES;
+  pager_init_locks(pager);
+
+  return pager;
+}
+
+/*
+A read-only pager maps the whole file and hands out pointers straight into
+the mapping, so there is no frame to allocate or copy into on a miss. NULL,
+with the reason printed, if the file cannot be opened and mapped as a db.
+*/
+Pager *pager_open_read_only(const char *filename, uint32_t max_frames) {
+  if (max_frames == 0) {
+    printf("Page cache must hold at least one page.\n");
+    return NULL;
+  }
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    printf("Unable to open file\n");
+    return NULL;
+  }
+  if (file_is_archive(fd)) {
+    return pager_open_archive(fd, max_frames);
+  }
+
+  // Recovery writes to the db file, which a read-only open cannot do
+  char *wal_filename = malloc(strlen(filename) + strlen("-wal") + 1);
+  sprintf(wal_filename, "%s-wal", filename);
+  struct stat wal_stat;
+  bool has_wal = stat(wal_filename, &wal_stat) == 0 && wal_stat.st_size > 0;
+  free(wal_filename);
+  if (has_wal) {
+    printf("Db has an unapplied write-ahead log. Open it read-write first.\n");
+    close(fd);
+    return NULL;
+  }
+
+  off_t file_length = lseek(fd, 0, SEEK_END);
+  if (file_length == 0) {
+    printf("Db file is empty or not a whole number of pages.\n");
+    close(fd);
+    return NULL;
+  }
+  if (!db_file_open_layout(fd)) {
+    close(fd);
+    return NULL;
+  }
+  if (file_length % PAGE_SIZE != 0) {
+    printf("Db file is empty or not a whole number of pages.\n");
+    layout_close();
+    close(fd);
+    return NULL;
+  }
+
+  void *map = mmap(NULL, file_length, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    printf("Error mapping db file: %d\n", errno);
+    layout_close();
+    close(fd);
+    return NULL;
+  }
+
+  Pager *pager = malloc(sizeof(Pager));
+  pager->file_descriptor = fd;
+  pager->wal = NULL;
+  pager->map = map;
+  pager->map_checked = calloc(file_length / PAGE_SIZE, sizeof(bool));
+  pager->archive_offsets = NULL;
+  pager->file_length = file_length;
+  pager->num_pages = file_length / PAGE_SIZE;
+  pager->frames = NULL;
+  pager->frames_capacity = 0;
+  pager->lru_head = NULL;
+  pager->lru_tail = NULL;
+  pager->num_frames = 0;
+  pager->max_frames = 0;
+  pager->readahead_pages = PAGER_DEFAULT_READAHEAD_PAGES;
+  pager_init_locks(pager);
+
+  return pager;
+}
+
+/*
+Tell the kernel how the mapping is about to be read. Only a read-only pager
+has a mapping; for the others this does nothing.
+*/
+void pager_advise(Pager *pager, int advice) {
+  if (pager->map != NULL) {
+    madvise(pager->map, pager->file_length, advice);
+  }
+}
+
+/*
+Ask the kernel to start reading num_pages pages from page_num into its page
+cache, without waiting for them. Pages already in the buffer pool are
+skipped when asking for a single one.
+*/
+void pager_prefetch(Pager *pager, uint32_t page_num, uint32_t num_pages) {
+  pthread_mutex_lock(&pager->lock);
+  off_t file_length = pager->file_length;
+  bool cached = num_pages == 1 && page_num < pager->frames_capacity &&
+                pager->frames[page_num] != NULL;
+  pthread_mutex_unlock(&pager->lock);
+
+  off_t offset = (off_t)page_num * PAGE_SIZE;
+  off_t length = (off_t)num_pages * PAGE_SIZE;
+  if (pager->archive_offsets != NULL) {
+    // Page images in an archive are in page order but of any size
+    if (page_num >= pager->num_pages) {
+      return;
+    }
+    uint32_t last = page_num + num_pages;
+    last = last < pager->num_pages ? last : pager->num_pages;
+    offset = pager->archive_offsets[page_num];
+    length = pager->archive_offsets[last] - offset;
+  }
+  if (cached || offset >= file_length) {
+    return;
+  }
+  if (offset + length > file_length) {
+    length = file_length - offset;
+  }
+
+  if (pager->map != NULL) {
+    madvise(pager->map + offset, length, MADV_WILLNEED);
+    return;
+  }
+#ifdef __APPLE__
+  struct radvisory advice = {.ra_offset = offset, .ra_count = (int)length};
+  fcntl(pager->file_descriptor, F_RDADVISE, &advice);
+#else
+  posix_fadvise(pager->file_descriptor, offset, length, POSIX_FADV_WILLNEED);
+#endif
+}
+
+void pager_lru_remove(Pager *pager, Frame *frame) {
+  if (frame->lru_prev) {
+    frame->lru_prev->lru_next = frame->lru_next;
+  } else {
+    pager->lru_head = frame->lru_next;
+  }
+  if (frame->lru_next) {
+    frame->lru_next->lru_prev = frame->lru_prev;
+  } else {
+    pager->lru_tail = frame->lru_prev;
+  }
+  frame->lru_prev = NULL;
+  frame->lru_next = NULL;
+}
+
+void pager_lru_push_front(Pager *pager, Frame *frame) {
+  frame->lru_prev = NULL;
+  frame->lru_next = pager->lru_head;
+  if (pager->lru_head) {
+    pager->lru_head->lru_prev = frame;
+  }
+  pager->lru_head = frame;
+  if (pager->lru_tail == NULL) {
+    pager->lru_tail = frame;
+  }
+}
+
+bool frame_needs_write(Frame *frame) {
+  return frame != NULL && frame->dirty && !frame->in_txn;
+}
+
+int compare_frames(const void *a, const void *b) {
+  uint32_t page_a = (*(Frame *const *)a)->page_num;
+  uint32_t page_b = (*(Frame *const *)b)->page_num;
+  return (page_a > page_b) - (page_a < page_b);
+}
+
+/*
+Write frames back to the file, in page order, and unpin them. The caller
+holds flush_lock, not pager->lock, and has pinned the frames and cleared
+their dirty flags. Runs of adjacent pages are written with a single pwritev
+call. Each frame's latch is held shared while it is written, so that a
+writer's first change to it waits for the write (and marks it dirty again).
+*/
+void pager_write_frames(Pager *pager, Frame **frames, uint32_t num_frames) {
+  struct iovec iov[IOV_MAX];
+  off_t file_length = 0;
+
+  // The log must be on disk before any page it covers reaches the db file
+  if (num_frames > 0) {
+    wal_sync(pager->wal);
+  }
+
+  uint32_t i = 0;
+  while (i < num_frames) {
+    uint32_t run_start = i;
+    int run_length = 0;
+    do {
+      pthread_rwlock_rdlock(&frames[i]->latch);
+      iov[run_length].iov_base = frames[i]->data;
+      iov[run_length].iov_len = PAGE_SIZE;
+      run_length++;
+      i++;
+    } while (i < num_frames && run_length < IOV_MAX &&
+             frames[i]->page_num == frames[i - 1]->page_num + 1);
+
+    off_t offset = (off_t)frames[run_start]->page_num * PAGE_SIZE;
+    ssize_t bytes_written =
+        pwritev(pager->file_descriptor, iov, run_length, offset);
+    for (uint32_t j = run_start; j < i; j++) {
+      pthread_rwlock_unlock(&frames[j]->latch);
+    }
+
+    if (bytes_written != (ssize_t)run_length * PAGE_SIZE) {
+      printf("Error writing: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    if (offset + bytes_written > file_length) {
+      file_length = offset + bytes_written;
+    }
+  }
+
+  pthread_mutex_lock(&pager->lock);
+  for (i = 0; i < num_frames; i++) {
+    frames[i]->pin_count--;
+  }
+  pager->stats.pages_written += num_frames;
+  pager->stats.bytes_written += (uint64_t)num_frames * PAGE_SIZE;
+  if (file_length > pager->file_length) {
+    pager->file_length = file_length;
+  }
+  pthread_mutex_unlock(&pager->lock);
+}
+
+/*
+Pin a frame that is about to be written back and clear its dirty flag.
+Called with pager->lock held.
+*/
+void pager_take_for_write(Frame *frame) {
+  frame->pin_count++;
+  frame->dirty = false;
+}
+
+void pager_mark_dirty(Pager *pager, uint32_t page_num) {
+  // The stand-in for an invalid page number is never written anywhere
+  if (page_num == INVALID_PAGE_NUM) {
+    return;
+  }
+  pthread_mutex_lock(&pager->lock);
+  Frame *frame = pager->frames[page_num];
+  if (frame == NULL) {
+    printf("Tried to mark page %d dirty but it is not cached\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+  frame->dirty = true;
+
+  if (frame->in_txn) {
+    pthread_mutex_unlock(&pager->lock);
+    return;
+  }
+
+  // First change to this page since the last commit: remember to log it
+  Wal *wal = pager->wal;
+  if (wal->txn_num_pages == wal->txn_capacity) {
+    wal->txn_capacity *= 2;
+    wal->txn_pages =
+        realloc(wal->txn_pages, wal->txn_capacity * sizeof(uint32_t));
+  }
+  wal->txn_pages[wal->txn_num_pages++] = page_num;
+
+  /*
+  Keep the committed image for older snapshots and for rollback. Callers
+  mark a page before they modify it, so the frame still holds it.
+  */
+  PageVersion *version = malloc(sizeof(PageVersion));
+  version->data = malloc(PAGE_SIZE);
+  memcpy(version->data, frame->data, PAGE_SIZE);
+  version->csn = frame->csn;
+  version->older = frame->versions;
+  frame->versions = version;
+  frame->in_txn = true;
+  pager->num_versions++;
+  pthread_mutex_unlock(&pager->lock);
+
+  // From here on readers copy the version, but some may still be copying
+  // the frame. Wait for them before the caller starts changing it.
+  pthread_rwlock_wrlock(&frame->latch);
+  pthread_rwlock_unlock(&frame->latch);
+}
+
+/* Free a clean frame. Called with pager->lock held. */
+void pager_evict(Pager *pager, Frame *frame) {
+  pager_lru_remove(pager, frame);
+  pager->frames[frame->page_num] = NULL;
+  pager->num_frames--;
+  pthread_rwlock_destroy(&frame->latch);
+  free(frame->data);
+  free(frame);
+}
+
+bool frame_can_evict(Frame *frame) {
+  return frame->pin_count == 0 && !frame->in_txn && frame->versions == NULL;
+}
+
+/*
+Evict least recently used, unpinned frames until the cache is back within
+its budget. get_page never evicts by itself, so pointers it hands out stay
+valid until the next call to pager_trim. Only call this where no unpinned
+page pointers are still in use (between statements, or from a cursor that
+has pinned its own page).
+
+Clean frames are freed right away. Dirty ones are written back first, with
+pager->lock dropped, and freed after unless someone has taken them up in
+the meantime. While a checkpoint is writing, dirty frames are left for it.
+*/
+void pager_trim(Pager *pager) {
+  // A failed pager keeps its dirty frames (see Unreadable Pages)
+  bool can_write = !pager_failed(pager) &&
+                   pthread_mutex_trylock(&pager->flush_lock) == 0;
+  pthread_mutex_lock(&pager->lock);
+  // Another thread is writing and may hold unpinned page pointers
+  if (pager->write_depth > 0 && !pthread_equal(pager->writer, pthread_self())) {
+    pthread_mutex_unlock(&pager->lock);
+    if (can_write) {
+      pthread_mutex_unlock(&pager->flush_lock);
+    }
+    return;
+  }
+
+  Frame **dirty = NULL;
+  uint32_t num_dirty = 0;
+  Frame *frame = pager->lru_tail;
+  while (pager->num_frames - num_dirty > pager->max_frames && frame != NULL) {
+    Frame *prev = frame->lru_prev;
+    if (frame_can_evict(frame)) {
+      if (!frame->dirty) {
+        pager_evict(pager, frame);
+      } else if (can_write) {
+        if (dirty == NULL) {
+          dirty = malloc(pager->num_frames * sizeof(Frame *));
+        }
+        pager_take_for_write(frame);
+        dirty[num_dirty++] = frame;
+      }
+    }
+    frame = prev;
+  }
+  pthread_mutex_unlock(&pager->lock);
+  if (!can_write) {
+    return;
+  }
+
+  qsort(dirty, num_dirty, sizeof(Frame *), compare_frames);
+  pager_write_frames(pager, dirty, num_dirty);
+  pthread_mutex_unlock(&pager->flush_lock);
+
+  pthread_mutex_lock(&pager->lock);
+  for (uint32_t i = 0; i < num_dirty; i++) {
+    if (frame_can_evict(dirty[i]) && !dirty[i]->dirty) {
+      pager_evict(pager, dirty[i]);
+    }
+  }
+  pthread_mutex_unlock(&pager->lock);
+  free(dirty);
+}
+
+/*
+Find or load the frame for a page. Called with pager->lock held, which is
+let go of while the page is read from the file.
+*/
+Frame *pager_get_frame(Pager *pager, uint32_t page_num) {
+  if (page_num >= pager->frames_capacity) {
+    uint32_t new_capacity = pager->frames_capacity * 2;
+    if (new_capacity <= page_num) {
+      new_capacity = page_num + 1;
+    }
+    pager->frames = realloc(pager->frames, new_capacity * sizeof(Frame *));
+    memset(pager->frames + pager->frames_capacity, 0,
+           (new_capacity - pager->frames_capacity) * sizeof(Frame *));
+    pager->frames_capacity = new_capacity;
+  }
+
+  Frame *frame = pager->frames[page_num];
+  if (frame != NULL) {
+    // Cache hit. Mark as most recently used.
+    pager->stats.cache_hits++;
+    if (pager->lru_head != frame) {
+      pager_lru_remove(pager, frame);
+      pager_lru_push_front(pager, frame);
+    }
+    // Pinned while waiting, so that it is still there when the read is done
+    frame->pin_count++;
+    while (frame->loading) {
+      pthread_cond_wait(&pager->loaded, &pager->lock);
+    }
+    frame->pin_count--;
+    return frame;
+  }
+
+  // Cache miss. Allocate a frame and load from file.
+  frame = malloc(sizeof(Frame));
+  frame->page_num = page_num;
+  frame->pin_count = 0;
+  frame->in_txn = false;
+  // Anything loaded from the file is older than every open snapshot: a
+  // frame with versions an open snapshot needs is never evicted
+  frame->csn = 0;
+  frame->versions = NULL;
+  frame->data = calloc(1, PAGE_SIZE);
+  pthread_rwlock_init(&frame->latch, NULL);
+
+  // A page past the end of the file has never been written
+  off_t offset = (off_t)page_num * PAGE_SIZE;
+  frame->dirty =
+      pager->archive_offsets == NULL && offset >= pager->file_length;
+  frame->loading = !frame->dirty;
+  pager->stats.cache_misses++;
+
+  pager->frames[page_num] = frame;
+  pager->num_frames++;
+  pager_lru_push_front(pager, frame);
+
+  if (page_num >= pager->num_pages) {
+    pager->num_pages = page_num + 1;
+  }
+  if (!frame->loading) {
+    return frame;
+  }
+
+  frame->pin_count++;
+  pthread_mutex_unlock(&pager->lock);
+  uint64_t bytes_read;
+  if (pager->archive_offsets != NULL) {
+    bytes_read = archive_read_page(pager, page_num, frame->data);
+  } else {
+    ssize_t result =
+        pread(pager->file_descriptor, frame->data, PAGE_SIZE, offset);
+    if (result != PAGE_SIZE) {
+      pager_fail(pager, "Error reading page %d: %d", page_num, errno);
+      page_make_stand_in(page_num, frame->data);
+      bytes_read = 0;
+    } else {
+      bytes_read = page_verify(pager, page_num, frame->data) ? result : 0;
+    }
+  }
+  pthread_mutex_lock(&pager->lock);
+
+  frame->pin_count--;
+  frame->loading = false;
+  pager->stats.pages_read++;
+  pager->stats.bytes_read += bytes_read;
+  pthread_cond_broadcast(&pager->loaded);
+  return frame;
+}
+
+/*
+The pager's own stand-in page, for a page with no frame to put one in: an
+invalid page number, or a page of a read-only db's map (see Unreadable
+Pages). It is made afresh each time, whatever was done to it since.
+*/
+void *pager_stand_in(Pager *pager, uint32_t page_num) {
+  page_make_stand_in(page_num, pager->stand_in);
+  return pager->stand_in;
+}
+
+void *get_page(Pager *pager, uint32_t page_num) {
+  if (page_num == INVALID_PAGE_NUM) {
+    pager_fail(pager, "Tried to fetch an invalid page number.");
+    return pager_stand_in(pager, page_num);
+  }
+
+  if (pager->map != NULL) {
+    if (page_num >= pager->num_pages) {
+      pager_fail(pager,
+                 "Tried to fetch page %d past the end of a read-only db.",
+                 page_num);
+      return pager_stand_in(pager, page_num);
+    }
+    void *page = pager->map + (off_t)page_num * PAGE_SIZE;
+    // Each page is checked the first time it is asked for. The map cannot
+    // be written, so a bad page is left unchecked, to fail again each time.
+    if (!__atomic_load_n(&pager->map_checked[page_num], __ATOMIC_ACQUIRE)) {
+      if (!page_checksum_ok(page_num, page)) {
+        pager_fail(pager, "Page %d is corrupt: checksum mismatch.", page_num);
+        return pager_stand_in(pager, page_num);
+      }
+      __atomic_store_n(&pager->map_checked[page_num], true, __ATOMIC_RELEASE);
+    }
+    return page;
+  }
+
+  pthread_mutex_lock(&pager->lock);
+  void *page = pager_get_frame(pager, page_num)->data;
+  pthread_mutex_unlock(&pager->lock);
+  return page;
+}
+
+/*
+Pinned pages stay in the cache until unpinned, no matter how cold they get.
+Cursors pin the leaf they point into.
+*/
+void *pager_pin(Pager *pager, uint32_t page_num) {
+  if (pager->map != NULL || page_num == INVALID_PAGE_NUM) {
+    return get_page(pager, page_num);
+  }
+
+  pthread_mutex_lock(&pager->lock);
+  Frame *frame = pager_get_frame(pager, page_num);
+  frame->pin_count++;
+  pthread_mutex_unlock(&pager->lock);
+  return frame->data;
+}
+
+/* Called with pager->lock held */
+Frame *pager_pinned_frame(Pager *pager, uint32_t page_num) {
+  Frame *frame = pager->frames[page_num];
+  if (frame == NULL || frame->pin_count == 0) {
+    printf("Tried to unpin page %d which is not pinned\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+  return frame;
+}
+
+void pager_unpin(Pager *pager, uint32_t page_num) {
+  if (pager->map != NULL || page_num == INVALID_PAGE_NUM) {
+    return;
+  }
+
+  pthread_mutex_lock(&pager->lock);
+  pager_pinned_frame(pager, page_num)->pin_count--;
+  pthread_mutex_unlock(&pager->lock);
+}
+
+/*
+The version of a frame that a snapshot sees. Called with pager->lock held.
+*/
+void *frame_version(Frame *frame, uint64_t snapshot) {
+  if (snapshot == SNAPSHOT_LATEST || (!frame->in_txn && frame->csn <= snapshot)) {
+    return frame->data;
+  }
+  for (PageVersion *version = frame->versions; version != NULL;
+       version = version->older) {
+    if (version->csn <= snapshot) {
+      return version->data;
+    }
+  }
+  printf("Page %d has no version old enough for snapshot %llu\n",
+         frame->page_num, (unsigned long long)snapshot);
+  exit(EXIT_FAILURE);
+}
+
+/*
+Free the versions of a frame that no open snapshot can see any more. A
+version is seen by snapshots from its own csn up to the csn of the next
+newer one, and the newest is kept while the frame is in_txn for rollback.
+Called with pager->lock held.
+*/
+void frame_reclaim_versions(Pager *pager, Frame *frame,
+                            uint64_t oldest_snapshot) {
+  PageVersion **link = &frame->versions;
+  uint64_t newer_csn = frame->csn;
+  if (frame->in_txn && *link != NULL) {
+    link = &(*link)->older;
+  }
+  while (*link != NULL && newer_csn > oldest_snapshot) {
+    newer_csn = (*link)->csn;
+    link = &(*link)->older;
+  }
+
+  PageVersion *version = *link;
+  *link = NULL;
+  while (version != NULL) {
+    PageVersion *older = version->older;
+    free(version->data);
+    free(version);
+    pager->num_versions--;
+    version = older;
+  }
+}
+
+/* Called with pager->lock held */
+uint64_t pager_oldest_snapshot(Pager *pager) {
+  uint64_t oldest = SNAPSHOT_LATEST;
+  for (uint32_t i = 0; i < pager->num_snapshots; i++) {
+    if (pager->snapshots[i] < oldest) {
+      oldest = pager->snapshots[i];
+    }
+  }
+  return oldest;
+}
+
+/*
+Start reading as of the last commit. Versions the snapshot can see are kept
+until pager_snapshot_end.
+*/
+uint64_t pager_snapshot_begin(Pager *pager) {
+  pthread_mutex_lock(&pager->lock);
+  if (pager->num_snapshots == pager->snapshots_capacity) {
+    pager->snapshots_capacity *= 2;
+    pager->snapshots = realloc(pager->snapshots,
+                               pager->snapshots_capacity * sizeof(uint64_t));
+  }
+  uint64_t snapshot = pager->commit_seq;
+  pager->snapshots[pager->num_snapshots++] = snapshot;
+  pthread_mutex_unlock(&pager->lock);
+  return snapshot;
+}
+
+void pager_snapshot_end(Pager *pager, uint64_t snapshot) {
+  pthread_mutex_lock(&pager->lock);
+  for (uint32_t i = 0; i < pager->num_snapshots; i++) {
+    if (pager->snapshots[i] == snapshot) {
+      pager->snapshots[i] = pager->snapshots[--pager->num_snapshots];
+      break;
+    }
+  }
+
+  // Frames with versions are never evicted, so they are all on the LRU list
+  if (pager->num_versions > 0) {
+    uint64_t oldest = pager_oldest_snapshot(pager);
+    for (Frame *frame = pager->lru_head; frame != NULL;
+         frame = frame->lru_next) {
+      if (frame->versions != NULL) {
+        frame_reclaim_versions(pager, frame, oldest);
+      }
+    }
+  }
+  pthread_mutex_unlock(&pager->lock);
+}
+
+/*
+Copy the page as the snapshot sees it into destination. The shared latch
+makes the writer's first pager_mark_dirty wait until the copy is done.
+*/
+void pager_read_page(Pager *pager, uint32_t page_num, uint64_t snapshot,
+                     void *destination) {
+  if (pager->map != NULL) {
+    memcpy(destination, get_page(pager, page_num), PAGE_SIZE);
+    return;
+  }
+  if (page_num == INVALID_PAGE_NUM) {
+    printf("Tried to fetch invalid page number\n");
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_mutex_lock(&pager->lock);
+  Frame *frame = pager_get_frame(pager, page_num);
+  frame->pin_count++;
+  pthread_mutex_unlock(&pager->lock);
+
+  pthread_rwlock_rdlock(&frame->latch);
+  pthread_mutex_lock(&pager->lock);
+  void *source = frame_version(frame, snapshot);
+  pthread_mutex_unlock(&pager->lock);
+  memcpy(destination, source, PAGE_SIZE);
+  pthread_rwlock_unlock(&frame->latch);
+
+  pthread_mutex_lock(&pager->lock);
+  frame->pin_count--;
+  pthread_mutex_unlock(&pager->lock);
+}
+
+/* Whether this thread holds write_lock */
+bool pager_is_writer(Pager *pager) {
+  pthread_mutex_lock(&pager->lock);
+  bool held =
+      pager->write_depth > 0 && pthread_equal(pager->writer, pthread_self());
+  pthread_mutex_unlock(&pager->lock);
+  return held;
+}
+
+/*
+Take write_lock, unless this thread already has it. Other threads' trims
+leave the cache alone until the matching pager_end_write.
+*/
+void pager_begin_write(Pager *pager) {
+  if (!pager_is_writer(pager)) {
+    pthread_mutex_lock(&pager->write_lock);
+  }
+
+  pthread_mutex_lock(&pager->lock);
+  pager->writer = pthread_self();
+  pager->write_depth++;
+  pthread_mutex_unlock(&pager->lock);
+}
+
+void pager_end_write(Pager *pager) {
+  pthread_mutex_lock(&pager->lock);
+  pager->write_depth--;
+  bool release = pager->write_depth == 0;
+  pthread_mutex_unlock(&pager->lock);
+  if (release) {
+    pthread_mutex_unlock(&pager->write_lock);
+  }
+}
+
+/*
+Append the transaction's pages and a commit record to the log, in as few
+writes as IOV_MAX allows
+*/
+void wal_write_commit(Pager *pager, Frame **frames) {
+  Wal *wal = pager->wal;
+  uint8_t *headers = malloc((wal->txn_num_pages + 1) * WAL_RECORD_HEADER_SIZE);
+  struct iovec iov[IOV_MAX];
+  int iov_count = 0;
+  ssize_t batch_length = 0;
+
+  for (uint32_t i = 0; i <= wal->txn_num_pages; i++) {
+    uint8_t *header = headers + i * WAL_RECORD_HEADER_SIZE;
+    uint32_t *page_num = (uint32_t *)(header + WAL_RECORD_PAGE_NUM_OFFSET);
+    uint32_t *checksum = (uint32_t *)(header + WAL_RECORD_CHECKSUM_OFFSET);
+
+    iov[iov_count].iov_base = header;
+    iov[iov_count].iov_len = WAL_RECORD_HEADER_SIZE;
+    iov_count++;
+    batch_length += WAL_RECORD_HEADER_SIZE;
+
+    if (i == wal->txn_num_pages) {
+      *page_num = WAL_COMMIT_MARKER;
+      *checksum = wal->txn_num_pages;
+    } else {
+      Frame *frame = frames[i];
+      page_set_checksum(frame->page_num, frame->data);
+      *page_num = frame->page_num;
+      *checksum = wal_checksum(frame->page_num, frame->data);
+      iov[iov_count].iov_base = frame->data;
+      iov[iov_count].iov_len = PAGE_SIZE;
+      iov_count++;
+      batch_length += PAGE_SIZE;
+    }
+
+    if (iov_count >= IOV_MAX - 1 || i == wal->txn_num_pages) {
+      ssize_t bytes_written =
+          pwritev(wal->file_descriptor, iov, iov_count, wal->length);
+      if (bytes_written != batch_length) {
+        printf("Error writing write-ahead log: %d\n", errno);
+        exit(EXIT_FAILURE);
+      }
+      wal->length += batch_length;
+      iov_count = 0;
+      batch_length = 0;
+    }
+  }
+  free(headers);
+  pager->stats.pages_written += wal->txn_num_pages;
+  pager->stats.bytes_written +=
+      (uint64_t)wal->txn_num_pages * PAGE_SIZE +
+      (wal->txn_num_pages + 1) * WAL_RECORD_HEADER_SIZE;
+}
+
+/*
+Copy every page changed since the last commit into the log, followed by a
+commit record. The log is synced once group_size commits have piled up or
+the oldest of them has waited WAL_GROUP_COMMIT_WINDOW_NS, so a burst of
+small commits shares one fdatasync. Commits that are written but not yet
+synced survive a process crash, but not a power failure.
+*/
+void wal_commit(Pager *pager) {
+  Wal *wal = pager->wal;
+  // What was changed after a page failed may rest on its stand-in
+  if (wal->txn_num_pages == 0 || pager_failed(pager)) {
+    return;
+  }
+
+  // Frames changed by the transaction cannot be evicted, so once looked up
+  // they can be written out without holding pager->lock
+  Frame **frames = malloc(wal->txn_num_pages * sizeof(Frame *));
+  pthread_mutex_lock(&pager->lock);
+  for (uint32_t i = 0; i < wal->txn_num_pages; i++) {
+    frames[i] = pager->frames[wal->txn_pages[i]];
+  }
+  pthread_mutex_unlock(&pager->lock);
+
+  if (!pager->in_memory) {
+    wal_write_commit(pager, frames);
+  }
+
+  // Publish the commit to new snapshots all at once
+  pthread_mutex_lock(&pager->lock);
+  uint64_t csn = ++pager->commit_seq;
+  uint64_t oldest = pager_oldest_snapshot(pager);
+  for (uint32_t i = 0; i < wal->txn_num_pages; i++) {
+    frames[i]->in_txn = false;
+    frames[i]->csn = csn;
+    frame_reclaim_versions(pager, frames[i], oldest);
+  }
+  pthread_mutex_unlock(&pager->lock);
+  free(frames);
+  wal->pages_since_checkpoint += wal->txn_num_pages;
+  wal->txn_num_pages = 0;
+  wal->txn_start_num_pages = pager->num_pages;
+  if (pager->in_memory) {
+    return;
+  }
+
+  pthread_mutex_lock(&wal->sync_lock);
+  if (wal->unsynced_commits == 0) {
+    clock_gettime(CLOCK_MONOTONIC, &wal->first_unsynced_commit);
+  }
+  wal->unsynced_commits++;
+
+  bool sync = wal->unsynced_commits >= wal->group_size ||
+              wal_unsynced_ns(wal) >= WAL_GROUP_COMMIT_WINDOW_NS;
+  if (!sync) {
+    // Nothing else may commit within the window, so leave it to the flusher,
+    // or sync now if there is none and one cannot be started
+    if (!wal->has_flusher) {
+      sync = !wal_start_flusher(wal);
+    }
+    pthread_cond_signal(&wal->sync_cond);
+  }
+  pthread_mutex_unlock(&wal->sync_lock);
+  if (sync) {
+    wal_sync(wal);
+  }
+}
+
+/*
+Write all committed pages into the db file and start a fresh log
+*/
+void pager_checkpoint(Pager *pager) {
+  if (pager->in_memory || pager_failed(pager)) {
+    return;
+  }
+  pthread_mutex_lock(&pager->flush_lock);
+  pthread_mutex_lock(&pager->lock);
+  Frame **frames = malloc((pager->num_frames + 1) * sizeof(Frame *));
+  uint32_t num_frames = 0;
+  for (uint32_t i = 0; i < pager->frames_capacity; i++) {
+    if (frame_needs_write(pager->frames[i])) {
+      pager_take_for_write(pager->frames[i]);
+      frames[num_frames++] = pager->frames[i];
+    }
+  }
+  pthread_mutex_unlock(&pager->lock);
+
+  pager_write_frames(pager, frames, num_frames);
+  free(frames);
+  if (fsync(pager->file_descriptor) == -1 ||
+      ftruncate(pager->wal->file_descriptor, 0) == -1) {
+    printf("Error checkpointing write-ahead log: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  pager->wal->length = 0;
+  pager->wal->pages_since_checkpoint = 0;
+  pthread_mutex_unlock(&pager->flush_lock);
+}
+
+void pager_begin_transaction(Pager *pager) {
+  wal_commit(pager);
+  pager->wal->in_transaction = true;
+  pager->wal->txn_start_num_pages = pager->num_pages;
+}
+
+void pager_commit_transaction(Pager *pager) {
+  pager->wal->in_transaction = false;
+  wal_commit(pager);
+  if (pager->wal->pages_since_checkpoint >= WAL_CHECKPOINT_PAGES) {
+    pager_checkpoint(pager);
+  }
+}
+
+/*
+Put back every page the transaction changed and forget pages it allocated.
+Readers must be kept out (the table's structure_lock) while this runs.
+*/
+void pager_rollback_transaction(Pager *pager) {
+  Wal *wal = pager->wal;
+  pthread_mutex_lock(&pager->lock);
+
+  for (uint32_t i = 0; i < wal->txn_num_pages; i++) {
+    Frame *frame = pager->frames[wal->txn_pages[i]];
+    PageVersion *committed = frame->versions;
+    frame->versions = committed->older;
+    frame->in_txn = false;
+
+    if (frame->page_num >= wal->txn_start_num_pages) {
+      // Nothing older than the transaction can see a page it allocated
+      frame->versions = committed;
+      frame_reclaim_versions(pager, frame, SNAPSHOT_LATEST);
+      pager_lru_remove(pager, frame);
+      pager->frames[frame->page_num] = NULL;
+      pager->num_frames--;
+      pthread_rwlock_destroy(&frame->latch);
+      free(frame->data);
+      free(frame);
+      continue;
+    }
+
+    memcpy(frame->data, committed->data, PAGE_SIZE);
+    free(committed->data);
+    free(committed);
+    pager->num_versions--;
+  }
+
+  pager->num_pages = wal->txn_start_num_pages;
+  wal->txn_num_pages = 0;
+  wal->in_transaction = false;
+  pthread_mutex_unlock(&pager->lock);
+}
+
+Table *tree_open(Pager *pager, uint32_t root_page_num) {
+  Table *tree = malloc(sizeof(Table));
+  tree->pager = pager;
+  tree->root_page_num = root_page_num;
+  tree->append_page_num = INVALID_PAGE_NUM;
+  for (uint32_t i = 0; i < NUM_INDEXED_COLUMNS; i++) {
+    tree->indexes[i] = NULL;
+  }
+  tree->vacuum = NULL;
+  return tree;
+}
+
+/*
+(Re)read the roots of the table and its indexes from the header, e.g.
+after a rollback threw away a newly created index
+*/
+void table_load_header(Table *table) {
+  void *header = get_page(table->pager, HEADER_PAGE_NUM);
+  table->root_page_num = *header_root_page_num(header);
+  table->append_page_num = INVALID_PAGE_NUM;
+
+  for (uint32_t i = 0; i < NUM_INDEXED_COLUMNS; i++) {
+    uint32_t index_root = *header_index_root(header, i);
+    if (index_root == 0) {
+      free(table->indexes[i]);
+      table->indexes[i] = NULL;
+    } else if (table->indexes[i] == NULL) {
+      table->indexes[i] = tree_open(table->pager, index_root);
+    } else {
+      table->indexes[i]->append_page_num = INVALID_PAGE_NUM;
+    }
+  }
+}
+
+/* Undo the open transaction, with readers kept out while pages go back */
+void table_rollback(Table *table) {
+  pthread_rwlock_wrlock(&table->structure_lock);
+  pager_rollback_transaction(table->pager);
+  table_load_header(table);
+  pthread_rwlock_unlock(&table->structure_lock);
+}
+
+/*
+The table of a pager just opened. NULL, with the pager closed, if there is
+no pager or its header page cannot be read.
+*/
+Table *table_open(Pager *pager) {
+  if (pager == NULL) {
+    return NULL;
+  }
+  Table *table = tree_open(pager, 0);
+  pthread_rwlock_init(&table->structure_lock, NULL);
+  table_load_header(table);
+  if (pager_failed(pager)) {
+    printf("%s\n", pager->error);
+    db_close(table);
+    return NULL;
+  }
+  return table;
+}
+
+Table *db_open_read_only(const char *filename, uint32_t max_frames) {
+  return table_open(pager_open_read_only(filename, max_frames));
+}
+
+Table *db_open_with_layout(const char *filename, uint32_t max_frames,
+                           uint32_t page_size, uint32_t max_internal_cells,
+                           uint32_t max_leaf_cell_size) {
+  Pager *pager;
+  if (strcmp(filename, DB_MEMORY_FILENAME) == 0) {
+    pager = pager_open_memory(page_size, max_internal_cells,
+                              max_leaf_cell_size);
+  } else {
+    pager = pager_open(filename, max_frames, page_size, max_internal_cells,
+                       max_leaf_cell_size);
+  }
+  return table_open(pager);
+}
+
+Table *db_open(const char *filename, uint32_t max_frames) {
+  return db_open_with_layout(filename, max_frames, DEFAULT_PAGE_SIZE, 0, 0);
+}
+
+typedef enum {
+  META_COMMAND_SUCCESS,
+  META_COMMAND_SUCCESS_UNRECOGNIZED_COMMAND
+} MetaCommandResult;
+
+typedef enum {
+  IMPORT_SUCCESS,
+  IMPORT_FILE_ERROR,
+  IMPORT_BAD_ROW,
+  IMPORT_READ_ONLY
+} ImportResult;
+
+ImportResult table_import(Table *table, const char *filename,
+                          uint32_t fill_percent, uint32_t *num_rows,
+                          uint32_t *num_duplicates);
+
+typedef enum {
+  CONDITION_EQUAL,
+  CONDITION_LESS,
+  CONDITION_LESS_EQUAL,
+  CONDITION_GREATER,
+  CONDITION_GREATER_EQUAL,
+  CONDITION_BETWEEN
+} ConditionOperator;
+
+/* One condition on id in a where clause. Only between uses values[1]. */
+typedef struct {
+  ConditionOperator operator;
+  int64_t values[2];
+} IdCondition;
+
+/* Where the value bound to a ? goes */
+typedef enum {
+  PARAMETER_ROW_ID,
+  PARAMETER_ROW_USERNAME,
+  PARAMETER_ROW_EMAIL,
+  PARAMETER_CONDITION_VALUE,
+  PARAMETER_FILTER_VALUE,
+  PARAMETER_LIMIT
+} ParameterTarget;
+
+typedef struct {
+  ParameterTarget target;
+  uint32_t index;  // The row or the id condition
+  uint32_t which;  // For between, which of the two values
+  bool bound;
+} Parameter;
+
+/*
+A parsed statement is its own plan: the rows to insert, or the conditions
+of a where clause, plus a list of the ? placeholders in the order they
+appeared. Binding a value writes it straight into the plan, so an insert
+can be prepared once and run many times with new values.
+*/
+struct Statement {
+  StatementType type;
+  Row *rows_to_insert;
+  uint32_t num_rows;
+  /* The columns a select outputs, in order, or none for all of them */
+  RowColumn columns[ROW_NUM_COLUMNS];
+  uint32_t num_columns;
+  /* The where clause as written, folded into the fields below to run */
+  IdCondition *id_conditions;
+  uint32_t num_id_conditions;
+  int64_t row_limit;
+  Parameter *parameters;
+  uint32_t num_parameters;
+  /*
+  Select and delete match ids from min_id to max_id inclusive, at most
+  limit rows
+  */
+  uint32_t min_id;
+  uint32_t max_id;
+  uint32_t limit;
+  /* ... and, if has_column_filter, only rows where the column equals value */
+  bool has_column_filter;
+  IndexedColumn filter_column;
+  char filter_value[COLUMN_EMAIL_SIZE + 1];
+  IndexedColumn index_column;  // For create index
+};
+
+typedef struct {
+  char *buffer;
+  size_t buffer_length;
+  ssize_t input_length;
+} InputBuffer;
+
+InputBuffer *new_input_buffer() {
+  InputBuffer *input_buffer = malloc(sizeof(InputBuffer));
+  input_buffer->buffer = NULL;
+  input_buffer->buffer_length = 0;
+  input_buffer->input_length = 0;
+  
+  return input_buffer;
+}
+
+/*
+Point the cursor at another page. The writer's own cursors and those of a
+read-only pager use the page in place, pinned. The others copy out the
+version their snapshot sees, so they hold nothing in the cache between
+calls, however slowly they are read.
+*/
+void *cursor_load_page(Cursor *cursor, uint32_t page_num) {
+  Pager *pager = cursor->table->pager;
+  if (cursor->copy == NULL) {
+    cursor->node = pager_pin(pager, page_num);
+    if (cursor->page_num != INVALID_PAGE_NUM) {
+      pager_unpin(pager, cursor->page_num);
+    }
+  } else {
+    pager_read_page(pager, page_num, cursor->snapshot, cursor->copy);
+  }
+  cursor->page_num = page_num;
+  return cursor->node;
+}
+
+Cursor *cursor_open(Table *table, uint64_t snapshot) {
+  Cursor *cursor = malloc(sizeof(Cursor));
+  cursor->table = table;
+  cursor->page_num = INVALID_PAGE_NUM;
+  cursor->cell_num = 0;
+  cursor->end_of_table = false;
+  cursor->snapshot = snapshot;
+  cursor->copy = NULL;
+  if (snapshot != SNAPSHOT_LATEST && table->pager->map == NULL) {
+    cursor->copy = malloc(PAGE_SIZE);
+  }
+  cursor->node = cursor->copy;
+  cursor->readahead_end = 0;
+  return cursor;
+}
+
+/*
+Return a cursor at the first row whose id is at least key. table_find
+can leave the cursor one past the last cell of a leaf, in which case
+the row we want is at the start of the next leaf.
+*/
+Cursor *table_seek_at(Table *table, uint64_t key, uint64_t snapshot) {
+  Cursor *cursor = table_find_at(table, key, snapshot);
+  cursor->end_of_table = false;
+
+  while (cursor->cell_num >= *leaf_node_num_cells(cursor->node)) {
+    uint32_t next_leaf = *leaf_node_next_leaf(cursor->node);
+    if (next_leaf == 0) {
+      cursor->end_of_table = true;
+      break;
+    }
+    cursor_load_page(cursor, next_leaf);
+    cursor->cell_num = 0;
+  }
+
+  return cursor;
+}
+
+Cursor *table_seek(Table *table, uint64_t key) {
+  return table_seek_at(table, key, SNAPSHOT_LATEST);
+}
+
+Cursor *table_start(Table *table) {
+  return table_seek(table, 0);
+}
+
+/* Key of the row under the cursor, without copying out the row */
+uint64_t cursor_key(Cursor *cursor) {
+  return leaf_node_key(cursor->node, cursor->cell_num);
+}
+
+/* Whether table_find found key itself rather than where it would go */
+bool cursor_at_key(Cursor *cursor, uint64_t key) {
+  return cursor->cell_num < *leaf_node_num_cells(cursor->node) &&
+         leaf_node_key(cursor->node, cursor->cell_num) == key;
+}
+
+/* Set cell_num to key's position in the cursor's leaf */
+void leaf_node_find(Cursor *cursor, uint64_t key) {
+  cursor->cell_num = leaf_node_lower_bound(cursor->node, key);
+}
+
+uint64_t internal_node_key(void *node, uint32_t key_num) {
+  return key_get((void *)internal_node_cell(node, key_num) +
+                     INTERNAL_NODE_CHILD_SIZE,
+                 node_key_size(node));
+}
+
+void internal_node_set_key(void *node, uint32_t key_num, uint64_t key) {
+  key_put((void *)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE,
+          node_key_size(node), key);
+}
+
+uint64_t get_node_max_key(Pager *pager, void *node) {
+  if (get_node_type(node) == NODE_LEAF) {
+    return leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+  }
+
+  void *right_child = get_page(pager, *internal_node_right_child(node));
+  return get_node_max_key(pager, right_child);
+}
+
+uint32_t internal_node_find_child(void *node, uint64_t key) {
+  /*
+  Return the index of the child which should contain
+  the given key
+  */
+
+  uint32_t num_keys = *internal_node_num_keys(node);
+
+  /* Binary search */
+  uint32_t min_index = 0;
+  uint32_t max_index = num_keys; /* there is one more child than key */
+
+  while (min_index != max_index) {
+    uint32_t index = (min_index + max_index) / 2;
+    uint64_t key_to_right = internal_node_key(node, index);
+    if (key_to_right >= key) {
+      max_index = index;
+    } else {
+      min_index = index + 1;
+    }
+  }
+
+  return min_index;
+}
+
+void internal_node_insert(Table *table, uint32_t parent_page_num,
+                          uint32_t child_page_num) {
+
+  /* Add a new child/key pair to parent that corresponds to child */
+
+  void *parent = get_page(table->pager, parent_page_num);
+  void *child = get_page(table->pager, child_page_num);
+  uint64_t child_max_key = get_node_max_key(table->pager, child);
+  uint32_t index = internal_node_find_child(parent, child_max_key);
+
+  uint32_t original_num_keys = *internal_node_num_keys(parent);
+
+  if (original_num_keys >= internal_node_max_cells(parent)) {
+    internal_node_split_and_insert(table, parent_page_num, child_page_num);
+    return;
+  }
+
+  pager_mark_dirty(table->pager, parent_page_num);
+
+  uint32_t right_child_page_num = *internal_node_right_child(parent);
+  /*
+  An internal node with a right child of INVALID_PAGE_NUM is empty
+  */
+  if (right_child_page_num == INVALID_PAGE_NUM) {
+    *internal_node_right_child(parent) = child_page_num;
+    return;
+  }
+
+  *internal_node_num_keys(parent) = original_num_keys + 1;
+
+  void *right_child = get_page(table->pager, right_child_page_num);
+
+  if (child_max_key > get_node_max_key(table->pager, right_child)) {
+    /* Replace right child */
+
+    *internal_node_child(parent, original_num_keys) = right_child_page_num;
+    internal_node_set_key(parent, original_num_keys,
+                          get_node_max_key(table->pager, right_child));
+    *internal_node_right_child(parent) = child_page_num;
+  } else {
+    /* Make room for the new cell */
+    for (uint32_t i = original_num_keys; i > index; i--) {
+      void *destination = internal_node_cell(parent, i);
+      void *source = internal_node_cell(parent, i - 1);
+      memcpy(destination, source, internal_node_cell_size(parent));
+    }
+
+    *internal_node_child(parent, index) = child_page_num;
+    internal_node_set_key(parent, index, child_max_key);
+  }
+}
+
+/*
+Take a page off the freelist, or extend the file if the list is empty
+*/
+uint32_t get_unused_page_num(Pager *pager) {
+  void *header = get_page(pager, HEADER_PAGE_NUM);
+  uint32_t page_num = *header_freelist_head(header);
+  if (page_num == 0) {
+    return pager->num_pages;
+  }
+
+  void *page = get_page(pager, page_num);
+  pager_mark_dirty(pager, HEADER_PAGE_NUM);
+  *header_freelist_head(header) = *free_node_next(page);
+  return page_num;
+}
+
+/*
+Put a page that is no longer part of any tree at the head of the freelist
+*/
+void pager_free_page(Pager *pager, uint32_t page_num) {
+  void *header = get_page(pager, HEADER_PAGE_NUM);
+  void *page = get_page(pager, page_num);
+  pager_mark_dirty(pager, HEADER_PAGE_NUM);
+  pager_mark_dirty(pager, page_num);
+
+  memset(page, 0, PAGE_SIZE);
+  set_node_type(page, NODE_FREE);
+  *free_node_next(page) = *header_freelist_head(header);
+  *header_freelist_head(header) = page_num;
+}
+
+/*
+Return the position of the given key
+if the key is not present, return the position
+where it should be inserted
+*/
+
+Cursor *table_find_at(Table *table, uint64_t key, uint64_t snapshot) {
+  Cursor *cursor = cursor_open(table, snapshot);
+  void *node = cursor_load_page(cursor, table->root_page_num);
+
+  // Overflow and free pages are never children
+  while (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t child_index = internal_node_find_child(node, key);
+    node = cursor_load_page(cursor, *internal_node_child(node, child_index));
+  }
+  leaf_node_find(cursor, key);
+  return cursor;
+}
+
+Cursor *table_find(Table *table, uint64_t key) {
+  return table_find_at(table, key, SNAPSHOT_LATEST);
+}
+
+/*
+Start reading the leaves after the one the cursor just moved into, so that
+a scan finds them in the page cache instead of waiting on each in turn.
+When the next leaf is the next page, as the bulk loader and appends lay
+them out, the following ones probably are too, and a whole window is read
+ahead; it is topped up once the cursor is half way through it. Otherwise
+only the next leaf is known.
+*/
+void cursor_read_ahead(Cursor *cursor) {
+  Pager *pager = cursor->table->pager;
+  uint32_t window = pager->readahead_pages;
+  uint32_t next_leaf = *leaf_node_next_leaf(cursor->node);
+  if (window == 0 || next_leaf == 0) {
+    return;
+  }
+
+  if (next_leaf != cursor->page_num + 1) {
+    pager_prefetch(pager, next_leaf, 1);
+    return;
+  }
+  bool in_window = next_leaf < cursor->readahead_end &&
+                   cursor->readahead_end - next_leaf <= window;
+  if (in_window && cursor->readahead_end - next_leaf > window / 2) {
+    return;
+  }
+  uint32_t start = in_window ? cursor->readahead_end : next_leaf;
+  cursor->readahead_end = next_leaf + window;
+  pager_prefetch(pager, start, cursor->readahead_end - start);
+}
+
+void cursor_advance(Cursor *cursor) {
+  void *node = cursor->node;
+  cursor->cell_num += 1;
+
+  if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
+    /* Advance to next leaf node */
+    uint32_t next_leaf = *leaf_node_next_leaf(node);
+    if (next_leaf == 0) {
+      /* This was rightmost leaf */
+      cursor->end_of_table = true;
+    } else {
+      cursor_load_page(cursor, next_leaf);
+      cursor->cell_num = 0;
+      cursor_read_ahead(cursor);
+      pager_trim(cursor->table->pager);
+    }
+  }
+}
+
+void cursor_close(Cursor *cursor) {
+  if (cursor->copy == NULL && cursor->page_num != INVALID_PAGE_NUM) {
+    pager_unpin(cursor->table->pager, cursor->page_num);
+  }
+  free(cursor->copy);
+  free(cursor);
+}
+
+void serialize_row(Row *source, void *destination) {
+  memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
+  strncpy(destination + USERNAME_OFFSET, source->username, USERNAME_SIZE);
+  strncpy(destination + EMAIL_OFFSET, source->email, EMAIL_SIZE);
+}
+
+void deserialize_row(void *source, Row *destination) {
+  memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
+  memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
+  memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
+}
+
+/*
+serialize_row pads every row to ROW_SIZE, which is what import files use.
+Inside the tree rows are packed down to their actual length instead.
+*/
+uint32_t row_payload_size(Row *row) {
+  return ID_SIZE + ROW_STRING_LENGTH_SIZE + strlen(row->username) +
+         ROW_STRING_LENGTH_SIZE + strlen(row->email);
+}
+
+void pack_row(Row *source, uint8_t *destination) {
+  memcpy(destination, &(source->id), ID_SIZE);
+  destination += ID_SIZE;
+
+  char *strings[] = {source->username, source->email};
+  for (uint32_t i = 0; i < 2; i++) {
+    uint8_t length = strlen(strings[i]);
+    *destination = length;
+    memcpy(destination + ROW_STRING_LENGTH_SIZE, strings[i], length);
+    destination += ROW_STRING_LENGTH_SIZE + length;
+  }
+}
+
+void unpack_row(uint8_t *source, Row *destination) {
+  memcpy(&(destination->id), source, ID_SIZE);
+  source += ID_SIZE;
+
+  char *strings[] = {destination->username, destination->email};
+  for (uint32_t i = 0; i < 2; i++) {
+    uint8_t length = *source;
+    memcpy(strings[i], source + ROW_STRING_LENGTH_SIZE, length);
+    strings[i][length] = '\0';
+    source += ROW_STRING_LENGTH_SIZE + length;
+  }
+}
+
+/*
+Store size bytes of data in a chain of new overflow pages and return the
+number of the first one
+*/
+uint32_t overflow_write(Pager *pager, uint8_t *data, uint32_t size) {
+  uint32_t first_page_num = get_unused_page_num(pager);
+  uint32_t page_num = first_page_num;
+
+  while (true) {
+    void *node = get_page(pager, page_num);
+    pager_mark_dirty(pager, page_num);
+    set_node_type(node, NODE_OVERFLOW);
+    set_node_root(node, false);
+
+    uint32_t chunk = size < OVERFLOW_NODE_SPACE ? size : OVERFLOW_NODE_SPACE;
+    memcpy(node + OVERFLOW_NODE_HEADER_SIZE, data, chunk);
+    data += chunk;
+    size -= chunk;
+
+    if (size == 0) {
+      *overflow_node_next(node) = 0;
+      return first_page_num;
+    }
+    page_num = get_unused_page_num(pager);
+    *overflow_node_next(node) = page_num;
+  }
+}
+
+/*
+Lay out the local part of a payload in cell and return the cell's size. If
+the payload is too long to keep whole, the caller stores the rest and sets
+leaf_cell_overflow_page.
+*/
+uint32_t leaf_cell_init(void *cell, uint8_t *payload, uint32_t payload_size) {
+  *leaf_cell_payload_size(cell) = payload_size;
+  memcpy(cell + LEAF_NODE_PAYLOAD_OFFSET, payload,
+         leaf_cell_local_size(payload_size));
+  return leaf_cell_size(payload_size);
+}
+
+/*
+Build the cell for a row in cell, which must have room for
+LEAF_NODE_MAX_CELL_SIZE bytes, writing overflow pages if needed
+*/
+uint32_t leaf_cell_for_row(Pager *pager, Row *row, void *cell) {
+  uint8_t payload[ROW_MAX_PAYLOAD_SIZE];
+  uint32_t payload_size = row_payload_size(row);
+  pack_row(row, payload);
+
+  uint32_t size = leaf_cell_init(cell, payload, payload_size);
+  if (payload_size > LEAF_NODE_MAX_LOCAL_PAYLOAD) {
+    *leaf_cell_overflow_page(cell) =
+        overflow_write(pager, payload + LEAF_NODE_MAX_LOCAL_PAYLOAD,
+                       payload_size - LEAF_NODE_MAX_LOCAL_PAYLOAD);
+  }
+  return size;
+}
+
+/*
+Read a row back, following its overflow chain if it has one. The chain is
+read as the snapshot sees it.
+*/
+void leaf_node_read_row(Pager *pager, void *node, uint32_t cell_num,
+                        uint64_t snapshot, Row *row) {
+  void *cell = leaf_node_cell(node, cell_num);
+  uint32_t payload_size = *leaf_cell_payload_size(cell);
+  uint32_t local_size = leaf_cell_local_size(payload_size);
+  if (local_size == payload_size) {
+    unpack_row(cell + LEAF_NODE_PAYLOAD_OFFSET, row);
+    return;
+  }
+
+  uint8_t payload[payload_size];
+  memcpy(payload, cell + LEAF_NODE_PAYLOAD_OFFSET, local_size);
+  uint32_t copied = local_size;
+  uint32_t page_num = *leaf_cell_overflow_page(cell);
+  uint8_t overflow[PAGE_SIZE];
+  while (copied < payload_size) {
+    pager_read_page(pager, page_num, snapshot, overflow);
+    uint32_t chunk = payload_size - copied;
+    if (chunk > OVERFLOW_NODE_SPACE) {
+      chunk = OVERFLOW_NODE_SPACE;
+    }
+    memcpy(payload + copied, overflow + OVERFLOW_NODE_HEADER_SIZE, chunk);
+    copied += chunk;
+    page_num = *overflow_node_next(overflow);
+  }
+  unpack_row(payload, row);
+}
+
+void cursor_read_row(Cursor *cursor, Row *row) {
+  leaf_node_read_row(cursor->table->pager, cursor->node, cursor->cell_num,
+                     cursor->snapshot, row);
+}
+
+void close_input_buffer(InputBuffer *input_buffer) {
+  free(input_buffer->buffer);
+  free(input_buffer);
+}
+
+void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level) {
+  void *node = get_page(pager, page_num);
+  uint32_t num_keys, child;
+  switch (get_node_type(node)) {
+  case (NODE_LEAF):
+    num_keys = *leaf_node_num_cells(node);
+    indent(indentation_level);
+    printf("- leaf (size %d)\n", num_keys);
+    for (uint32_t i = 0; i < num_keys; i++) {
+      indent(indentation_level + 1);
+      printf("- %llu\n", (unsigned long long)leaf_node_key(node, i));
+    }
+    break;
+  case (NODE_INTERNAL):
+    num_keys = *internal_node_num_keys(node);
+    indent(indentation_level);
+    printf("- internal (size %d)\n", num_keys);
+    if (num_keys > 0) {
+      for (uint32_t i = 0; i < num_keys; i++) {
+        child = *internal_node_child(node, i);
+        print_tree(pager, child, indentation_level + 1);
+        indent(indentation_level + 1);
+        printf("- key %llu\n",
+               (unsigned long long)internal_node_key(node, i));
+      }
+      child = *internal_node_right_child(node);
+      print_tree(pager, child, indentation_level + 1);
+    }
+    break;
+  case (NODE_OVERFLOW):
+  case (NODE_FREE):
+    // Never the child of an internal node
+    break;
+  }
+}
+
+/* Write back what is committed and let go of the file and the cache */
+void pager_close(Pager *pager) {
+  Wal *wal = pager->wal;
+
+  if (pager->map != NULL) {
+    munmap(pager->map, pager->file_length);
+    free(pager->map_checked);
+    free(pager->snapshots);
+    free(pager->stand_in);
+    close(pager->file_descriptor);
+    free(pager);
+    layout_close();
+    return;
+  }
+
+  if (wal != NULL) {
+    wal_stop_flusher(wal);
+    // An open transaction is abandoned, as if the process had crashed, and
+    // so are changes a failed pager would not commit
+    if (wal->in_transaction || wal->txn_num_pages > 0) {
+      pager_rollback_transaction(pager);
+    }
+    pager_checkpoint(pager);
+    if (!pager->in_memory) {
+      close(wal->file_descriptor);
+      // A failed pager skipped the checkpoint, so the log is still needed
+      if (!pager_failed(pager)) {
+        unlink(wal->filename);
+      }
+    }
+    free(wal->filename);
+    free(wal->txn_pages);
+    free(wal);
+  }
+
+  Frame *frame = pager->lru_head;
+  while (frame != NULL) {
+    Frame *next = frame->lru_next;
+    free(frame->data);
+    free(frame);
+    frame = next;
+  }
+
+  int result = pager->in_memory ? 0 : close(pager->file_descriptor);
+
+  if (result == -1) {
+    printf("Error closing db file.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  free(pager->frames);
+  free(pager->archive_offsets);
+  free(pager->snapshots);
+  free(pager->filename);
+  free(pager->stand_in);
+  free(pager);
+  layout_close();
+}
+
+void vacuum_abandon(Table *table);
+
+const char *db_error(Table *table) {
+  return pager_failed(table->pager) ? table->pager->error : NULL;
+}
+
+void db_close(Table *table) {
+  db_snapshot_wait(table);
+  if (table->vacuum != NULL) {
+    vacuum_abandon(table);
+  }
+
+  for (uint32_t i = 0; i < NUM_INDEXED_COLUMNS; i++) {
+    free(table->indexes[i]);
+  }
+  pager_close(table->pager);
+  pthread_rwlock_destroy(&table->structure_lock);
+  free(table);
+}
+
+void print_constants() {
+  printf("PAGE_SIZE: %d\n", PAGE_SIZE);
+  printf("ROW_SIZE: %d\n", ROW_SIZE);
+  printf("ROW_MAX_PAYLOAD_SIZE: %d\n", ROW_MAX_PAYLOAD_SIZE);
+  printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
+  printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
+  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
+  printf("LEAF_NODE_MAX_CELL_SIZE: %d\n", LEAF_NODE_MAX_CELL_SIZE);
+  printf("LEAF_NODE_MAX_LOCAL_PAYLOAD: %d\n", LEAF_NODE_MAX_LOCAL_PAYLOAD);
+  printf("INTERNAL_NODE_MAX_CELLS: %d\n", INTERNAL_NODE_MAX_CELLS);
+}
+
+void print_leaf_node(void *node) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  printf("leaf (size %d)\n", num_cells);
+
+  for (uint32_t i = 0; i < num_cells; i++) {
+    uint64_t key = leaf_node_key(node, i);
+    printf(" - %d: %llu\n", i, (unsigned long long)key);
+  }
+}
+
+void do_import(InputBuffer *input_buffer, Table *table) {
+  strtok(input_buffer->buffer, " ");
+  char *filename = strtok(NULL, " ");
+  char *fill_string = strtok(NULL, " ");
+
+  if (filename == NULL) {
+    printf("Usage: .import <file> [fill percent]\n");
+    return;
+  }
+  int fill_percent = fill_string ? atoi(fill_string) : 100;
+  if (fill_percent <= 0 || fill_percent > 100) {
+    printf("Fill percent must be between 1 and 100.\n");
+    return;
+  }
+
+  uint32_t num_rows, num_duplicates;
+  switch (table_import(table, filename, fill_percent, &num_rows,
+                       &num_duplicates)) {
+  case (IMPORT_SUCCESS):
+    printf("Imported %d rows.\n", num_rows);
+    if (num_duplicates > 0) {
+      printf("Skipped %d duplicate keys.\n", num_duplicates);
+    }
+    break;
+  case (IMPORT_FILE_ERROR):
+    printf("Unable to read '%s'.\n", filename);
+    break;
+  case (IMPORT_BAD_ROW):
+    printf("Could not parse row %d of '%s'. Nothing imported.\n", num_rows,
+           filename);
+    break;
+  case (IMPORT_READ_ONLY):
+    printf("Error: Db is open read-only.\n");
+    break;
+  }
+}
+
+/*
+Start over with nothing cached: committed pages go to the db file, the
+buffer pool is emptied and the kernel is told to drop the file from its
+page cache
+*/
+void pager_drop_cache(Pager *pager) {
+  if (pager->in_memory) {
+    return;  // Its frames are all there is
+  }
+  pager_begin_write(pager);
+  if (pager->wal != NULL) {
+    pager_checkpoint(pager);
+  }
+  uint32_t max_frames = pager->max_frames;
+  pager->max_frames = 0;
+  pager_trim(pager);
+  pager->max_frames = max_frames;
+  pager_end_write(pager);
+#ifndef __APPLE__
+  posix_fadvise(pager->file_descriptor, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+}
+
+/* Time a full scan that starts with nothing cached. Returns seconds. */
+double bench_cold_scan(Table *table, uint32_t readahead_pages,
+                       uint32_t *num_rows) {
+  Pager *pager = table->pager;
+  pager_drop_cache(pager);
+
+  uint32_t saved_readahead_pages = pager->readahead_pages;
+  pager->readahead_pages = readahead_pages;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  Row row;
+  *num_rows = 0;
+  uint64_t snapshot = pager_snapshot_begin(pager);
+  Cursor *cursor = table_seek_at(table, 0, snapshot);
+  while (!cursor->end_of_table) {
+    cursor_read_row(cursor, &row);
+    (*num_rows)++;
+    cursor_advance(cursor);
+  }
+  cursor_close(cursor);
+  pager_snapshot_end(pager, snapshot);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  pager->readahead_pages = saved_readahead_pages;
+  return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+uint64_t monotonic_ns();
+
+void count_row_visitor(Row *row, void *context) { (*(uint64_t *)context)++; }
+
+/* Time a full scan with every page cached, counting rows per thread */
+double bench_warm_scan(Table *table, uint32_t num_threads, uint64_t *num_rows) {
+  uint64_t counts[DB_SCAN_MAX_THREADS] = {0};
+  void *contexts[DB_SCAN_MAX_THREADS];
+  for (uint32_t i = 0; i < DB_SCAN_MAX_THREADS; i++) {
+    contexts[i] = &counts[i];
+  }
+
+  uint64_t start_ns = monotonic_ns();
+  db_scan_parallel(table, num_threads, count_row_visitor, contexts);
+  double seconds = (monotonic_ns() - start_ns) / 1e9;
+
+  *num_rows = 0;
+  for (uint32_t i = 0; i < DB_SCAN_MAX_THREADS; i++) {
+    *num_rows += counts[i];
+  }
+  return seconds;
+}
+
+/*
+.bench parallel <threads>: a warm full scan on one thread, then split
+across threads (see Parallel Scans)
+*/
+void do_bench_parallel(Table *table, uint32_t num_threads) {
+  if (num_threads == 0 || num_threads > DB_SCAN_MAX_THREADS) {
+    printf("Threads must be between 1 and %d.\n", DB_SCAN_MAX_THREADS);
+    return;
+  }
+
+  // Room for every page, and one untimed scan to load them
+  Pager *pager = table->pager;
+  uint32_t max_frames = pager->max_frames;
+  if (pager->max_frames < pager->num_pages) {
+    pager->max_frames = pager->num_pages;
+  }
+  uint64_t num_rows;
+  bench_warm_scan(table, 1, &num_rows);
+  double megabytes = (double)pager->num_pages * PAGE_SIZE / 1e6;
+  double one = bench_warm_scan(table, 1, &num_rows);
+  double many = bench_warm_scan(table, num_threads, &num_rows);
+  pager->max_frames = max_frames;
+  pager_trim(pager);
+
+  printf("Warm scan of %llu rows (%.1f MB):\n", (unsigned long long)num_rows,
+         megabytes);
+  printf("  1 thread: %.3f s, %.1f MB/s\n", one, megabytes / one);
+  printf("  %d threads: %.3f s, %.1f MB/s\n", num_threads, many,
+         megabytes / many);
+}
+
+#define BENCH_SEARCH_ROUNDS 1000000
+
+/*
+Time BENCH_SEARCH_ROUNDS compares of a full search window, adding up the
+positions into *sum so that two compares can be checked against each other
+*/
+double bench_keys32(KeysCompare compare, uint32_t *keys, uint64_t *sum) {
+  *sum = 0;
+  uint64_t start_ns = monotonic_ns();
+  for (uint32_t i = 0; i < BENCH_SEARCH_ROUNDS; i++) {
+    uint32_t key = i % (LEAF_NODE_SEARCH_WINDOW * 2 + 1);
+    *sum += keys32_less_than_with(compare, keys, LEAF_NODE_SEARCH_WINDOW, key);
+  }
+  return (monotonic_ns() - start_ns) / 1e9;
+}
+
+double bench_keys64(KeysCompare compare, uint64_t *keys, uint64_t *sum) {
+  *sum = 0;
+  uint64_t start_ns = monotonic_ns();
+  for (uint32_t i = 0; i < BENCH_SEARCH_ROUNDS; i++) {
+    uint64_t key = i % (LEAF_NODE_SEARCH_WINDOW * 2 + 1);
+    *sum += keys64_less_than_with(compare, keys, LEAF_NODE_SEARCH_WINDOW, key);
+  }
+  return (monotonic_ns() - start_ns) / 1e9;
+}
+
+/*
+.bench search: the compare that ends a leaf search, as this CPU runs it and
+one key at a time (see Searching a leaf)
+*/
+void do_bench_search() {
+  uint32_t keys32[LEAF_NODE_SEARCH_WINDOW];
+  uint64_t keys64[LEAF_NODE_SEARCH_WINDOW];
+  for (uint32_t i = 0; i < LEAF_NODE_SEARCH_WINDOW; i++) {
+    keys32[i] = i * 2 + 1;
+    keys64[i] = i * 2 + 1;
+  }
+
+  uint64_t fast_sum, slow_sum;
+  KeysCompare compare = keys32_compare();
+  double fast = bench_keys32(compare, keys32, &fast_sum);
+  double slow = bench_keys32(KEYS_COMPARE_SCALAR, keys32, &slow_sum);
+  printf("Search window of %d keys, %d times:\n", LEAF_NODE_SEARCH_WINDOW,
+         BENCH_SEARCH_ROUNDS);
+  printf("  table keys: %s %.3f s, one at a time %.3f s%s\n",
+         keys_compare_names[compare], fast, slow,
+         fast_sum == slow_sum ? "" : ", positions differ");
+
+  compare = keys64_compare();
+  fast = bench_keys64(compare, keys64, &fast_sum);
+  slow = bench_keys64(KEYS_COMPARE_SCALAR, keys64, &slow_sum);
+  printf("  index keys: %s %.3f s, one at a time %.3f s%s\n",
+         keys_compare_names[compare], fast, slow,
+         fast_sum == slow_sum ? "" : ", positions differ");
+}
+
+/*
+.bench scan: cold full scans without and with read-ahead
+.bench parallel <threads>: warm full scans on one thread and on several
+.bench search: the leaf search's compare with and without SIMD
+*/
+void do_bench(InputBuffer *input_buffer, Table *table) {
+  if (strncmp(input_buffer->buffer, ".bench parallel ", 16) == 0) {
+    do_bench_parallel(table, atoi(input_buffer->buffer + 16));
+    return;
+  }
+  if (strcmp(input_buffer->buffer, ".bench search") == 0) {
+    do_bench_search();
+    return;
+  }
+  if (strcmp(input_buffer->buffer, ".bench scan") != 0) {
+    printf("Usage: .bench scan | .bench parallel <threads> | .bench search\n");
+    return;
+  }
+
+  uint32_t num_rows;
+  double megabytes = (double)table->pager->num_pages * PAGE_SIZE / 1e6;
+  double plain = bench_cold_scan(table, 0, &num_rows);
+  double ahead = bench_cold_scan(table, PAGER_DEFAULT_READAHEAD_PAGES, &num_rows);
+  printf("Cold scan of %d rows (%.1f MB):\n", num_rows, megabytes);
+  printf("  no read-ahead: %.3f s, %.1f MB/s\n", plain, megabytes / plain);
+  printf("  read-ahead %d pages: %.3f s, %.1f MB/s\n",
+         PAGER_DEFAULT_READAHEAD_PAGES, ahead, megabytes / ahead);
+}
+
+/*
+Write a compressed copy of the db as of the last commit to filename (see
+Compressed Archive Layout). False if the file cannot be written.
+*/
+bool archive_write(Table *table, const char *filename, uint32_t *num_pages,
+                   uint64_t *archive_size) {
+  Pager *pager = table->pager;
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+  if (fd == -1) {
+    return false;
+  }
+
+  uint64_t snapshot = pager_snapshot_begin(pager);
+  pthread_mutex_lock(&pager->lock);
+  *num_pages = pager->num_pages;
+  pthread_mutex_unlock(&pager->lock);
+
+  ssize_t offsets_size = ((ssize_t)*num_pages + 1) * ARCHIVE_OFFSET_SIZE;
+  uint64_t *offsets = malloc(offsets_size);
+  uint64_t offset = ARCHIVE_OFFSETS_OFFSET + offsets_size;
+  uint8_t page[PAGE_SIZE];
+  uint8_t image[ARCHIVE_MAX_IMAGE_SIZE];
+  bool ok = true;
+  for (uint32_t i = 0; i < *num_pages && ok; i++) {
+    pager_read_page(pager, i, snapshot, page);
+    pager_trim(pager);
+    uint32_t size = archive_encode_page(i, page, image);
+    offsets[i] = offset;
+    ok = pwrite(fd, image, size, offset) == size;
+    offset += size;
+  }
+  offsets[*num_pages] = offset;
+  pager_snapshot_end(pager, snapshot);
+
+  uint8_t header[ARCHIVE_OFFSETS_OFFSET];
+  memcpy(header, ARCHIVE_MAGIC, ARCHIVE_MAGIC_SIZE);
+  memcpy(header + ARCHIVE_NUM_PAGES_OFFSET, num_pages, ARCHIVE_NUM_PAGES_SIZE);
+  memcpy(header + ARCHIVE_PAGE_SIZE_OFFSET, &PAGE_SIZE, ARCHIVE_PAGE_SIZE_SIZE);
+  memcpy(header + ARCHIVE_MAX_INTERNAL_CELLS_OFFSET, &INTERNAL_NODE_MAX_CELLS,
+         ARCHIVE_MAX_INTERNAL_CELLS_SIZE);
+  memcpy(header + ARCHIVE_MAX_LEAF_CELL_SIZE_OFFSET, &LEAF_NODE_MAX_CELL_SIZE,
+         ARCHIVE_MAX_LEAF_CELL_SIZE_SIZE);
+  ok = ok &&
+       pwrite(fd, header, ARCHIVE_OFFSETS_OFFSET, 0) ==
+           ARCHIVE_OFFSETS_OFFSET &&
+       pwrite(fd, offsets, offsets_size, ARCHIVE_OFFSETS_OFFSET) ==
+           offsets_size &&
+       fsync(fd) == 0;
+  close(fd);
+  free(offsets);
+  *archive_size = offset;
+  return ok;
+}
+
+#define SNAPSHOT_BATCH_PAGES 64
+
+/*
+The committed image of a page, for the child of db_snapshot_to_file. The
+child has a frozen copy of the parent, locks and all, so nothing here takes
+a lock or allocates.
+*/
+void snapshot_read_page(Pager *pager, uint32_t page_num, uint64_t snapshot,
+                        void *page) {
+  if (page_num < pager->frames_capacity && pager->frames[page_num] != NULL) {
+    memcpy(page, frame_version(pager->frames[page_num], snapshot), PAGE_SIZE);
+  } else {
+    memset(page, 0, PAGE_SIZE);
+  }
+  page_set_checksum(page_num, page);
+}
+
+/* In the child: write the pages in order, sync, and put the file in place */
+void snapshot_write_file(Pager *pager, uint64_t snapshot, uint32_t num_pages,
+                         int fd, uint8_t *batch, const char *tmp_filename,
+                         const char *filename) {
+  for (uint32_t first = 0; first < num_pages; first += SNAPSHOT_BATCH_PAGES) {
+    uint32_t count = num_pages - first < SNAPSHOT_BATCH_PAGES
+                         ? num_pages - first
+                         : SNAPSHOT_BATCH_PAGES;
+    for (uint32_t i = 0; i < count; i++) {
+      snapshot_read_page(pager, first + i, snapshot, batch + i * PAGE_SIZE);
+    }
+    ssize_t length = (ssize_t)count * PAGE_SIZE;
+    if (write(fd, batch, length) != length) {
+      _exit(EXIT_FAILURE);
+    }
+  }
+  if (fsync(fd) == -1 || close(fd) == -1 ||
+      rename(tmp_filename, filename) == -1) {
+    _exit(EXIT_FAILURE);
+  }
+  _exit(EXIT_SUCCESS);
+}
+
+bool db_snapshot_wait(Table *table) {
+  Pager *pager = table->pager;
+  if (pager->snapshot_pid == 0) {
+    return true;
+  }
+  int status;
+  pid_t pid = waitpid(pager->snapshot_pid, &status, 0);
+  pager->snapshot_pid = 0;
+  return pid != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/*
+The pages are fixed at the fork: the write lock keeps out a commit, and the
+snapshot is the last commit, so pages of an open transaction are written as
+they were before it. Only a db held in memory has every page in the child's
+copy of the frames. A db with a file would leave the child reading pages
+the parent goes on writing back, so it gets SNAPSHOT_FILE_NOT_IN_MEMORY.
+*/
+SnapshotFileResult db_snapshot_to_file(Table *table, const char *filename) {
+  Pager *pager = table->pager;
+  if (!pager->in_memory) {
+    return SNAPSHOT_FILE_NOT_IN_MEMORY;
+  }
+  if (pager->snapshot_pid != 0) {
+    int status;
+    pid_t pid = waitpid(pager->snapshot_pid, &status, WNOHANG);
+    if (pid == 0) {
+      return SNAPSHOT_FILE_BUSY;
+    }
+    pager->snapshot_pid = 0;
+  }
+
+  size_t tmp_filename_size = strlen(filename) + 5;
+  char *tmp_filename = malloc(tmp_filename_size);
+  snprintf(tmp_filename, tmp_filename_size, "%s.tmp", filename);
+  int fd = open(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+  if (fd == -1) {
+    free(tmp_filename);
+    return SNAPSHOT_FILE_ERROR;
+  }
+  uint8_t *batch = malloc(SNAPSHOT_BATCH_PAGES * PAGE_SIZE);
+
+  pager_begin_write(pager);
+  pthread_mutex_lock(&pager->lock);
+  uint64_t snapshot = pager->commit_seq;
+  uint32_t num_pages = pager->wal != NULL && pager->wal->in_transaction
+                           ? pager->wal->txn_start_num_pages
+                           : pager->num_pages;
+  pid_t pid = fork();
+  if (pid == 0) {
+    snapshot_write_file(pager, snapshot, num_pages, fd, batch, tmp_filename,
+                        filename);
+  }
+  pthread_mutex_unlock(&pager->lock);
+  pager_end_write(pager);
+
+  close(fd);
+  free(batch);
+  if (pid == -1) {
+    unlink(tmp_filename);
+    free(tmp_filename);
+    return SNAPSHOT_FILE_ERROR;
+  }
+  free(tmp_filename);
+  pager->snapshot_pid = pid;
+  return SNAPSHOT_FILE_STARTED;
+}
+
+void do_archive(InputBuffer *input_buffer, Table *table) {
+  strtok(input_buffer->buffer, " ");
+  char *filename = strtok(NULL, " ");
+  if (filename == NULL) {
+    printf("Usage: .archive <file>\n");
+    return;
+  }
+
+  uint32_t num_pages;
+  uint64_t archive_size;
+  if (!archive_write(table, filename, &num_pages, &archive_size)) {
+    printf("Unable to write '%s'.\n", filename);
+    return;
+  }
+  printf("Archived %d pages (%llu bytes) in %llu bytes.\n", num_pages,
+         (unsigned long long)num_pages * PAGE_SIZE,
+         (unsigned long long)archive_size);
+}
+
+void do_snapshot(InputBuffer *input_buffer, Table *table) {
+  strtok(input_buffer->buffer, " ");
+  char *filename = strtok(NULL, " ");
+  if (filename == NULL) {
+    printf("Usage: .snapshot <file>\n");
+    return;
+  }
+
+  switch (db_snapshot_to_file(table, filename)) {
+  case (SNAPSHOT_FILE_STARTED):
+    printf("Writing snapshot to '%s' in the background.\n", filename);
+    break;
+  case (SNAPSHOT_FILE_BUSY):
+    printf("A snapshot is still being written.\n");
+    break;
+  case (SNAPSHOT_FILE_ERROR):
+    printf("Unable to write '%s'.\n", filename);
+    break;
+  case (SNAPSHOT_FILE_NOT_IN_MEMORY):
+    printf("Only a %s db can be snapshotted.\n", DB_MEMORY_FILENAME);
+    break;
+  }
+}
+
+#define VACUUM_STEP_ROWS 1000
+
+/* Whether there is input to read without waiting */
+bool input_pending() {
+  struct pollfd input = {.fd = STDIN_FILENO, .events = POLLIN};
+  return poll(&input, 1, 0) > 0;
+}
+
+/*
+Run the vacuum a step at a time until it is done, or, unless to_end, until
+the user has typed something. Between REPL statements it only runs while
+the REPL would be waiting for input anyway.
+*/
+VacuumResult run_vacuum(Table *table, bool to_end, VacuumProgress *progress) {
+  VacuumResult result;
+  do {
+    result = db_vacuum_step(table, VACUUM_STEP_ROWS, progress);
+  } while (result == VACUUM_IN_PROGRESS && (to_end || !input_pending()));
+
+  if (result == VACUUM_DONE) {
+    uint64_t saved = progress->old_size > progress->new_size
+                         ? progress->old_size - progress->new_size
+                         : 0;
+    printf("Vacuumed %llu rows: %llu bytes to %llu bytes (%llu%% smaller).\n",
+           (unsigned long long)progress->rows,
+           (unsigned long long)progress->old_size,
+           (unsigned long long)progress->new_size,
+           (unsigned long long)(progress->old_size > 0
+                                    ? saved * 100 / progress->old_size
+                                    : 0));
+  } else if (result == VACUUM_FILE_ERROR) {
+    printf("Unable to replace the db file. Vacuum abandoned.\n");
+  } else if (result == VACUUM_DB_ERROR) {
+    printf("A page could not be read. Vacuum abandoned.\n");
+  }
+  return result;
+}
+
+void do_vacuum(Table *table) {
+  switch (db_vacuum_begin(table)) {
+  case (VACUUM_READ_ONLY):
+    printf("Error: Db is open read-only.\n");
+    return;
+  case (VACUUM_NO_FILE):
+    printf("Error: Db has no file to vacuum.\n");
+    return;
+  case (VACUUM_IN_TRANSACTION):
+    printf("Error: Transaction already open.\n");
+    return;
+  case (VACUUM_FILE_ERROR):
+    printf("Unable to write '%s.vacuum'.\n", table->pager->filename);
+    return;
+  case (VACUUM_DB_ERROR):
+    printf("%s\n", db_error(table));
+    return;
+  default:
+    break;
+  }
+
+  VacuumProgress progress;
+  VacuumResult result = run_vacuum(table, false, &progress);
+  if (result == VACUUM_IN_PROGRESS || result == VACUUM_WAITING) {
+    printf("Vacuuming in the background, %llu rows copied so far.\n",
+           (unsigned long long)progress.rows);
+  }
+}
+
+const char *STATEMENT_TYPE_NAMES[NUM_STATEMENT_TYPES] = {
+    "insert", "select", "begin", "commit", "rollback", "create index",
+    "delete"};
+
+/* .stats: the counters of db_stats, and the table's tree */
+void print_stats(Table *table) {
+  DbStats stats;
+  db_stats(table, &stats);
+  printf("Cache: %llu hits, %llu misses\n",
+         (unsigned long long)stats.cache_hits,
+         (unsigned long long)stats.cache_misses);
+  printf("Read: %llu pages, %llu bytes\n",
+         (unsigned long long)stats.pages_read,
+         (unsigned long long)stats.bytes_read);
+  printf("Written: %llu pages, %llu bytes\n",
+         (unsigned long long)stats.pages_written,
+         (unsigned long long)stats.bytes_written);
+  printf("Splits: %llu leaf, %llu internal\n",
+         (unsigned long long)stats.leaf_splits,
+         (unsigned long long)stats.internal_splits);
+  printf("Tree: height %d, %d leaves, %d internal nodes\n", stats.tree_height,
+         stats.num_leaves, stats.num_internal_nodes);
+
+  // Only the buckets with something in them
+  printf("Leaf fill:");
+  const char *separator = " ";
+  for (uint32_t i = 0; i < DB_STATS_FILL_BUCKETS; i++) {
+    if (stats.leaf_fill[i] > 0) {
+      printf("%s%d-%d%% %d", separator, i * 10, (i + 1) * 10,
+             stats.leaf_fill[i]);
+      separator = ", ";
+    }
+  }
+  printf("\n");
+
+  for (uint32_t type = 0; type < NUM_STATEMENT_TYPES; type++) {
+    if (stats.statements[type] == 0) {
+      continue;
+    }
+    printf("%s: %llu in %.3f ms", STATEMENT_TYPE_NAMES[type],
+           (unsigned long long)stats.statements[type],
+           stats.statement_ns[type] / 1e6);
+    for (uint32_t i = 0; i < DB_STATS_LATENCY_BUCKETS; i++) {
+      uint64_t count = stats.latency[type][i];
+      if (count == 0) {
+        continue;
+      }
+      if (i < DB_STATS_LATENCY_BUCKETS - 1) {
+        printf(", <%lluus %llu", 1ull << i, (unsigned long long)count);
+      } else {
+        printf(", >=%lluus %llu", 1ull << (i - 1), (unsigned long long)count);
+      }
+    }
+    printf("\n");
+  }
+}
+
+/* Where and how the REPL writes the rows of a select */
+typedef struct {
+  OutputFormat format;
+  int fd;  // STDOUT_FILENO unless .output named a file
+} Output;
+
+/* .mode text|csv|binary */
+void do_mode(InputBuffer *input_buffer, Output *output) {
+  strtok(input_buffer->buffer, " ");
+  char *mode = strtok(NULL, " ");
+  if (mode != NULL && strcmp(mode, "text") == 0) {
+    output->format = OUTPUT_TEXT;
+  } else if (mode != NULL && strcmp(mode, "csv") == 0) {
+    output->format = OUTPUT_CSV;
+  } else if (mode != NULL && strcmp(mode, "binary") == 0) {
+    output->format = OUTPUT_BINARY;
+  } else {
+    printf("Usage: .mode text|csv|binary\n");
+  }
+}
+
+/* .output [file]: rows go to the file from now on, or back to stdout */
+void do_output(InputBuffer *input_buffer, Output *output) {
+  strtok(input_buffer->buffer, " ");
+  char *filename = strtok(NULL, " ");
+  int fd = STDOUT_FILENO;
+  if (filename != NULL) {
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if (fd == -1) {
+      printf("Unable to write '%s'.\n", filename);
+      return;
+    }
+  }
+  if (output->fd != STDOUT_FILENO) {
+    close(output->fd);
+  }
+  output->fd = fd;
+}
+
+MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table *table,
+                                  Output *output) {
+  if (strcmp(input_buffer->buffer, ".exit") == 0) {
+    close_input_buffer(input_buffer);
+    if (table->vacuum != NULL) {
+      VacuumProgress progress;
+      run_vacuum(table, true, &progress);
+    }
+    db_close(table);
+    exit(EXIT_SUCCESS);
+  } else if (strcmp(input_buffer->buffer, ".btree") == 0) {
+    printf("Tree:\n");
+    // Keeps other threads from evicting pages while the tree is printed
+    pager_begin_write(table->pager);
+    print_tree(table->pager, table->root_page_num, 0);
+    pager_end_write(table->pager);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".constants") == 0) {
+    printf("Constants:\n");
+    print_constants();
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".import ", 8) == 0) {
+    do_import(input_buffer, table);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".bench", 6) == 0) {
+    do_bench(input_buffer, table);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".archive", 8) == 0) {
+    do_archive(input_buffer, table);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".vacuum") == 0) {
+    do_vacuum(table);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".snapshot", 9) == 0) {
+    do_snapshot(input_buffer, table);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".stats") == 0) {
+    print_stats(table);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".stats reset") == 0) {
+    db_stats_reset(table);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".mode", 5) == 0) {
+    do_mode(input_buffer, output);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".output", 7) == 0) {
+    do_output(input_buffer, output);
+    return META_COMMAND_SUCCESS;
+  } else {
+    return META_COMMAND_SUCCESS_UNRECOGNIZED_COMMAND;
+  }
+}
+
+/*
+ * Statements are read by a small lexer that turns a line into tokens, and a
+ * parser that reads the tokens in order into a Statement. Whitespace and
+ * commas separate words, so does an operator, and a value with spaces or
+ * commas in it can be quoted: insert 1 'a b' ab@example.com
+ */
+typedef enum {
+  TOKEN_END,
+  TOKEN_WORD,       // A keyword, column name or unquoted value
+  TOKEN_NUMBER,     // Digits, maybe with a leading -
+  TOKEN_STRING,     // 'quoted', without the quotes
+  TOKEN_OPERATOR,   // = < <= > >=
+  TOKEN_COMMA,
+  TOKEN_PARAMETER,  // ?
+  TOKEN_ERROR       // A string with no closing quote
+} TokenType;
+
+typedef struct {
+  TokenType type;
+  const char *start;
+  uint32_t length;
+} Token;
+
+typedef struct {
+  const char *position;
+  Token token;  // The token the parser is looking at
+} Lexer;
+
+bool lexer_is_separator(char c) {
+  return c == '\0' || isspace((unsigned char)c) || c == ',' || c == '\'' ||
+         c == '=' || c == '<' || c == '>';
+}
+
+/* Read the next token into lexer->token */
+void lexer_next(Lexer *lexer) {
+  const char *p = lexer->position;
+  while (isspace((unsigned char)*p)) {
+    p++;
+  }
+
+  Token *token = &lexer->token;
+  token->start = p;
+  if (*p == '\0') {
+    token->type = TOKEN_END;
+  } else if (*p == ',') {
+    token->type = TOKEN_COMMA;
+    p++;
+  } else if (*p == '?') {
+    token->type = TOKEN_PARAMETER;
+    p++;
+  } else if (*p == '=' || *p == '<' || *p == '>') {
+    token->type = TOKEN_OPERATOR;
+    p += (*p != '=' && p[1] == '=') ? 2 : 1;
+  } else if (*p == '\'') {
+    const char *end = strchr(p + 1, '\'');
+    if (end == NULL) {
+      token->type = TOKEN_ERROR;
+      p += strlen(p);
+    } else {
+      token->type = TOKEN_STRING;
+      token->start = p + 1;
+      token->length = end - token->start;
+      lexer->position = end + 1;
+      return;
+    }
+  } else {
+    const char *digits = *p == '-' ? p + 1 : p;
+    while (!lexer_is_separator(*p)) {
+      p++;
+    }
+    bool number = digits < p;
+    for (const char *c = digits; c < p; c++) {
+      number = number && isdigit((unsigned char)*c);
+    }
+    token->type = number ? TOKEN_NUMBER : TOKEN_WORD;
+  }
+  token->length = p - token->start;
+  lexer->position = p;
+}
+
+void lexer_init(Lexer *lexer, const char *input) {
+  lexer->position = input;
+  lexer_next(lexer);
+}
+
+/* Keywords are matched without regard to case, as in SQL */
+bool token_is(Token *token, const char *keyword) {
+  return token->type == TOKEN_WORD && token->length == strlen(keyword) &&
+         strncasecmp(token->start, keyword, token->length) == 0;
+}
+
+/* Consume the current token if it is the keyword */
+bool lexer_accept(Lexer *lexer, const char *keyword) {
+  if (!token_is(&lexer->token, keyword)) {
+    return false;
+  }
+  lexer_next(lexer);
+  return true;
+}
+
+/* Read a number token as an id: non-negative and no wider than 32 bits */
+PrepareResult token_id(Token *token, int64_t *id) {
+  if (token->type != TOKEN_NUMBER) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (token->start[0] == '-') {
+    return PREPARE_NEGATIVE_ID;
+  }
+  errno = 0;
+  long long value = strtoll(token->start, NULL, 10);
+  if (errno != 0 || value > UINT32_MAX) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  *id = value;
+  return PREPARE_SUCCESS;
+}
+
+bool token_is_text(Token *token) {
+  return token->type == TOKEN_WORD || token->type == TOKEN_NUMBER ||
+         token->type == TOKEN_STRING;
+}
+
+PrepareResult token_copy_text(Token *token, char *destination,
+                              uint32_t max_length) {
+  if (token->length > max_length) {
+    return PREPARE_STRING_TOO_LONG;
+  }
+  memcpy(destination, token->start, token->length);
+  destination[token->length] = '\0';
+  return PREPARE_SUCCESS;
+}
+
+/* Note a ? so a later bind knows where its value goes */
+void statement_add_parameter(Statement *statement, ParameterTarget target,
+                             uint32_t index, uint32_t which) {
+  statement->parameters =
+      realloc(statement->parameters,
+              (statement->num_parameters + 1) * sizeof(Parameter));
+  statement->parameters[statement->num_parameters++] =
+      (Parameter){.target = target, .index = index, .which = which};
+}
+
+/*
+One row of an insert: id username email. Any of the three can be a ?. All
+three are read before any is checked, so a short row is a syntax error
+whatever else is wrong with it.
+*/
+PrepareResult prepare_row(Lexer *lexer, Statement *statement, Row *row) {
+  Token tokens[3];
+  for (uint32_t i = 0; i < 3; i++) {
+    tokens[i] = lexer->token;
+    if (!token_is_text(&tokens[i]) && tokens[i].type != TOKEN_PARAMETER) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    lexer_next(lexer);
+  }
+
+  uint32_t row_index = statement->num_rows;
+  memset(row, 0, sizeof(Row));
+  if (tokens[0].type == TOKEN_PARAMETER) {
+    statement_add_parameter(statement, PARAMETER_ROW_ID, row_index, 0);
+  } else {
+    int64_t id;
+    PrepareResult result = token_id(&tokens[0], &id);
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+    row->id = id;
+  }
+
+  if (tokens[1].type == TOKEN_PARAMETER) {
+    statement_add_parameter(statement, PARAMETER_ROW_USERNAME, row_index, 0);
+  } else if (token_copy_text(&tokens[1], row->username,
+                             COLUMN_USERNAME_SIZE) != PREPARE_SUCCESS) {
+    return PREPARE_STRING_TOO_LONG;
+  }
+
+  if (tokens[2].type == TOKEN_PARAMETER) {
+    statement_add_parameter(statement, PARAMETER_ROW_EMAIL, row_index, 0);
+  } else if (token_copy_text(&tokens[2], row->email, COLUMN_EMAIL_SIZE) !=
+             PREPARE_SUCCESS) {
+    return PREPARE_STRING_TOO_LONG;
+  }
+
+  return PREPARE_SUCCESS;
+}
+
+/*
+One insert can carry many rows, separated by commas:
+insert 1 user1 person1@example.com, 2 user2 person2@example.com
+*/
+PrepareResult prepare_insert(Lexer *lexer, Statement *statement) {
+  statement->type = STATEMENT_INSERT;
+
+  uint32_t capacity = 1;
+  statement->rows_to_insert = malloc(capacity * sizeof(Row));
+
+  while (true) {
+    if (statement->num_rows == capacity) {
+      capacity *= 2;
+      statement->rows_to_insert =
+          realloc(statement->rows_to_insert, capacity * sizeof(Row));
+    }
+
+    PrepareResult result = prepare_row(
+        lexer, statement, &statement->rows_to_insert[statement->num_rows]);
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+    statement->num_rows++;
+
+    if (lexer->token.type != TOKEN_COMMA) {
+      break;
+    }
+    lexer_next(lexer);
+  }
+
+  return lexer->token.type == TOKEN_END ? PREPARE_SUCCESS
+                                        : PREPARE_SYNTAX_ERROR;
+}
+
+bool parse_indexed_column(Token *token, IndexedColumn *column) {
+  if (token_is(token, "username")) {
+    *column = COLUMN_USERNAME;
+    return true;
+  }
+  if (token_is(token, "email")) {
+    *column = COLUMN_EMAIL;
+    return true;
+  }
+  return false;
+}
+
+bool parse_row_column(Token *token, RowColumn *column) {
+  if (token_is(token, "id")) {
+    *column = ROW_COLUMN_ID;
+    return true;
+  }
+  if (token_is(token, "username")) {
+    *column = ROW_COLUMN_USERNAME;
+    return true;
+  }
+  if (token_is(token, "email")) {
+    *column = ROW_COLUMN_EMAIL;
+    return true;
+  }
+  return false;
+}
+
+/*
+select [<column>[, <column> ...]], each of id, username and email at most
+once, in the order they are to be output
+*/
+PrepareResult prepare_select_columns(Lexer *lexer, Statement *statement) {
+  RowColumn column;
+  while (parse_row_column(&lexer->token, &column)) {
+    for (uint32_t i = 0; i < statement->num_columns; i++) {
+      if (statement->columns[i] == column) {
+        return PREPARE_SYNTAX_ERROR;
+      }
+    }
+    statement->columns[statement->num_columns++] = column;
+    lexer_next(lexer);
+    if (lexer->token.type != TOKEN_COMMA) {
+      return PREPARE_SUCCESS;
+    }
+    lexer_next(lexer);
+  }
+  // A comma with no column after it
+  return statement->num_columns == 0 ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
+}
+
+/* An id or a ?, for value `which` of id condition `index` */
+PrepareResult prepare_condition_value(Lexer *lexer, Statement *statement,
+                                      uint32_t index, uint32_t which) {
+  IdCondition *condition = &statement->id_conditions[index];
+  if (lexer->token.type == TOKEN_PARAMETER) {
+    statement_add_parameter(statement, PARAMETER_CONDITION_VALUE, index,
+                            which);
+    condition->values[which] = 0;
+  } else if (token_id(&lexer->token, &condition->values[which]) !=
+             PREPARE_SUCCESS) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  lexer_next(lexer);
+  return PREPARE_SUCCESS;
+}
+
+/*
+A condition on id:
+  id = N, id < N, id <= N, id > N, id >= N, id between A and B
+*/
+PrepareResult prepare_id_condition(Lexer *lexer, Statement *statement) {
+  const char *operators[] = {"=", "<", "<=", ">", ">="};
+
+  uint32_t index = statement->num_id_conditions++;
+  statement->id_conditions =
+      realloc(statement->id_conditions,
+              statement->num_id_conditions * sizeof(IdCondition));
+  IdCondition *condition = &statement->id_conditions[index];
+
+  Token *token = &lexer->token;
+  if (lexer_accept(lexer, "between")) {
+    condition->operator = CONDITION_BETWEEN;
+    PrepareResult result = prepare_condition_value(lexer, statement, index, 0);
+    if (result != PREPARE_SUCCESS || !lexer_accept(lexer, "and")) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    return prepare_condition_value(lexer, statement, index, 1);
+  }
+
+  if (token->type != TOKEN_OPERATOR) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  for (uint32_t i = 0; i < 5; i++) {
+    if (token->length == strlen(operators[i]) &&
+        strncmp(token->start, operators[i], token->length) == 0) {
+      condition->operator = CONDITION_EQUAL + i;
+    }
+  }
+  lexer_next(lexer);
+  return prepare_condition_value(lexer, statement, index, 0);
+}
+
+/*
+One condition of a where clause: a range on id, or username = X or
+email = X. Only one username/email condition is allowed per select.
+*/
+PrepareResult prepare_condition(Lexer *lexer, Statement *statement) {
+  if (lexer_accept(lexer, "id")) {
+    return prepare_id_condition(lexer, statement);
+  }
+
+  IndexedColumn column;
+  if (!parse_indexed_column(&lexer->token, &column) ||
+      statement->has_column_filter) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  lexer_next(lexer);
+  Token *token = &lexer->token;
+  if (token->type != TOKEN_OPERATOR || token->length != 1 ||
+      token->start[0] != '=') {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  lexer_next(lexer);
+
+  statement->has_column_filter = true;
+  statement->filter_column = column;
+  if (token->type == TOKEN_PARAMETER) {
+    statement_add_parameter(statement, PARAMETER_FILTER_VALUE, 0, 0);
+    statement->filter_value[0] = '\0';
+  } else if (token_is_text(token)) {
+    uint32_t max_length =
+        column == COLUMN_USERNAME ? COLUMN_USERNAME_SIZE : COLUMN_EMAIL_SIZE;
+    PrepareResult result =
+        token_copy_text(token, statement->filter_value, max_length);
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+  } else {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  lexer_next(lexer);
+  return PREPARE_SUCCESS;
+}
+
+/*
+[where <condition> [and <condition> ...]] [limit N]
+*/
+PrepareResult prepare_where_clause(Lexer *lexer, Statement *statement) {
+  if (lexer_accept(lexer, "where")) {
+    do {
+      PrepareResult result = prepare_condition(lexer, statement);
+      if (result != PREPARE_SUCCESS) {
+        return result;
+      }
+    } while (lexer_accept(lexer, "and"));
+  }
+
+  if (lexer_accept(lexer, "limit")) {
+    if (lexer->token.type == TOKEN_PARAMETER) {
+      statement_add_parameter(statement, PARAMETER_LIMIT, 0, 0);
+    } else if (token_id(&lexer->token, &statement->row_limit) !=
+               PREPARE_SUCCESS) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    lexer_next(lexer);
+  }
+
+  return lexer->token.type == TOKEN_END ? PREPARE_SUCCESS
+                                        : PREPARE_SYNTAX_ERROR;
+}
+
+/*
+Fold the id conditions and the limit into min_id, max_id and limit, once
+every ? has its value
+*/
+void statement_resolve_where(Statement *statement) {
+  int64_t min_id = 0;
+  int64_t max_id = UINT32_MAX;
+  int64_t limit = statement->row_limit;
+
+  for (uint32_t i = 0; i < statement->num_id_conditions; i++) {
+    IdCondition *condition = &statement->id_conditions[i];
+    int64_t value = condition->values[0];
+    int64_t low = 0;
+    int64_t high = UINT32_MAX;
+    switch (condition->operator) {
+      case (CONDITION_EQUAL):
+        low = value;
+        high = value;
+        break;
+      case (CONDITION_LESS):
+        high = value - 1;
+        break;
+      case (CONDITION_LESS_EQUAL):
+        high = value;
+        break;
+      case (CONDITION_GREATER):
+        low = value + 1;
+        break;
+      case (CONDITION_GREATER_EQUAL):
+        low = value;
+        break;
+      case (CONDITION_BETWEEN):
+        low = value;
+        high = condition->values[1];
+        break;
+    }
+    if (low > min_id) {
+      min_id = low;
+    }
+    if (high < max_id) {
+      max_id = high;
+    }
+  }
+
+  // A range like id > 5 and id < 3 matches nothing
+  if (min_id > max_id) {
+    limit = 0;
+    min_id = 0;
+    max_id = 0;
+  }
+
+  statement->min_id = min_id;
+  statement->max_id = max_id;
+  statement->limit = limit;
+}
+
+/*
+create index on username
+create index on email
+*/
+PrepareResult prepare_create_index(Lexer *lexer, Statement *statement) {
+  statement->type = STATEMENT_CREATE_INDEX;
+
+  if (!lexer_accept(lexer, "index") || !lexer_accept(lexer, "on") ||
+      !parse_indexed_column(&lexer->token, &statement->index_column)) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  lexer_next(lexer);
+  return lexer->token.type == TOKEN_END ? PREPARE_SUCCESS
+                                        : PREPARE_SYNTAX_ERROR;
+}
+
+void statement_free(Statement *statement) {
+  free(statement->rows_to_insert);
+  free(statement->id_conditions);
+  free(statement->parameters);
+  statement->rows_to_insert = NULL;
+  statement->id_conditions = NULL;
+  statement->parameters = NULL;
+}
+
+/*
+Parse one statement. On failure the statement holds nothing that needs
+freeing.
+*/
+PrepareResult prepare_statement(const char *sql, Statement *statement) {
+  memset(statement, 0, sizeof(Statement));
+  statement->row_limit = UINT32_MAX;
+
+  Lexer lexer;
+  lexer_init(&lexer, sql);
+  PrepareResult result;
+  if (lexer_accept(&lexer, "insert")) {
+    result = prepare_insert(&lexer, statement);
+  } else if (lexer_accept(&lexer, "select")) {
+    statement->type = STATEMENT_SELECT;
+    result = prepare_select_columns(&lexer, statement);
+    if (result == PREPARE_SUCCESS) {
+      result = prepare_where_clause(&lexer, statement);
+    }
+  } else if (lexer_accept(&lexer, "delete")) {
+    // delete takes the same where clause as select
+    statement->type = STATEMENT_DELETE;
+    result = prepare_where_clause(&lexer, statement);
+  } else if (lexer_accept(&lexer, "create")) {
+    result = prepare_create_index(&lexer, statement);
+  } else {
+    if (lexer_accept(&lexer, "begin")) {
+      statement->type = STATEMENT_BEGIN;
+    } else if (lexer_accept(&lexer, "commit")) {
+      statement->type = STATEMENT_COMMIT;
+    } else if (lexer_accept(&lexer, "rollback")) {
+      statement->type = STATEMENT_ROLLBACK;
+    } else {
+      return PREPARE_UNRECOGNIZED_STATEMENT;
+    }
+    result = lexer.token.type == TOKEN_END ? PREPARE_SUCCESS
+                                           : PREPARE_UNRECOGNIZED_STATEMENT;
+  }
+
+  if (result != PREPARE_SUCCESS) {
+    statement_free(statement);
+    return result;
+  }
+  statement_resolve_where(statement);
+  return PREPARE_SUCCESS;
+}
+
+void print_prompt() { printf("db > "); }
+
+/* Read one line. Returns false at the end of the input. */
+bool read_input(InputBuffer *input_buffer) {
+  ssize_t bytes_read =
+      getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
+
+  if (bytes_read <= 0) {
+    return false;
+  }
+
+  // Ignore trailing newline, if the last line has one
+  if (input_buffer->buffer[bytes_read - 1] == '\n') {
+    bytes_read--;
+  }
+  input_buffer->input_length = bytes_read;
+  input_buffer->buffer[bytes_read] = 0;
+  return true;
+}
+
+uint32_t *node_parent(void *node) { return node + PARENT_POINTER_OFFSET; }
+
+/*
+Change the key of the child whose max key was old_key. The right child has
+no key, so there is nothing to change for it.
+*/
+void update_internal_node_key(void *node, uint64_t old_key, uint64_t new_key) {
+  uint32_t old_child_index = internal_node_find_child(node, old_key);
+  if (old_child_index < *internal_node_num_keys(node)) {
+    internal_node_set_key(node, old_child_index, new_key);
+  }
+}
+
+void create_new_root(Table *table, uint32_t right_child_page_num) {
+  /*
+  Handle splitting the root
+  Old root compied to new page, becomes left child
+  Address of right child passed in
+  Re-initialize root page to contain the new root node
+  New root node points to two children
+  */
+
+  void *root = get_page(table->pager, table->root_page_num);
+  void *right_child = get_page(table->pager, right_child_page_num);
+  uint32_t left_child_page_num = get_unused_page_num(table->pager);
+  void *left_child = get_page(table->pager, left_child_page_num);
+  pager_mark_dirty(table->pager, table->root_page_num);
+  pager_mark_dirty(table->pager, right_child_page_num);
+  pager_mark_dirty(table->pager, left_child_page_num);
+
+  if (get_node_type(root) == NODE_INTERNAL) {
+    initialize_internal_node(right_child, node_key_size(root));
+    initialize_internal_node(left_child, node_key_size(root));
+  }
+
+  /* Left child has data copied from old root*/
+  memcpy(left_child, root, PAGE_SIZE);
+  set_node_root(left_child, false);
+
+  if (get_node_type(left_child) == NODE_INTERNAL) {
+    void *child;
+    for (int i = 0; i < *internal_node_num_keys(left_child); i++) {
+      child = get_page(table->pager, *internal_node_child(left_child, i));
+      pager_mark_dirty(table->pager, *internal_node_child(left_child, i));
+      *node_parent(child) = left_child_page_num;
+    }
+    child = get_page(table->pager, *internal_node_right_child(left_child));
+    pager_mark_dirty(table->pager, *internal_node_right_child(left_child));
+    *node_parent(child) = left_child_page_num;
+  }
+
+  /* Root node is a new internal node with one key and two children */
+  initialize_internal_node(root, node_key_size(left_child));
+  set_node_root(root, true);
+  *internal_node_num_keys(root) = 1;
+  *internal_node_child(root, 0) = left_child_page_num;
+  uint64_t left_child_max_key = get_node_max_key(table->pager, left_child);
+  internal_node_set_key(root, 0, left_child_max_key);
+  *internal_node_right_child(root) = right_child_page_num;
+  *node_parent(left_child) = table->root_page_num;
+  *node_parent(right_child) = table->root_page_num;
+}
+
+/*
+Rebuild left and right from cells and their keys, in order, giving each
+about half of the bytes. The cells must not live in either node.
+*/
+void leaf_nodes_distribute(void *left, void *right, uint64_t *keys,
+                           void **cells, uint32_t num_cells) {
+  uint32_t total_bytes = 0;
+  for (uint32_t i = 0; i < num_cells; i++) {
+    total_bytes += leaf_cell_size(*leaf_cell_payload_size(cells[i]));
+  }
+
+  uint32_t left_count = 0;
+  uint32_t left_bytes = 0;
+  while (left_count < num_cells - 1) {
+    uint32_t size = leaf_cell_size(*leaf_cell_payload_size(cells[left_count]));
+    if (left_count > 0 && left_bytes + size > total_bytes / 2) {
+      break;
+    }
+    left_bytes += size;
+    left_count++;
+  }
+
+  void *nodes[] = {left, right};
+  for (uint32_t i = 0; i < 2; i++) {
+    memset(nodes[i] + LEAF_NODE_HEADER_SIZE, 0, LEAF_NODE_SPACE_FOR_CELLS);
+    *leaf_node_num_cells(nodes[i]) = 0;
+    *leaf_node_content_start(nodes[i]) = PAGE_SIZE;
+  }
+
+  for (uint32_t i = 0; i < num_cells; i++) {
+    uint32_t size = leaf_cell_size(*leaf_cell_payload_size(cells[i]));
+    if (i < left_count) {
+      leaf_node_insert_cell(left, i, keys[i], cells[i], size);
+    } else {
+      leaf_node_insert_cell(right, i - left_count, keys[i], cells[i], size);
+    }
+  }
+}
+
+void leaf_node_split_and_insert(Cursor *cursor, uint64_t new_key,
+                                void *new_cell) {
+  /*
+  Create a new node and move half the cells over.
+  Insert the new value in one of the two nodes.
+  Update parent or create a new parent
+  */
+
+  Pager *pager = cursor->table->pager;
+  pager->stats.leaf_splits++;
+  void *old_node = get_page(pager, cursor->page_num);
+  uint64_t old_max = get_node_max_key(pager, old_node);
+  uint32_t new_page_num = get_unused_page_num(pager);
+  void *new_node = get_page(pager, new_page_num);
+  pager_mark_dirty(pager, cursor->page_num);
+  pager_mark_dirty(pager, new_page_num);
+  initialize_leaf_node(new_node, node_key_size(old_node));
+  *node_parent(new_node) = *node_parent(old_node);
+  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+  *leaf_node_next_leaf(old_node) = new_page_num;
+
+  /*
+  All existing cells plus the new one should be divided between old (left)
+  and new (right) nodes. The old node is rebuilt from a copy of itself.
+  */
+  uint8_t copy[PAGE_SIZE];
+  memcpy(copy, old_node, PAGE_SIZE);
+  uint32_t num_cells = *leaf_node_num_cells(copy) + 1;
+
+  uint64_t keys[num_cells];
+  void *cells[num_cells];
+  for (uint32_t i = 0; i < num_cells; i++) {
+    if (i == cursor->cell_num) {
+      keys[i] = new_key;
+      cells[i] = new_cell;
+    } else {
+      uint32_t old_cell_num = i < cursor->cell_num ? i : i - 1;
+      keys[i] = leaf_node_key(copy, old_cell_num);
+      cells[i] = leaf_node_cell(copy, old_cell_num);
+    }
+  }
+  leaf_nodes_distribute(old_node, new_node, keys, cells, num_cells);
+
+  if (is_node_root(old_node)) {
+    return create_new_root(cursor->table, new_page_num);
+  } else {
+    uint32_t parent_page_num = *node_parent(old_node);
+    uint64_t new_max = get_node_max_key(pager, old_node);
+    void *parent = get_page(pager, parent_page_num);
+
+    pager_mark_dirty(pager, parent_page_num);
+    update_internal_node_key(parent, old_max, new_max);
+    internal_node_insert(cursor->table, parent_page_num, new_page_num);
+    return;
+  }
+}
+
+void leaf_node_insert(Cursor *cursor, uint64_t key, Row *value) {
+  Pager *pager = cursor->table->pager;
+  uint8_t cell[LEAF_NODE_MAX_CELL_SIZE];
+  uint32_t cell_size = leaf_cell_for_row(pager, value, cell);
+
+  void *node = get_page(pager, cursor->page_num);
+  uint32_t needed = cell_size + leaf_node_entry_size(node);
+  bool compact = leaf_node_gap(node) < needed;
+  if (compact && leaf_node_free_space(node) < needed) {
+    // Node full
+    leaf_node_split_and_insert(cursor, key, cell);
+    return;
+  }
+
+  pager_mark_dirty(pager, cursor->page_num);
+  if (compact) {
+    leaf_node_compact(node);
+  }
+  leaf_node_insert_cell(node, cursor->cell_num, key, cell, cell_size);
+}
+
+void internal_node_split_and_insert(Table *table, uint32_t parent_page_num,
+                                    uint32_t child_page_num) {
+  uint32_t old_page_num = parent_page_num;
+  table->pager->stats.internal_splits++;
+  void *old_node = get_page(table->pager, parent_page_num);
+  uint64_t old_max = get_node_max_key(table->pager, old_node);
+
+  void *child = get_page(table->pager, child_page_num);
+  uint64_t child_max = get_node_max_key(table->pager, child);
+
+  uint32_t new_page_num = get_unused_page_num(table->pager);
+
+  /*
+ Declaring a flag before updating pointers which
+ records whether this operation involves splitting the root -
+ if it does, we will insert our newly created node during
+ the step where the table's new root is created. If it does
+ not, we have to insert the newly created node into its parent
+ after the old node's keys have been transferred over. We are not
+ able to do this if the newly created node's parent is not a newly
+ initialized root node, because in that case its parent may have existing
+ keys aside from our old node which we are splitting. If that is true, we
+ need to find a place for our newly created node in its parent, and we
+ cannot insert it at the correct index if it does not yet have any keys
+ */
+
+  uint32_t splitting_root = is_node_root(old_node);
+
+  void *parent;
+  void *new_node;
+
+  if (splitting_root) {
+
+    create_new_root(table, new_page_num);
+    parent = get_page(table->pager, table->root_page_num);
+
+    /*
+    If we are splitting the root, we need to update old_node to point
+    to the new root's left child, new_page_num will already point to
+    the new root's right child
+    */
+
+    old_page_num = *internal_node_child(parent, 0);
+    old_node = get_page(table->pager, old_page_num);
+  } else {
+    parent = get_page(table->pager, *node_parent(old_node));
+    new_node = get_page(table->pager, new_page_num);
+    // The page may come off the freelist, so keep its committed image
+    pager_mark_dirty(table->pager, new_page_num);
+    initialize_internal_node(new_node, node_key_size(old_node));
+  }
+  pager_mark_dirty(table->pager, old_page_num);
+  pager_mark_dirty(table->pager, new_page_num);
+
+  uint32_t *old_num_keys = internal_node_num_keys(old_node);
+  uint32_t cur_page_num = *internal_node_right_child(old_node);
+  void *cur = get_page(table->pager, cur_page_num);
+
+  /*
+  First put right child into new node and set right child of old node to invalid
+  page number
+  */
+
+  internal_node_insert(table, new_page_num, cur_page_num);
+  pager_mark_dirty(table->pager, cur_page_num);
+  *node_parent(cur) = new_page_num;
+  *internal_node_right_child(old_node) = INVALID_PAGE_NUM;
+
+  /*
+  For each key until you get to the middle key, move the key and the child to
+  the new node
+  */
+  int max_cells = internal_node_max_cells(old_node);
+  for (int i = max_cells - 1; i > max_cells / 2; i--) {
+    cur_page_num = *internal_node_child(old_node, i);
+    cur = get_page(table->pager, cur_page_num);
+
+    internal_node_insert(table, new_page_num, cur_page_num);
+    pager_mark_dirty(table->pager, cur_page_num);
+    *node_parent(cur) = new_page_num;
+    (*old_num_keys)--;
+  }
+  /*
+  Set child before middle key, which is now the highest key, to be node's right
+child, and decrement number of keys
+  */
+  *internal_node_right_child(old_node) =
+      *internal_node_child(old_node, *old_num_keys - 1);
+  (*old_num_keys)--;
+  /*
+   Determine which of the two nodes after the split should contain the child
+ to be inserted, and insert the child
+   */
+  uint64_t max_after_split = get_node_max_key(table->pager, old_node);
+  uint32_t destination_page_num =
+      child_max < max_after_split ? old_page_num : new_page_num;
+  internal_node_insert(table, destination_page_num, child_page_num);
+  pager_mark_dirty(table->pager, child_page_num);
+  *node_parent(child) = destination_page_num;
+  pager_mark_dirty(table->pager, splitting_root ? table->root_page_num
+                                                : *node_parent(old_node));
+  update_internal_node_key(parent, old_max,
+                           get_node_max_key(table->pager, old_node));
+  if (!splitting_root) {
+    /*
+    Set the parent before inserting: if the parent splits too, the insert
+    moves new_node and rewrites its parent pointer
+    */
+    *node_parent(new_node) = *node_parent(old_node);
+    internal_node_insert(table, *node_parent(old_node), new_page_num);
+  }
+}
+
+/*
+ * Deleting
+ * A leaf that drops below LEAF_NODE_MIN_USED_SPACE is merged with a
+ * sibling under the same parent if the two fit in one page, and otherwise
+ * takes cells from it. An internal node left with a single child does the
+ * same with its sibling, and a root left with a single child is replaced
+ * by that child, so the tree gets shorter. Merged-away pages go on the
+ * freelist.
+ *
+ * Keys in internal nodes are not lowered when the max key of a child is
+ * deleted. They stay upper bounds of the child, which is all that finding
+ * and inserting rely on.
+ */
+
+/* Free the overflow chain of a cell, if it has one */
+void leaf_cell_free_overflow(Pager *pager, void *cell) {
+  uint32_t payload_size = *leaf_cell_payload_size(cell);
+  if (payload_size <= LEAF_NODE_MAX_LOCAL_PAYLOAD) {
+    return;
+  }
+
+  uint32_t page_num = *leaf_cell_overflow_page(cell);
+  while (page_num != 0) {
+    uint32_t next = *overflow_node_next(get_page(pager, page_num));
+    pager_free_page(pager, page_num);
+    page_num = next;
+  }
+}
+
+void leaf_node_remove_cell(Pager *pager, void *node, uint32_t cell_num) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  void *cell = leaf_node_cell(node, cell_num);
+  uint32_t size = leaf_cell_size(*leaf_cell_payload_size(cell));
+  leaf_cell_free_overflow(pager, cell);
+
+  // The cell becomes a hole, unless it borders the gap
+  if (*leaf_node_slot(node, cell_num) == *leaf_node_content_start(node)) {
+    *leaf_node_content_start(node) += size;
+  }
+  memset(cell, 0, size);
+
+  uint32_t key_size = node_key_size(node);
+  void *keys = leaf_node_keys(node);
+  memmove(keys + cell_num * key_size, keys + (cell_num + 1) * key_size,
+          (num_cells - cell_num - 1) * key_size);
+
+  // The reverse of leaf_node_insert_cell: slots move down by a key, and
+  // those after cell_num by a slot more
+  uint16_t *slots = leaf_node_slot(node, 0);
+  uint16_t *new_slots = (void *)slots - key_size;
+  memmove(new_slots, slots, cell_num * LEAF_NODE_SLOT_SIZE);
+  memmove(new_slots + cell_num, slots + cell_num + 1,
+          (num_cells - cell_num - 1) * LEAF_NODE_SLOT_SIZE);
+  *leaf_node_num_cells(node) = num_cells - 1;
+}
+
+uint32_t internal_node_child_index(void *node, uint32_t child_page_num) {
+  uint32_t num_keys = *internal_node_num_keys(node);
+  for (uint32_t i = 0; i < num_keys; i++) {
+    if (*internal_node_child(node, i) == child_page_num) {
+      return i;
+    }
+  }
+  return num_keys;
+}
+
+void internal_node_remove_cell(void *node, uint32_t cell_num) {
+  uint32_t num_keys = *internal_node_num_keys(node);
+  memmove(internal_node_cell(node, cell_num),
+          internal_node_cell(node, cell_num + 1),
+          (num_keys - cell_num - 1) * internal_node_cell_size(node));
+  *internal_node_num_keys(node) = num_keys - 1;
+}
+
+void set_parent(Pager *pager, uint32_t page_num, uint32_t parent_page_num) {
+  void *node = get_page(pager, page_num);
+  pager_mark_dirty(pager, page_num);
+  *node_parent(node) = parent_page_num;
+}
+
+/*
+Children left_index and left_index + 1 of parent have been merged into the
+left one. Drop the right one from the parent.
+*/
+void internal_node_remove_merged(Table *tree, uint32_t parent_page_num,
+                                 uint32_t left_index);
+
+/*
+The root has a single child left. Move the child into the root page, so
+the root keeps its page number, and free the child's page.
+*/
+void collapse_root(Table *tree) {
+  Pager *pager = tree->pager;
+  void *root = get_page(pager, tree->root_page_num);
+  uint32_t child_page_num = *internal_node_right_child(root);
+  void *child = get_page(pager, child_page_num);
+
+  pager_mark_dirty(pager, tree->root_page_num);
+  memcpy(root, child, PAGE_SIZE);
+  set_node_root(root, true);
+
+  if (get_node_type(root) == NODE_INTERNAL) {
+    uint32_t num_keys = *internal_node_num_keys(root);
+    for (uint32_t i = 0; i <= num_keys; i++) {
+      set_parent(pager, *internal_node_child(root, i), tree->root_page_num);
+    }
+  }
+  pager_free_page(pager, child_page_num);
+}
+
+/*
+An internal node has one child left. Merge it with a sibling if the
+result fits, otherwise take one child from the sibling.
+*/
+void internal_node_rebalance(Table *tree, uint32_t page_num) {
+  Pager *pager = tree->pager;
+  void *node = get_page(pager, page_num);
+  if (*internal_node_num_keys(node) > 0) {
+    return;
+  }
+  if (is_node_root(node)) {
+    collapse_root(tree);
+    return;
+  }
+
+  uint32_t parent_page_num = *node_parent(node);
+  void *parent = get_page(pager, parent_page_num);
+  uint32_t index = internal_node_child_index(parent, page_num);
+  uint32_t left_index =
+      index < *internal_node_num_keys(parent) ? index : index - 1;
+  uint32_t left_page_num = *internal_node_child(parent, left_index);
+  uint32_t right_page_num = *internal_node_child(parent, left_index + 1);
+  void *left = get_page(pager, left_page_num);
+  void *right = get_page(pager, right_page_num);
+  pager_mark_dirty(pager, left_page_num);
+  pager_mark_dirty(pager, right_page_num);
+  pager_mark_dirty(pager, parent_page_num);
+
+  uint32_t left_keys = *internal_node_num_keys(left);
+  uint32_t right_keys = *internal_node_num_keys(right);
+  uint64_t separator = internal_node_key(parent, left_index);
+
+  if (left_keys + 1 + right_keys <= internal_node_max_cells(left)) {
+    // The separator comes down between the two nodes' children
+    *internal_node_cell(left, left_keys) = *internal_node_right_child(left);
+    internal_node_set_key(left, left_keys, separator);
+    memcpy(internal_node_cell(left, left_keys + 1), internal_node_cell(right, 0),
+           right_keys * internal_node_cell_size(right));
+    *internal_node_right_child(left) = *internal_node_right_child(right);
+    *internal_node_num_keys(left) = left_keys + 1 + right_keys;
+
+    for (uint32_t i = left_keys + 1; i <= left_keys + 1 + right_keys; i++) {
+      set_parent(pager, *internal_node_child(left, i), left_page_num);
+    }
+    pager_free_page(pager, right_page_num);
+    internal_node_remove_merged(tree, parent_page_num, left_index);
+    return;
+  }
+
+  uint32_t moved_child;
+  if (left_keys == 0) {
+    // Take the first child of the right node
+    moved_child = *internal_node_child(right, 0);
+    *internal_node_cell(left, 0) = *internal_node_right_child(left);
+    internal_node_set_key(left, 0, separator);
+    *internal_node_num_keys(left) = 1;
+    *internal_node_right_child(left) = moved_child;
+    separator = internal_node_key(right, 0);
+    internal_node_remove_cell(right, 0);
+    set_parent(pager, moved_child, left_page_num);
+  } else {
+    // Take the last child of the left node
+    moved_child = *internal_node_right_child(left);
+    memmove(internal_node_cell(right, 1), internal_node_cell(right, 0),
+            right_keys * internal_node_cell_size(right));
+    *internal_node_cell(right, 0) = moved_child;
+    internal_node_set_key(right, 0, separator);
+    *internal_node_num_keys(right) = right_keys + 1;
+    *internal_node_right_child(left) = *internal_node_child(left, left_keys - 1);
+    separator = internal_node_key(left, left_keys - 1);
+    *internal_node_num_keys(left) = left_keys - 1;
+    set_parent(pager, moved_child, right_page_num);
+  }
+  internal_node_set_key(parent, left_index, separator);
+}
+
+void internal_node_remove_merged(Table *tree, uint32_t parent_page_num,
+                                 uint32_t left_index) {
+  void *parent = get_page(tree->pager, parent_page_num);
+  pager_mark_dirty(tree->pager, parent_page_num);
+
+  // The right slot now leads to the merged node, under the right one's key
+  *internal_node_child(parent, left_index + 1) =
+      *internal_node_child(parent, left_index);
+  internal_node_remove_cell(parent, left_index);
+  internal_node_rebalance(tree, parent_page_num);
+}
+
+/*
+A leaf lost a cell. If it is now too empty, merge it with a sibling or
+even out the two.
+*/
+void leaf_node_rebalance(Table *tree, uint32_t page_num) {
+  Pager *pager = tree->pager;
+  void *node = get_page(pager, page_num);
+  if (is_node_root(node) ||
+      LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(node) >=
+          LEAF_NODE_MIN_USED_SPACE) {
+    return;
+  }
+
+  uint32_t parent_page_num = *node_parent(node);
+  void *parent = get_page(pager, parent_page_num);
+  uint32_t index = internal_node_child_index(parent, page_num);
+  uint32_t left_index =
+      index < *internal_node_num_keys(parent) ? index : index - 1;
+  uint32_t left_page_num = *internal_node_child(parent, left_index);
+  uint32_t right_page_num = *internal_node_child(parent, left_index + 1);
+
+  void *left = get_page(pager, left_page_num);
+  void *right = get_page(pager, right_page_num);
+  pager_mark_dirty(pager, left_page_num);
+  pager_mark_dirty(pager, right_page_num);
+  pager_mark_dirty(pager, parent_page_num);
+
+  uint32_t left_free = leaf_node_free_space(left);
+  uint32_t right_used = LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(right);
+
+  if (right_used <= left_free) {
+    if (leaf_node_gap(left) < right_used) {
+      leaf_node_compact(left);
+    }
+    uint32_t right_cells = *leaf_node_num_cells(right);
+    for (uint32_t i = 0; i < right_cells; i++) {
+      void *cell = leaf_node_cell(right, i);
+      leaf_node_insert_cell(left, *leaf_node_num_cells(left),
+                            leaf_node_key(right, i), cell,
+                            leaf_cell_size(*leaf_cell_payload_size(cell)));
+    }
+    *leaf_node_next_leaf(left) = *leaf_node_next_leaf(right);
+    pager_free_page(pager, right_page_num);
+    internal_node_remove_merged(tree, parent_page_num, left_index);
+    return;
+  }
+
+  uint8_t left_copy[PAGE_SIZE];
+  uint8_t right_copy[PAGE_SIZE];
+  memcpy(left_copy, left, PAGE_SIZE);
+  memcpy(right_copy, right, PAGE_SIZE);
+  uint32_t left_cells = *leaf_node_num_cells(left_copy);
+  uint32_t num_cells = left_cells + *leaf_node_num_cells(right_copy);
+
+  uint64_t keys[num_cells];
+  void *cells[num_cells];
+  for (uint32_t i = 0; i < num_cells; i++) {
+    void *copy = i < left_cells ? left_copy : right_copy;
+    uint32_t cell_num = i < left_cells ? i : i - left_cells;
+    keys[i] = leaf_node_key(copy, cell_num);
+    cells[i] = leaf_node_cell(copy, cell_num);
+  }
+  leaf_nodes_distribute(left, right, keys, cells, num_cells);
+  internal_node_set_key(parent, left_index,
+                        leaf_node_key(left, *leaf_node_num_cells(left) - 1));
+}
+
+/*
+Remove key from the tree. Returns false if it was not there.
+*/
+bool tree_delete(Table *tree, uint64_t key) {
+  Pager *pager = tree->pager;
+  Cursor *cursor = table_find(tree, key);
+  uint32_t page_num = cursor->page_num;
+  uint32_t cell_num = cursor->cell_num;
+  cursor_close(cursor);
+
+  void *node = get_page(pager, page_num);
+  if (cell_num >= *leaf_node_num_cells(node) ||
+      leaf_node_key(node, cell_num) != key) {
+    return false;
+  }
+
+  pager_mark_dirty(pager, page_num);
+  leaf_node_remove_cell(pager, node, cell_num);
+  // The remembered rightmost leaf may be merged away
+  tree->append_page_num = INVALID_PAGE_NUM;
+  leaf_node_rebalance(tree, page_num);
+  return true;
+}
+
+/*
+Append to the remembered rightmost leaf if the key is larger than every key
+in the tree and the leaf has room. Internal nodes only store the max keys
+of children left of the right child, so nothing above the leaf changes.
+*/
+bool tree_try_append(Table *tree, uint64_t key, Row *row) {
+  if (tree->append_page_num == INVALID_PAGE_NUM) {
+    return false;
+  }
+
+  void *node = get_page(tree->pager, tree->append_page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t needed =
+      leaf_cell_size(row_payload_size(row)) + leaf_node_entry_size(node);
+  if (get_node_type(node) != NODE_LEAF || *leaf_node_next_leaf(node) != 0 ||
+      num_cells == 0 || leaf_node_gap(node) < needed ||
+      key <= leaf_node_key(node, num_cells - 1)) {
+    return false;
+  }
+
+  Cursor cursor = {.table = tree,
+                   .page_num = tree->append_page_num,
+                   .cell_num = num_cells,
+                   .end_of_table = true,
+                   .snapshot = SNAPSHOT_LATEST,
+                   .node = node,
+                   .copy = NULL};
+  leaf_node_insert(&cursor, key, row);
+  return true;
+}
+
+ExecuteResult tree_insert(Table *tree, uint64_t key_to_insert,
+                          Row *row_to_insert) {
+  if (tree_try_append(tree, key_to_insert, row_to_insert)) {
+    return EXECUTE_SUCCESS;
+  }
+
+  Cursor *cursor = table_find(tree, key_to_insert);
+
+  // Check the leaf the cursor landed in, which is not the root once it splits
+  void *node = get_page(tree->pager, cursor->page_num);
+  uint32_t num_cells = (*leaf_node_num_cells(node));
+
+  /*
+  Remember the rightmost leaf unless this insert splits it, in which case the
+  next insert that lands there finds the new one
+  */
+  if (*leaf_node_next_leaf(node) == 0) {
+    uint32_t needed =
+        leaf_cell_size(row_payload_size(row_to_insert)) +
+        leaf_node_entry_size(node);
+    tree->append_page_num = leaf_node_free_space(node) >= needed
+                                ? cursor->page_num
+                                : INVALID_PAGE_NUM;
+  }
+
+  if (cursor->cell_num < num_cells) {
+    uint64_t key_at_index = leaf_node_key(node, cursor->cell_num);
+    if (key_at_index == key_to_insert) {
+      cursor_close(cursor);
+      return EXECUTE_DUPLICATE_KEY;
+    }
+  }
+
+  leaf_node_insert(cursor, key_to_insert, row_to_insert);
+
+  cursor_close(cursor);
+  return EXECUTE_SUCCESS;
+}
+
+/* FNV-1a, used to turn a column value into an index key */
+uint32_t hash_string(const char *string) {
+  uint32_t hash = 2166136261u;
+  for (const uint8_t *c = (const uint8_t *)string; *c != '\0'; c++) {
+    hash = (hash ^ *c) * 16777619u;
+  }
+  return hash;
+}
+
+char *row_column(Row *row, IndexedColumn column) {
+  return column == COLUMN_USERNAME ? row->username : row->email;
+}
+
+/*
+ * Secondary indexes
+ * An index is a B-tree like the table's. Each entry is keyed by the hash of
+ * the column value in the top 32 bits and the row's id in the bottom 32,
+ * and stores a row holding only the id and that value. Rows with the same
+ * value are then just neighbouring keys, ordered by id. Lookups walk the
+ * keys with the value's hash and compare the stored values, to skip rows
+ * whose value only collides with it.
+ */
+uint64_t index_key(const char *value, uint32_t id) {
+  return (uint64_t)hash_string(value) << 32 | id;
+}
 
-  Table *table = malloc(sizeof(Table));
-  table->pager = pager;
-  table->root_page_num = 0;
+void index_insert(Table *index, IndexedColumn column, Row *row) {
+  Row entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.id = row->id;
+  strcpy(row_column(&entry, column), row_column(row, column));
+  tree_insert(index, index_key(row_column(row, column), row->id), &entry);
+}
 
-  if (pager->num_pages == 0) {
-    // New db file. Initialize page 0 as leaf node.
-    void *root_node = get_page(pager, 0);
-    initialize_leaf_node(root_node);
-    set_node_root(root_node, true);
+/*
+Collect the ids of rows whose column equals value into a malloc'd array, in
+id order
+*/
+uint32_t index_lookup(Table *index, IndexedColumn column, const char *value,
+                      uint64_t snapshot, uint32_t **ids) {
+  uint32_t num_ids = 0;
+  uint32_t capacity = 8;
+  *ids = malloc(capacity * sizeof(uint32_t));
+
+  Row entry;
+  uint32_t hash = hash_string(value);
+  Cursor *cursor = table_seek_at(index, index_key(value, 0), snapshot);
+  while (!cursor->end_of_table && cursor_key(cursor) >> 32 == hash) {
+    cursor_read_row(cursor, &entry);
+    if (strcmp(row_column(&entry, column), value) == 0) {
+      if (num_ids == capacity) {
+        capacity *= 2;
+        *ids = realloc(*ids, capacity * sizeof(uint32_t));
+      }
+      (*ids)[num_ids++] = entry.id;
+    }
+    cursor_advance(cursor);
   }
 
-  return table;
+  cursor_close(cursor);
+  return num_ids;
 }
 
-typedef enum {
-  META_COMMAND_SUCCESS,
-  META_COMMAND_SUCCESS_UNRECOGNIZED_COMMAND
-} MetaCommandResult;
+void index_delete(Table *index, IndexedColumn column, Row *row) {
+  tree_delete(index, index_key(row_column(row, column), row->id));
+}
 
-typedef enum {
-  PREPARE_SUCCESS,
-  PREPARE_SYNTAX_ERROR,
-  PREPARE_UNRECOGNIZED_STATEMENT,
-  PREPARE_STRING_TOO_LONG,
-  PREPARE_NEGATIVE_ID
-} PrepareResult;
+/* Index every row already in the table */
+void index_build(Table *table, Table *index, IndexedColumn column) {
+  Row row;
+  Cursor *cursor = table_start(table);
+  while (!cursor->end_of_table) {
+    cursor_read_row(cursor, &row);
+    index_insert(index, column, &row);
+    cursor_advance(cursor);
+  }
+  cursor_close(cursor);
+}
 
-typedef enum { STATEMENT_INSERT, STATEMENT_SELECT } StatementType;
+void vacuum_note_change(Vacuum *vacuum, uint32_t id);
 
-typedef struct {
-  StatementType type;
-  Row row_to_insert;
-} Statement;
+ExecuteResult table_insert(Table *table, Row *row_to_insert) {
+  pager_begin_write(table->pager);
+  ExecuteResult result = tree_insert(table, row_to_insert->id, row_to_insert);
+  if (result == EXECUTE_SUCCESS) {
+    if (table->vacuum != NULL) {
+      vacuum_note_change(table->vacuum, row_to_insert->id);
+    }
+    for (uint32_t i = 0; i < NUM_INDEXED_COLUMNS; i++) {
+      if (table->indexes[i] != NULL) {
+        index_insert(table->indexes[i], i, row_to_insert);
+      }
+    }
+  }
+  pager_end_write(table->pager);
+  return result;
+}
 
-typedef struct {
-  char *buffer;
-  size_t buffer_length;
-  ssize_t input_length;
-} InputBuffer;
+/* Remove the row with this id from the table and its indexes */
+bool table_delete(Table *table, uint32_t id) {
+  pager_begin_write(table->pager);
+  Cursor *cursor = table_find(table, id);
+  bool found = cursor_at_key(cursor, id);
+  Row row;
+  if (found) {
+    cursor_read_row(cursor, &row);
+  }
+  cursor_close(cursor);
 
-InputBuffer *new_input_buffer() {
-  InputBuffer *input_buffer = malloc(sizeof(InputBuffer));
-  input_buffer->buffer = NULL;
-  input_buffer->buffer_length = 0;
-  input_buffer->input_length = 0;
-  
-  return input_buffer;
+  if (found) {
+    for (uint32_t i = 0; i < NUM_INDEXED_COLUMNS; i++) {
+      if (table->indexes[i] != NULL) {
+        index_delete(table->indexes[i], i, &row);
+      }
+    }
+    tree_delete(table, id);
+    if (table->vacuum != NULL) {
+      vacuum_note_change(table->vacuum, id);
+    }
+  }
+  pager_end_write(table->pager);
+  return found;
 }
 
-Cursor *table_start(Table *table) {
-  Cursor *cursor = table_find(table, 0);
+/*
+Give the column a new empty B-tree, record its root in the header and fill
+it from the rows already in the table
+*/
+ExecuteResult execute_create_index(Statement *statement, Table *table) {
+  IndexedColumn column = statement->index_column;
+  if (table->indexes[column] != NULL) {
+    return EXECUTE_INDEX_EXISTS;
+  }
 
-  void *node = get_page(table->pager, cursor->page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
-  cursor->end_of_table = (num_cells == 0);
+  Pager *pager = table->pager;
+  uint32_t root_page_num = get_unused_page_num(pager);
+  void *root = get_page(pager, root_page_num);
+  pager_mark_dirty(pager, root_page_num);
+  initialize_leaf_node(root, INDEX_KEY_SIZE);
+  set_node_root(root, true);
 
-  return cursor;
+  void *header = get_page(pager, HEADER_PAGE_NUM);
+  pager_mark_dirty(pager, HEADER_PAGE_NUM);
+  *header_index_root(header, column) = root_page_num;
+
+  // Other threads find the index through the header, once it is committed
+  Table *index = tree_open(pager, root_page_num);
+  index_build(table, index, column);
+  table->indexes[column] = index;
+  return EXECUTE_SUCCESS;
 }
 
-Cursor *leaf_node_find(Table *table, uint32_t page_num, uint32_t key) {
-  void *node = get_page(table->pager, page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
+/*
+A statement with several rows runs in a transaction of its own, so a
+duplicate key part way through leaves the table as it was. Inside an
+explicit transaction the rows before the duplicate stay.
+*/
+ExecuteResult execute_insert(Statement *statement, Table *table) {
+  Pager *pager = table->pager;
+  bool own_transaction = statement->num_rows > 1 && !pager->wal->in_transaction;
+  if (own_transaction) {
+    pager_begin_transaction(pager);
+  }
 
-  Cursor *cursor = malloc(sizeof(Cursor));
-  cursor->table = table;
-  cursor->page_num = page_num;
+  for (uint32_t i = 0; i < statement->num_rows; i++) {
+    if (table_insert(table, &statement->rows_to_insert[i]) ==
+        EXECUTE_DUPLICATE_KEY) {
+      if (own_transaction) {
+        table_rollback(table);
+      }
+      return EXECUTE_DUPLICATE_KEY;
+    }
+  }
+
+  if (own_transaction) {
+    pager_commit_transaction(pager);
+  }
+  return EXECUTE_SUCCESS;
+}
+
+/*
+ * Bulk loading
+ *
+ * An empty table is built bottom-up from rows in key order: leaves are packed
+ * left to right to the requested fill factor, then each internal level is
+ * built over the one below it. Every page except the root is new, so it is
+ * written straight to the db file in large sequential batches; the tree only
+ * becomes visible when the root is committed through the write-ahead log.
+ * Until then a crash leaves nothing but unreachable pages behind.
+ */
+#define BULK_LOAD_BATCH_PAGES 64
+#define BULK_LOAD_RUN_ROWS 32768
+#define BULK_LOAD_COMMIT_ROWS 10000
+
+typedef struct {
+  uint32_t page_num;
+  uint64_t max_key;
+} ChildRef;
 
+typedef struct {
+  Table *table;
+  uint32_t leaf_space; // Bytes of cells and slots to put in each leaf
+  void *batch; // Finished pages waiting to be written, in page order
+  uint32_t batch_first_page_num;
+  uint32_t batch_num_pages;
+  uint32_t next_page_num;
   /*
-  Either
-  1. the position of the ky
-  2. Position of another key
-  3. The position one past the key
+  Leaf being filled. It only gets a page number once it is full, because
+  overflow pages for its rows are handed out while it fills.
   */
+  void *leaf;
+  uint32_t leaf_bytes;
+  uint32_t last_leaf_page_num; // INVALID_PAGE_NUM until a leaf is finished
+  ChildRef *children; // Finished nodes of the level being built
+  uint32_t num_children;
+  uint32_t children_capacity;
+} BulkLoader;
+
+BulkLoader *bulk_load_begin(Table *table, uint32_t fill_percent) {
+  BulkLoader *loader = malloc(sizeof(BulkLoader));
+  loader->table = table;
+  loader->leaf_space = LEAF_NODE_SPACE_FOR_CELLS * fill_percent / 100;
+  loader->batch = malloc(BULK_LOAD_BATCH_PAGES * PAGE_SIZE);
+  loader->batch_num_pages = 0;
+  // Free pages are left alone so that everything lands in one sequential run
+  loader->next_page_num = table->pager->num_pages;
+  loader->batch_first_page_num = loader->next_page_num;
+  loader->leaf = malloc(PAGE_SIZE);
+  memset(loader->leaf, 0, PAGE_SIZE);
+  initialize_leaf_node(loader->leaf, TABLE_KEY_SIZE);
+  loader->leaf_bytes = 0;
+  loader->last_leaf_page_num = INVALID_PAGE_NUM;
+  loader->children_capacity = 64;
+  loader->children = malloc(loader->children_capacity * sizeof(ChildRef));
+  loader->num_children = 0;
+  return loader;
+}
 
-  uint32_t min_index = 0;
-  uint32_t one_past_max_index = num_cells;
-  while (one_past_max_index != min_index) {
-    uint32_t index = (min_index + one_past_max_index) / 2;
-    uint32_t key_at_index = *leaf_node_key(node, index);
+void bulk_load_flush_batch(BulkLoader *loader) {
+  if (loader->batch_num_pages == 0) {
+    return;
+  }
 
-    if (key == key_at_index) {
-      cursor->cell_num = index;
-      return cursor;
-    }
+  for (uint32_t i = 0; i < loader->batch_num_pages; i++) {
+    page_set_checksum(loader->batch_first_page_num + i,
+                      loader->batch + i * PAGE_SIZE);
+  }
 
-    if (key < key_at_index) {
-      one_past_max_index = index;
-    } else {
-      min_index = index + 1;
-    }
+  Pager *pager = loader->table->pager;
+  off_t offset = (off_t)loader->batch_first_page_num * PAGE_SIZE;
+  ssize_t length = (ssize_t)loader->batch_num_pages * PAGE_SIZE;
+  if (pwrite(pager->file_descriptor, loader->batch, length, offset) != length) {
+    printf("Error writing: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  pthread_mutex_lock(&pager->lock);
+  pager->stats.pages_written += loader->batch_num_pages;
+  pager->stats.bytes_written += length;
+  if (offset + length > pager->file_length) {
+    pager->file_length = offset + length;
   }
+  pthread_mutex_unlock(&pager->lock);
 
-  cursor->cell_num = min_index;
-  return cursor;
+  loader->batch_first_page_num += loader->batch_num_pages;
+  loader->batch_num_pages = 0;
+}
+
+/*
+Hand out the next page number along with a zeroed buffer for it. Pages are
+handed out in order, so the batch always covers one contiguous run.
+*/
+void *bulk_load_new_page(BulkLoader *loader, uint32_t *page_num) {
+  if (loader->batch_num_pages == BULK_LOAD_BATCH_PAGES) {
+    bulk_load_flush_batch(loader);
+  }
+  void *page = loader->batch + loader->batch_num_pages * PAGE_SIZE;
+  memset(page, 0, PAGE_SIZE);
+  loader->batch_num_pages++;
+  *page_num = loader->next_page_num++;
+  return page;
 }
 
-uint32_t *internal_node_key(void *node, uint32_t key_num) {
-  return (void *)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+void bulk_load_add_child(BulkLoader *loader, uint32_t page_num,
+                         uint64_t max_key) {
+  if (loader->num_children == loader->children_capacity) {
+    loader->children_capacity *= 2;
+    loader->children = realloc(loader->children,
+                               loader->children_capacity * sizeof(ChildRef));
+  }
+  loader->children[loader->num_children].page_num = page_num;
+  loader->children[loader->num_children].max_key = max_key;
+  loader->num_children++;
 }
 
-uint32_t get_node_max_key(Pager *pager, void *node) {
-  if (get_node_type(node) == NODE_LEAF) {
-    return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+/*
+Set a 4-byte field of a page that was already handed out, either in the
+batch or, if the batch it was in has been written, in the file. A page in
+the file is read back so its checksum can be redone.
+*/
+void bulk_load_patch(BulkLoader *loader, uint32_t page_num, uint32_t offset,
+                     uint32_t value) {
+  if (page_num >= loader->batch_first_page_num &&
+      page_num < loader->batch_first_page_num + loader->batch_num_pages) {
+    void *page =
+        loader->batch + (page_num - loader->batch_first_page_num) * PAGE_SIZE;
+    *(uint32_t *)(page + offset) = value;
+    return;
   }
 
-  void *right_child = get_page(pager, *internal_node_right_child(node));
-  return get_node_max_key(pager, right_child);
+  Pager *pager = loader->table->pager;
+  uint8_t page[PAGE_SIZE];
+  off_t file_offset = (off_t)page_num * PAGE_SIZE;
+  if (pread(pager->file_descriptor, page, PAGE_SIZE, file_offset) !=
+      PAGE_SIZE) {
+    printf("Error reading file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  *(uint32_t *)(page + offset) = value;
+  page_set_checksum(page_num, page);
+  if (pwrite(pager->file_descriptor, page, PAGE_SIZE, file_offset) !=
+      PAGE_SIZE) {
+    printf("Error writing: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
 }
 
-uint32_t internal_node_find_child(void *node, uint32_t key) {
-  /*
-  Return the index of the child which should contain
-  the given key
-  */
+void bulk_load_set_parent(BulkLoader *loader, uint32_t page_num,
+                          uint32_t parent_page_num) {
+  bulk_load_patch(loader, page_num, PARENT_POINTER_OFFSET, parent_page_num);
+}
 
-  uint32_t num_keys = *internal_node_num_keys(node);
+/* Like overflow_write, but with pages handed out by the loader */
+uint32_t bulk_load_write_overflow(BulkLoader *loader, uint8_t *data,
+                                  uint32_t size) {
+  uint32_t first_page_num = loader->next_page_num;
+  while (size > 0) {
+    uint32_t page_num;
+    void *node = bulk_load_new_page(loader, &page_num);
+    set_node_type(node, NODE_OVERFLOW);
+
+    uint32_t chunk = size < OVERFLOW_NODE_SPACE ? size : OVERFLOW_NODE_SPACE;
+    memcpy(node + OVERFLOW_NODE_HEADER_SIZE, data, chunk);
+    data += chunk;
+    size -= chunk;
+    // The next page handed out continues the chain
+    *overflow_node_next(node) = size > 0 ? loader->next_page_num : 0;
+  }
+  return first_page_num;
+}
 
-  /* Binary search */
-  uint32_t min_index = 0;
-  uint32_t max_index = num_keys; /* there is one more child than key */
+/*
+Give the filled leaf a page and link the previous leaf to it
+*/
+void bulk_load_finish_leaf(BulkLoader *loader) {
+  uint32_t page_num;
+  void *page = bulk_load_new_page(loader, &page_num);
+  memcpy(page, loader->leaf, PAGE_SIZE);
 
-  while (min_index != max_index) {
-    uint32_t index = (min_index + max_index) / 2;
-    uint32_t key_to_right = *internal_node_key(node, index);
-    if (key_to_right >= key) {
-      max_index = index;
-    } else {
-      min_index = index + 1;
+  if (loader->last_leaf_page_num != INVALID_PAGE_NUM) {
+    bulk_load_patch(loader, loader->last_leaf_page_num,
+                    LEAF_NODE_NEXT_LEAF_OFFSET, page_num);
+  }
+  loader->last_leaf_page_num = page_num;
+
+  uint32_t num_cells = *leaf_node_num_cells(loader->leaf);
+  bulk_load_add_child(loader, page_num,
+                      leaf_node_key(loader->leaf, num_cells - 1));
+
+  memset(loader->leaf, 0, PAGE_SIZE);
+  initialize_leaf_node(loader->leaf, TABLE_KEY_SIZE);
+  loader->leaf_bytes = 0;
+}
+
+/*
+Rows must arrive in strictly increasing key order
+*/
+void bulk_load_add(BulkLoader *loader, Row *row) {
+  uint8_t payload[ROW_MAX_PAYLOAD_SIZE];
+  uint32_t payload_size = row_payload_size(row);
+  pack_row(row, payload);
+
+  uint32_t needed =
+      leaf_cell_size(payload_size) + leaf_node_entry_size(loader->leaf);
+  if (loader->leaf_bytes > 0 &&
+      (loader->leaf_bytes + needed > loader->leaf_space ||
+       needed > leaf_node_gap(loader->leaf))) {
+    bulk_load_finish_leaf(loader);
+  }
+
+  uint8_t cell[LEAF_NODE_MAX_CELL_SIZE];
+  uint32_t cell_size = leaf_cell_init(cell, payload, payload_size);
+  if (payload_size > LEAF_NODE_MAX_LOCAL_PAYLOAD) {
+    *leaf_cell_overflow_page(cell) =
+        bulk_load_write_overflow(loader, payload + LEAF_NODE_MAX_LOCAL_PAYLOAD,
+                                 payload_size - LEAF_NODE_MAX_LOCAL_PAYLOAD);
+  }
+
+  uint32_t num_cells = *leaf_node_num_cells(loader->leaf);
+  leaf_node_insert_cell(loader->leaf, num_cells, row->id, cell, cell_size);
+  loader->leaf_bytes += needed;
+}
+
+/*
+Fill an internal node with children[0..num_children) and point them at it
+*/
+void bulk_load_fill_internal_node(BulkLoader *loader, void *node,
+                                  uint32_t page_num, ChildRef *children,
+                                  uint32_t num_children) {
+  initialize_internal_node(node, TABLE_KEY_SIZE);
+  *internal_node_num_keys(node) = num_children - 1;
+  for (uint32_t i = 0; i + 1 < num_children; i++) {
+    *internal_node_cell(node, i) = children[i].page_num;
+    internal_node_set_key(node, i, children[i].max_key);
+  }
+  *internal_node_right_child(node) = children[num_children - 1].page_num;
+
+  for (uint32_t i = 0; i < num_children; i++) {
+    bulk_load_set_parent(loader, children[i].page_num, page_num);
+  }
+}
+
+void bulk_load_free(BulkLoader *loader) {
+  free(loader->batch);
+  free(loader->leaf);
+  free(loader->children);
+  free(loader);
+}
+
+void bulk_load_finish(BulkLoader *loader) {
+  Table *table = loader->table;
+  Pager *pager = table->pager;
+
+  bool leaf_has_rows = *leaf_node_num_cells(loader->leaf) > 0;
+  if (!leaf_has_rows && loader->num_children == 0) {
+    // No rows, the table stays empty
+    bulk_load_free(loader);
+    return;
+  }
+
+  // Readers see the empty root until the commit that hangs the tree off it
+  void *root = get_page(pager, table->root_page_num);
+  pager_mark_dirty(pager, table->root_page_num);
+
+  if (loader->num_children == 0) {
+    // Everything fit in one leaf, which becomes the root itself
+    memcpy(root, loader->leaf, PAGE_SIZE);
+    set_node_root(root, true);
+    bulk_load_flush_batch(loader);  // Overflow pages, if any
+  } else {
+    if (leaf_has_rows) {
+      bulk_load_finish_leaf(loader);
+    }
+    bulk_load_flush_batch(loader);
+
+    /*
+    Build one level at a time until a single node can hold what is left. Nodes
+    take INTERNAL_NODE_MAX_CELLS + 1 children each; if that would leave the
+    last node with a single child, the one before it gives up a child.
+    */
+    const uint32_t max_children = INTERNAL_NODE_MAX_CELLS + 1;
+    while (loader->num_children > max_children) {
+      ChildRef *level = loader->children;
+      uint32_t level_size = loader->num_children;
+      loader->children_capacity = level_size / 2 + 1;
+      loader->children = malloc(loader->children_capacity * sizeof(ChildRef));
+      loader->num_children = 0;
+
+      uint32_t start = 0;
+      while (start < level_size) {
+        uint32_t remaining = level_size - start;
+        uint32_t count = remaining < max_children ? remaining : max_children;
+        if (remaining == max_children + 1) {
+          count = max_children - 1;
+        }
+
+        uint32_t page_num;
+        void *node = bulk_load_new_page(loader, &page_num);
+        bulk_load_fill_internal_node(loader, node, page_num, level + start,
+                                     count);
+        bulk_load_add_child(loader, page_num, level[start + count - 1].max_key);
+        start += count;
+      }
+
+      free(level);
+      bulk_load_flush_batch(loader);
     }
+
+    bulk_load_fill_internal_node(loader, root, table->root_page_num,
+                                 loader->children, loader->num_children);
+    set_node_root(root, true);
   }
+  table->append_page_num = INVALID_PAGE_NUM;
 
-  return min_index;
+  // The new pages must be on disk before the root that points at them
+  if (fsync(pager->file_descriptor) == -1) {
+    printf("Error syncing db file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  pthread_mutex_lock(&pager->lock);
+  pager->num_pages = loader->next_page_num;
+  pthread_mutex_unlock(&pager->lock);
+
+  bulk_load_free(loader);
 }
 
-void internal_node_insert(Table *table, uint32_t parent_page_num,
-                          uint32_t child_page_num) {
+/*
+Rows come either from a CSV file (name ends in .csv, one id,username,email
+per line) or from a binary file of serialized rows, ROW_SIZE bytes each.
+*/
+typedef struct {
+  FILE *file;
+  bool is_csv;
+  char *line;
+  size_t line_capacity;
+  uint32_t row_num;
+  bool bad_row;
+} RowStream;
+
+RowStream *row_stream_open(const char *filename) {
+  FILE *file = fopen(filename, "r");
+  if (file == NULL) {
+    return NULL;
+  }
 
-  /* Add a new child/key pair to parent that corresponds to child */
+  RowStream *stream = malloc(sizeof(RowStream));
+  size_t length = strlen(filename);
+  stream->file = file;
+  stream->is_csv = length >= 4 && strcmp(filename + length - 4, ".csv") == 0;
+  stream->line = NULL;
+  stream->line_capacity = 0;
+  stream->row_num = 0;
+  stream->bad_row = false;
+  return stream;
+}
 
-  void *parent = get_page(table->pager, parent_page_num);
-  void *child = get_page(table->pager, child_page_num);
-  uint32_t child_max_key = get_node_max_key(table->pager, child);
-  uint32_t index = internal_node_find_child(parent, child_max_key);
+void row_stream_close(RowStream *stream) {
+  fclose(stream->file);
+  free(stream->line);
+  free(stream);
+}
 
-  uint32_t original_num_keys = *internal_node_num_keys(parent);
+bool parse_csv_row(char *line, Row *row) {
+  char *id_string = strsep(&line, ",");
+  char *username = strsep(&line, ",");
+  char *email = strsep(&line, ",\r\n");
+  if (id_string == NULL || username == NULL || email == NULL) {
+    return false;
+  }
 
-  if (original_num_keys >= INTERNAL_NODE_MAX_CELLS) {
-    internal_node_split_and_insert(table, parent_page_num, child_page_num);
+  char *end;
+  long id = strtol(id_string, &end, 10);
+  if (end == id_string || id < 0 || id > UINT32_MAX) {
+    return false;
+  }
+  if (strlen(username) > COLUMN_USERNAME_SIZE ||
+      strlen(email) > COLUMN_EMAIL_SIZE) {
+    return false;
+  }
+
+  row->id = id;
+  strcpy(row->username, username);
+  strcpy(row->email, email);
+  return true;
+}
+
+/*
+Read the next row. Returns false at the end of the stream or on a row that
+does not parse, in which case bad_row is set.
+*/
+bool row_stream_next(RowStream *stream, Row *row) {
+  if (!stream->is_csv) {
+    uint8_t buffer[ROW_SIZE];
+    if (fread(buffer, ROW_SIZE, 1, stream->file) != 1) {
+      return false;
+    }
+    stream->row_num++;
+    deserialize_row(buffer, row);
+    row->username[COLUMN_USERNAME_SIZE] = 0;
+    row->email[COLUMN_EMAIL_SIZE] = 0;
+    return true;
+  }
+
+  ssize_t length;
+  while ((length = getline(&stream->line, &stream->line_capacity,
+                           stream->file)) > 0) {
+    stream->row_num++;
+    if (stream->line[0] == '\n' || stream->line[0] == '\r') {
+      continue;
+    }
+    if (!parse_csv_row(stream->line, row)) {
+      stream->bad_row = true;
+      return false;
+    }
+    return true;
+  }
+  return false;
+}
+
+/*
+Rows waiting to be sorted remember their position in the input, so that of
+several rows with the same key the first one is kept
+*/
+typedef struct {
+  Row row;
+  uint32_t input_order;
+} SortRow;
+
+int compare_sort_rows(const void *a, const void *b) {
+  const SortRow *row_a = a;
+  const SortRow *row_b = b;
+  if (row_a->row.id != row_b->row.id) {
+    return row_a->row.id > row_b->row.id ? 1 : -1;
+  }
+  return row_a->input_order > row_b->input_order ? 1 : -1;
+}
+
+/*
+Where imported rows go: into a bulk loader when the table started out
+empty, otherwise through the normal insert path
+*/
+typedef struct {
+  Table *table;
+  BulkLoader *loader;
+  bool has_last_key;
+  uint32_t last_key;
+  uint32_t num_rows;
+  uint32_t num_duplicates;
+} ImportTarget;
+
+void import_add_row(ImportTarget *target, Row *row) {
+  if (target->has_last_key && row->id == target->last_key) {
+    target->num_duplicates++;
     return;
   }
+  target->has_last_key = true;
+  target->last_key = row->id;
 
-  uint32_t right_child_page_num = *internal_node_right_child(parent);
-  /*
-  An internal node with a right child of INVALID_PAGE_NUM is empty
-  */
-  if (right_child_page_num == INVALID_PAGE_NUM) {
-    *internal_node_right_child(parent) = child_page_num;
+  if (target->loader != NULL) {
+    bulk_load_add(target->loader, row);
+    target->num_rows++;
     return;
   }
 
-  *internal_node_num_keys(parent) = original_num_keys + 1;
+  if (table_insert(target->table, row) == EXECUTE_DUPLICATE_KEY) {
+    target->num_duplicates++;
+    return;
+  }
+  target->num_rows++;
+
+  // Keep the set of uncommitted pages, which cannot be evicted, bounded
+  Pager *pager = target->table->pager;
+  if (target->num_rows % BULK_LOAD_COMMIT_ROWS == 0 &&
+      !pager->wal->in_transaction) {
+    pager_commit_transaction(pager);
+    pager_trim(pager);
+  }
+}
 
-  void *right_child = get_page(table->pager, right_child_page_num);
+typedef struct {
+  FILE *file;
+  Row row;
+  uint32_t run_num;
+} SortRun;
 
-  if (child_max_key > get_node_max_key(table->pager, right_child)) {
-    /* Replace right child */
+bool sort_run_next(SortRun *run) {
+  uint8_t buffer[ROW_SIZE];
+  if (fread(buffer, ROW_SIZE, 1, run->file) != 1) {
+    return false;
+  }
+  deserialize_row(buffer, &run->row);
+  return true;
+}
 
-    *internal_node_child(parent, original_num_keys) = right_child_page_num;
-    *internal_node_key(parent, original_num_keys) =
-        get_node_max_key(table->pager, right_child);
-    *internal_node_right_child(parent) = child_page_num;
-  } else {
-    /* Make room for the new cell */
-    for (uint32_t i = original_num_keys; i > index; i--) {
-      void *destination = internal_node_cell(parent, i);
-      void *source = internal_node_cell(parent, i - 1);
-      memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
+// Earlier runs hold earlier input, so they win ties
+bool sort_run_before(SortRun *a, SortRun *b) {
+  if (a->row.id != b->row.id) {
+    return a->row.id < b->row.id;
+  }
+  return a->run_num < b->run_num;
+}
+
+void sort_heap_sift_down(SortRun **heap, uint32_t heap_size, uint32_t i) {
+  while (true) {
+    uint32_t smallest = i;
+    uint32_t left = 2 * i + 1;
+    uint32_t right = 2 * i + 2;
+    if (left < heap_size && sort_run_before(heap[left], heap[smallest])) {
+      smallest = left;
+    }
+    if (right < heap_size && sort_run_before(heap[right], heap[smallest])) {
+      smallest = right;
+    }
+    if (smallest == i) {
+      return;
+    }
+    SortRun *swap = heap[i];
+    heap[i] = heap[smallest];
+    heap[smallest] = swap;
+    i = smallest;
+  }
+}
+
+/*
+External merge sort. Rows are read BULK_LOAD_RUN_ROWS at a time, sorted in
+memory and spilled to temporary files, then the runs are merged through a
+min-heap. Input that fits in one run never touches a temporary file.
+*/
+ImportResult import_sorted(RowStream *stream, ImportTarget *target) {
+  SortRow *rows = malloc(BULK_LOAD_RUN_ROWS * sizeof(SortRow));
+  SortRun *runs = NULL;
+  uint32_t num_runs = 0;
+  bool done = false;
+
+  while (!done) {
+    uint32_t num_rows = 0;
+    while (num_rows < BULK_LOAD_RUN_ROWS &&
+           row_stream_next(stream, &rows[num_rows].row)) {
+      rows[num_rows].input_order = num_rows;
+      num_rows++;
+    }
+    done = num_rows < BULK_LOAD_RUN_ROWS;
+    qsort(rows, num_rows, sizeof(SortRow), compare_sort_rows);
+
+    if (done && num_runs == 0) {
+      for (uint32_t i = 0; i < num_rows; i++) {
+        import_add_row(target, &rows[i].row);
+      }
+      free(rows);
+      return IMPORT_SUCCESS;
+    }
+
+    FILE *file = tmpfile();
+    if (file == NULL) {
+      free(rows);
+      return IMPORT_FILE_ERROR;
+    }
+    uint8_t buffer[ROW_SIZE];
+    for (uint32_t i = 0; i < num_rows; i++) {
+      serialize_row(&rows[i].row, buffer);
+      fwrite(buffer, ROW_SIZE, 1, file);
     }
+    rewind(file);
 
-    *internal_node_child(parent, index) = child_page_num;
-    *internal_node_key(parent, index) = child_max_key;
+    runs = realloc(runs, (num_runs + 1) * sizeof(SortRun));
+    runs[num_runs].file = file;
+    runs[num_runs].run_num = num_runs;
+    num_runs++;
   }
-}
+  free(rows);
 
-Cursor *internal_node_find(Table *table, uint32_t page_num, uint32_t key) {
-  void *node = get_page(table->pager, page_num);
+  SortRun **heap = malloc(num_runs * sizeof(SortRun *));
+  uint32_t heap_size = 0;
+  for (uint32_t i = 0; i < num_runs; i++) {
+    if (sort_run_next(&runs[i])) {
+      heap[heap_size++] = &runs[i];
+    }
+  }
+  for (int32_t i = heap_size / 2 - 1; i >= 0; i--) {
+    sort_heap_sift_down(heap, heap_size, i);
+  }
 
-  uint32_t child_index = internal_node_find_child(node, key);
-  uint32_t child_num = *internal_node_child(node, child_index);
+  while (heap_size > 0) {
+    import_add_row(target, &heap[0]->row);
+    if (!sort_run_next(heap[0])) {
+      heap[0] = heap[--heap_size];
+    }
+    sort_heap_sift_down(heap, heap_size, 0);
+  }
 
-  void *child = get_page(table->pager, child_num);
-  switch (get_node_type(child)) {
-  case NODE_LEAF:
-    return leaf_node_find(table, child_num, key);
-  case NODE_INTERNAL:
-    return internal_node_find(table, child_num, key);
+  for (uint32_t i = 0; i < num_runs; i++) {
+    fclose(runs[i].file);
   }
+  free(heap);
+  free(runs);
+  return IMPORT_SUCCESS;
 }
 
 /*
-Until we start recycling free pages, new pages will always
-go onto the end of the db file
+Load every row of a file into the table. A first pass validates the rows and
+checks whether they are already in key order; if they are not, they are
+sorted externally before loading. Duplicate keys are skipped and counted.
+An empty table is built bottom-up with leaves fill_percent full; otherwise,
+or in a db with no file for the loader to write to, or while a vacuum has
+to see each row go in, rows go through the normal insert path in key order.
 */
+ImportResult table_import(Table *table, const char *filename,
+                          uint32_t fill_percent, uint32_t *num_rows,
+                          uint32_t *num_duplicates) {
+  Pager *pager = table->pager;
+  if (pager->wal == NULL) {
+    return IMPORT_READ_ONLY;
+  }
 
-uint32_t get_unused_page_num(Pager *pager) { return pager->num_pages; }
-
-/*
-Return the position of the given key
-if the key is not present, return the position
-where it should be inserted
-*/
+  RowStream *stream = row_stream_open(filename);
+  if (stream == NULL) {
+    return IMPORT_FILE_ERROR;
+  }
 
-Cursor *table_find(Table *table, uint32_t key) {
-  uint32_t root_page_num = table->root_page_num;
-  void *root_node = get_page(table->pager, root_page_num);
+  Row row;
+  bool sorted = true;
+  bool has_previous = false;
+  uint32_t previous_id = 0;
+  while (row_stream_next(stream, &row)) {
+    if (has_previous && row.id <= previous_id) {
+      sorted = false;
+    }
+    has_previous = true;
+    previous_id = row.id;
+  }
+  if (stream->bad_row) {
+    *num_rows = stream->row_num;
+    row_stream_close(stream);
+    return IMPORT_BAD_ROW;
+  }
+  rewind(stream->file);
+  stream->row_num = 0;
+
+  pager_begin_write(pager);
+  ImportTarget target;
+  target.table = table;
+  target.loader = NULL;
+  target.has_last_key = false;
+  target.num_rows = 0;
+  target.num_duplicates = 0;
+
+  void *root = get_page(pager, table->root_page_num);
+  if (!pager->in_memory && table->vacuum == NULL &&
+      get_node_type(root) == NODE_LEAF && *leaf_node_num_cells(root) == 0) {
+    target.loader = bulk_load_begin(table, fill_percent);
+  }
 
-  if (get_node_type(root_node) == NODE_LEAF) {
-    return leaf_node_find(table, root_page_num, key);
+  ImportResult result = IMPORT_SUCCESS;
+  if (sorted) {
+    while (row_stream_next(stream, &row)) {
+      import_add_row(&target, &row);
+    }
   } else {
-    return internal_node_find(table, root_page_num, key);
+    result = import_sorted(stream, &target);
   }
-}
-
-void *cursor_value(Cursor *cursor) {
-  uint32_t page_num = cursor->page_num;
-  void *page = get_page(cursor->table->pager, page_num);
-
-  return leaf_node_value(page, cursor->cell_num);
-}
-
-void cursor_advance(Cursor *cursor) {
-  uint32_t page_num = cursor->page_num;
-  void *node = get_page(cursor->table->pager, page_num);
-  cursor->cell_num += 1;
-
-  if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
-    /* Advance to next leaf node */
-    uint32_t next_leaf = *leaf_node_next_leaf(node);
-    if (next_leaf == 0) {
-      /* This was rightmost leaf */
-      cursor->end_of_table = true;
-    } else {
-      cursor->page_num = next_leaf;
-      cursor->cell_num = 0;
+  row_stream_close(stream);
+
+  if (target.loader != NULL) {
+    bulk_load_finish(target.loader);
+    // Indexes on an empty table are empty too, so fill them from scratch
+    for (uint32_t i = 0; i < NUM_INDEXED_COLUMNS; i++) {
+      if (table->indexes[i] != NULL) {
+        index_build(table, table->indexes[i], i);
+      }
     }
   }
-}
+  if (!pager->wal->in_transaction) {
+    pager_commit_transaction(pager);
+  }
+  pager_trim(pager);
+  pager_end_write(pager);
 
-void serialize_row(Row *source, void *destination) {
-  memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
-  strncpy(destination + USERNAME_OFFSET, source->username, USERNAME_SIZE);
-  strncpy(destination + EMAIL_OFFSET, source->email, EMAIL_SIZE);
+  *num_rows = target.num_rows;
+  *num_duplicates = target.num_duplicates;
+  return result;
 }
 
-void deserialize_row(void *source, Row *destination) {
-  memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
-  memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
-  memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
+/*
+Root of the column's index as the snapshot sees it, or 0 if there is none.
+The writer's own reads use the table's. Anyone else reads the header as of
+their snapshot, so an index created after it is left alone.
+*/
+uint32_t table_index_root(Table *table, IndexedColumn column,
+                          uint64_t snapshot) {
+  if (snapshot == SNAPSHOT_LATEST) {
+    Table *index = table->indexes[column];
+    return index == NULL ? 0 : index->root_page_num;
+  }
+  uint8_t header[PAGE_SIZE];
+  pager_read_page(table->pager, HEADER_PAGE_NUM, snapshot, header);
+  return *header_index_root(header, column);
 }
 
-void close_input_buffer(InputBuffer *input_buffer) {
-  free(input_buffer->buffer);
-  free(input_buffer);
-}
+/*
+Look the matching ids up in the column's index, which returns them in id
+order, then fetch each row from the table
+*/
+void index_visit_matches(Statement *statement, Table *table,
+                         uint32_t index_root, uint64_t snapshot,
+                         RowVisitor visit, void *context) {
+  Table index = {.root_page_num = index_root, .pager = table->pager};
+  uint32_t *ids;
+  uint32_t num_ids = index_lookup(&index, statement->filter_column,
+                                  statement->filter_value, snapshot, &ids);
 
-void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level) {
-  void *node = get_page(pager, page_num);
-  uint32_t num_keys, child;
-  switch (get_node_type(node)) {
-  case (NODE_LEAF):
-    num_keys = *leaf_node_num_cells(node);
-    indent(indentation_level);
-    printf("- leaf (size %d)\n", num_keys);
-    for (uint32_t i = 0; i < num_keys; i++) {
-      indent(indentation_level + 1);
-      printf("- %d\n", *leaf_node_key(node, i));
+  Row row;
+  uint32_t num_rows = 0;
+  for (uint32_t i = 0; i < num_ids && num_rows < statement->limit; i++) {
+    if (ids[i] < statement->min_id || ids[i] > statement->max_id) {
+      continue;
     }
-    break;
-  case (NODE_INTERNAL):
-    num_keys = *internal_node_num_keys(node);
-    indent(indentation_level);
-    printf("- internal (size %d)\n", num_keys);
-    if (num_keys > 0) {
-      for (uint32_t i = 0; i < num_keys; i++) {
-        child = *internal_node_child(node, i);
-        print_tree(pager, child, indentation_level + 1);
-        indent(indentation_level + 1);
-        printf("- key %d\n", *internal_node_key(node, i));
-      }
-      child = *internal_node_right_child(node);
-      print_tree(pager, child, indentation_level + 1);
+
+    // The row may have been deleted since the index was read
+    Cursor *cursor = table_find_at(table, ids[i], snapshot);
+    bool found = cursor_at_key(cursor, ids[i]);
+    if (found) {
+      cursor_read_row(cursor, &row);
+    }
+    cursor_close(cursor);
+    if (found) {
+      visit(&row, context);
+      num_rows++;
     }
-    break;
   }
+
+  free(ids);
 }
 
-void pager_flush(Pager *pager, uint32_t page_num) {
-  if (pager->pages[page_num] == NULL) {
-    printf("Tried to flush null page\n");
-    exit(EXIT_FAILURE);
+/*
+Seek to the first id in range and walk the leaf chain from there, stopping
+at the first id past the range or once limit rows are visited. A point
+lookup reads one page per level of the tree. Rows are read as the snapshot
+sees them.
+*/
+void table_visit_matches(Statement *statement, Table *table, uint64_t snapshot,
+                         RowVisitor visit, void *context) {
+  if (statement->has_column_filter) {
+    uint32_t index_root =
+        table_index_root(table, statement->filter_column, snapshot);
+    if (index_root != 0) {
+      index_visit_matches(statement, table, index_root, snapshot, visit,
+                          context);
+      return;
+    }
   }
 
-  off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-
-  if (offset == -1) {
-    printf("Error seeking: %d\n", errno);
-    exit(EXIT_FAILURE);
+  Row row;
+  bool full_scan = statement->min_id == 0 && statement->max_id == UINT32_MAX;
+  if (full_scan) {
+    pager_advise(table->pager, MADV_SEQUENTIAL);
   }
 
-  ssize_t bytes_written =
-      write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
+  Cursor *cursor = table_seek_at(table, statement->min_id, snapshot);
+  uint32_t num_rows = 0;
+  while (!(cursor->end_of_table) && num_rows < statement->limit &&
+         cursor_key(cursor) <= statement->max_id) {
+    cursor_read_row(cursor, &row);
+    // Without an index, a username/email condition is checked row by row
+    if (!statement->has_column_filter ||
+        strcmp(row_column(&row, statement->filter_column),
+               statement->filter_value) == 0) {
+      visit(&row, context);
+      num_rows++;
+    }
+    cursor_advance(cursor);
+  }
 
-  if (bytes_written == -1) {
-    printf("Error writing: %d\n", errno);
-    exit(EXIT_FAILURE);
+  cursor_close(cursor);
+  if (full_scan) {
+    pager_advise(table->pager, MADV_NORMAL);
   }
 }
 
-void db_close(Table *table) {
+/*
+A select sees the table as of the last commit, however long it runs. Inside
+a transaction it also sees the transaction's own changes.
+*/
+ExecuteResult execute_select(Statement *statement, Table *table,
+                             RowVisitor visit, void *context) {
   Pager *pager = table->pager;
+  if (pager_is_writer(pager)) {
+    table_visit_matches(statement, table, SNAPSHOT_LATEST, visit, context);
+    return EXECUTE_SUCCESS;
+  }
 
-  for (uint32_t i = 0; i < pager->num_pages; i++) {
+  uint64_t snapshot = pager_snapshot_begin(pager);
+  table_visit_matches(statement, table, snapshot, visit, context);
+  pager_snapshot_end(pager, snapshot);
+  return EXECUTE_SUCCESS;
+}
 
-    if (pager->pages[i] == NULL) {
-      continue;
-    }
+/*
+ * Parallel Scans
+ *
+ * A full scan can be split by key range and each range given to its own
+ * thread, with its own cursor and its own context for the visitor. The
+ * ranges are those of the root's children, grouped into as many runs of
+ * neighbouring children as there are threads, so each thread walks its own
+ * stretch of leaves and none of them share a cursor or a lock. The caller's
+ * shared hold on structure_lock covers them all until they are joined. A
+ * root that is a leaf, or has fewer children than threads, gives fewer
+ * ranges.
+ */
+typedef struct {
+  Table *table;
+  uint64_t snapshot;
+  uint32_t min_id;
+  uint32_t max_id;
+  RowVisitor visit;
+  void *context;
+  pthread_t thread;
+  bool has_thread;
+} ScanPartition;
+
+/*
+Split the ids into at most max_partitions ranges along the root's children
+as the snapshot sees them. Returns how many; partition i covers ids from
+min_ids[i] to max_ids[i].
+*/
+uint32_t table_partition(Table *table, uint64_t snapshot,
+                         uint32_t max_partitions, uint32_t *min_ids,
+                         uint32_t *max_ids) {
+  void *root = malloc(PAGE_SIZE);
+  pager_read_page(table->pager, table->root_page_num, snapshot, root);
 
-    pager_flush(pager, i);
-    free(pager->pages[i]);
-    pager->pages[i] = NULL;
+  uint32_t num_children = 1;
+  if (get_node_type(root) == NODE_INTERNAL) {
+    num_children = *internal_node_num_keys(root) + 1;
+  }
+  uint32_t num_partitions =
+      num_children < max_partitions ? num_children : max_partitions;
+
+  // Each child holds the ids up to its key, and the right child the rest
+  for (uint32_t i = 0; i < num_partitions; i++) {
+    uint32_t first = (uint64_t)i * num_children / num_partitions;
+    uint32_t last = (uint64_t)(i + 1) * num_children / num_partitions - 1;
+    min_ids[i] = first == 0 ? 0 : internal_node_key(root, first - 1) + 1;
+    max_ids[i] =
+        last == num_children - 1 ? UINT32_MAX : internal_node_key(root, last);
   }
+  free(root);
+  return num_partitions;
+}
 
-  int result = close(pager->file_descriptor);
+void *scan_partition_run(void *argument) {
+  ScanPartition *partition = argument;
+  Table *table = partition->table;
+  Row row;
 
-  if (result == -1) {
-    printf("Error closing db file.\n");
-    exit(EXIT_FAILURE);
+  Cursor *cursor =
+      table_seek_at(table, partition->min_id, partition->snapshot);
+  while (!cursor->end_of_table && cursor_key(cursor) <= partition->max_id) {
+    cursor_read_row(cursor, &row);
+    partition->visit(&row, partition->context);
+    cursor_advance(cursor);
   }
+  cursor_close(cursor);
+  return NULL;
+}
 
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    void *page = pager->pages[i];
-
-    if (page) {
-      free(page);
-      pager->pages[i] = NULL;
+/*
+Visit every row the snapshot sees with up to num_threads threads. Thread i
+calls visit with contexts[i], with its rows in id order; the threads run at
+the same time, so a visitor should only touch its own context, and the
+caller combines them afterwards. The first range is scanned on the calling
+thread, and so is any range whose thread cannot be started.
+*/
+void table_scan_parallel(Table *table, uint64_t snapshot, uint32_t num_threads,
+                         RowVisitor visit, void **contexts) {
+  if (num_threads == 0) {
+    num_threads = 1;
+  } else if (num_threads > DB_SCAN_MAX_THREADS) {
+    num_threads = DB_SCAN_MAX_THREADS;
+  }
+  uint32_t min_ids[DB_SCAN_MAX_THREADS];
+  uint32_t max_ids[DB_SCAN_MAX_THREADS];
+  uint32_t num_partitions =
+      table_partition(table, snapshot, num_threads, min_ids, max_ids);
+
+  ScanPartition *partitions = malloc(num_partitions * sizeof(ScanPartition));
+  for (uint32_t i = 0; i < num_partitions; i++) {
+    partitions[i] = (ScanPartition){.table = table,
+                                    .snapshot = snapshot,
+                                    .min_id = min_ids[i],
+                                    .max_id = max_ids[i],
+                                    .visit = visit,
+                                    .context = contexts[i]};
+  }
+  for (uint32_t i = 1; i < num_partitions; i++) {
+    partitions[i].has_thread =
+        pthread_create(&partitions[i].thread, NULL, scan_partition_run,
+                       &partitions[i]) == 0;
+  }
+  scan_partition_run(&partitions[0]);
+  for (uint32_t i = 1; i < num_partitions; i++) {
+    if (partitions[i].has_thread) {
+      pthread_join(partitions[i].thread, NULL);
+    } else {
+      scan_partition_run(&partitions[i]);
     }
   }
-
-  free(pager);
-  free(table);
+  free(partitions);
+  pager_trim(table->pager);
 }
 
-void print_constants() {
-  printf("ROW_SIZE: %d\n", ROW_SIZE);
-  printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
-  printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-  printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-  printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+void db_scan_parallel(Table *table, uint32_t num_threads, RowVisitor visit,
+                      void **contexts) {
+  pthread_rwlock_rdlock(&table->structure_lock);
+  Pager *pager = table->pager;
+  if (pager_is_writer(pager)) {
+    table_scan_parallel(table, SNAPSHOT_LATEST, num_threads, visit, contexts);
+  } else {
+    uint64_t snapshot = pager_snapshot_begin(pager);
+    table_scan_parallel(table, snapshot, num_threads, visit, contexts);
+    pager_snapshot_end(pager, snapshot);
+  }
+  pthread_rwlock_unlock(&table->structure_lock);
 }
 
-void print_leaf_node(void *node) {
-  uint32_t num_cells = *leaf_node_num_cells(node);
-  printf("leaf (size %d)\n", num_cells);
-
-  for (uint32_t i = 0; i < num_cells; i++) {
-    uint32_t key = *leaf_node_key(node, i);
-    printf(" - %d: %d\n", i, key);
+typedef struct {
+  uint32_t *ids;
+  uint32_t num_ids;
+  uint32_t capacity;
+} IdList;
+
+void collect_id_visitor(Row *row, void *context) {
+  IdList *list = context;
+  if (list->num_ids == list->capacity) {
+    list->capacity *= 2;
+    list->ids = realloc(list->ids, list->capacity * sizeof(uint32_t));
   }
+  list->ids[list->num_ids++] = row->id;
 }
 
-MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table *table) {
-  if (strcmp(input_buffer->buffer, ".exit") == 0) {
-    close_input_buffer(input_buffer);
-    db_close(table);
-    exit(EXIT_SUCCESS);
-  } else if (strcmp(input_buffer->buffer, ".btree") == 0) {
-    printf("Tree:\n");
-    print_tree(table->pager, 0, 0);
-    return META_COMMAND_SUCCESS;
-  } else if (strcmp(input_buffer->buffer, ".constants") == 0) {
-    printf("Constants:\n");
-    print_constants();
-    return META_COMMAND_SUCCESS;
-  } else {
-    return META_COMMAND_SUCCESS_UNRECOGNIZED_COMMAND;
+/*
+Collect the matching ids first, since deleting while a cursor walks the
+leaves would move cells out from under it
+*/
+ExecuteResult execute_delete(Statement *statement, Table *table) {
+  IdList list = {malloc(8 * sizeof(uint32_t)), 0, 8};
+  table_visit_matches(statement, table, SNAPSHOT_LATEST, collect_id_visitor,
+                      &list);
+
+  for (uint32_t i = 0; i < list.num_ids; i++) {
+    table_delete(table, list.ids[i]);
   }
+  free(list.ids);
+  return EXECUTE_SUCCESS;
 }
 
-PrepareResult prepare_insert(InputBuffer *input_buffer, Statement *statement) {
-  statement->type = STATEMENT_INSERT;
+/*
+ * Vacuum
+ *
+ * Inserts in random order leave leaves about half full and scattered
+ * through the file, which makes scans read more pages and seek between
+ * them. A vacuum copies the table in key order into a new file next to the
+ * db (<db>.vacuum) through the bulk loader, so the leaves come out packed
+ * and in key order on disk, then renames the new file over the old one.
+ *
+ * It runs a number of rows at a time (db_vacuum_step; VACUUM_STEP_ROWS in
+ * the REPL), and other statements can run between steps. Rows are read from a snapshot taken when
+ * the vacuum begins, and every insert or delete after that notes the id.
+ * Once the copy is done, the noted ids are looked up again and replayed onto
+ * the new file, which is then renamed into place. That last step waits until
+ * no transaction or snapshot is open on the table.
+ */
+#define VACUUM_FILL_PERCENT 100
+
+struct Vacuum {
+  Table *target;         // The table being built in the new file
+  char *filename;        // The new file, <db>.vacuum
+  DbIterator *iterator;  // Rows still to copy, NULL once they all are
+  BulkLoader *loader;
+  IdList changed;        // Ids inserted or deleted since the snapshot
+  uint64_t num_rows;     // Copied so far
+};
+
+void vacuum_note_change(Vacuum *vacuum, uint32_t id) {
+  Row row = {.id = id};
+  collect_id_visitor(&row, &vacuum->changed);
+}
 
-  char *keyword = strtok(input_buffer->buffer, " ");
-  char *id_string = strtok(NULL, " ");
-  char *username = strtok(NULL, " ");
-  char *email = strtok(NULL, " ");
+void vacuum_free(Table *table) {
+  Vacuum *vacuum = table->vacuum;
+  free(vacuum->filename);
+  free(vacuum->changed.ids);
+  free(vacuum);
+  table->vacuum = NULL;
+}
 
-  if (id_string == NULL || username == NULL || email == NULL) {
-    return PREPARE_SYNTAX_ERROR;
+/* Stop a vacuum part way and delete its file. The db is left as it is. */
+void vacuum_abandon(Table *table) {
+  Vacuum *vacuum = table->vacuum;
+  if (vacuum->iterator != NULL) {
+    db_iterator_close(vacuum->iterator);
+    bulk_load_free(vacuum->loader);
   }
+  db_close(vacuum->target);
+  unlink(vacuum->filename);
+  vacuum_free(table);
+}
 
-  int id = atoi(id_string);
-  if (id < 0) {
-    return PREPARE_NEGATIVE_ID;
+VacuumResult db_vacuum_begin(Table *table) {
+  Pager *pager = table->pager;
+  if (table->vacuum != NULL) {
+    return VACUUM_IN_PROGRESS;
   }
-
-  if (strlen(username) > COLUMN_USERNAME_SIZE) {
-    return PREPARE_STRING_TOO_LONG;
+  if (pager->wal == NULL) {
+    return VACUUM_READ_ONLY;
   }
-
-  if (strlen(email) > COLUMN_EMAIL_SIZE) {
-    return PREPARE_STRING_TOO_LONG;
+  if (pager->filename == NULL) {
+    return VACUUM_NO_FILE;
   }
-
-  // Q: Why strcpy vs direct assignment?
-  statement->row_to_insert.id = id;
-  strcpy(statement->row_to_insert.username, username);
-  strcpy(statement->row_to_insert.email, email);
-
-  return PREPARE_SUCCESS;
-}
-
-PrepareResult prepare_statement(InputBuffer *input_buffer,
-                                Statement *statement) {
-  if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
-    return prepare_insert(input_buffer, statement);
+  if (pager->wal->in_transaction) {
+    return VACUUM_IN_TRANSACTION;
   }
-  if (strcmp(input_buffer->buffer, "select") ==0) {
-    statement->type = STATEMENT_SELECT;
-    return PREPARE_SUCCESS;
+  if (pager_failed(pager)) {
+    return VACUUM_DB_ERROR;
   }
 
-  return PREPARE_UNRECOGNIZED_STATEMENT;
+  size_t length = strlen(pager->filename) + strlen(".vacuum-wal") + 1;
+  char *filename = malloc(length);
+  // A log left by a vacuum that crashed must not be replayed onto a new file
+  snprintf(filename, length, "%s.vacuum-wal", pager->filename);
+  unlink(filename);
+  snprintf(filename, length, "%s.vacuum", pager->filename);
+  int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+  if (fd == -1) {
+    free(filename);
+    return VACUUM_FILE_ERROR;
+  }
+  close(fd);
+
+  Table *target =
+      db_open_with_layout(filename, pager->max_frames, PAGE_SIZE,
+                          INTERNAL_NODE_MAX_CELLS, LEAF_NODE_MAX_CELL_SIZE);
+  if (target == NULL) {
+    unlink(filename);
+    free(filename);
+    return VACUUM_FILE_ERROR;
+  }
+  Vacuum *vacuum = malloc(sizeof(Vacuum));
+  vacuum->filename = filename;
+  vacuum->target = target;
+  vacuum->changed = (IdList){malloc(8 * sizeof(uint32_t)), 0, 8};
+  vacuum->num_rows = 0;
+
+  // The indexes start out empty and are built once the rows are in
+  pager_begin_write(target->pager);
+  for (uint32_t i = 0; i < NUM_INDEXED_COLUMNS; i++) {
+    if (table->indexes[i] != NULL) {
+      Statement statement = {.type = STATEMENT_CREATE_INDEX,
+                             .index_column = i};
+      execute_create_index(&statement, target);
+    }
+  }
+  pager_commit_transaction(target->pager);
+  pager_end_write(target->pager);
+  vacuum->loader = bulk_load_begin(target, VACUUM_FILL_PERCENT);
+
+  // No write can come between the snapshot and noting changes
+  pager_begin_write(pager);
+  vacuum->iterator = db_iterator_open(table, 0, UINT32_MAX);
+  table->vacuum = vacuum;
+  pager_end_write(pager);
+  return VACUUM_IN_PROGRESS;
 }
 
-void print_prompt() { printf("db > "); }
+/* Every row of the snapshot is in: build the tree over them and commit it */
+void vacuum_finish_copy(Vacuum *vacuum) {
+  db_iterator_close(vacuum->iterator);
+  vacuum->iterator = NULL;
+
+  Table *target = vacuum->target;
+  pager_begin_write(target->pager);
+  bulk_load_finish(vacuum->loader);
+  vacuum->loader = NULL;
+  for (uint32_t i = 0; i < NUM_INDEXED_COLUMNS; i++) {
+    if (target->indexes[i] != NULL) {
+      index_build(target, target->indexes[i], i);
+    }
+  }
+  pager_commit_transaction(target->pager);
+  pager_trim(target->pager);
+  pager_end_write(target->pager);
+}
 
-void read_input(InputBuffer *input_buffer) {
-  ssize_t bytes_read =
-      getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
+/*
+Replay the noted changes onto the new file, put it in place of the db file
+and reopen the table on it. The old file is checkpointed first, so that its
+log is empty and has nothing to replay onto the new file after a crash.
 
-  if (bytes_read <= 0) {
-    printf("Error reading input\n");
-    exit(EXIT_FAILURE);
+The old pager is freed, so readers are kept out with structure_lock from
+the check that none of them holds a snapshot until the table has its new
+pager. Returns VACUUM_WAITING, with nothing done, if one does.
+*/
+VacuumResult vacuum_replace(Table *table, VacuumProgress *progress) {
+  Vacuum *vacuum = table->vacuum;
+  Pager *pager = table->pager;
+  Table *target = vacuum->target;
+
+  pager_begin_write(pager);
+  bool busy = pthread_rwlock_trywrlock(&table->structure_lock) != 0;
+  if (!busy) {
+    pthread_mutex_lock(&pager->lock);
+    busy = pager->wal->in_transaction || pager->num_snapshots > 0;
+    pthread_mutex_unlock(&pager->lock);
+    if (busy) {
+      pthread_rwlock_unlock(&table->structure_lock);
+    }
+  }
+  if (busy) {
+    pager_end_write(pager);
+    progress->rows = vacuum->num_rows;
+    return VACUUM_WAITING;
   }
 
-  // Ignore trailing newline
-  input_buffer->input_length = bytes_read - 1;
-  input_buffer->buffer[bytes_read - 1] = 0;
-}
+  pager_begin_write(target->pager);
+  for (uint32_t i = 0; i < vacuum->changed.num_ids; i++) {
+    uint32_t id = vacuum->changed.ids[i];
+    table_delete(target, id);
 
-uint32_t *node_parent(void *node) { return node + PARENT_POINTER_OFFSET; }
+    Cursor *cursor = table_find(table, id);
+    if (cursor_at_key(cursor, id)) {
+      Row row;
+      cursor_read_row(cursor, &row);
+      table_insert(target, &row);
+    }
+    cursor_close(cursor);
 
-void update_internal_node_key(void *node, uint32_t old_key, uint32_t new_key) {
-  uint32_t old_child_index = internal_node_find_child(node, old_key);
-  *internal_node_key(node, old_child_index) = new_key;
+    // Keep the set of uncommitted pages, which cannot be evicted, bounded
+    if ((i + 1) % BULK_LOAD_COMMIT_ROWS == 0) {
+      pager_commit_transaction(target->pager);
+      pager_trim(target->pager);
+    }
+  }
+  pager_commit_transaction(target->pager);
+  pager_end_write(target->pager);
+
+  pager_checkpoint(pager);
+  progress->old_size = lseek(pager->file_descriptor, 0, SEEK_END);
+  pager_end_write(pager);
+
+  // A copy made from stand-ins for unreadable pages is not the table
+  if (pager_failed(pager) || pager_failed(target->pager)) {
+    pthread_rwlock_unlock(&table->structure_lock);
+    vacuum_abandon(table);
+    return VACUUM_DB_ERROR;
+  }
+  db_close(target);
+  struct stat target_stat;
+  if (stat(vacuum->filename, &target_stat) == -1 ||
+      rename(vacuum->filename, pager->filename) == -1) {
+    pthread_rwlock_unlock(&table->structure_lock);
+    unlink(vacuum->filename);
+    vacuum_free(table);
+    return VACUUM_FILE_ERROR;
+  }
+  progress->new_size = target_stat.st_size;
+  progress->rows = vacuum->num_rows;
+  vacuum_free(table);
+
+  // The reopened pager carries on where the old one was
+  char *filename = pager->filename;
+  pager->filename = NULL;
+  uint32_t max_frames = pager->max_frames;
+  uint32_t readahead_pages = pager->readahead_pages;
+  uint32_t group_size = pager->wal->group_size;
+  pid_t snapshot_pid = pager->snapshot_pid;
+  DbStats stats = pager->stats;
+  for (uint32_t i = 0; i < NUM_INDEXED_COLUMNS; i++) {
+    free(table->indexes[i]);
+    table->indexes[i] = NULL;
+  }
+  pager_close(pager);
+
+  pager = pager_open(filename, max_frames, PAGE_SIZE, INTERNAL_NODE_MAX_CELLS,
+                     LEAF_NODE_MAX_CELL_SIZE);
+  if (pager == NULL) {
+    // The table has to have a pager, so it gets an empty one that says why
+    pager = pager_open_memory(PAGE_SIZE, INTERNAL_NODE_MAX_CELLS,
+                              LEAF_NODE_MAX_CELL_SIZE);
+    pager_fail(pager, "Unable to reopen '%s' after the vacuum.", filename);
+  }
+  free(filename);
+  pager->readahead_pages = readahead_pages;
+  pager->wal->group_size = group_size;
+  pager->snapshot_pid = snapshot_pid;
+  pager->stats = stats;
+  table->pager = pager;
+  table_load_header(table);
+  pthread_rwlock_unlock(&table->structure_lock);
+  return VACUUM_DONE;
 }
 
-void create_new_root(Table *table, uint32_t right_child_page_num) {
-  /*
-  Handle splitting the root
-  Old root compied to new page, becomes left child
-  Address of right child passed in
-  Re-initialize root page to contain the new root node
-  New root node points to two children
-  */
+VacuumResult db_vacuum_step(Table *table, uint32_t max_rows,
+                            VacuumProgress *progress) {
+  Vacuum *vacuum = table->vacuum;
+  memset(progress, 0, sizeof(VacuumProgress));
+  if (vacuum == NULL) {
+    return VACUUM_DONE;
+  }
+  if (pager_failed(table->pager) || pager_failed(vacuum->target->pager)) {
+    vacuum_abandon(table);
+    return VACUUM_DB_ERROR;
+  }
 
-  void *root = get_page(table->pager, table->root_page_num);
-  void *right_child = get_page(table->pager, right_child_page_num);
-  uint32_t left_child_page_num = get_unused_page_num(table->pager);
-  void *left_child = get_page(table->pager, left_child_page_num);
+  if (vacuum->iterator != NULL) {
+    if (max_rows == 0) {
+      max_rows = UINT32_MAX;
+    }
+    Row row;
+    uint32_t num_rows = 0;
+    while (num_rows < max_rows && db_iterator_next(vacuum->iterator, &row)) {
+      bulk_load_add(vacuum->loader, &row);
+      num_rows++;
+    }
+    vacuum->num_rows += num_rows;
+    if (num_rows == max_rows) {
+      progress->rows = vacuum->num_rows;
+      return VACUUM_IN_PROGRESS;
+    }
+    vacuum_finish_copy(vacuum);
+  }
 
-  if (get_node_type(root) == NODE_INTERNAL) {
-    initialize_internal_node(right_child);
-    initialize_internal_node(left_child);
+  // Checked again in vacuum_replace, but a transaction open on another
+  // thread would keep it waiting for the write lock
+  Pager *pager = table->pager;
+  pthread_mutex_lock(&pager->lock);
+  bool busy = pager->wal->in_transaction || pager->num_snapshots > 0;
+  pthread_mutex_unlock(&pager->lock);
+  if (busy) {
+    progress->rows = vacuum->num_rows;
+    return VACUUM_WAITING;
   }
+  return vacuum_replace(table, progress);
+}
 
-  /* Left child has data copied from old root*/
-  memcpy(left_child, root, PAGE_SIZE);
-  set_node_root(left_child, false);
+ExecuteResult execute_transaction(Statement *statement, Table *table) {
+  Pager *pager = table->pager;
+  bool in_transaction = pager->wal->in_transaction;
 
-  if (get_node_type(left_child) == NODE_INTERNAL) {
-    void *child;
-    for (int i = 0; i < *internal_node_num_keys(left_child); i++) {
-      child = get_page(table->pager, *internal_node_child(left_child, i));
-      *node_parent(child) = left_child_page_num;
+  switch (statement->type) {
+    case (STATEMENT_BEGIN):
+      if (in_transaction) {
+        return EXECUTE_ALREADY_IN_TRANSACTION;
+      }
+      pager_begin_transaction(pager);
+      return EXECUTE_SUCCESS;
+    case (STATEMENT_COMMIT):
+      if (!in_transaction) {
+        return EXECUTE_NO_TRANSACTION;
+      }
+      pager_commit_transaction(pager);
+      return EXECUTE_SUCCESS;
+    default:
+      if (!in_transaction) {
+        return EXECUTE_NO_TRANSACTION;
+      }
+      // An index created in the transaction is gone, and so may be the
+      // remembered rightmost leaf
+      table_rollback(table);
+      return EXECUTE_SUCCESS;
+  }
+}
+
+bool statement_is_bound(Statement *statement) {
+  for (uint32_t i = 0; i < statement->num_parameters; i++) {
+    if (!statement->parameters[i].bound) {
+      return false;
     }
-    child = get_page(table->pager, *internal_node_right_child(left_child));
-    *node_parent(child) = left_child_page_num;
   }
-
-  /* Root node is a new internal node with one key and two children */
-  initialize_internal_node(root);
-  set_node_root(root, true);
-  *internal_node_num_keys(root) = 1;
-  *internal_node_child(root, 0) = left_child_page_num;
-  uint32_t left_child_max_key = get_node_max_key(table->pager, left_child);
-  *internal_node_key(root, 0) = left_child_max_key;
-  *internal_node_right_child(root) = right_child_page_num;
-  *node_parent(left_child) = table->root_page_num;
-  *node_parent(right_child) = table->root_page_num;
+  return true;
 }
 
-void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, Row *value) {
-  /*
-  Create a new node and move half the cells over.
-  Insert the new value in one of the two nodes.
-  Update parent or create a new parent
-  */
+/* Run a statement. A select hands each row it finds to visit. */
+ExecuteResult run_statement(Statement *statement, Table *table,
+                            RowVisitor visit, void *context) {
+  Pager *pager = table->pager;
+  if (!statement_is_bound(statement)) {
+    return EXECUTE_UNBOUND_PARAMETER;
+  }
+  if (statement->type == STATEMENT_SELECT) {
+    ExecuteResult result = execute_select(statement, table, visit, context);
+    pager_trim(pager);
+    return pager_failed(pager) ? EXECUTE_DB_ERROR : result;
+  }
+  if (pager->wal == NULL) {
+    return EXECUTE_READ_ONLY;
+  }
 
-  void *old_node = get_page(cursor->table->pager, cursor->page_num);
-  uint32_t old_max = get_node_max_key(cursor->table->pager, old_node);
-  uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-  void *new_node = get_page(cursor->table->pager, new_page_num);
-  initialize_leaf_node(new_node);
-  *node_parent(new_node) = *node_parent(old_node);
-  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
-  *leaf_node_next_leaf(old_node) = new_page_num;
+  pager_begin_write(pager);
+  bool was_in_transaction = pager->wal->in_transaction;
 
-  /*
-  All existing keys plus new key should be divided
-  evenly between old (left) and new (right) nodes.
-  Starting from the right, move each key to correct position.
-  */
+  ExecuteResult result = EXECUTE_SUCCESS;
+  switch (statement->type) {
+    case (STATEMENT_INSERT):
+      result = execute_insert(statement, table);
+      break;
+    case (STATEMENT_SELECT):
+      break;
+    case (STATEMENT_BEGIN):
+    case (STATEMENT_COMMIT):
+    case (STATEMENT_ROLLBACK):
+      result = execute_transaction(statement, table);
+      break;
+    case (STATEMENT_CREATE_INDEX):
+      result = execute_create_index(statement, table);
+      break;
+    case (STATEMENT_DELETE):
+      result = execute_delete(statement, table);
+      break;
+  }
 
-  for (int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
-    void *destination_node;
-    if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
-      destination_node = new_node;
-    } else {
-      destination_node = old_node;
-    }
-    uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-    void *destination = leaf_node_cell(destination_node, index_within_node);
+  // Nothing is committed once a page could not be read (see Unreadable
+  // Pages), so whatever the statement and any open transaction changed is
+  // put back
+  if (pager_failed(pager)) {
+    table_rollback(table);
+    result = EXECUTE_DB_ERROR;
+  }
 
-    if (i == cursor->cell_num) {
-      serialize_row(value,
-                    leaf_node_value(destination_node, index_within_node));
-      *leaf_node_key(destination_node, index_within_node) = key;
-    } else if (i > cursor->cell_num) {
-      memcpy(destination, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
-    } else {
-      memcpy(destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
-    }
+  // Outside an explicit transaction every statement commits on its own
+  bool in_transaction = pager->wal->in_transaction;
+  if (!in_transaction) {
+    pager_commit_transaction(pager);
   }
 
-  *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-  *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+  // An explicit transaction holds the write lock from begin to commit
+  if (in_transaction && !was_in_transaction) {
+    pager_begin_write(pager);
+  } else if (was_in_transaction && !in_transaction) {
+    pager_end_write(pager);
+  }
+  pager_end_write(pager);
 
-  if (is_node_root(old_node)) {
-    return create_new_root(cursor->table, new_page_num);
-  } else {
-    uint32_t parent_page_num = *node_parent(old_node);
-    uint32_t new_max = get_node_max_key(cursor->table->pager, old_node);
-    void *parent = get_page(cursor->table->pager, parent_page_num);
+  // No page pointers are held between statements, so it is safe to evict
+  pager_trim(pager);
+  return result;
+}
 
-    update_internal_node_key(parent, old_max, new_max);
-    internal_node_insert(cursor->table, parent_page_num, new_page_num);
-    return;
+uint64_t monotonic_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+Run a statement and count how long it took in the pager's stats. Readers
+may be doing the same from other threads, so the counts are atomic.
+*/
+ExecuteResult execute_statement(Statement *statement, Table *table,
+                                RowVisitor visit, void *context) {
+  // A select is a reader, so it holds on to the pager until it is counted
+  bool reader = statement->type == STATEMENT_SELECT;
+  if (reader) {
+    pthread_rwlock_rdlock(&table->structure_lock);
+  }
+  uint64_t start = monotonic_ns();
+  ExecuteResult result = run_statement(statement, table, visit, context);
+  uint64_t elapsed_ns = monotonic_ns() - start;
+
+  uint64_t elapsed_us = elapsed_ns / 1000;
+  uint32_t bucket = elapsed_us == 0 ? 0 : 64 - __builtin_clzll(elapsed_us);
+  if (bucket >= DB_STATS_LATENCY_BUCKETS) {
+    bucket = DB_STATS_LATENCY_BUCKETS - 1;
   }
+  DbStats *stats = &table->pager->stats;
+  __atomic_fetch_add(&stats->statements[statement->type], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&stats->statement_ns[statement->type], elapsed_ns,
+                     __ATOMIC_RELAXED);
+  __atomic_fetch_add(&stats->latency[statement->type][bucket], 1,
+                     __ATOMIC_RELAXED);
+  if (reader) {
+    pthread_rwlock_unlock(&table->structure_lock);
+  }
+  return result;
 }
 
-void leaf_node_insert(Cursor *cursor, uint32_t key, Row *value) {
-  void *node = get_page(cursor->table->pager, cursor->page_num);
+/*
+ * Prepared statements, for programs that use the db as a library. A
+ * statement is parsed once by db_prepare, and each ? in it is given a value
+ * by db_bind_int or db_bind_text before db_step runs it. The values stay
+ * bound, so a loop can rebind only what changes and step again:
+ *
+ *   Statement *insert;
+ *   db_prepare("insert ? ? ?", &insert);
+ *   for (...) {
+ *     db_bind_int(insert, 1, id);
+ *     db_bind_text(insert, 2, username);
+ *     db_bind_text(insert, 3, email);
+ *     db_step(table, insert, NULL, NULL);
+ *   }
+ *   db_finalize(insert);
+ */
+PrepareResult db_prepare(const char *sql, Statement **statement) {
+  *statement = malloc(sizeof(Statement));
+  PrepareResult result = prepare_statement(sql, *statement);
+  if (result != PREPARE_SUCCESS) {
+    free(*statement);
+    *statement = NULL;
+  }
+  return result;
+}
 
-  uint32_t num_cells = *leaf_node_num_cells(node);
+/* The ? numbered `number`, counting from 1, or NULL if there is none */
+Parameter *statement_parameter(Statement *statement, uint32_t number) {
+  if (number == 0 || number > statement->num_parameters) {
+    return NULL;
+  }
+  return &statement->parameters[number - 1];
+}
 
-  if (num_cells >= LEAF_NODE_MAX_CELLS) {
-    // Node full
-    leaf_node_split_and_insert(cursor, key, value);
-    return;
+PrepareResult db_bind_int(Statement *statement, uint32_t number,
+                          int64_t value) {
+  Parameter *parameter = statement_parameter(statement, number);
+  if (parameter == NULL || parameter->target == PARAMETER_ROW_USERNAME ||
+      parameter->target == PARAMETER_ROW_EMAIL ||
+      parameter->target == PARAMETER_FILTER_VALUE || value > UINT32_MAX) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (value < 0) {
+    return PREPARE_NEGATIVE_ID;
   }
 
-  if (cursor->cell_num < num_cells) {
-    // Make room for new cell
+  switch (parameter->target) {
+    case (PARAMETER_ROW_ID):
+      statement->rows_to_insert[parameter->index].id = value;
+      break;
+    case (PARAMETER_CONDITION_VALUE):
+      statement->id_conditions[parameter->index].values[parameter->which] =
+          value;
+      break;
+    case (PARAMETER_LIMIT):
+      statement->row_limit = value;
+      break;
+    default:
+      break;
+  }
+  parameter->bound = true;
+  statement_resolve_where(statement);
+  return PREPARE_SUCCESS;
+}
 
-    for (uint32_t i = num_cells; i > cursor->cell_num; i--) {
-      memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1),
-             LEAF_NODE_CELL_SIZE);
-    }
+PrepareResult db_bind_text(Statement *statement, uint32_t number,
+                           const char *value) {
+  Parameter *parameter = statement_parameter(statement, number);
+  char *destination;
+  uint32_t max_length;
+  if (parameter == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  switch (parameter->target) {
+    case (PARAMETER_ROW_USERNAME):
+      destination = statement->rows_to_insert[parameter->index].username;
+      max_length = COLUMN_USERNAME_SIZE;
+      break;
+    case (PARAMETER_ROW_EMAIL):
+      destination = statement->rows_to_insert[parameter->index].email;
+      max_length = COLUMN_EMAIL_SIZE;
+      break;
+    case (PARAMETER_FILTER_VALUE):
+      destination = statement->filter_value;
+      max_length = statement->filter_column == COLUMN_USERNAME
+                       ? COLUMN_USERNAME_SIZE
+                       : COLUMN_EMAIL_SIZE;
+      break;
+    default:
+      return PREPARE_SYNTAX_ERROR;
   }
 
-  *(leaf_node_num_cells(node)) += 1;
-  *(leaf_node_key(node, cursor->cell_num)) = key;
-  serialize_row(value, leaf_node_value(node, cursor->cell_num));
+  if (strlen(value) > max_length) {
+    return PREPARE_STRING_TOO_LONG;
+  }
+  strcpy(destination, value);
+  parameter->bound = true;
+  return PREPARE_SUCCESS;
 }
 
-void internal_node_split_and_insert(Table *table, uint32_t parent_page_num,
-                                    uint32_t child_page_num) {
-  uint32_t old_page_num = parent_page_num;
-  void *old_node = get_page(table->pager, parent_page_num);
-  uint32_t old_max = get_node_max_key(table->pager, old_node);
+void ignore_row_visitor(Row *row, void *context) {}
 
-  void *child = get_page(table->pager, child_page_num);
-  uint32_t child_max = get_node_max_key(table->pager, child);
+/*
+Run the statement with its current values. A select hands each row to
+visit; the Row is only valid during the call.
+*/
+ExecuteResult db_step(Table *table, Statement *statement, RowVisitor visit,
+                      void *context) {
+  if (visit == NULL) {
+    visit = ignore_row_visitor;
+  }
+  return execute_statement(statement, table, visit, context);
+}
 
-  uint32_t new_page_num = get_unused_page_num(table->pager);
+void db_finalize(Statement *statement) {
+  if (statement != NULL) {
+    statement_free(statement);
+    free(statement);
+  }
+}
 
-  /*
- Declaring a flag before updating pointers which
- records whether this operation involves splitting the root -
- if it does, we will insert our newly created node during
- the step where the table's new root is created. If it does
- not, we have to insert the newly created node into its parent
- after the old node's keys have been transferred over. We are not
- able to do this if the newly created node's parent is not a newly
- initialized root node, because in that case its parent may have existing
- keys aside from our old node which we are splitting. If that is true, we
- need to find a place for our newly created node in its parent, and we
- cannot insert it at the correct index if it does not yet have any keys
+/*
+ * The library's direct calls. They skip the parser but otherwise go the
+ * same way a statement does, so locking, snapshots and commits behave as
+ * in the REPL.
  */
+ExecuteResult db_insert(Table *table, const Row *row) {
+  Row copy = *row;
+  Statement statement = {.type = STATEMENT_INSERT,
+                         .rows_to_insert = &copy,
+                         .num_rows = 1};
+  return execute_statement(&statement, table, ignore_row_visitor, NULL);
+}
 
-  uint32_t splitting_root = is_node_root(old_node);
+/*
+A point lookup: one page per level of the tree. Like a select it reads as
+of the last commit, or the writer's own latest pages inside a transaction.
+*/
+bool db_get(Table *table, uint32_t id, Row *row) {
+  pthread_rwlock_rdlock(&table->structure_lock);
+  Pager *pager = table->pager;
+  bool writer = pager_is_writer(pager);
+  uint64_t snapshot = writer ? SNAPSHOT_LATEST : pager_snapshot_begin(pager);
 
-  void *parent;
-  void *new_node;
+  Cursor *cursor = table_find_at(table, id, snapshot);
+  bool found = cursor_at_key(cursor, id);
+  if (found) {
+    cursor_read_row(cursor, row);
+  }
+  cursor_close(cursor);
 
-  if (splitting_root) {
+  if (!writer) {
+    pager_snapshot_end(pager, snapshot);
+  }
+  pager_trim(pager);
+  pthread_rwlock_unlock(&table->structure_lock);
+  return found;
+}
 
-    create_new_root(table, new_page_num);
-    parent = get_page(table->pager, table->root_page_num);
+void db_scan(Table *table, uint32_t min_id, uint32_t max_id, RowVisitor visit,
+             void *context) {
+  Statement statement = {.type = STATEMENT_SELECT,
+                         .min_id = min_id,
+                         .max_id = max_id,
+                         .limit = UINT32_MAX};
+  execute_statement(&statement, table, visit, context);
+}
 
-    /*
-    If we are splitting the root, we need to update old_node to point
-    to the new root's left child, new_page_num will already point to
-    the new root's right child
-    */
+/*
+An iterator keeps its cursor and snapshot between calls. Its cursor copies
+pages out (or reads a read-only map in place), so it pins nothing in the
+cache, and it only holds structure_lock inside each call, so the same
+thread can write while it is open. Its snapshot keeps a vacuum from
+swapping the pager until it is closed.
+*/
+struct DbIterator {
+  Table *table;
+  Cursor *cursor;
+  uint64_t snapshot;
+  uint32_t max_id;
+};
+
+DbIterator *db_iterator_open(Table *table, uint32_t min_id, uint32_t max_id) {
+  DbIterator *iterator = malloc(sizeof(DbIterator));
+  iterator->table = table;
+  iterator->max_id = max_id;
+
+  pthread_rwlock_rdlock(&table->structure_lock);
+  iterator->snapshot = pager_snapshot_begin(table->pager);
+  iterator->cursor = table_seek_at(table, min_id, iterator->snapshot);
+  pthread_rwlock_unlock(&table->structure_lock);
+  return iterator;
+}
 
-    old_page_num = *internal_node_child(parent, 0);
-    old_node = get_page(table->pager, old_page_num);
-  } else {
-    parent = get_page(table->pager, *node_parent(old_node));
-    new_node = get_page(table->pager, new_page_num);
-    initialize_internal_node(new_node);
+bool db_iterator_next(DbIterator *iterator, Row *row) {
+  Cursor *cursor = iterator->cursor;
+  Table *table = iterator->table;
+
+  pthread_rwlock_rdlock(&table->structure_lock);
+  bool found =
+      !cursor->end_of_table && cursor_key(cursor) <= iterator->max_id;
+  if (found) {
+    cursor_read_row(cursor, row);
+    cursor_advance(cursor);
   }
+  pthread_rwlock_unlock(&table->structure_lock);
+  return found;
+}
 
-  uint32_t *old_num_keys = internal_node_num_keys(old_node);
-  uint32_t cur_page_num = *internal_node_right_child(old_node);
-  void *cur = get_page(table->pager, cur_page_num);
+void db_iterator_close(DbIterator *iterator) {
+  Table *table = iterator->table;
+  pthread_rwlock_rdlock(&table->structure_lock);
+  cursor_close(iterator->cursor);
+  pager_snapshot_end(table->pager, iterator->snapshot);
+  pager_trim(table->pager);
+  pthread_rwlock_unlock(&table->structure_lock);
+  free(iterator);
+}
 
-  /*
-  First put right child into new node and set right child of old node to invalid
-  page number
-  */
+/* Height, node counts and leaf fill of the tree under page_num */
+void stats_walk_tree(Pager *pager, uint32_t page_num, uint32_t depth,
+                     DbStats *stats) {
+  void *node = get_page(pager, page_num);
+  if (depth > stats->tree_height) {
+    stats->tree_height = depth;
+  }
+  if (get_node_type(node) == NODE_LEAF) {
+    stats->num_leaves++;
+    uint32_t used = LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(node);
+    uint32_t bucket =
+        (uint64_t)used * DB_STATS_FILL_BUCKETS / LEAF_NODE_SPACE_FOR_CELLS;
+    if (bucket >= DB_STATS_FILL_BUCKETS) {
+      bucket = DB_STATS_FILL_BUCKETS - 1;
+    }
+    stats->leaf_fill[bucket]++;
+    return;
+  }
 
-  internal_node_insert(table, new_page_num, cur_page_num);
-  *node_parent(cur) = new_page_num;
-  *internal_node_right_child(old_node) = INVALID_PAGE_NUM;
+  stats->num_internal_nodes++;
+  uint32_t num_keys = *internal_node_num_keys(node);
+  for (uint32_t i = 0; i < num_keys; i++) {
+    stats_walk_tree(pager, *internal_node_child(node, i), depth + 1, stats);
+  }
+  stats_walk_tree(pager, *internal_node_right_child(node), depth + 1, stats);
+}
 
-  /*
-  For each key until you get to the middle key, move the key and the child to
-  the new node
-  */
-  for (int i = INTERNAL_NODE_MAX_CELLS - 1; i > INTERNAL_NODE_MAX_CELLS / 2;
-       i--) {
-    cur_page_num = *internal_node_child(old_node, i);
-    cur = get_page(table->pager, cur_page_num);
+void db_stats(Table *table, DbStats *stats) {
+  Pager *pager = table->pager;
+  // The tree is walked like .btree prints it, with writers kept out
+  pager_begin_write(pager);
+  pthread_mutex_lock(&pager->lock);
+  *stats = pager->stats;
+  pthread_mutex_unlock(&pager->lock);
+  stats->tree_height = 0;
+  stats->num_leaves = 0;
+  stats->num_internal_nodes = 0;
+  memset(stats->leaf_fill, 0, sizeof(stats->leaf_fill));
+  stats_walk_tree(pager, table->root_page_num, 1, stats);
+  pager_end_write(pager);
+  pager_trim(pager);
+}
 
-    internal_node_insert(table, new_page_num, cur_page_num);
-    *node_parent(cur) = new_page_num;
-    (*old_num_keys)--;
-  }
-  /*
-  Set child before middle key, which is now the highest key, to be node's right
-child, and decrement number of keys
-  */
-  *internal_node_right_child(old_node) =
-      *internal_node_child(old_node, *old_num_keys - 1);
-  (*old_num_keys)--;
-  /*
-   Determine which of the two nodes after the split should contain the child
- to be inserted, and insert the child
-   */
-  uint32_t max_after_split = get_node_max_key(table->pager, old_node);
-  uint32_t destination_page_num =
-      child_max < max_after_split ? old_page_num : new_page_num;
-  internal_node_insert(table, destination_page_num, child_page_num);
-  *node_parent(child) = destination_page_num;
-  update_internal_node_key(parent, old_max,
-                           get_node_max_key(table->pager, old_node));
-  if (!splitting_root) {
-    internal_node_insert(table, *node_parent(old_node), new_page_num);
-    *node_parent(new_node) = *node_parent(old_node);
-  }
+void db_stats_reset(Table *table) {
+  Pager *pager = table->pager;
+  pthread_mutex_lock(&pager->lock);
+  memset(&pager->stats, 0, sizeof(DbStats));
+  pthread_mutex_unlock(&pager->lock);
 }
 
-ExecuteResult execute_insert(Statement *statement, Table *table) {
-  void *node = get_page(table->pager, table->root_page_num);
-  uint32_t num_cells = (*leaf_node_num_cells(node));
+/*
+ * Result Sinks
+ *
+ * A sink takes the rows of a select and formats them into a buffer of
+ * RESULT_SINK_NUM_CHUNKS chunks. Once the last chunk is full all of them go
+ * out in one writev, so a large export costs one system call per megabyte
+ * rather than a printf per row, and the memory it needs does not grow with
+ * the number of rows. A row is never split between chunks.
+ *
+ *   text    (1, user1, person1@example.com), as the REPL has always printed
+ *   csv     1,user1,person1@example.com, with fields that hold a comma, a
+ *           quote or a line break quoted and their quotes doubled
+ *   binary  each column in turn, an id as a uint32 and text as a uint16
+ *           length and then its bytes, in native byte order, with nothing
+ *           between rows
+ */
+#define RESULT_SINK_CHUNK_SIZE 65536
+#define RESULT_SINK_NUM_CHUNKS 16
+/* More than the longest row in any format: a csv email of only quotes */
+#define RESULT_SINK_MAX_ROW_SIZE 1024
+
+struct ResultSink {
+  int fd;
+  OutputFormat format;
+  RowColumn columns[ROW_NUM_COLUMNS];
+  uint32_t num_columns;
+  char *buffer;
+  struct iovec chunks[RESULT_SINK_NUM_CHUNKS];
+  uint32_t num_chunks;  // Chunks in use; rows go into the last one
+};
+
+void result_sink_reset(ResultSink *sink) {
+  for (uint32_t i = 0; i < RESULT_SINK_NUM_CHUNKS; i++) {
+    sink->chunks[i].iov_base = sink->buffer + i * RESULT_SINK_CHUNK_SIZE;
+    sink->chunks[i].iov_len = 0;
+  }
+  sink->num_chunks = 1;
+}
 
-  Row *row_to_insert = &(statement->row_to_insert);
-  uint32_t key_to_insert = row_to_insert->id;
-  Cursor *cursor = table_find(table, key_to_insert);
+void result_sink_flush(ResultSink *sink) {
+  struct iovec *iov = sink->chunks;
+  uint32_t iov_count = sink->num_chunks;
+  if (iov[0].iov_len == 0) {
+    return;
+  }
+  while (iov_count > 0) {
+    ssize_t written = writev(sink->fd, iov, iov_count);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      printf("Error writing rows: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    // A short write leaves the rest of the chunks, and maybe part of one
+    while (iov_count > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      iov_count--;
+    }
+    if (iov_count > 0) {
+      iov->iov_base += written;
+      iov->iov_len -= written;
+    }
+  }
+  result_sink_reset(sink);
+}
 
-  if (cursor->cell_num < num_cells) {
-    uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
-    if (key_at_index == key_to_insert) {
-      return EXECUTE_DUPLICATE_KEY;
+ResultSink *db_sink_open(int fd, OutputFormat format, const RowColumn *columns,
+                         uint32_t num_columns) {
+  ResultSink *sink = malloc(sizeof(ResultSink));
+  sink->fd = fd;
+  sink->format = format;
+  if (num_columns == 0) {
+    sink->columns[0] = ROW_COLUMN_ID;
+    sink->columns[1] = ROW_COLUMN_USERNAME;
+    sink->columns[2] = ROW_COLUMN_EMAIL;
+    num_columns = ROW_NUM_COLUMNS;
+  } else {
+    if (num_columns > ROW_NUM_COLUMNS) {
+      num_columns = ROW_NUM_COLUMNS;
     }
+    memcpy(sink->columns, columns, num_columns * sizeof(RowColumn));
   }
+  sink->num_columns = num_columns;
+  sink->buffer = malloc(RESULT_SINK_NUM_CHUNKS * RESULT_SINK_CHUNK_SIZE);
+  result_sink_reset(sink);
+  return sink;
+}
 
-  leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
+void db_sink_close(ResultSink *sink) {
+  result_sink_flush(sink);
+  free(sink->buffer);
+  free(sink);
+}
 
-  free(cursor);
-  return EXECUTE_SUCCESS;
+/* Each of these writes at out and returns the end of what it wrote */
+char *format_uint32(char *out, uint32_t value) {
+  char digits[10];
+  uint32_t num_digits = 0;
+  do {
+    digits[num_digits++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+  while (num_digits > 0) {
+    *out++ = digits[--num_digits];
+  }
+  return out;
 }
 
-void print_row(Row *row) {
-  printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+char *format_csv_field(char *out, const char *text, uint32_t length) {
+  if (strpbrk(text, ",\"\r\n") == NULL) {
+    memcpy(out, text, length);
+    return out + length;
+  }
+  *out++ = '"';
+  for (uint32_t i = 0; i < length; i++) {
+    if (text[i] == '"') {
+      *out++ = '"';
+    }
+    *out++ = text[i];
+  }
+  *out++ = '"';
+  return out;
 }
 
-ExecuteResult execute_select(Statement *statement, Table *table) {
-  Row row;
-  Cursor *cursor = table_start(table);
-  while (!(cursor->end_of_table)) {
-    deserialize_row(cursor_value(cursor), &row);
-    print_row(&row);
-    cursor_advance(cursor);
+char *format_column(OutputFormat format, char *out, Row *row,
+                    RowColumn column) {
+  if (column == ROW_COLUMN_ID) {
+    if (format == OUTPUT_BINARY) {
+      memcpy(out, &row->id, sizeof(row->id));
+      return out + sizeof(row->id);
+    }
+    return format_uint32(out, row->id);
   }
 
-  free(cursor);
-  return EXECUTE_SUCCESS;
+  const char *text =
+      column == ROW_COLUMN_USERNAME ? row->username : row->email;
+  uint16_t length = strlen(text);
+  switch (format) {
+    case (OUTPUT_TEXT):
+      memcpy(out, text, length);
+      return out + length;
+    case (OUTPUT_CSV):
+      return format_csv_field(out, text, length);
+    case (OUTPUT_BINARY):
+      memcpy(out, &length, sizeof(length));
+      memcpy(out + sizeof(length), text, length);
+      return out + sizeof(length) + length;
+  }
+  return out;
 }
 
-ExecuteResult execute_statement(Statement *statement, Table *table) {
-  switch (statement->type) {
-    case (STATEMENT_INSERT):
-      return execute_insert(statement, table);
-    case (STATEMENT_SELECT):
-      return execute_select(statement, table);
+void db_sink_row(Row *row, void *context) {
+  ResultSink *sink = context;
+  struct iovec *chunk = &sink->chunks[sink->num_chunks - 1];
+  if (RESULT_SINK_CHUNK_SIZE - chunk->iov_len < RESULT_SINK_MAX_ROW_SIZE) {
+    if (sink->num_chunks == RESULT_SINK_NUM_CHUNKS) {
+      result_sink_flush(sink);
+    } else {
+      sink->num_chunks++;
+    }
+    chunk = &sink->chunks[sink->num_chunks - 1];
+  }
+
+  char *out = chunk->iov_base + chunk->iov_len;
+  if (sink->format == OUTPUT_TEXT) {
+    *out++ = '(';
+  }
+  for (uint32_t i = 0; i < sink->num_columns; i++) {
+    if (i > 0 && sink->format == OUTPUT_TEXT) {
+      *out++ = ',';
+      *out++ = ' ';
+    } else if (i > 0 && sink->format == OUTPUT_CSV) {
+      *out++ = ',';
+    }
+    out = format_column(sink->format, out, row, sink->columns[i]);
   }
+  if (sink->format == OUTPUT_TEXT) {
+    *out++ = ')';
+  }
+  if (sink->format != OUTPUT_BINARY) {
+    *out++ = '\n';
+  }
+  chunk->iov_len = out - (char *)chunk->iov_base;
 }
 
+#ifndef TINYDB_LIBRARY
 int main(int argc, char *argv[]) {
   if (argc < 2) {
     printf("Must supply a database filename.\n");
@@ -1037,15 +7617,87 @@ int main(int argc, char *argv[]) {
   }
 
   char *filename = argv[1];
-  Table *table = db_open(filename);
+  uint32_t max_frames = PAGER_DEFAULT_MAX_FRAMES;
+  uint32_t wal_group_size = WAL_DEFAULT_GROUP_COMMIT;
+  // Only used when the file is created
+  uint32_t page_size = DEFAULT_PAGE_SIZE;
+  uint32_t max_internal_cells = 0;
+  uint32_t max_leaf_cell_size = 0;
+  bool read_only = false;
+  /*
+  In batch mode a script is read without prompts, its output is written in
+  large blocks rather than flushed after each statement, and the end of the
+  script ends the session like .exit
+  */
+  bool batch = false;
+
+  for (int i = 2; i < argc; i++) {
+    if (strncmp(argv[i], "--cache-pages=", 14) == 0) {
+      max_frames = atoi(argv[i] + 14);
+    } else if (strncmp(argv[i], "--wal-group=", 12) == 0) {
+      wal_group_size = atoi(argv[i] + 12);
+    } else if (strncmp(argv[i], "--page-size=", 12) == 0) {
+      page_size = atoi(argv[i] + 12);
+    } else if (strncmp(argv[i], "--max-internal-cells=", 21) == 0) {
+      max_internal_cells = atoi(argv[i] + 21);
+    } else if (strncmp(argv[i], "--max-leaf-cell-size=", 21) == 0) {
+      max_leaf_cell_size = atoi(argv[i] + 21);
+    } else if (strcmp(argv[i], "--read-only") == 0) {
+      read_only = true;
+    } else if (strcmp(argv[i], "--batch") == 0) {
+      batch = true;
+    } else {
+      printf("Unknown option '%s'\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
 
+  Table *table;
+  if (read_only) {
+    table = db_open_read_only(filename, max_frames);
+  } else {
+    table = db_open_with_layout(filename, max_frames, page_size,
+                                max_internal_cells, max_leaf_cell_size);
+  }
+  if (table == NULL) {
+    exit(EXIT_FAILURE);
+  }
+  if (!read_only) {
+    table->pager->wal->group_size = wal_group_size > 0 ? wal_group_size : 1;
+  }
+
+  Output output = {.format = OUTPUT_TEXT, .fd = STDOUT_FILENO};
   InputBuffer *input_buffer = new_input_buffer();
   while (true) {
-    print_prompt();
-    read_input(input_buffer);
+    // The library keeps a db open after a page cannot be read; the REPL
+    // stops there, whatever command read it
+    if (db_error(table) != NULL) {
+      printf("%s\n", db_error(table));
+      exit(EXIT_FAILURE);
+    }
+    if (table->vacuum != NULL) {
+      VacuumProgress progress;
+      run_vacuum(table, false, &progress);
+    }
+    if (!batch) {
+      print_prompt();
+    }
+    if (!read_input(input_buffer)) {
+      if (!batch) {
+        printf("Error reading input\n");
+        exit(EXIT_FAILURE);
+      }
+      close_input_buffer(input_buffer);
+      if (table->vacuum != NULL) {
+        VacuumProgress progress;
+        run_vacuum(table, true, &progress);
+      }
+      db_close(table);
+      exit(EXIT_SUCCESS);
+    }
 
     if (input_buffer->buffer[0] == '.') {
-      switch (do_meta_command(input_buffer, table)) {
+      switch (do_meta_command(input_buffer, table, &output)) {
       case (META_COMMAND_SUCCESS):
         continue;
       case (META_COMMAND_SUCCESS_UNRECOGNIZED_COMMAND):
@@ -1055,7 +7707,7 @@ int main(int argc, char *argv[]) {
     }
 
     Statement statement;
-    switch (prepare_statement(input_buffer, &statement)) {
+    switch (prepare_statement(input_buffer->buffer, &statement)) {
       case (PREPARE_SUCCESS):
         break;
       case (PREPARE_STRING_TOO_LONG):
@@ -1072,8 +7724,21 @@ int main(int argc, char *argv[]) {
         continue;
     }
 
+    // A select's rows go out through a sink, after what stdout holds so far
+    ResultSink *sink = NULL;
+    if (statement.type == STATEMENT_SELECT) {
+      fflush(stdout);
+      sink = db_sink_open(output.fd, output.format, statement.columns,
+                          statement.num_columns);
+    }
+    ExecuteResult result = execute_statement(
+        &statement, table, sink != NULL ? db_sink_row : ignore_row_visitor,
+        sink);
+    if (sink != NULL) {
+      db_sink_close(sink);
+    }
 
-    switch (execute_statement(&statement, table)) {
+    switch (result) {
       case (EXECUTE_SUCCESS):
         printf("Executed.\n");
         break;
@@ -1083,7 +7748,29 @@ int main(int argc, char *argv[]) {
       case (EXECUTE_TABLE_FULL):
         printf("Error: Table full\n");
         break;
+      case (EXECUTE_ALREADY_IN_TRANSACTION):
+        printf("Error: Transaction already open.\n");
+        break;
+      case (EXECUTE_NO_TRANSACTION):
+        printf("Error: No transaction is open.\n");
+        break;
+      case (EXECUTE_READ_ONLY):
+        printf("Error: Db is open read-only.\n");
+        break;
+      case (EXECUTE_INDEX_EXISTS):
+        printf("Error: Index already exists.\n");
+        break;
+      case (EXECUTE_UNBOUND_PARAMETER):
+        printf("Error: Statement has a ? with no value bound.\n");
+        break;
+      case (EXECUTE_DB_ERROR):
+        printf("%s\n", db_error(table));
+        exit(EXIT_FAILURE);
+    }
+    statement_free(&statement);
+    if (!batch) {
+      fflush(stdout);
     }
-    fflush(stdout);
   }
 }
+#endif
@@ -3,39 +3,131 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/stat.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
 
-#define PAGE_SIZE 4096
-#define TABLE_MAX_PAGES 100
 #define INVALID_PAGE_NUM UINT32_MAX
+#define NUM_INDEXED_COLUMNS 2
+#define HEADER_MAGIC "tinydb\0\0"
+#define MIN_PAGE_SIZE 4096
+#define MAX_PAGE_SIZE 65536
+#define VERIFY_BATCH_PAGES 64
+#define VERIFY_MAX_THREADS 64
 
-typedef enum { NODE_INTERNAL, NODE_LEAF } NodeType;
+typedef enum { NODE_INTERNAL, NODE_LEAF, NODE_OVERFLOW, NODE_FREE } NodeType;
+
+const uint32_t PAGE_CHECKSUM_SIZE = sizeof(uint32_t);
+const uint32_t PAGE_CHECKSUM_OFFSET = 0;
+
+/* The same header layout as db.c; the page size is read from the file */
+const uint32_t HEADER_MAGIC_OFFSET = PAGE_CHECKSUM_OFFSET + PAGE_CHECKSUM_SIZE;
+const uint32_t HEADER_MAGIC_SIZE = 8;
+const uint32_t HEADER_VERSION_OFFSET = HEADER_MAGIC_OFFSET + HEADER_MAGIC_SIZE;
+const uint32_t HEADER_PAGE_SIZE_OFFSET = HEADER_VERSION_OFFSET + sizeof(uint32_t);
+const uint32_t HEADER_MAX_INTERNAL_CELLS_OFFSET = HEADER_PAGE_SIZE_OFFSET + sizeof(uint32_t);
+const uint32_t HEADER_MAX_LEAF_CELL_SIZE_OFFSET = HEADER_MAX_INTERNAL_CELLS_OFFSET + sizeof(uint32_t);
+const uint32_t HEADER_ROOT_PAGE_OFFSET = HEADER_MAX_LEAF_CELL_SIZE_OFFSET + sizeof(uint32_t);
+const uint32_t HEADER_INDEX_ROOTS_OFFSET = HEADER_ROOT_PAGE_OFFSET + sizeof(uint32_t);
+const uint32_t HEADER_FREELIST_HEAD_OFFSET =
+    HEADER_INDEX_ROOTS_OFFSET + NUM_INDEXED_COLUMNS * sizeof(uint32_t);
 
 const uint32_t NODE_TYPE_SIZE = sizeof(uint8_t);
-const uint32_t NODE_TYPE_OFFSET = 0;
+const uint32_t NODE_TYPE_OFFSET = PAGE_CHECKSUM_OFFSET + PAGE_CHECKSUM_SIZE;
 const uint32_t IS_ROOT_SIZE = sizeof(uint8_t);
-const uint32_t IS_ROOT_OFFSET = NODE_TYPE_SIZE;
+const uint32_t IS_ROOT_OFFSET = NODE_TYPE_OFFSET + NODE_TYPE_SIZE;
+const uint32_t NODE_KEY_SIZE_SIZE = sizeof(uint16_t);
+const uint32_t NODE_KEY_SIZE_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
 const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);
-const uint32_t PARENT_POINTER_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
-const uint8_t COMMON_NODE_HEADER_SIZE = NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE;
+const uint32_t PARENT_POINTER_OFFSET = NODE_KEY_SIZE_OFFSET + NODE_KEY_SIZE_SIZE;
+const uint8_t COMMON_NODE_HEADER_SIZE =
+    PAGE_CHECKSUM_SIZE + NODE_TYPE_SIZE + IS_ROOT_SIZE + NODE_KEY_SIZE_SIZE + PARENT_POINTER_SIZE;
+
+/* Keys of the table's tree and of an index's, as in db.c */
+const uint32_t TABLE_KEY_SIZE = sizeof(uint32_t);
+const uint32_t INDEX_KEY_SIZE = sizeof(uint64_t);
 
 const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE;
 const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET = INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
 const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE;
-const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
-const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
 
 const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET = LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
+const uint32_t LEAF_NODE_CONTENT_START_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_CONTENT_START_OFFSET = LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE + LEAF_NODE_CONTENT_START_SIZE;
+const uint32_t LEAF_NODE_SLOT_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_MAX_ENTRY_SIZE = INDEX_KEY_SIZE + LEAF_NODE_SLOT_SIZE;
+const uint32_t LEAF_NODE_PAYLOAD_OFFSET = sizeof(uint16_t);
+const uint32_t LEAF_NODE_OVERFLOW_POINTER_SIZE = sizeof(uint32_t);
+
+/* Set by read_layout from the header of the file being looked at */
+uint32_t PAGE_SIZE;
+uint32_t INTERNAL_NODE_MAX_CELLS;
+uint32_t LEAF_NODE_SPACE_FOR_CELLS;
+uint32_t LEAF_NODE_MAX_CELL_SIZE;
+uint32_t LEAF_NODE_MAX_LOCAL_PAYLOAD;
+
+const uint32_t OVERFLOW_NODE_NEXT_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t FREE_NODE_NEXT_OFFSET = COMMON_NODE_HEADER_SIZE;
 
 NodeType get_node_type(void* node) {
   return (NodeType)*((uint8_t*)(node + NODE_TYPE_OFFSET));
 }
 
+bool is_node_root(void* node) {
+  return (bool)*((uint8_t*)(node + IS_ROOT_OFFSET));
+}
+
+uint32_t node_key_size(void* node) {
+  return *(uint16_t*)(node + NODE_KEY_SIZE_OFFSET);
+}
+
+uint64_t key_get(void* key, uint32_t key_size) {
+  return key_size == TABLE_KEY_SIZE ? *(uint32_t*)key : *(uint64_t*)key;
+}
+
+/* Same as layout_open in db.c. False if the header is not a db's. */
+bool read_layout(int fd) {
+  uint8_t header[HEADER_ROOT_PAGE_OFFSET];
+  if (pread(fd, header, sizeof(header), 0) != sizeof(header) ||
+      memcmp(header + HEADER_MAGIC_OFFSET, HEADER_MAGIC, HEADER_MAGIC_SIZE) != 0) {
+    return false;
+  }
+  uint32_t page_size = *(uint32_t*)(header + HEADER_PAGE_SIZE_OFFSET);
+  uint32_t max_internal_cells = *(uint32_t*)(header + HEADER_MAX_INTERNAL_CELLS_OFFSET);
+  uint32_t max_leaf_cell_size = *(uint32_t*)(header + HEADER_MAX_LEAF_CELL_SIZE_OFFSET);
+  if (page_size < MIN_PAGE_SIZE || page_size > MAX_PAGE_SIZE || (page_size & (page_size - 1)) != 0 ||
+      max_internal_cells < 1 ||
+      max_internal_cells >= (page_size - INTERNAL_NODE_HEADER_SIZE) / (INTERNAL_NODE_CHILD_SIZE + TABLE_KEY_SIZE) ||
+      max_leaf_cell_size % 4 != 0 || max_leaf_cell_size <= LEAF_NODE_PAYLOAD_OFFSET + LEAF_NODE_OVERFLOW_POINTER_SIZE ||
+      max_leaf_cell_size > ((page_size - LEAF_NODE_HEADER_SIZE) / 4 - LEAF_NODE_MAX_ENTRY_SIZE)) {
+    return false;
+  }
+  PAGE_SIZE = page_size;
+  INTERNAL_NODE_MAX_CELLS = max_internal_cells;
+  LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
+  LEAF_NODE_MAX_CELL_SIZE = max_leaf_cell_size;
+  LEAF_NODE_MAX_LOCAL_PAYLOAD = LEAF_NODE_MAX_CELL_SIZE - LEAF_NODE_PAYLOAD_OFFSET - LEAF_NODE_OVERFLOW_POINTER_SIZE;
+  return true;
+}
+
+uint32_t* node_parent(void* node) {
+  return node + PARENT_POINTER_OFFSET;
+}
+
 uint32_t* internal_node_num_keys(void* node) {
   return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
 }
@@ -45,49 +137,607 @@ uint32_t* internal_node_right_child(void* node) {
 }
 
 uint32_t* internal_node_cell(void* node, uint32_t cell_num) {
-  return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+  return node + INTERNAL_NODE_HEADER_SIZE + cell_num * (INTERNAL_NODE_CHILD_SIZE + node_key_size(node));
+}
+
+uint64_t internal_node_key(void* node, uint32_t key_num) {
+  return key_get((void*)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE, node_key_size(node));
 }
 
 uint32_t* leaf_node_num_cells(void* node) {
   return node + LEAF_NODE_NUM_CELLS_OFFSET;
 }
 
-int main(int argc, char* argv[]) {
-  if (argc < 2) {
-    printf("Usage: %s <db_file>\n", argv[0]);
-    return 1;
+uint32_t* leaf_node_next_leaf(void* node) {
+  return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+}
+
+uint32_t* leaf_node_content_start(void* node) {
+  return node + LEAF_NODE_CONTENT_START_OFFSET;
+}
+
+uint64_t leaf_node_key(void* node, uint32_t cell_num) {
+  return key_get(node + LEAF_NODE_HEADER_SIZE + cell_num * node_key_size(node), node_key_size(node));
+}
+
+uint16_t* leaf_node_slot(void* node, uint32_t cell_num) {
+  return node + LEAF_NODE_HEADER_SIZE + *leaf_node_num_cells(node) * node_key_size(node) +
+         cell_num * LEAF_NODE_SLOT_SIZE;
+}
+
+/* Same as leaf_cell_size in db.c */
+uint32_t leaf_cell_size(uint32_t payload_size) {
+  uint32_t size = LEAF_NODE_PAYLOAD_OFFSET;
+  if (payload_size > LEAF_NODE_MAX_LOCAL_PAYLOAD) {
+    size += LEAF_NODE_MAX_LOCAL_PAYLOAD + LEAF_NODE_OVERFLOW_POINTER_SIZE;
+  } else {
+    size += payload_size;
   }
-  
-  int fd = open(argv[1], O_RDONLY);
-  if (fd < 0) {
-    perror("open");
+  return (size + 3) & ~3u;
+}
+
+/* CRC32C, the same way db.c computes it */
+uint32_t crc32c_table[256];
+
+void crc32c_init_table() {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+    }
+    crc32c_table[i] = crc;
+  }
+}
+
+uint32_t crc32c_bytes(uint32_t crc, const uint8_t* data, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    crc = crc32c_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2"))) uint32_t crc32c_sse42(uint32_t crc, const uint8_t* data, size_t length) {
+  for (; length >= sizeof(uint64_t); length -= sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc = (uint32_t)_mm_crc32_u64(crc, word);
+    data += sizeof(word);
+  }
+  for (; length > 0; length--) {
+    crc = _mm_crc32_u8(crc, *data++);
+  }
+  return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t length) {
+  crc = ~crc;
+#if defined(__ARM_FEATURE_CRC32)
+  const uint8_t* bytes = data;
+  for (; length >= sizeof(uint64_t); length -= sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    crc = __crc32cd(crc, word);
+    bytes += sizeof(word);
+  }
+  for (; length > 0; length--) {
+    crc = __crc32cb(crc, *bytes++);
+  }
+#elif defined(__x86_64__) && defined(__GNUC__)
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc = crc32c_sse42(crc, data, length);
+  } else {
+    crc = crc32c_bytes(crc, data, length);
+  }
+#else
+  crc = crc32c_bytes(crc, data, length);
+#endif
+  return ~crc;
+}
+
+bool page_checksum_ok(uint32_t page_num, void* page) {
+  uint32_t crc = crc32c(0, &page_num, sizeof(page_num));
+  crc = crc32c(crc, page + PAGE_CHECKSUM_OFFSET + PAGE_CHECKSUM_SIZE,
+               PAGE_SIZE - PAGE_CHECKSUM_OFFSET - PAGE_CHECKSUM_SIZE);
+  // Every page inside the file is written with its checksum, zeros included
+  return *(uint32_t*)(page + PAGE_CHECKSUM_OFFSET) == crc;
+}
+
+/*
+ * Verify
+ *
+ * First every page is read and checked on its own: checksum, node type,
+ * keys in order, cells inside the page, page numbers inside the file. The
+ * file is split into batches that worker threads take in turn, and what
+ * each page says about its place in the tree goes into a PageInfo.
+ *
+ * Then the trees, the overflow chains and the freelist are walked from the
+ * header using only the PageInfos, checking parent pointers, key ranges
+ * and the leaf sibling links. Each page can be reached once; a second
+ * visit is reported and not followed, so a page pointing back at its own
+ * ancestor (like test_hang.db) cannot send the walk round in circles.
+ * Pages nothing reaches are reported last.
+ */
+typedef struct {
+  char problem[96];  // First thing wrong with the page itself, "" if none
+  bool usable;       // Safe to follow the page numbers it holds
+  bool reached;
+  NodeType type;
+  bool is_root;
+  uint32_t parent;
+  uint32_t key_size;  // Of a leaf or internal node
+  uint32_t num_keys;  // Cells of a leaf, keys of an internal node
+  uint64_t min_key;
+  uint64_t max_key;
+  uint32_t next;  // Next leaf, overflow or free page, 0 for none
+  uint64_t* keys;      // Of an internal node, and the children either side
+  uint32_t* children;
+  uint32_t* overflow;  // First overflow page of each long cell of a leaf
+  uint32_t num_overflow;
+} PageInfo;
+
+typedef struct {
+  int fd;
+  uint32_t num_pages;
+  PageInfo* pages;
+  uint32_t next_batch;  // First page of the next batch nobody has taken
+  pthread_mutex_t lock;
+  uint32_t num_problems;
+} Verifier;
+
+bool page_num_ok(Verifier* v, uint32_t page_num) {
+  return page_num > 0 && page_num < v->num_pages;
+}
+
+void check_leaf(Verifier* v, void* node, PageInfo* info) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t entry_size = node_key_size(node) + LEAF_NODE_SLOT_SIZE;
+  if (num_cells > LEAF_NODE_SPACE_FOR_CELLS / entry_size) {
+    snprintf(info->problem, sizeof(info->problem), "leaf has %u cells", num_cells);
+    return;
+  }
+  uint32_t content_start = *leaf_node_content_start(node);
+  if (content_start < LEAF_NODE_HEADER_SIZE + num_cells * entry_size ||
+      content_start > PAGE_SIZE) {
+    snprintf(info->problem, sizeof(info->problem),
+             "cells start at %u, inside the slot array or past the page", content_start);
+    return;
+  }
+  uint32_t next_leaf = *leaf_node_next_leaf(node);
+  if (next_leaf != 0 && !page_num_ok(v, next_leaf)) {
+    snprintf(info->problem, sizeof(info->problem), "next leaf %u is not a page", next_leaf);
+    return;
+  }
+
+  info->overflow = malloc((num_cells > 0 ? num_cells : 1) * sizeof(uint32_t));
+  for (uint32_t i = 0; i < num_cells; i++) {
+    uint64_t key = leaf_node_key(node, i);
+    if (i > 0 && key <= leaf_node_key(node, i - 1)) {
+      snprintf(info->problem, sizeof(info->problem), "key %llu of cell %u is out of order",
+               (unsigned long long)key, i);
+      return;
+    }
+    uint32_t offset = *leaf_node_slot(node, i);
+    if (offset < content_start || offset + LEAF_NODE_PAYLOAD_OFFSET > PAGE_SIZE) {
+      snprintf(info->problem, sizeof(info->problem), "cell %u is at %u, outside the cells", i, offset);
+      return;
+    }
+    uint32_t payload_size = *(uint16_t*)(node + offset);
+    if (offset + leaf_cell_size(payload_size) > PAGE_SIZE) {
+      snprintf(info->problem, sizeof(info->problem), "cell %u runs past the end of the page", i);
+      return;
+    }
+    if (payload_size > LEAF_NODE_MAX_LOCAL_PAYLOAD) {
+      uint32_t overflow = *(uint32_t*)(node + offset + LEAF_NODE_PAYLOAD_OFFSET + LEAF_NODE_MAX_LOCAL_PAYLOAD);
+      if (!page_num_ok(v, overflow)) {
+        snprintf(info->problem, sizeof(info->problem), "cell %u overflows to %u, which is not a page", i, overflow);
+        return;
+      }
+      info->overflow[info->num_overflow++] = overflow;
+    }
+  }
+
+  info->num_keys = num_cells;
+  if (num_cells > 0) {
+    info->min_key = leaf_node_key(node, 0);
+    info->max_key = leaf_node_key(node, num_cells - 1);
+  }
+  info->next = next_leaf;
+  info->usable = true;
+}
+
+void check_internal(Verifier* v, void* node, PageInfo* info) {
+  uint32_t num_keys = *internal_node_num_keys(node);
+  uint32_t cell_size = INTERNAL_NODE_CHILD_SIZE + node_key_size(node);
+  if (num_keys > INTERNAL_NODE_MAX_CELLS ||
+      num_keys >= (PAGE_SIZE - INTERNAL_NODE_HEADER_SIZE) / cell_size) {
+    snprintf(info->problem, sizeof(info->problem), "internal node has %u keys", num_keys);
+    return;
+  }
+  info->keys = malloc((num_keys > 0 ? num_keys : 1) * sizeof(uint64_t));
+  info->children = malloc((num_keys + 1) * sizeof(uint32_t));
+  for (uint32_t i = 0; i <= num_keys; i++) {
+    uint32_t child = i < num_keys ? *internal_node_cell(node, i) : *internal_node_right_child(node);
+    if (!page_num_ok(v, child)) {
+      snprintf(info->problem, sizeof(info->problem), "child %u is %u, which is not a page", i, child);
+      return;
+    }
+    info->children[i] = child;
+  }
+  for (uint32_t i = 0; i < num_keys; i++) {
+    info->keys[i] = internal_node_key(node, i);
+    if (i > 0 && info->keys[i] <= info->keys[i - 1]) {
+      snprintf(info->problem, sizeof(info->problem), "key %u is out of order", i);
+      return;
+    }
+  }
+
+  info->num_keys = num_keys;
+  if (num_keys > 0) {
+    info->min_key = info->keys[0];
+    info->max_key = info->keys[num_keys - 1];
+  }
+  info->usable = true;
+}
+
+void check_page(Verifier* v, uint32_t page_num, void* node) {
+  PageInfo* info = &v->pages[page_num];
+  bool checksum_ok = page_checksum_ok(page_num, node);
+  if (page_num == 0) {
+    info->usable = true;
+  } else {
+    info->type = get_node_type(node);
+    info->is_root = is_node_root(node);
+    info->parent = *node_parent(node);
+    uint32_t next = *(uint32_t*)(node + COMMON_NODE_HEADER_SIZE);
+    info->key_size = node_key_size(node);
+    switch (info->type) {
+      case NODE_LEAF:
+      case NODE_INTERNAL:
+        if (info->key_size != TABLE_KEY_SIZE && info->key_size != INDEX_KEY_SIZE) {
+          snprintf(info->problem, sizeof(info->problem), "keys are %u bytes", info->key_size);
+        } else if (info->type == NODE_LEAF) {
+          check_leaf(v, node, info);
+        } else {
+          check_internal(v, node, info);
+        }
+        break;
+      case NODE_OVERFLOW:
+      case NODE_FREE:
+        if (next != 0 && !page_num_ok(v, next)) {
+          snprintf(info->problem, sizeof(info->problem), "next page %u is not a page", next);
+        } else {
+          info->next = next;
+          info->usable = true;
+        }
+        break;
+      default:
+        snprintf(info->problem, sizeof(info->problem), "unknown node type %u", info->type);
+    }
+  }
+  // A bad checksum is reported ahead of whatever else is wrong
+  if (!checksum_ok) {
+    snprintf(info->problem, sizeof(info->problem), "checksum mismatch");
+  }
+}
+
+void* verify_worker(void* arg) {
+  Verifier* v = arg;
+  void* batch = malloc(VERIFY_BATCH_PAGES * PAGE_SIZE);
+  while (true) {
+    pthread_mutex_lock(&v->lock);
+    uint32_t first = v->next_batch;
+    v->next_batch += VERIFY_BATCH_PAGES;
+    pthread_mutex_unlock(&v->lock);
+    if (first >= v->num_pages) {
+      break;
+    }
+
+    uint32_t count = v->num_pages - first;
+    if (count > VERIFY_BATCH_PAGES) {
+      count = VERIFY_BATCH_PAGES;
+    }
+    ssize_t length = (ssize_t)count * PAGE_SIZE;
+    if (pread(v->fd, batch, length, (off_t)first * PAGE_SIZE) != length) {
+      perror("pread");
+      exit(1);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      check_page(v, first + i, batch + i * PAGE_SIZE);
+    }
+  }
+  free(batch);
+  return NULL;
+}
+
+void report(Verifier* v, uint32_t page_num, const char* problem) {
+  printf("Page %u: %s\n", page_num, problem);
+  v->num_problems++;
+}
+
+/* Claim a page for whatever reached it. False if it cannot be claimed. */
+bool reach(Verifier* v, uint32_t page_num, uint32_t from) {
+  PageInfo* info = &v->pages[page_num];
+  if (info->reached) {
+    char problem[96];
+    snprintf(problem, sizeof(problem), "reached again from page %u", from);
+    report(v, page_num, problem);
+    return false;
+  }
+  info->reached = true;
+  return info->usable;
+}
+
+void walk_overflow(Verifier* v, uint32_t page_num, uint32_t from) {
+  while (page_num != 0 && reach(v, page_num, from)) {
+    if (v->pages[page_num].type != NODE_OVERFLOW) {
+      report(v, page_num, "in an overflow chain but not an overflow page");
+      return;
+    }
+    from = page_num;
+    page_num = v->pages[page_num].next;
+  }
+}
+
+void walk_freelist(Verifier* v, uint32_t page_num) {
+  uint32_t from = 0;
+  while (page_num != 0 && reach(v, page_num, from)) {
+    if (v->pages[page_num].type != NODE_FREE) {
+      report(v, page_num, "on the freelist but not a free page");
+      return;
+    }
+    from = page_num;
+    page_num = v->pages[page_num].next;
+  }
+}
+
+typedef struct {
+  uint32_t page_num;
+  uint32_t parent;
+  bool has_low;  // Keys must be above low; the leftmost nodes have no bound
+  uint64_t low;
+  bool has_high;  // Keys must be at most high
+  uint64_t high;
+} WalkEntry;
+
+/*
+Walk a tree depth first, left to right, so the leaves come out in key
+order and each one's next leaf can be checked against the one after it.
+Every node of the tree must have keys of key_size bytes.
+*/
+void walk_tree(Verifier* v, uint32_t root, uint32_t key_size) {
+  if (!page_num_ok(v, root)) {
+    char problem[96];
+    snprintf(problem, sizeof(problem), "root %u is not a page", root);
+    report(v, 0, problem);
+    return;
+  }
+
+  uint32_t stack_capacity = 64;
+  WalkEntry* stack = malloc(stack_capacity * sizeof(WalkEntry));
+  uint32_t stack_size = 0;
+  stack[stack_size++] = (WalkEntry){.page_num = root, .parent = 0};
+  uint32_t last_leaf = 0;
+  char problem[96];
+
+  while (stack_size > 0) {
+    WalkEntry entry = stack[--stack_size];
+    if (!reach(v, entry.page_num, entry.parent)) {
+      if (!v->pages[entry.page_num].usable) {
+        // The leaves under it are unknown, so start the sibling check over
+        last_leaf = 0;
+      }
+      continue;
+    }
+    PageInfo* info = &v->pages[entry.page_num];
+
+    if (info->type != NODE_LEAF && info->type != NODE_INTERNAL) {
+      report(v, entry.page_num, "in a tree but not a leaf or internal node");
+      continue;
+    }
+    if (info->key_size != key_size) {
+      snprintf(problem, sizeof(problem), "keys are %u bytes, not %u as in its tree", info->key_size, key_size);
+      report(v, entry.page_num, problem);
+      continue;
+    }
+    if (info->is_root != (entry.page_num == root)) {
+      report(v, entry.page_num, info->is_root ? "marked as a root but has a parent" : "root not marked as one");
+    }
+    if (entry.page_num != root && info->parent != entry.parent) {
+      snprintf(problem, sizeof(problem), "parent pointer is %u, not %u", info->parent, entry.parent);
+      report(v, entry.page_num, problem);
+    }
+    if (info->num_keys > 0 && ((entry.has_low && info->min_key <= entry.low) ||
+                               (entry.has_high && info->max_key > entry.high))) {
+      snprintf(problem, sizeof(problem), "keys %llu..%llu are outside the range its parent gives it",
+               (unsigned long long)info->min_key, (unsigned long long)info->max_key);
+      report(v, entry.page_num, problem);
+    }
+
+    if (info->type == NODE_LEAF) {
+      if (last_leaf != 0 && v->pages[last_leaf].next != entry.page_num) {
+        snprintf(problem, sizeof(problem), "next leaf is %u, not %u", v->pages[last_leaf].next,
+                 entry.page_num);
+        report(v, last_leaf, problem);
+      }
+      last_leaf = entry.page_num;
+      for (uint32_t i = 0; i < info->num_overflow; i++) {
+        walk_overflow(v, info->overflow[i], entry.page_num);
+      }
+      continue;
+    }
+
+    // Pushed right to left so the leftmost child is walked first
+    if (stack_size + info->num_keys + 1 > stack_capacity) {
+      stack_capacity = 2 * (stack_size + info->num_keys + 1);
+      stack = realloc(stack, stack_capacity * sizeof(WalkEntry));
+    }
+    for (int32_t i = info->num_keys; i >= 0; i--) {
+      WalkEntry child = entry;
+      child.page_num = info->children[i];
+      child.parent = entry.page_num;
+      if (i > 0) {
+        child.has_low = true;
+        child.low = info->keys[i - 1];
+      }
+      if (i < (int32_t)info->num_keys) {
+        child.has_high = true;
+        child.high = info->keys[i];
+      }
+      stack[stack_size++] = child;
+    }
+  }
+
+  if (last_leaf != 0 && v->pages[last_leaf].next != 0) {
+    snprintf(problem, sizeof(problem), "last leaf links to %u", v->pages[last_leaf].next);
+    report(v, last_leaf, problem);
+  }
+  free(stack);
+}
+
+int verify(int fd, uint32_t num_threads) {
+  struct stat file_stat;
+  fstat(fd, &file_stat);
+  if (file_stat.st_size == 0 || file_stat.st_size % PAGE_SIZE != 0) {
+    printf("File is empty or not a whole number of pages\n");
     return 1;
   }
-  
-  void* pages[10];
-  for (int i = 0; i < 10; i++) {
-    pages[i] = malloc(PAGE_SIZE);
-    ssize_t r = pread(fd, pages[i], PAGE_SIZE, i * PAGE_SIZE);
-    if (r <= 0) break;
-    
-    void* node = pages[i];
+
+  Verifier v;
+  v.fd = fd;
+  v.num_pages = file_stat.st_size / PAGE_SIZE;
+  v.pages = calloc(v.num_pages, sizeof(PageInfo));
+  v.next_batch = 0;
+  v.num_problems = 0;
+  pthread_mutex_init(&v.lock, NULL);
+
+  pthread_t threads[VERIFY_MAX_THREADS];
+  for (uint32_t i = 0; i < num_threads; i++) {
+    pthread_create(&threads[i], NULL, verify_worker, &v);
+  }
+  for (uint32_t i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  // Problems with single pages, in page order
+  for (uint32_t i = 0; i < v.num_pages; i++) {
+    if (v.pages[i].problem[0] != '\0') {
+      report(&v, i, v.pages[i].problem);
+    }
+  }
+
+  uint8_t* header = malloc(PAGE_SIZE);
+  pread(fd, header, PAGE_SIZE, 0);
+  v.pages[0].reached = true;
+  walk_tree(&v, *(uint32_t*)(header + HEADER_ROOT_PAGE_OFFSET), TABLE_KEY_SIZE);
+  for (uint32_t i = 0; i < NUM_INDEXED_COLUMNS; i++) {
+    uint32_t index_root = *(uint32_t*)(header + HEADER_INDEX_ROOTS_OFFSET + i * sizeof(uint32_t));
+    if (index_root != 0) {
+      walk_tree(&v, index_root, INDEX_KEY_SIZE);
+    }
+  }
+  uint32_t freelist_head = *(uint32_t*)(header + HEADER_FREELIST_HEAD_OFFSET);
+  if (freelist_head != 0 && !page_num_ok(&v, freelist_head)) {
+    report(&v, 0, "freelist head is not a page");
+  } else {
+    walk_freelist(&v, freelist_head);
+  }
+  free(header);
+
+  for (uint32_t i = 0; i < v.num_pages; i++) {
+    if (!v.pages[i].reached) {
+      report(&v, i, "not in any tree or on the freelist");
+    }
+    free(v.pages[i].overflow);
+    free(v.pages[i].keys);
+    free(v.pages[i].children);
+  }
+
+  if (v.num_problems == 0) {
+    printf("Checked %u pages: ok\n", v.num_pages);
+  } else {
+    printf("Checked %u pages: %u problem%s\n", v.num_pages, v.num_problems,
+           v.num_problems == 1 ? "" : "s");
+  }
+  free(v.pages);
+  return v.num_problems == 0 ? 0 : 1;
+}
+
+void dump(int fd) {
+  void* node = malloc(PAGE_SIZE);
+  for (uint32_t i = 0; pread(fd, node, PAGE_SIZE, (off_t)i * PAGE_SIZE) == PAGE_SIZE; i++) {
     NodeType type = get_node_type(node);
-    
+
     printf("Page %d: ", i);
-    if (type == NODE_LEAF) {
+    if (i == 0) {
+      // Page 0 is the file header, with the layout and the table's root page
+      printf("HEADER, page_size=%u, max_internal_cells=%u, max_leaf_cell_size=%u, root=%u\n", PAGE_SIZE,
+             INTERNAL_NODE_MAX_CELLS, LEAF_NODE_MAX_CELL_SIZE, *(uint32_t*)(node + HEADER_ROOT_PAGE_OFFSET));
+    } else if (type == NODE_OVERFLOW) {
+      printf("OVERFLOW\n");
+    } else if (type == NODE_FREE) {
+      printf("FREE, next=%u\n", *(uint32_t*)(node + FREE_NODE_NEXT_OFFSET));
+    } else if (type == NODE_LEAF) {
       printf("LEAF, num_cells=%u\n", *leaf_node_num_cells(node));
     } else {
       uint32_t num_keys = *internal_node_num_keys(node);
       uint32_t right_child = *internal_node_right_child(node);
       printf("INTERNAL, num_keys=%u, right_child=%u, children: ", num_keys, right_child);
-      for (uint32_t j = 0; j < num_keys; j++) {
+      uint32_t cell_size = INTERNAL_NODE_CHILD_SIZE + node_key_size(node);
+      for (uint32_t j = 0; j < num_keys && INTERNAL_NODE_HEADER_SIZE + (j + 1) * cell_size <= PAGE_SIZE; j++) {
         uint32_t* cell = internal_node_cell(node, j);
         printf("%u ", *cell);
       }
       printf("\n");
     }
   }
-  
+  free(node);
+}
+
+int main(int argc, char* argv[]) {
+  bool verify_mode = false;
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  const char* filename = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--verify") == 0) {
+      verify_mode = true;
+    } else if (strncmp(argv[i], "--threads=", strlen("--threads=")) == 0) {
+      num_threads = atol(argv[i] + strlen("--threads="));
+    } else {
+      filename = argv[i];
+    }
+  }
+  if (filename == NULL) {
+    printf("Usage: %s [--verify [--threads=N]] <db_file>\n", argv[0]);
+    return 1;
+  }
+  if (num_threads < 1) {
+    num_threads = 1;
+  } else if (num_threads > VERIFY_MAX_THREADS) {
+    num_threads = VERIFY_MAX_THREADS;
+  }
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    perror("open");
+    return 1;
+  }
+
+  if (!read_layout(fd)) {
+    printf("File is not a db\n");
+    close(fd);
+    return 1;
+  }
+
+  crc32c_init_table();
+  int result = 0;
+  if (verify_mode) {
+    result = verify(fd, num_threads);
+  } else {
+    dump(fd);
+  }
+
   close(fd);
-  return 0;
+  return result;
 }
@@ -1,11 +1,15 @@
 describe 'database' do
   before do
-    `rm -rf test.db`
+    `rm -rf test.db test.db-wal import.csv archive.db export.csv export.bin snapshot.db snapshot.db-wal test.db.vacuum test.db.vacuum-wal not_a_db.db library_errors library_errors.c vacuum_reader vacuum_reader.c`
   end
 
-  def run_script(commands)
+  after do
+    `rm -rf import.csv export.csv export.bin snapshot.db snapshot.db-wal`
+  end
+
+  def run_script(commands, options = "", filename = "test.db")
     raw_output = nil
-    IO.popen("./db test.db", "r+") do |pipe|
+    IO.popen("./db #{filename} #{options}", "r+") do |pipe|
       commands.each do |command|
         begin
           pipe.puts command
@@ -22,6 +26,24 @@ describe 'database' do
     raw_output.split("\n")
   end
 
+  # Rows padded to the column limits. Each one takes 300 bytes of a leaf, so
+  # 13 fit in a leaf, which keeps the tree shapes below small.
+  def wide_username(i)
+    "user#{i}".ljust(32, "u")
+  end
+
+  def wide_email(i)
+    "person#{i}@example.com".rjust(255, "p")
+  end
+
+  def wide_insert(i)
+    "insert #{i} #{wide_username(i)} #{wide_email(i)}"
+  end
+
+  def wide_row(i)
+    "(#{i}, #{wide_username(i)}, #{wide_email(i)})"
+  end
+
   it 'inserts and retrieves a row' do
     result = run_script([
       "insert 1 user1 person1@example.com",
@@ -57,6 +79,99 @@ describe 'database' do
     ])
   end
 
+  it 'keeps every row when the page cache is smaller than the table' do
+    script = (1..100).map { |i| wide_insert(i) }
+    script << ".exit"
+    run_script(script, "--cache-pages=2")
+
+    result = run_script(["select", ".exit"], "--cache-pages=2")
+    expected = (1..100).map { |i| wide_row(i) }
+    expected[0] = "db > #{expected[0]}"
+    expect(result).to match_array(expected + ["Executed.", "db > "])
+  end
+
+  it 'does not write to the file in a session that only reads' do
+    run_script(["insert 1 user1 person1@example.com", ".exit"])
+    File.utime(Time.at(0), Time.at(0), "test.db")
+
+    run_script(["select", ".exit"])
+    expect(File.mtime("test.db")).to eq(Time.at(0))
+  end
+
+  it 'keeps committed rows when the process dies before .exit' do
+    run_script([
+      "insert 1 user1 person1@example.com",
+      "insert 2 user2 person2@example.com",
+    ])
+
+    result = run_script(["select", ".exit"])
+    expect(result).to match_array([
+      "db > (1, user1, person1@example.com)",
+      "(2, user2, person2@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'discards rows inserted in a rolled back transaction' do
+    script = ["insert 1 user1 person1@example.com", "begin"]
+    script += (2..30).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script += ["rollback", "select", ".exit"]
+    result = run_script(script)
+
+    expect(result.last(4)).to match_array([
+      "db > Executed.",
+      "db > (1, user1, person1@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'reads rows but refuses writes when opened read-only' do
+    run_script(["insert 1 user1 person1@example.com", ".exit"])
+
+    result = run_script([
+      "select",
+      "insert 2 user2 person2@example.com",
+      ".exit",
+    ], "--read-only")
+    expect(result).to match_array([
+      "db > (1, user1, person1@example.com)",
+      "Executed.",
+      "db > Error: Db is open read-only.",
+      "db > ",
+    ])
+  end
+
+  it 'imports unsorted rows from a csv file and skips duplicate keys' do
+    File.write("import.csv", "3,user3,person3@example.com\n" \
+                             "1,user1,person1@example.com\n" \
+                             "2,user2,person2@example.com\n" \
+                             "1,again,again@example.com\n")
+    result = run_script([".import import.csv", "select", ".exit"])
+
+    expect(result).to match_array([
+      "db > Imported 3 rows.",
+      "Skipped 1 duplicate keys.",
+      "db > (1, user1, person1@example.com)",
+      "(2, user2, person2@example.com)",
+      "(3, user3, person3@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'packs full leaves when importing into an empty table' do
+    rows = (1..26).map { |i| "#{i},#{wide_username(i)},#{wide_email(i)}\n" }
+    File.write("import.csv", rows.join)
+    result = run_script([".import import.csv", ".btree", ".exit"])
+
+    expect(result.select { |line| line.include?("leaf") }).to match_array([
+      "  - leaf (size 13)",
+      "  - leaf (size 13)",
+    ])
+  end
+
   it 'prints error message when table is full' do
     script = (1..1401).map do |i|
       "insert #{i} user#{i} person#{i}@example.com"
@@ -133,6 +248,486 @@ describe 'database' do
     ])
   end
 
+  it 'inserts several rows in one statement' do
+    script = [
+      "insert 1 user1 person1@example.com, 2 user2 person2@example.com",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result).to match_array([
+      "db > Executed.",
+      "db > (1, user1, person1@example.com)",
+      "(2, user2, person2@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'inserts none of the rows when a multi-row insert has a duplicate id' do
+    script = [
+      "insert 1 user1 person1@example.com",
+      "insert 2 user2 person2@example.com, 1 user1 person1@example.com",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result).to match_array([
+      "db > Executed.",
+      "db > Error: Duplicate key.",
+      "db > (1, user1, person1@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'selects ranges of ids with where and limit' do
+    script = (1..30).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "select where id = 17"
+    script << "select where id >= 12 and id < 15"
+    script << "select where id between 28 and 40 limit 2"
+    script << "select where id > 30"
+    script << ".exit"
+    result = run_script(script)
+    expect(result[30..-1]).to match_array([
+      "db > (17, user17, person17@example.com)",
+      "Executed.",
+      "db > (12, user12, person12@example.com)",
+      "(13, user13, person13@example.com)",
+      "(14, user14, person14@example.com)",
+      "Executed.",
+      "db > (28, user28, person28@example.com)",
+      "(29, user29, person29@example.com)",
+      "Executed.",
+      "db > Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'runs a script in batch mode without prompts' do
+    script = [
+      "insert 1 'user one' person1@example.com, 2 user2 person2@example.com",
+      "SELECT WHERE id>=1 AND username = 'user one'",
+      "insert 3 ? person3@example.com",
+      "insert 4 'user4 person4@example.com",
+      "select",
+    ]
+    result = run_script(script, "--batch")
+    expect(result).to match_array([
+      "Executed.",
+      "(1, user one, person1@example.com)",
+      "Executed.",
+      "Error: Statement has a ? with no value bound.",
+      "Syntax error. Could not parse statement. ",
+      "(1, user one, person1@example.com)",
+      "(2, user2, person2@example.com)",
+      "Executed.",
+    ])
+  end
+
+  it 'writes selected columns as text, csv or binary' do
+    result = run_script([
+      "insert 1 user1 person1@example.com",
+      "insert 2 'a,b' 'say \"hi\"'",
+      "select email, id where id >= 2",
+      ".mode csv",
+      ".output export.csv",
+      "select",
+      ".output",
+      "select username",
+      ".mode binary",
+      ".output export.bin",
+      "select id, username where id = 1",
+      ".exit",
+    ])
+    expect(result).to eq([
+      "db > Executed.",
+      "db > Executed.",
+      "db > (say \"hi\", 2)",
+      "Executed.",
+      "db > db > db > Executed.",
+      "db > db > user1",
+      "\"a,b\"",
+      "Executed.",
+      "db > db > db > Executed.",
+      "db > ",
+    ])
+    expect(File.read("export.csv")).to eq(
+      "1,user1,person1@example.com\n" \
+      "2,\"a,b\",\"say \"\"hi\"\"\"\n"
+    )
+    expect(File.binread("export.bin")).to eq([1, 5].pack("LS") + "user1")
+  end
+
+  it 'prints counters and the shape of the tree' do
+    script = (1..14).map { |i| wide_insert(i) }
+    result = run_script(script + [".stats", ".stats reset", ".stats", ".exit"])
+    counts = result[14..16].map { |line| line.gsub(/\d+/, "N") }
+    expect(counts).to eq([
+      "db > Cache: N hits, N misses",
+      "Read: N pages, N bytes",
+      "Written: N pages, N bytes",
+    ])
+    expect(result[17..19]).to eq([
+      "Splits: 1 leaf, 0 internal",
+      "Tree: height 2, 2 leaves, 1 internal nodes",
+      "Leaf fill: 50-60% 2",
+    ])
+    expect(result[20]).to match(/^insert: 14 in \d+\.\d+ ms(, <\d+us \d+)+$/)
+    expect(result[21..-1]).to eq([
+      "db > db > Cache: 0 hits, 0 misses",
+      "Read: 0 pages, 0 bytes",
+      "Written: 0 pages, 0 bytes",
+      "Splits: 0 leaf, 0 internal",
+      "Tree: height 2, 2 leaves, 1 internal nodes",
+      "Leaf fill: 50-60% 2",
+      "db > ",
+    ])
+  end
+
+  it 'finds rows by username through an index' do
+    script = [
+      "insert 1 alice person1@example.com",
+      "insert 2 bob person2@example.com",
+      "create index on username",
+      "insert 3 alice person3@example.com",
+      ".exit",
+    ]
+    run_script(script)
+
+    result = run_script([
+      "select where username = alice",
+      "create index on username",
+      ".exit",
+    ])
+    expect(result).to match_array([
+      "db > (1, alice, person1@example.com)",
+      "(3, alice, person3@example.com)",
+      "Executed.",
+      "db > Error: Index already exists.",
+      "db > ",
+    ])
+  end
+
+  it 'indexes many rows with the same value' do
+    script = ["create index on username"]
+    script += (1..300).map { |i| "insert #{i} same person#{i}@example.com" }
+    script += ["delete where id <= 200", "select where username = same", ".exit"]
+    result = run_script(script)
+    expected = (201..300).map { |i| "(#{i}, same, person#{i}@example.com)" }
+    expected[0] = "db > #{expected[0]}"
+    expect(result[302...result.length]).to eq(expected + ["Executed.", "db > "])
+    expect(`./debug_tree --verify test.db`.split("\n").last).to match(/: ok$/)
+  end
+
+  it 'deletes rows matching a where clause' do
+    script = (1..3).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script += ["delete where id = 2", "select", ".exit"]
+    result = run_script(script)
+    expect(result.last(5)).to match_array([
+      "db > Executed.",
+      "db > (1, user1, person1@example.com)",
+      "(3, user3, person3@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'reuses pages freed by deletes' do
+    inserts = (1..100).map { |i| wide_insert(i) }
+    run_script(inserts + [".exit"])
+    size = File.size("test.db")
+
+    result = run_script(["delete", ".btree", ".exit"])
+    expect(result).to include("- leaf (size 0)")
+
+    run_script(inserts + [".exit"])
+    expect(File.size("test.db")).to eq(size)
+  end
+
+  it 'verifies a db and refuses pages whose checksum does not match' do
+    run_script((1..20).map { |i| wide_insert(i) } + [".exit"])
+    expect(`./debug_tree --verify --threads=2 test.db`.split("\n")).to eq([
+      "Checked 4 pages: ok",
+    ])
+
+    # Flip one bit in the middle of the second leaf
+    File.open("test.db", "r+b") do |file|
+      file.seek(3 * 4096 + 2000)
+      byte = file.read(1).ord
+      file.seek(3 * 4096 + 2000)
+      file.write((byte ^ 1).chr)
+    end
+
+    expect(`./debug_tree --verify test.db`.split("\n")).to eq([
+      "Page 3: checksum mismatch",
+      "Checked 4 pages: 1 problem",
+    ])
+    result = run_script(["select", ".exit"])
+    expect(result).to eq(["db > Page 3 is corrupt: checksum mismatch."])
+  end
+
+  it 'refuses a page of zeros inside the file' do
+    run_script((1..20).map { |i| wide_insert(i) } + [".exit"])
+    File.open("test.db", "r+b") do |file|
+      file.seek(3 * 4096)
+      file.write("\0" * 4096)
+    end
+
+    expect(`./debug_tree --verify test.db`.split("\n")).to eq([
+      "Page 3: checksum mismatch",
+      "Checked 4 pages: 1 problem",
+    ])
+    result = run_script(["select where id > 0 limit 3", ".exit"])
+    expect(result).to eq(["db > Page 3 is corrupt: checksum mismatch."])
+  end
+
+  it 'returns library errors to the caller instead of exiting' do
+    run_script((1..20).map { |i| wide_insert(i) } + [".exit"])
+    File.open("test.db", "r+b") do |file|
+      file.seek(3 * 4096)
+      file.write("\0" * 4096)
+    end
+    File.write("not_a_db.db", "not a db" * 1000)
+    File.write("library_errors.c", <<~C)
+      #define TINYDB_LIBRARY
+      #include "db.c"
+
+      void count_row(Row *row, void *context) { (*(int *)context)++; }
+
+      int main() {
+        if (db_open("not_a_db.db", 16) == NULL) printf("refused\\n");
+        Table *table = db_open("test.db", 16);
+        int rows = 0;
+        db_scan(table, 0, UINT32_MAX, count_row, &rows);
+        printf("%d rows: %s\\n", rows, db_error(table));
+        Row row = {.id = 100, .username = "a", .email = "b"};
+        printf("insert %s\\n",
+               db_insert(table, &row) == EXECUTE_DB_ERROR ? "refused" : "ok");
+        db_close(table);
+        printf("closed\\n");
+        return 0;
+      }
+    C
+    expect(system("cc -o library_errors library_errors.c -lpthread")).to eq(true)
+
+    expect(`./library_errors`.split("\n")).to eq([
+      "File is not a db.",
+      "refused",
+      "0 rows: Page 3 is corrupt: checksum mismatch.",
+      "insert refused",
+      "closed",
+    ])
+  end
+
+  it 'writes a compressed archive that reads back the same rows' do
+    inserts = (1..200).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    result = run_script(inserts + [".archive archive.db", "select", ".exit"])
+    rows = result[201..-2]
+    expect(result[200]).to match(/^db > Archived \d+ pages \(\d+ bytes\) in \d+ bytes\.$/)
+    expect(File.size("archive.db") * 3).to be < File.size("test.db")
+
+    result = run_script(["select", "insert 201 a b", ".exit"], "--read-only", "archive.db")
+    expect(result[0..-3]).to eq(rows)
+    expect(result[-2]).to eq("db > Error: Db is open read-only.")
+
+    result = run_script([".exit"], "", "archive.db")
+    expect(result).to eq(["Db is a compressed archive. Open it with --read-only."])
+  end
+
+  it 'vacuums a fragmented table into a smaller file in key order' do
+    # Every id once, in scattered order, so leaves split and stay half full
+    ids = (1..100).map { |i| i * 37 % 101 }
+    run_script(ids.map { |i| wide_insert(i) } + [".exit"])
+    size = File.size("test.db")
+
+    result = run_script([".vacuum", wide_insert(101), "select", ".exit"])
+    match = /^db > Vacuumed 100 rows: (\d+) bytes to (\d+) bytes \(\d+% smaller\)\.$/.match(result[0])
+    expect(match.nil?).to eq(false)
+    expect(match[1].to_i).to eq(size)
+    expect(File.size("test.db")).to eq(match[2].to_i)
+    expect(File.size("test.db")).to be < size
+    expect(File.exist?("test.db.vacuum")).to eq(false)
+
+    expected = (1..101).map { |i| wide_row(i) }
+    expected[0] = "db > #{expected[0]}"
+    expect(result[2..-1]).to eq(expected + ["Executed.", "db > "])
+    expect(`./debug_tree --verify test.db`.split("\n")).to eq([
+      "Checked #{File.size("test.db") / 4096} pages: ok",
+    ])
+  end
+
+  it 'finishes a vacuum while another thread reads' do
+    ids = (1..100).map { |i| i * 37 % 101 }
+    run_script(ids.map { |i| wide_insert(i) } + [".exit"])
+    File.write("vacuum_reader.c", <<~C)
+      #define TINYDB_LIBRARY
+      #include "db.c"
+
+      Table *table;
+      int stop;
+      int misses;
+
+      void *read_rows(void *argument) {
+        Row row;
+        for (uint32_t i = 0; !__atomic_load_n(&stop, __ATOMIC_ACQUIRE); i++) {
+          if (!db_get(table, i % 100 + 1, &row)) misses++;
+          usleep(10);
+        }
+        return NULL;
+      }
+
+      int main() {
+        table = db_open("test.db", 16);
+        pthread_t reader;
+        pthread_create(&reader, NULL, read_rows, NULL);
+        VacuumProgress progress;
+        VacuumResult result = db_vacuum_begin(table);
+        // 0 copies every row in one step
+        while (result == VACUUM_IN_PROGRESS || result == VACUUM_WAITING) {
+          result = db_vacuum_step(table, 0, &progress);
+        }
+        __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+        pthread_join(reader, NULL);
+        printf("%s, %d rows, %d misses\\n",
+               result == VACUUM_DONE ? "done" : "failed", (int)progress.rows,
+               misses);
+        db_close(table);
+        return 0;
+      }
+    C
+    expect(system("cc -o vacuum_reader vacuum_reader.c -lpthread")).to eq(true)
+
+    expect(`./vacuum_reader`).to eq("done, 100 rows, 0 misses\n")
+    expect(`./debug_tree --verify test.db`.split("\n")).to eq([
+      "Checked #{File.size("test.db") / 4096} pages: ok",
+    ])
+  end
+
+  it 'keeps a :memory: db only until it is saved with .snapshot' do
+    inserts = (1..100).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script = inserts + ["begin", "insert 101 a b", ".snapshot snapshot.db", "commit", ".exit"]
+    result = run_script(script, "", ":memory:")
+    expect(result[102]).to eq("db > Writing snapshot to 'snapshot.db' in the background.")
+    expect(File.exist?(":memory:")).to eq(false)
+
+    result = run_script(["select", ".exit"], "", "snapshot.db")
+    expected = (1..100).map { |i| "(#{i}, user#{i}, person#{i}@example.com)" }
+    expected[0] = "db > #{expected[0]}"
+    expect(result).to eq(expected + ["Executed.", "db > "])
+
+    result = run_script([".snapshot", ".exit"], "", ":memory:")
+    expect(result[0]).to eq("db > Usage: .snapshot <file>")
+  end
+
+  it 'snapshots only a :memory: db' do
+    result = run_script(["insert 1 a b", ".snapshot snapshot.db", ".exit"])
+    expect(result[1]).to eq("db > Only a :memory: db can be snapshotted.")
+    expect(File.exist?("snapshot.db")).to eq(false)
+    expect(File.exist?("snapshot.db.tmp")).to eq(false)
+  end
+
+  it 'benchmarks a cold scan with and without read-ahead' do
+    script = (1..50).map { |i| wide_insert(i) }
+    result = run_script(script + [".bench scan", ".exit"])
+    timings = result.last(4).map { |line| line.gsub(/\d+\.\d+/, "N") }
+    expect(timings).to eq([
+      "db > Cold scan of 50 rows (N MB):",
+      "  no read-ahead: N s, N MB/s",
+      "  read-ahead 32 pages: N s, N MB/s",
+      "db > ",
+    ])
+  end
+
+  it 'splits a warm scan across threads at the root' do
+    script = (1..50).map { |i| wide_insert(i) }
+    result = run_script(script + [".bench parallel 4", ".bench parallel 0", ".exit"])
+    timings = result.last(5).map { |line| line.gsub(/\d+\.\d+/, "N") }
+    expect(timings).to eq([
+      "db > Warm scan of 50 rows (N MB):",
+      "  1 thread: N s, N MB/s",
+      "  4 threads: N s, N MB/s",
+      "db > Threads must be between 1 and 256.",
+      "db > ",
+    ])
+  end
+
+  it 'runs the leaf search compare with SIMD where the CPU has it' do
+    result = run_script([".bench search", ".exit"])
+    timings = result.last(4).map { |line| line.gsub(/\d+\.\d+/, "N") }
+    expect(timings[0]).to eq("db > Search window of 16 keys, 1000000 times:")
+    expect(timings[3]).to eq("db > ")
+    if RbConfig::CONFIG["host_cpu"] =~ /x86_64/
+      expect(timings[1]).to match(/^  table keys: (SSE2|AVX2) N s, one at a time N s$/)
+      expect(timings[2]).to match(/^  index keys: (SSE4\.2|AVX2) N s, one at a time N s$/)
+    else
+      expect(timings[1]).to eq("  table keys: one at a time N s, one at a time N s")
+      expect(timings[2]).to eq("  index keys: one at a time N s, one at a time N s")
+    end
+  end
+
+  it 'fits many short rows in one leaf' do
+    script = (1..90).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".btree"
+    script << ".exit"
+    result = run_script(script)
+    expect(result[90]).to eq("db > Tree:")
+    expect(result[91]).to eq("- leaf (size 90)")
+  end
+
+  it 'keeps the page size a db was created with' do
+    script = (1..100).map { |i| wide_insert(i) }
+    result = run_script(script + [".btree", ".exit"], "--page-size=65536")
+    expect(result[101]).to eq("- leaf (size 100)")
+
+    # Reopened without the option, the file still has 64K pages
+    result = run_script([wide_insert(101), ".btree", ".exit"])
+    expect(result[2]).to eq("- leaf (size 101)")
+    expect(File.size("test.db")).to eq(2 * 65536)
+    expect(`./debug_tree --verify test.db`.split("\n")).to eq([
+      "Checked 2 pages: ok",
+    ])
+
+    `rm -rf test.db test.db-wal`
+    result = run_script([".exit"], "--page-size=5000")
+    expect(result).to eq(["Page size must be a power of two from 4096 to 65536."])
+  end
+
+  it 'keeps the rest of a row too long for a leaf cell on overflow pages' do
+    # 16-byte cells keep 10 bytes of a row in the leaf, so every wide row
+    # has one overflow page and a short one has none
+    script = (1..20).map { |i| wide_insert(i) } + ["insert 21 a b"]
+    run_script(script + [".exit"], "--max-leaf-cell-size=16")
+    expect(`./debug_tree --verify test.db`.split("\n")).to eq([
+      "Checked 22 pages: ok",
+    ])
+
+    # Reopened without the option, rows are still read back whole
+    result = run_script(["delete where id <= 10", "select", ".exit"])
+    expected = (11..20).map { |i| wide_row(i) } + ["(21, a, b)"]
+    expected[0] = "db > #{expected[0]}"
+    expect(result[1..-1]).to eq(expected + ["Executed.", "db > "])
+
+    # The deleted rows' overflow pages are freed, and the vacuum's copy
+    # writes new ones
+    result = run_script([".vacuum", "select where id > 19", ".exit"])
+    expect(result[0]).to match(/^db > Vacuumed 11 rows: /)
+    expect(result[1..-1]).to eq([
+      "db > #{wide_row(20)}", "(21, a, b)", "Executed.", "db > ",
+    ])
+    expect(`./debug_tree --verify test.db`.split("\n")).to eq([
+      "Checked 12 pages: ok",
+    ])
+
+    `rm -rf test.db test.db-wal`
+    result = run_script([".exit"], "--max-leaf-cell-size=18")
+    expect(result).to eq(["Leaf cells must take from 16 to 1008 bytes, a multiple of 4."])
+  end
+
   it 'allows printing out the structure of a one-node btree' do
     script = [3, 1, 2].map do |i|
       "insert #{i} user#{i} person#{i}@example.com"
@@ -155,11 +750,9 @@ describe 'database' do
   end
 
   it 'allows printing out the structure of a 3-leaf-node btree' do
-    script = (1..14).map do |i|
-      "insert #{i} user#{i} person#{i}@example.com"
-    end
+    script = (1..14).map { |i| wide_insert(i) }
     script << ".btree"
-    script << "insert 15 user15 person15@example.com"
+    script << wide_insert(15)
     script << ".exit"
     result = run_script(script)
 
@@ -190,36 +783,10 @@ describe 'database' do
 
   it 'allows printing out the structure of a 4-leaf-node btree' do
     script = [
-      "insert 18 user18 person18@example.com",
-      "insert 7 user7 person7@example.com",
-      "insert 10 user10 person10@example.com",
-      "insert 29 user29 person29@example.com",
-      "insert 23 user23 person23@example.com",
-      "insert 4 user4 person4@example.com",
-      "insert 14 user14 person14@example.com",
-      "insert 30 user30 person30@example.com",
-      "insert 15 user15 person15@example.com",
-      "insert 26 user26 person26@example.com",
-      "insert 22 user22 person22@example.com",
-      "insert 19 user19 person19@example.com",
-      "insert 2 user2 person2@example.com",
-      "insert 1 user1 person1@example.com",
-      "insert 21 user21 person21@example.com",
-      "insert 11 user11 person11@example.com",
-      "insert 6 user6 person6@example.com",
-      "insert 20 user20 person20@example.com",
-      "insert 5 user5 person5@example.com",
-      "insert 8 user8 person8@example.com",
-      "insert 9 user9 person9@example.com",
-      "insert 3 user3 person3@example.com",
-      "insert 12 user12 person12@example.com",
-      "insert 27 user27 person27@example.com",
-      "insert 17 user17 person17@example.com",
-      "insert 16 user16 person16@example.com",
-      "insert 13 user13 person13@example.com",
-      "insert 24 user24 person24@example.com",
-      "insert 25 user25 person25@example.com",
-      "insert 28 user28 person28@example.com",
+      18, 7, 10, 29, 23, 4, 14, 30, 15, 26, 22, 19, 2, 1, 21, 11, 6, 20, 5, 8,
+      9, 3, 12, 27, 17, 16, 13, 24, 25, 28
+    ].map { |i| wide_insert(i) }
+    script += [
       ".btree",
       ".exit",
     ]
@@ -271,74 +838,17 @@ describe 'database' do
 
   it 'allows printing out the structure of a 7-leaf-node btree' do
     script = [
-      "insert 58 user58 person58@example.com",
-      "insert 56 user56 person56@example.com",
-      "insert 8 user8 person8@example.com",
-      "insert 54 user54 person54@example.com",
-      "insert 77 user77 person77@example.com",
-      "insert 7 user7 person7@example.com",
-      "insert 25 user25 person25@example.com",
-      "insert 71 user71 person71@example.com",
-      "insert 13 user13 person13@example.com",
-      "insert 22 user22 person22@example.com",
-      "insert 53 user53 person53@example.com",
-      "insert 51 user51 person51@example.com",
-      "insert 59 user59 person59@example.com",
-      "insert 32 user32 person32@example.com",
-      "insert 36 user36 person36@example.com",
-      "insert 79 user79 person79@example.com",
-      "insert 10 user10 person10@example.com",
-      "insert 33 user33 person33@example.com",
-      "insert 20 user20 person20@example.com",
-      "insert 4 user4 person4@example.com",
-      "insert 35 user35 person35@example.com",
-      "insert 76 user76 person76@example.com",
-      "insert 49 user49 person49@example.com",
-      "insert 24 user24 person24@example.com",
-      "insert 70 user70 person70@example.com",
-      "insert 48 user48 person48@example.com",
-      "insert 39 user39 person39@example.com",
-      "insert 15 user15 person15@example.com",
-      "insert 47 user47 person47@example.com",
-      "insert 30 user30 person30@example.com",
-      "insert 86 user86 person86@example.com",
-      "insert 31 user31 person31@example.com",
-      "insert 68 user68 person68@example.com",
-      "insert 37 user37 person37@example.com",
-      "insert 66 user66 person66@example.com",
-      "insert 63 user63 person63@example.com",
-      "insert 40 user40 person40@example.com",
-      "insert 78 user78 person78@example.com",
-      "insert 19 user19 person19@example.com",
-      "insert 46 user46 person46@example.com",
-      "insert 14 user14 person14@example.com",
-      "insert 81 user81 person81@example.com",
-      "insert 72 user72 person72@example.com",
-      "insert 6 user6 person6@example.com",
-      "insert 50 user50 person50@example.com",
-      "insert 85 user85 person85@example.com",
-      "insert 67 user67 person67@example.com",
-      "insert 2 user2 person2@example.com",
-      "insert 55 user55 person55@example.com",
-      "insert 69 user69 person69@example.com",
-      "insert 5 user5 person5@example.com",
-      "insert 65 user65 person65@example.com",
-      "insert 52 user52 person52@example.com",
-      "insert 1 user1 person1@example.com",
-      "insert 29 user29 person29@example.com",
-      "insert 9 user9 person9@example.com",
-      "insert 43 user43 person43@example.com",
-      "insert 75 user75 person75@example.com",
-      "insert 21 user21 person21@example.com",
-      "insert 82 user82 person82@example.com",
-      "insert 12 user12 person12@example.com",
-      "insert 18 user18 person18@example.com",
-      "insert 60 user60 person60@example.com",
-      "insert 44 user44 person44@example.com",
+      58, 56, 8, 54, 77, 7, 25, 71, 13, 22, 53, 51, 59, 32, 36, 79, 10, 33,
+      20, 4, 35, 76, 49, 24, 70, 48, 39, 15, 47, 30, 86, 31, 68, 37, 66, 63,
+      40, 78, 19, 46, 14, 81, 72, 6, 50, 85, 67, 2, 55, 69, 5, 65, 52, 1, 29,
+      9, 43, 75, 21, 82, 12, 18, 60, 44
+    ].map { |i| wide_insert(i) }
+    script += [
       ".btree",
       ".exit",
     ]
-    result = run_script(script)
+    # Internal nodes as small as they go, so that 7 leaves need 3 of them
+    result = run_script(script, "--max-internal-cells=3")
 
     expect(result[64...(result.length)]).to match_array([
       "db > Tree:",
@@ -426,6 +936,21 @@ describe 'database' do
     ])
   end
 
+  it 'fills an internal node with as many keys as it can take' do
+    script = (1..3569).map { |i| wide_insert(i) }
+    result = run_script(script + [".btree", ".exit"])
+    expect(result[3569..3570]).to eq(["db > Tree:", "- internal (size 508)"])
+
+    # The next leaf split is the full root's right child's, and splits the root
+    result = run_script([wide_insert(3570), ".btree", ".exit"])
+    expect(result[1..2]).to eq(["db > Tree:", "- internal (size 1)"])
+    expect(`./debug_tree --verify test.db`.split("\n").last).to match(/: ok$/)
+
+    `rm -rf test.db test.db-wal`
+    result = run_script([".exit"], "--max-internal-cells=509")
+    expect(result).to eq(["Internal nodes must hold from 3 to 508 keys."])
+  end
+
   it 'prints constants' do
     script = [
       ".constants",
@@ -435,12 +960,15 @@ describe 'database' do
 
     expect(result).to match_array([
       "db > Constants:",
+      "PAGE_SIZE: 4096",
       "ROW_SIZE: 293",
-      "COMMON_NODE_HEADER_SIZE: 6",
-      "LEAF_NODE_HEADER_SIZE: 14",
-      "LEAF_NODE_CELL_SIZE: 297",
-      "LEAF_NODE_SPACE_FOR_CELLS: 4082",
-      "LEAF_NODE_MAX_CELLS: 13",
+      "ROW_MAX_PAYLOAD_SIZE: 293",
+      "COMMON_NODE_HEADER_SIZE: 12",
+      "LEAF_NODE_HEADER_SIZE: 24",
+      "LEAF_NODE_SPACE_FOR_CELLS: 4072",
+      "LEAF_NODE_MAX_CELL_SIZE: 1008",
+      "LEAF_NODE_MAX_LOCAL_PAYLOAD: 1002",
+      "INTERNAL_NODE_MAX_CELLS: 508",
       "db > ",
     ])
   end
@@ -448,28 +976,15 @@ describe 'database' do
   it 'prints all rows in a multi-level tree' do
     script = []
     (1..15).each do |i|
-      script << "insert #{i} user#{i} person#{i}@example.com"
+      script << wide_insert(i)
     end
     script << "select"
     script << ".exit"
     result = run_script(script)
-    expect(result[15...result.length]).to match_array([
-      "db > (1, user1, person1@example.com)",
-      "(2, user2, person2@example.com)",
-      "(3, user3, person3@example.com)",
-      "(4, user4, person4@example.com)",
-      "(5, user5, person5@example.com)",
-      "(6, user6, person6@example.com)",
-      "(7, user7, person7@example.com)",
-      "(8, user8, person8@example.com)",
-      "(9, user9, person9@example.com)",
-      "(10, user10, person10@example.com)",
-      "(11, user11, person11@example.com)",
-      "(12, user12, person12@example.com)",
-      "(13, user13, person13@example.com)",
-      "(14, user14, person14@example.com)",
-      "(15, user15, person15@example.com)",
-      "Executed.", "db > ",
-    ])
+    expected = (1..15).map { |i| wide_row(i) }
+    expected[0] = "db > #{expected[0]}"
+    expect(result[15...result.length]).to match_array(
+      expected + ["Executed.", "db > "]
+    )
   end
 end
\ No newline at end of file
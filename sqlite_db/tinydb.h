@@ -0,0 +1,273 @@
+/*
+ * tinydb: the db as a library
+ *
+ * db.c built with -DTINYDB_LIBRARY leaves out the REPL, and what is left is
+ * libtinydb (see the Makefile). A program links it and calls the functions
+ * below directly, with no pipe to the db process and no text to format and
+ * parse on each operation.
+ *
+ *   Table *table = db_open("my.db", PAGER_DEFAULT_MAX_FRAMES);
+ *   Row row = {.id = 1, .username = "alice", .email = "alice@example.com"};
+ *   db_insert(table, &row);
+ *   if (db_get(table, 1, &row)) { ... }
+ *   db_close(table);
+ *
+ * A db file that cannot be opened makes db_open print why and return NULL.
+ * A page that cannot be read once the db is open leaves it open but failed
+ * (see db_error). Only a failing write or sync of the file or its log still
+ * ends the process, as do the REPL's own errors.
+ */
+#ifndef TINYDB_H
+#define TINYDB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TINYDB_API __attribute__((visibility("default")))
+
+#define COLUMN_USERNAME_SIZE 32
+#define COLUMN_EMAIL_SIZE 255
+#define PAGER_DEFAULT_MAX_FRAMES 1024
+#define DB_MEMORY_FILENAME ":memory:"
+
+typedef struct {
+  uint32_t id;
+  char username[COLUMN_USERNAME_SIZE + 1];
+  char email[COLUMN_EMAIL_SIZE + 1];
+} Row;
+
+typedef enum {
+  EXECUTE_SUCCESS,
+  EXECUTE_TABLE_FULL,
+  EXECUTE_DUPLICATE_KEY,
+  EXECUTE_ALREADY_IN_TRANSACTION,
+  EXECUTE_NO_TRANSACTION,
+  EXECUTE_READ_ONLY,
+  EXECUTE_INDEX_EXISTS,
+  EXECUTE_UNBOUND_PARAMETER,
+  EXECUTE_DB_ERROR  // A page could not be read; see db_error
+} ExecuteResult;
+
+typedef enum {
+  PREPARE_SUCCESS,
+  PREPARE_SYNTAX_ERROR,
+  PREPARE_UNRECOGNIZED_STATEMENT,
+  PREPARE_STRING_TOO_LONG,
+  PREPARE_NEGATIVE_ID
+} PrepareResult;
+
+typedef enum {
+  STATEMENT_INSERT,
+  STATEMENT_SELECT,
+  STATEMENT_BEGIN,
+  STATEMENT_COMMIT,
+  STATEMENT_ROLLBACK,
+  STATEMENT_CREATE_INDEX,
+  STATEMENT_DELETE
+} StatementType;
+#define NUM_STATEMENT_TYPES (STATEMENT_DELETE + 1)
+
+/* The columns of a row, for picking which ones a select outputs */
+typedef enum { ROW_COLUMN_ID, ROW_COLUMN_USERNAME, ROW_COLUMN_EMAIL } RowColumn;
+
+typedef enum { OUTPUT_TEXT, OUTPUT_CSV, OUTPUT_BINARY } OutputFormat;
+
+typedef struct Table Table;
+typedef struct Statement Statement;
+typedef struct DbIterator DbIterator;
+typedef struct ResultSink ResultSink;
+
+/* Called once per row. The Row is only valid during the call. */
+typedef void (*RowVisitor)(Row *row, void *context);
+
+/*
+max_frames is how many pages the cache holds. DB_MEMORY_FILENAME opens a
+new db with no file, held entirely in memory whatever max_frames is, and
+gone at db_close unless saved with db_snapshot_to_file.
+
+Every db open in a process has the same page size and internal node size.
+The db_open functions return NULL for a db whose layout differs from that of
+one already open.
+*/
+TINYDB_API Table *db_open(const char *filename, uint32_t max_frames);
+/*
+Like db_open, but a new file gets this page size, a power of two from 4096
+to 65536, internal nodes of at most max_internal_cells keys (0 for the most
+allowed, one fewer than fit in a page), and leaf cells of at most
+max_leaf_cell_size bytes, a multiple of 4 (0 for the most allowed, about a
+quarter of a page). A row too long for a cell goes on overflow pages, which
+no row needs with the largest cells. An existing file keeps the layout it
+was created with.
+*/
+TINYDB_API Table *db_open_with_layout(const char *filename,
+                                      uint32_t max_frames, uint32_t page_size,
+                                      uint32_t max_internal_cells,
+                                      uint32_t max_leaf_cell_size);
+TINYDB_API Table *db_open_read_only(const char *filename, uint32_t max_frames);
+TINYDB_API void db_close(Table *table);
+
+/*
+NULL while every page read has been fine, otherwise why the first bad one
+was refused. From then on the tree is read as if that page were empty:
+db_get and the scans find fewer rows, each statement returns
+EXECUTE_DB_ERROR, and nothing more is committed. What was committed before
+stays in the log for the next db_open to replay.
+*/
+TINYDB_API const char *db_error(Table *table);
+
+/*
+Insert one row. Outside a transaction it commits on its own; run "begin"
+and "commit" through db_prepare/db_step to group many inserts.
+*/
+TINYDB_API ExecuteResult db_insert(Table *table, const Row *row);
+
+/* Copy the row with this id into *row. Returns false if there is none. */
+TINYDB_API bool db_get(Table *table, uint32_t id, Row *row);
+
+/* Visit the rows with ids from min_id to max_id inclusive, in id order */
+TINYDB_API void db_scan(Table *table, uint32_t min_id, uint32_t max_id,
+                        RowVisitor visit, void *context);
+
+#define DB_SCAN_MAX_THREADS 256
+
+/*
+Visit every row with up to num_threads threads at once (at most
+DB_SCAN_MAX_THREADS), each taking a range of ids along the root's children.
+Thread i calls visit with contexts[i], so each can count or sum into its
+own and the caller combines them after; contexts needs num_threads
+entries. A thread's rows come in id order, but the threads' rows
+interleave. Like db_scan, it sees the table as of the last commit, or the
+open transaction's changes inside one.
+*/
+TINYDB_API void db_scan_parallel(Table *table, uint32_t num_threads,
+                                  RowVisitor visit, void **contexts);
+
+/*
+Walk the rows with ids from min_id to max_id, one db_iterator_next at a
+time. The iterator sees the table as of the last commit when it was opened,
+whatever is written while it is open.
+*/
+TINYDB_API DbIterator *db_iterator_open(Table *table, uint32_t min_id,
+                                        uint32_t max_id);
+TINYDB_API bool db_iterator_next(DbIterator *iterator, Row *row);
+TINYDB_API void db_iterator_close(DbIterator *iterator);
+
+/* Any statement the REPL takes, with ? for values bound before each step */
+TINYDB_API PrepareResult db_prepare(const char *sql, Statement **statement);
+TINYDB_API PrepareResult db_bind_int(Statement *statement, uint32_t number,
+                                     int64_t value);
+TINYDB_API PrepareResult db_bind_text(Statement *statement, uint32_t number,
+                                      const char *value);
+TINYDB_API ExecuteResult db_step(Table *table, Statement *statement,
+                                 RowVisitor visit, void *context);
+TINYDB_API void db_finalize(Statement *statement);
+
+/*
+Write rows to fd in one of the output formats, buffered and flushed in
+large blocks. columns picks up to three columns and their order, or all of
+them if num_columns is 0. Pass db_sink_row and the sink as the visitor of
+db_scan or db_step; db_sink_close writes what is left but leaves fd open.
+
+  ResultSink *sink = db_sink_open(fd, OUTPUT_CSV, NULL, 0);
+  db_scan(table, 0, UINT32_MAX, db_sink_row, sink);
+  db_sink_close(sink);
+*/
+TINYDB_API ResultSink *db_sink_open(int fd, OutputFormat format,
+                                    const RowColumn *columns,
+                                    uint32_t num_columns);
+TINYDB_API void db_sink_row(Row *row, void *sink);
+TINYDB_API void db_sink_close(ResultSink *sink);
+
+typedef enum {
+  SNAPSHOT_FILE_STARTED,
+  SNAPSHOT_FILE_BUSY,  // The last one is still being written
+  SNAPSHOT_FILE_ERROR,
+  SNAPSHOT_FILE_NOT_IN_MEMORY  // Not a DB_MEMORY_FILENAME db
+} SnapshotFileResult;
+
+/*
+Save a DB_MEMORY_FILENAME table as of the last commit to a db file, in the
+background: a forked child writes the pages to filename.tmp in order and
+renames it to filename when it is synced, so filename is either the old
+file or the whole snapshot. The caller only waits for the fork, and can go
+on writing; the child's copy of the pages is kept apart by copy-on-write.
+A db with a file has pages outside memory that the caller would go on
+writing under the child, so it is refused. db_snapshot_wait
+waits for the child and returns whether it succeeded (true if there was
+none). db_close waits too.
+*/
+TINYDB_API SnapshotFileResult db_snapshot_to_file(Table *table,
+                                                  const char *filename);
+TINYDB_API bool db_snapshot_wait(Table *table);
+
+typedef enum {
+  VACUUM_IN_PROGRESS,     // Call db_vacuum_step again
+  VACUUM_WAITING,         // Copied; waiting for transactions and readers
+  VACUUM_DONE,
+  VACUUM_READ_ONLY,
+  VACUUM_NO_FILE,         // A DB_MEMORY_FILENAME db
+  VACUUM_IN_TRANSACTION,  // A vacuum cannot begin inside a transaction
+  VACUUM_FILE_ERROR,      // The new file could not be written or renamed
+  VACUUM_DB_ERROR         // A page of the db or the new file could not be
+                          // read, and the vacuum was abandoned
+} VacuumResult;
+
+typedef struct {
+  uint64_t rows;      // Copied so far
+  uint64_t old_size;  // The file sizes in bytes, once VACUUM_DONE
+  uint64_t new_size;
+} VacuumProgress;
+
+/*
+Rewrite the table into a new file with full leaves in key order, then
+rename it over the db file. db_vacuum_begin starts it; each db_vacuum_step
+copies up to max_rows rows (0 for all that are left), and the table can be
+read and written in between. Writes made meanwhile are carried over when
+the copy is done. The step that finishes reopens the table's file, so it
+waits (VACUUM_WAITING) while a transaction or iterator is open or another
+thread is reading. Reads on other threads may go on throughout, but like
+db_close it must not run while another thread writes to the table.
+db_close abandons a vacuum not done.
+*/
+TINYDB_API VacuumResult db_vacuum_begin(Table *table);
+TINYDB_API VacuumResult db_vacuum_step(Table *table, uint32_t max_rows,
+                                       VacuumProgress *progress);
+
+/*
+Counters kept while a db is open, for seeing why a workload is slow. The
+pager and split counts and the latencies cost an addition or two per
+event; the tree shape is found by walking the table's tree when db_stats
+is called.
+*/
+#define DB_STATS_FILL_BUCKETS 10
+#define DB_STATS_LATENCY_BUCKETS 24
+
+typedef struct {
+  /* None for a db opened read-only, which maps its file instead */
+  uint64_t cache_hits;    // Pages found in the cache
+  uint64_t cache_misses;  // Pages loaded from the file
+  uint64_t pages_read;
+  uint64_t bytes_read;
+  uint64_t pages_written;  // To the db file or the log
+  uint64_t bytes_written;
+  uint64_t leaf_splits;
+  uint64_t internal_splits;
+  /* The table's tree, not counting its indexes */
+  uint32_t tree_height;  // 1 when the root is a leaf
+  uint32_t num_leaves;
+  uint32_t num_internal_nodes;
+  /* Leaves by how full they are: bucket i is i*10% to (i+1)*10% */
+  uint32_t leaf_fill[DB_STATS_FILL_BUCKETS];
+  /*
+  Statements run, by type, and how long they took: bucket 0 is under 1 us,
+  bucket i from 2^(i-1) up to 2^i us, and the last bucket everything longer
+  */
+  uint64_t statements[NUM_STATEMENT_TYPES];
+  uint64_t statement_ns[NUM_STATEMENT_TYPES];
+  uint64_t latency[NUM_STATEMENT_TYPES][DB_STATS_LATENCY_BUCKETS];
+} DbStats;
+
+TINYDB_API void db_stats(Table *table, DbStats *stats);
+TINYDB_API void db_stats_reset(Table *table);
+
+#endif